@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+#
+# Distributed mode (-J/-j) test -- a coordinator on 127.0.0.1 and several
+# workers auditing a local POP3 server.
+#
+# Besides three workers sharing the secret, the coordinator is joined by a
+# worker with the wrong secret, which must be dropped, and by a rogue client
+# reporting a valid login outside of its lease, which must be ignored. Every
+# login must be tested once and the valid one reported once. A worker must
+# also refuse a coordinator sending options other than those of the audit.
+#
+# Build medusa with -fsanitize=address to have memory errors reported.
+#
+# Usage: dist_local.py [path to medusa] [path to modules]
+
+import os, socket, socketserver, subprocess, sys, threading, time
+
+MEDUSA = sys.argv[1] if len(sys.argv) > 1 else "medusa"
+MODULES = sys.argv[2] if len(sys.argv) > 2 else None
+SECRET = "dist-local-%d" % os.getpid()
+USERS = ["alice", "bob", "carol"]
+PASSWORDS = ["pass%d" % i for i in range(40)]
+VALID = ("bob", "pass25")
+
+attempts = []
+lock = threading.Lock()
+
+
+class Pop3(socketserver.StreamRequestHandler):
+	def handle(self):
+		user = None
+		self.wfile.write(b"+OK ready\r\n")
+		for line in self.rfile:
+			cmd, _, arg = line.decode(errors="replace").rstrip("\r\n").partition(" ")
+			cmd = cmd.upper()
+			if cmd == "USER":
+				user = arg
+				self.wfile.write(b"+OK\r\n")
+			elif cmd == "PASS":
+				with lock:
+					attempts.append((user, arg))
+				time.sleep(0.01)
+				self.wfile.write(b"+OK\r\n" if (user, arg) == VALID else b"-ERR invalid\r\n")
+			elif cmd == "QUIT":
+				self.wfile.write(b"+OK bye\r\n")
+				return
+			else:
+				# no CAPA, STLS or AUTH
+				self.wfile.write(b"-ERR unsupported\r\n")
+
+
+class Server(socketserver.ThreadingTCPServer):
+	allow_reuse_address = True
+	daemon_threads = True
+
+
+def free_port():
+	sock = socket.socket()
+	sock.bind(("127.0.0.1", 0))
+	port = sock.getsockname()[1]
+	sock.close()
+	return port
+
+
+def connect(port):
+	for i in range(100):
+		try:
+			return socket.create_connection(("127.0.0.1", port))
+		except OSError:
+			time.sleep(0.1)
+	raise RuntimeError("coordinator not listening")
+
+
+def read_line(sock):
+	data = b""
+	while not data.endswith(b"\n"):
+		chunk = sock.recv(1)
+		if not chunk:
+			break
+		data += chunk
+	return data.decode(errors="replace").rstrip("\n").split("\t")
+
+
+def rogue(port):
+	# holds a lease, then reports the valid login for another user and a password it was not leased
+	sock = connect(port)
+	sock.sendall(("HELLO\t2\trogue\t1\t%s\n" % SECRET).encode())
+	read_line(sock)
+	sock.sendall(b"LEASE\n")
+	lease = read_line(sock)
+	if lease[0] == "LEASE":
+		sock.sendall(("RESULT\t%s\t2\tmallory\t%s\n" % (lease[1], lease[5])).encode())
+		sock.sendall(("RESULT\t%s\t2\t%s\tnot-leased\n" % (lease[1], lease[4])).encode())
+	time.sleep(0.5)
+	sock.close()
+	return lease
+
+
+def fake_coordinator(env):
+	# a coordinator asking its workers to write a file must be refused
+	listen = socket.socket()
+	listen.bind(("127.0.0.1", 0))
+	listen.listen(1)
+	port = listen.getsockname()[1]
+	worker = subprocess.Popen([MEDUSA, "-j", "127.0.0.1:%d" % port, "-b"], env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	sock, addr = listen.accept()
+	read_line(sock)
+	sock.sendall(b"JOB\t-M\tpop3\t-O\t/tmp/dist_local.out\n")
+	output = worker.communicate(timeout=30)[0].decode(errors="replace")
+	sock.close()
+	listen.close()
+	return worker.returncode, output
+
+
+def main():
+	server = Server(("127.0.0.1", 0), Pop3)
+	pop_port = server.server_address[1]
+	threading.Thread(target=server.serve_forever, daemon=True).start()
+
+	users = "/tmp/dist_local.users.%d" % os.getpid()
+	passwords = "/tmp/dist_local.passwords.%d" % os.getpid()
+	with open(users, "w") as f:
+		f.write("\n".join(USERS) + "\n")
+	with open(passwords, "w") as f:
+		f.write("\n".join(PASSWORDS) + "\n")
+
+	env = dict(os.environ)
+	if MODULES:
+		env["MEDUSA_MODULE_PATH"] = MODULES
+	env.setdefault("ASAN_OPTIONS", "detect_leaks=0")
+	env["MEDUSA_DIST_SECRET"] = SECRET
+	bad_env = dict(env, MEDUSA_DIST_SECRET="wrong")
+
+	port = free_port()
+	coordinator = subprocess.Popen([MEDUSA, "-J", str(port), "-M", "pop3", "-h", "127.0.0.1", "-n", str(pop_port), "-U", users, "-P", passwords, "-t", "2", "-b"],
+	                               env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+
+	lease = rogue(port)
+	intruder = subprocess.run([MEDUSA, "-j", "127.0.0.1:%d" % port, "-b"], env=bad_env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=60)
+	workers = [subprocess.Popen([MEDUSA, "-j", "127.0.0.1:%d" % port, "-t", "2", "-b"], env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT) for i in range(3)]
+
+	output = coordinator.communicate(timeout=300)[0].decode(errors="replace")
+	worker_output = [w.communicate(timeout=60)[0].decode(errors="replace") for w in workers]
+	refused, refused_output = fake_coordinator(env)
+	os.unlink(users)
+	os.unlink(passwords)
+
+	errors = []
+	if lease[0] != "LEASE":
+		errors.append("rogue client was not leased any login (%s)" % lease[0])
+	if coordinator.returncode != 0:
+		errors.append("coordinator exit status %d" % coordinator.returncode)
+	for i, w in enumerate(workers):
+		if w.returncode != 0:
+			errors.append("worker %d exit status %d" % (i, w.returncode))
+	if intruder.returncode == 0 or "did not give the shared secret" not in output:
+		errors.append("worker with the wrong secret was not dropped")
+	if output.count("outside of lease") != 2 or "mallory" in output or "not-leased" in output:
+		errors.append("logins outside of the lease were not ignored")
+	if output.count("[SUCCESS]") != 1 or "User: %s Password: %s [SUCCESS]" % VALID not in output:
+		errors.append("valid login not reported once")
+	if refused == 0 or "do not accept: -O" not in refused_output or os.path.exists("/tmp/dist_local.out"):
+		errors.append("worker accepted an option outside of the audit")
+
+	# logins of a user are dropped once its password is found
+	tested = set(attempts)
+	if len(tested) != len(attempts):
+		errors.append("%d logins tested more than once" % (len(attempts) - len(tested)))
+	for user in USERS:
+		if user != VALID[0] and any((user, p) not in tested for p in PASSWORDS):
+			errors.append("logins of %s not all tested" % user)
+	if "AddressSanitizer" in output + "".join(worker_output) + refused_output:
+		errors.append("AddressSanitizer report")
+
+	if errors:
+		sys.stdout.write(output[-4000:])
+		for text in worker_output:
+			sys.stdout.write(text[-2000:])
+		print("FAIL: " + "; ".join(errors))
+		return 1
+
+	print("PASS: %d logins tested once each by %d workers, intruders rejected" % (len(attempts), len(workers)))
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+#
+# snmp MODE:SWEEP regression test -- replies which arrive after their request
+# timed out and was queued for retransmission.
+#
+# A local agent answers every first query TIMEOUT seconds late, so replies
+# arrive while the engine still holds a backlog of expired requests waiting
+# for retransmission. RATE is kept low so that this backlog builds up. Each
+# reply completes its request, and once the host is complete its requests are
+# freed. The engine must not resend them afterwards.
+#
+# Build medusa with -fsanitize=address to have use-after-free reported.
+#
+# Usage: snmp_sweep_late_reply.py [path to medusa] [path to modules]
+
+import os, socket, subprocess, sys, threading, time
+
+MEDUSA = sys.argv[1] if len(sys.argv) > 1 else "medusa"
+MODULES = sys.argv[2] if len(sys.argv) > 2 else None
+COMMUNITIES = 500
+TIMEOUT = 1
+RATE = 100
+
+
+def agent(sock, delay):
+	seen = set()
+	pending = []
+	sock.settimeout(0.001)
+	while True:
+		try:
+			data, addr = sock.recvfrom(1500)
+			# request-id follows the GET PDU header; answer each request-id once
+			pdu = data.index(b"\xa0")
+			rid = data[pdu + 4:pdu + 8]
+			if rid not in seen:
+				seen.add(rid)
+				reply = data[:pdu] + b"\xa2" + data[pdu + 1:]
+				pending.append((time.time() + delay, reply, addr))
+		except socket.timeout:
+			pass
+		now = time.time()
+		while pending and pending[0][0] <= now:
+			sock.sendto(pending[0][1], pending[0][2])
+			pending.pop(0)
+
+
+def main():
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+	sock.bind(("127.0.0.1", 0))
+	port = sock.getsockname()[1]
+	threading.Thread(target=agent, args=(sock, TIMEOUT), daemon=True).start()
+
+	path = "/tmp/snmp_sweep_late_reply.%d" % os.getpid()
+	with open(path, "w") as f:
+		for i in range(COMMUNITIES):
+			f.write("community%d\n" % i)
+
+	env = dict(os.environ)
+	if MODULES:
+		env["MEDUSA_MODULE_PATH"] = MODULES
+	env.setdefault("ASAN_OPTIONS", "detect_leaks=0")
+
+	cmd = [MEDUSA, "-M", "snmp", "-h", "127.0.0.1", "-n", str(port), "-u", "admin", "-P", path,
+	       "-m", "MODE:SWEEP", "-m", "TIMEOUT:%d" % TIMEOUT, "-m", "RETRIES:3", "-m", "RATE:%d" % RATE]
+	proc = subprocess.run(cmd, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=120)
+	os.unlink(path)
+
+	output = proc.stdout.decode(errors="replace")
+	found = output.count("[SUCCESS]")
+
+	if (proc.returncode != 0) or ("AddressSanitizer" in output) or (found != COMMUNITIES):
+		sys.stdout.write(output[-4000:])
+		print("FAIL: exit status %d, %d of %d community strings reported" % (proc.returncode, found, COMMUNITIES))
+		return 1
+
+	print("PASS: %d community strings reported once each" % found)
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
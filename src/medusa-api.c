@@ -0,0 +1,371 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Embeddable C API (libmedusa): audit setup, run control and result events (see medusa-api.h)
+ *
+*/
+
+#include "medusa.h"
+
+#define MEDUSA_STATE_NEW 0
+#define MEDUSA_STATE_RUNNING 1
+#define MEDUSA_STATE_DONE 2
+
+struct __sMedusaAudit {
+  sAudit *psAudit;
+  int argc;                   // command line recorded in the output file (-O)
+  char **argv;
+  size_t nUserSize;           // bytes used by the users added so far
+  size_t nPassSize;           // bytes used by the passwords added so far
+  int iState;
+  int iStarted;               // run in a background thread (medusaAuditStart())
+  pthread_t thrRun;
+  int iResult;
+};
+
+/*
+  Create an audit with the default options. Returns NULL if an audit
+  already exists in this process.
+*/
+sMedusaAudit* medusaAuditCreate()
+{
+  sMedusaAudit *psMedusa;
+  sAudit *psNew;
+
+  if ((psNew = auditCreate()) == NULL)
+  {
+    writeError(ERR_ERROR, "Only one audit may exist at a time.");
+    return NULL;
+  }
+
+  psMedusa = malloc(sizeof(sMedusaAudit));
+  memset(psMedusa, 0, sizeof(sMedusaAudit));
+  psMedusa->psAudit = psNew;
+  psMedusa->iState = MEDUSA_STATE_NEW;
+
+  return psMedusa;
+}
+
+/* Audits can only be described until they are run */
+static int isAuditNew(sMedusaAudit *psMedusa)
+{
+  if ((psMedusa == NULL) || (psMedusa->iState != MEDUSA_STATE_NEW))
+  {
+    writeError(ERR_ERROR, "Audit was already run.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+  Apply command-line options (argv[0] is the program name). Hosts, users and
+  passwords may be supplied both ways, except that a list given by option
+  cannot be extended by the calls below. argv must remain valid until the
+  audit has run.
+*/
+int medusaAuditParseArgs(sMedusaAudit *psMedusa, int argc, char **argv)
+{
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psMedusa->argc = argc;
+  psMedusa->argv = argv;
+
+  optind = 1;
+  if (checkOptions(argc, argv, psMedusa->psAudit))
+    return MEDUSA_FAILURE;
+
+  return MEDUSA_SUCCESS;
+}
+
+int medusaAuditSetModule(sMedusaAudit *psMedusa, const char *pModule)
+{
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  FREE(szModuleName);
+  szModuleName = strdup(pModule);
+  psMedusa->psAudit->pModuleName = szModuleName;
+
+  return MEDUSA_SUCCESS;
+}
+
+int medusaAuditAddModuleParam(sMedusaAudit *psMedusa, const char *pParam)
+{
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  nModuleParamCount++;
+  arrModuleParams = realloc(arrModuleParams, nModuleParamCount * sizeof(char*));
+  arrModuleParams[nModuleParamCount - 1] = strdup(pParam);
+
+  return MEDUSA_SUCCESS;
+}
+
+/*
+  Add a target - hostname, IP address, CIDR block or range, optionally
+  followed by :PORT (as for -h).
+*/
+int medusaAuditAddHost(sMedusaAudit *psMedusa, const char *pTarget)
+{
+  sAudit *psAudit;
+  char *pSpec;
+  int iRet;
+
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psAudit = psMedusa->psAudit;
+
+  /* task and combo files name the services of their hosts */
+  if ((psAudit->pOptTask) || (psAudit->pOptCombo))
+  {
+    writeError(ERR_ERROR, "Hosts cannot be added to audits using a task or combo file.");
+    return MEDUSA_FAILURE;
+  }
+
+  pSpec = strdup(pTarget);
+  iRet = hostListAdd(&psAudit->sHostList, pSpec, 0);
+  free(pSpec);
+
+  if (iRet == FAILURE)
+    return MEDUSA_FAILURE;
+
+  if (psAudit->HostType == L_UNSET)
+    psAudit->HostType = L_SINGLE;
+
+  return MEDUSA_SUCCESS;
+}
+
+/* Append an entry to a list of NUL-separated entries, as read by loadFile() */
+static int addListEntry(char **ppList, size_t *pnSize, const char *pEntry)
+{
+  size_t nLen = strlen(pEntry);
+
+  if (nLen == 0)
+    return FAILURE;
+
+  if ((*ppList = realloc(*ppList, *pnSize + nLen + 2)) == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for list entry.");
+
+  memcpy(*ppList + *pnSize, pEntry, nLen + 1);
+  *pnSize += nLen + 1;
+  (*ppList)[*pnSize] = '\0';  /* extra NULL to identify end of list */
+
+  return SUCCESS;
+}
+
+int medusaAuditAddUser(sMedusaAudit *psMedusa, const char *pUser)
+{
+  sAudit *psAudit;
+
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psAudit = psMedusa->psAudit;
+
+  if ((psAudit->UserType != L_UNSET) && ((psAudit->UserType != L_FILE) || (psAudit->pOptUser)))
+  {
+    writeError(ERR_ERROR, "Users were already supplied by option.");
+    return MEDUSA_FAILURE;
+  }
+
+  if (addListEntry(&psAudit->pUserFile, &psMedusa->nUserSize, pUser) == FAILURE)
+    return MEDUSA_FAILURE;
+
+  psAudit->UserType = L_FILE;
+  psAudit->pGlobalUser = psAudit->pUserFile;
+  psAudit->iUserCnt++;
+
+  return MEDUSA_SUCCESS;
+}
+
+int medusaAuditAddPassword(sMedusaAudit *psMedusa, const char *pPass)
+{
+  sAudit *psAudit;
+
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psAudit = psMedusa->psAudit;
+
+  if ((psAudit->PassType != L_UNSET) && ((psAudit->PassType != L_FILE) || (psAudit->pOptPass) || (psAudit->pfnPassNext)))
+  {
+    writeError(ERR_ERROR, "Passwords were already supplied by option or callback.");
+    return MEDUSA_FAILURE;
+  }
+
+  if (addListEntry(&psAudit->pPassFile, &psMedusa->nPassSize, pPass) == FAILURE)
+    return MEDUSA_FAILURE;
+
+  psAudit->PassType = L_FILE;
+  psAudit->pGlobalPass = psAudit->pPassFile;
+  psAudit->iPassCnt++;
+
+  return MEDUSA_SUCCESS;
+}
+
+/*
+  Test the passwords returned by pfnNext, which is called by a reader thread
+  until it returns NULL. Passwords are streamed as for -P FIFOs: every user
+  is tested with each password, which is read once.
+*/
+int medusaAuditSetPasswordSource(sMedusaAudit *psMedusa, pfnMedusaNext pfnNext, void *pArg)
+{
+  sAudit *psAudit;
+
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psAudit = psMedusa->psAudit;
+
+  if (psAudit->PassType != L_UNSET)
+  {
+    writeError(ERR_ERROR, "Passwords were already supplied.");
+    return MEDUSA_FAILURE;
+  }
+
+  psAudit->PassType = L_FILE;
+  psAudit->pfnPassNext = pfnNext;
+  psAudit->pPassNextArg = pArg;
+
+  return MEDUSA_SUCCESS;
+}
+
+void medusaAuditSetEventHandler(sMedusaAudit *psMedusa, pfnMedusaEvent pfnEvent, void *pArg)
+{
+  if (!isAuditNew(psMedusa))
+    return;
+
+  psMedusa->psAudit->pfnEvent = pfnEvent;
+  psMedusa->psAudit->pEventArg = pArg;
+}
+
+/*
+  Mark the audit as testing a lease of a distributed audit (medusa-dist.c).
+  It is resumed by its coordinator, so no resume map is written once stopped.
+*/
+void medusaAuditSetLeased(sMedusaAudit *psMedusa)
+{
+  if (!isAuditNew(psMedusa))
+    return;
+
+  psMedusa->psAudit->iLeased = TRUE;
+}
+
+/* Check that the audit has a module, hosts, users and passwords */
+int medusaAuditValidate(sMedusaAudit *psMedusa)
+{
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  return (checkAuditInput(psMedusa->psAudit) == SUCCESS) ? MEDUSA_SUCCESS : MEDUSA_FAILURE;
+}
+
+/*
+  Run the audit in the calling thread. Returns MEDUSA_STOPPED if it was
+  ended by medusaAuditStop() - the logins left untested are then reported
+  as a resume map (-Z).
+*/
+int medusaAuditRun(sMedusaAudit *psMedusa)
+{
+  sAudit *psAudit;
+
+  if (!isAuditNew(psMedusa))
+    return MEDUSA_FAILURE;
+
+  psAudit = psMedusa->psAudit;
+  psMedusa->iState = MEDUSA_STATE_RUNNING;
+
+  if ((checkAuditInput(psAudit) == FAILURE) || (auditLoad(psAudit, psMedusa->argc, psMedusa->argv) == FAILURE))
+    psMedusa->iResult = MEDUSA_FAILURE;
+  else if (auditRun(psAudit) == SUCCESS)
+    psMedusa->iResult = MEDUSA_SUCCESS;
+  else
+    psMedusa->iResult = MEDUSA_FAILURE;
+
+  if (psAudit->iStopped)
+    psMedusa->iResult = MEDUSA_STOPPED;
+
+  psMedusa->iState = MEDUSA_STATE_DONE;
+
+  return psMedusa->iResult;
+}
+
+static void* runAudit(void *arg)
+{
+  medusaAuditRun((sMedusaAudit *)arg);
+
+  return NULL;
+}
+
+/* Run the audit in a background thread. See medusaAuditWait(). */
+int medusaAuditStart(sMedusaAudit *psMedusa)
+{
+  if ((!isAuditNew(psMedusa)) || (psMedusa->iStarted))
+    return MEDUSA_FAILURE;
+
+  if (pthread_create(&psMedusa->thrRun, NULL, runAudit, (void *)psMedusa) != 0)
+  {
+    writeError(ERR_ERROR, "Failed to create audit thread - %s", strerror( errno ) );
+    return MEDUSA_FAILURE;
+  }
+
+  psMedusa->iStarted = TRUE;
+
+  return MEDUSA_SUCCESS;
+}
+
+/* Wait for an audit started by medusaAuditStart() and return its result */
+int medusaAuditWait(sMedusaAudit *psMedusa)
+{
+  if ((psMedusa == NULL) || (!psMedusa->iStarted))
+    return MEDUSA_FAILURE;
+
+  pthread_join(psMedusa->thrRun, NULL);
+  psMedusa->iStarted = FALSE;
+
+  return psMedusa->iResult;
+}
+
+/*
+  Ask the login threads to end the audit. Returns at once - the audit
+  ends once the logins in progress have completed. Safe to call from
+  event handlers and signal handlers.
+*/
+void medusaAuditStop(sMedusaAudit *psMedusa)
+{
+  if (psMedusa)
+    auditStop(psMedusa->psAudit);
+}
+
+/* Free the audit, waiting for it first if it runs in the background */
+void medusaAuditFree(sMedusaAudit *psMedusa)
+{
+  if (psMedusa == NULL)
+    return;
+
+  if (psMedusa->iStarted)
+    medusaAuditWait(psMedusa);
+
+  auditFree(psMedusa->psAudit);
+  free(psMedusa);
+}
@@ -0,0 +1,116 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_API_H
+#define _MEDUSA_API_H
+
+/*
+  libmedusa - run Medusa audits from another program.
+
+  An audit is created with medusaAuditCreate(), described by the calls below
+  (and/or by the usual command-line options through medusaAuditParseArgs())
+  and then run, either in the calling thread (medusaAuditRun()) or in the
+  background (medusaAuditStart(), medusaAuditWait()). Login results are
+  delivered to the event handler as they happen.
+
+  Only one audit may exist at a time within a process. Modules are loaded
+  with dlopen() and use the functions of the library, so programs linking
+  libmedusa.a must export its symbols (e.g. -rdynamic -Wl,--whole-archive
+  -lmedusa -Wl,--no-whole-archive). Fatal errors still end the process.
+*/
+
+#define MEDUSA_SUCCESS 0
+#define MEDUSA_FAILURE -1
+#define MEDUSA_STOPPED 1            // audit was ended by medusaAuditStop()
+
+/* event types */
+#define MEDUSA_EVENT_ATTEMPT 1      // login tested, see iResult
+#define MEDUSA_EVENT_HOST_DONE 2    // all logins of a host were tested
+#define MEDUSA_EVENT_UNREACHABLE 3  // host skipped by the liveness pre-scan (-S)
+
+/* login results (MEDUSA_EVENT_ATTEMPT) */
+#define MEDUSA_RESULT_SUCCESS 2
+#define MEDUSA_RESULT_FAIL 3
+#define MEDUSA_RESULT_ERROR 4
+
+typedef struct __sMedusaAudit sMedusaAudit;
+
+/*
+  Strings are only valid for the duration of the call. Events are sent by the
+  login threads, so handlers must be thread safe and should return quickly.
+*/
+typedef struct __sMedusaEvent {
+  int iType;
+  const char *pModule;
+  const char *pHost;
+  int iPort;                  // 0 if the module's default port is unknown
+  const char *pUser;          // MEDUSA_EVENT_ATTEMPT only
+  const char *pPass;          // MEDUSA_EVENT_ATTEMPT only
+  int iResult;
+  const char *pMessage;       // module or probe message, NULL if none
+} sMedusaEvent;
+
+typedef void (*pfnMedusaEvent)(const sMedusaEvent *psEvent, void *pArg);
+
+/* Return the next candidate, or NULL once there are no more. Called by a reader thread. */
+typedef const char* (*pfnMedusaNext)(void *pArg);
+
+sMedusaAudit* medusaAuditCreate();
+int medusaAuditParseArgs(sMedusaAudit *psMedusa, int argc, char **argv);
+int medusaAuditSetModule(sMedusaAudit *psMedusa, const char *pModule);
+int medusaAuditAddModuleParam(sMedusaAudit *psMedusa, const char *pParam);
+int medusaAuditAddHost(sMedusaAudit *psMedusa, const char *pTarget);
+int medusaAuditAddUser(sMedusaAudit *psMedusa, const char *pUser);
+int medusaAuditAddPassword(sMedusaAudit *psMedusa, const char *pPass);
+int medusaAuditSetPasswordSource(sMedusaAudit *psMedusa, pfnMedusaNext pfnNext, void *pArg);
+void medusaAuditSetEventHandler(sMedusaAudit *psMedusa, pfnMedusaEvent pfnEvent, void *pArg);
+int medusaAuditValidate(sMedusaAudit *psMedusa);
+int medusaAuditRun(sMedusaAudit *psMedusa);
+int medusaAuditStart(sMedusaAudit *psMedusa);
+int medusaAuditWait(sMedusaAudit *psMedusa);
+void medusaAuditStop(sMedusaAudit *psMedusa);
+void medusaAuditFree(sMedusaAudit *psMedusa);
+
+/*
+  Daemon mode. medusaDaemonRun() takes the options of the daemon (-Y SOCKET
+  [-t NUM] [-v NUM] [-w NUM] [-b]) and runs the audits submitted on the
+  local socket until it receives SIGTERM or SIGINT. Each audit (job) runs in
+  a process forked from the daemon. medusaDaemonSubmit() runs the audit
+  described by argv (command-line options) in the daemon and returns its
+  exit status. The job uses the standard input, output and error of the
+  caller. MEDUSA_FAILURE is returned if the job could not be submitted.
+*/
+#define MEDUSA_DAEMON_USAGE 64      // exit status of jobs with invalid options
+
+int medusaDaemonRun(int argc, char **argv);
+int medusaDaemonSubmit(const char *pSocket, int argc, char **argv);
+
+/*
+  Distributed mode. An audit given a coordinator address (-J [ADDR:]PORT)
+  leases its logins to the workers connected to it rather than testing them
+  itself. medusaWorkerRun() takes the options of a worker (-j HOST:PORT
+  [-t NUM] [-v NUM] [-w NUM] [-b]) and tests the logins leased by the
+  coordinator until it ends the audit.
+*/
+int medusaWorkerRun(int argc, char **argv);
+
+#endif
@@ -0,0 +1,654 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Coroutine login runtime (-E)
+ *
+*/
+
+#include <poll.h>
+#include "medusa.h"
+#include "medusa-coro.h"
+
+sCoroGroup* coroGroupCreate(void)
+{
+  sCoroGroup *psGroup;
+
+  psGroup = malloc(sizeof(sCoroGroup));
+  memset(psGroup, 0, sizeof(sCoroGroup));
+  pthread_mutex_init(&psGroup->ptmMutex, NULL);
+  pthread_cond_init(&psGroup->ptcDone, NULL);
+
+  return psGroup;
+}
+
+/* wait for the coroutines spawned in the group to end */
+void coroGroupWait(sCoroGroup *psGroup)
+{
+  pthread_mutex_lock(&psGroup->ptmMutex);
+  while (psGroup->iActive > 0)
+    pthread_cond_wait(&psGroup->ptcDone, &psGroup->ptmMutex);
+  pthread_mutex_unlock(&psGroup->ptmMutex);
+}
+
+void coroGroupFree(sCoroGroup *psGroup)
+{
+  if (psGroup == NULL)
+    return;
+
+  pthread_mutex_destroy(&psGroup->ptmMutex);
+  pthread_cond_destroy(&psGroup->ptcDone);
+  free(psGroup);
+}
+
+#ifdef HAVE_COROUTINES
+
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#ifndef MAP_ANONYMOUS
+  #define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_STACK
+  #define MAP_STACK 0
+#endif
+
+static pthread_mutex_t ptmRuntime = PTHREAD_MUTEX_INITIALIZER;
+static int iRuntimeUsers = 0;               // audits using the runtime (ptmRuntime)
+static sCoroSched *arrSched = NULL;
+static int nSched = 0;
+static unsigned int nNextSched = 0;
+static pthread_key_t pkSched;
+static pthread_once_t poSched = PTHREAD_ONCE_INIT;
+
+static void createKey(void)
+{
+  pthread_key_create(&pkSched, NULL);
+}
+
+static int64_t getNow(void)
+{
+  struct timespec tsNow;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsNow);
+  return (int64_t)tsNow.tv_sec * 1000000000 + tsNow.tv_nsec;
+}
+
+/* coroutine running on the calling thread, NULL outside of the coroutines */
+static sCoro* getCurrent(sCoroSched **ppsSched)
+{
+  sCoroSched *psSched;
+
+  if (nSched == 0)
+    return NULL;
+
+  psSched = pthread_getspecific(pkSched);
+  if (ppsSched)
+    *ppsSched = psSched;
+
+  return (psSched) ? psSched->psCurrent : NULL;
+}
+
+/* Timer heap - the coroutine whose deadline is closest first */
+static void heapSwap(sCoroSched *psSched, int i, int j)
+{
+  sCoro *psTmp;
+
+  psTmp = psSched->arrHeap[i];
+  psSched->arrHeap[i] = psSched->arrHeap[j];
+  psSched->arrHeap[j] = psTmp;
+  psSched->arrHeap[i]->iHeap = i;
+  psSched->arrHeap[j]->iHeap = j;
+}
+
+static void heapUp(sCoroSched *psSched, int i)
+{
+  while ((i > 0) && (psSched->arrHeap[(i - 1) / 2]->nDeadline > psSched->arrHeap[i]->nDeadline))
+  {
+    heapSwap(psSched, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void heapDown(sCoroSched *psSched, int i)
+{
+  int iChild;
+
+  while ((iChild = 2 * i + 1) < psSched->nHeap)
+  {
+    if ((iChild + 1 < psSched->nHeap) && (psSched->arrHeap[iChild + 1]->nDeadline < psSched->arrHeap[iChild]->nDeadline))
+      iChild++;
+
+    if (psSched->arrHeap[i]->nDeadline <= psSched->arrHeap[iChild]->nDeadline)
+      break;
+
+    heapSwap(psSched, i, iChild);
+    i = iChild;
+  }
+}
+
+static void heapPush(sCoroSched *psSched, sCoro *psCoro)
+{
+  if (psSched->nHeap == psSched->nHeapAlloc)
+  {
+    psSched->nHeapAlloc = (psSched->nHeapAlloc) ? psSched->nHeapAlloc * 2 : 64;
+    psSched->arrHeap = realloc(psSched->arrHeap, psSched->nHeapAlloc * sizeof(sCoro *));
+  }
+
+  psCoro->iHeap = psSched->nHeap;
+  psSched->arrHeap[psSched->nHeap++] = psCoro;
+  heapUp(psSched, psCoro->iHeap);
+}
+
+static void heapRemove(sCoroSched *psSched, sCoro *psCoro)
+{
+  int i = psCoro->iHeap;
+
+  if (i < 0)
+    return;
+
+  psSched->nHeap--;
+  if (i != psSched->nHeap)
+  {
+    heapSwap(psSched, i, psSched->nHeap);
+    heapDown(psSched, i);
+    heapUp(psSched, i);
+  }
+  psCoro->iHeap = -1;
+}
+
+static void pushReady(sCoroSched *psSched, sCoro *psCoro)
+{
+  psCoro->psNext = NULL;
+  if (psSched->psReadyTail)
+    psSched->psReadyTail->psNext = psCoro;
+  else
+    psSched->psReady = psCoro;
+  psSched->psReadyTail = psCoro;
+}
+
+/*
+  Stacks are mapped, not allocated: only the pages a module touches use
+  memory. The lowest page is a guard, so an overflow faults instead of
+  overwriting the neighbouring stack.
+*/
+static char* getStack(sCoroSched *psSched)
+{
+  char *pStack;
+
+  if (psSched->nStacks > 0)
+    return psSched->arrStacks[--psSched->nStacks];
+
+  pStack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (pStack == MAP_FAILED)
+    return NULL;
+
+  mprotect(pStack, sysconf(_SC_PAGESIZE), PROT_NONE);
+  return pStack;
+}
+
+static void putStack(sCoroSched *psSched, char *pStack)
+{
+  if (psSched->nStacks < CORO_STACK_POOL)
+    psSched->arrStacks[psSched->nStacks++] = pStack;
+  else
+    munmap(pStack, CORO_STACK_SIZE);
+}
+
+/* entry point of the coroutines - the one starting is the scheduler's current */
+static void runCoro(void)
+{
+  sCoroSched *psSched;
+  sCoro *psCoro;
+
+  psCoro = getCurrent(&psSched);
+  psCoro->pfnStart(psCoro->pArg);
+
+  psCoro->iDone = TRUE;
+  swapcontext(&psCoro->ucContext, &psSched->ucSched);
+}
+
+static void endCoro(sCoroSched *psSched, sCoro *psCoro)
+{
+  sCoroGroup *psGroup = psCoro->psGroup;
+
+  if (psCoro->pStack)
+    putStack(psSched, psCoro->pStack);
+  free(psCoro);
+  psSched->iCoros--;
+
+  pthread_mutex_lock(&psGroup->ptmMutex);
+  if (--psGroup->iActive == 0)
+    pthread_cond_broadcast(&psGroup->ptcDone);
+  pthread_mutex_unlock(&psGroup->ptmMutex);
+}
+
+/* coroutines spawned by other threads are given their stack and made ready */
+static int takeIncoming(sCoroSched *psSched)
+{
+  sCoro *psCoro, *psNext;
+  int iStop;
+
+  pthread_mutex_lock(&psSched->ptmMutex);
+  psCoro = psSched->psIncoming;
+  psSched->psIncoming = NULL;
+  iStop = psSched->iStop;
+  pthread_mutex_unlock(&psSched->ptmMutex);
+
+  for (; psCoro; psCoro = psNext)
+  {
+    psNext = psCoro->psNext;
+    psSched->iCoros++;
+
+    if ((psCoro->pStack = getStack(psSched)) == NULL)
+    {
+      writeError(ERR_ERROR, "[takeIncoming] Failed to map coroutine stack - %s", strerror(errno));
+      endCoro(psSched, psCoro);
+      continue;
+    }
+
+    getcontext(&psCoro->ucContext);
+    psCoro->ucContext.uc_stack.ss_sp = psCoro->pStack;
+    psCoro->ucContext.uc_stack.ss_size = CORO_STACK_SIZE;
+    psCoro->ucContext.uc_link = NULL;
+    makecontext(&psCoro->ucContext, runCoro, 0);
+
+    pushReady(psSched, psCoro);
+  }
+
+  return iStop;
+}
+
+/* the descriptor is ready or the deadline passed */
+static void wakeCoro(sCoroSched *psSched, sCoro *psCoro, int iEvents)
+{
+  if (!psCoro->iWaiting)
+    return;
+
+  if (psCoro->hWait >= 0)
+    epoll_ctl(psSched->hEpoll, EPOLL_CTL_DEL, psCoro->hWait, NULL);
+  heapRemove(psSched, psCoro);
+
+  psCoro->hWait = -1;
+  psCoro->iEvents = iEvents;
+  psCoro->iWaiting = FALSE;
+  pushReady(psSched, psCoro);
+}
+
+static void *runScheduler(void *pArg)
+{
+  sCoroSched *psSched = (sCoroSched *)pArg;
+  struct epoll_event arrEvents[CORO_EVENTS];
+  sCoro *psCoro;
+  char bufWake[64];
+  int64_t nNow;
+  int i, nEvents, iTimeout, iStop;
+
+  pthread_setspecific(pkSched, psSched);
+
+  while (1)
+  {
+    iStop = takeIncoming(psSched);
+
+    while ((psCoro = psSched->psReady) != NULL)
+    {
+      psSched->psReady = psCoro->psNext;
+      if (psSched->psReady == NULL)
+        psSched->psReadyTail = NULL;
+
+      psSched->psCurrent = psCoro;
+      swapcontext(&psSched->ucSched, &psCoro->ucContext);
+      psSched->psCurrent = NULL;
+
+      if (psCoro->iDone)
+        endCoro(psSched, psCoro);
+    }
+
+    if ((iStop) && (psSched->iCoros == 0))
+      break;
+
+    iTimeout = -1;
+    if (psSched->nHeap > 0)
+    {
+      nNow = getNow();
+      iTimeout = (psSched->arrHeap[0]->nDeadline <= nNow) ? 0 : (int)((psSched->arrHeap[0]->nDeadline - nNow + 999999) / 1000000);
+    }
+
+    nEvents = epoll_wait(psSched->hEpoll, arrEvents, CORO_EVENTS, iTimeout);
+    for (i = 0; i < nEvents; i++)
+    {
+      if (arrEvents[i].data.ptr == NULL)
+      {
+        while (read(psSched->arrWake[0], bufWake, sizeof(bufWake)) > 0);
+        continue;
+      }
+
+      wakeCoro(psSched, (sCoro *)arrEvents[i].data.ptr, arrEvents[i].events);
+    }
+
+    nNow = getNow();
+    while ((psSched->nHeap > 0) && (psSched->arrHeap[0]->nDeadline <= nNow))
+      wakeCoro(psSched, psSched->arrHeap[0], 0);
+  }
+
+  return NULL;
+}
+
+static void freeScheduler(sCoroSched *psSched)
+{
+  while (psSched->nStacks > 0)
+    munmap(psSched->arrStacks[--psSched->nStacks], CORO_STACK_SIZE);
+
+  FREE(psSched->arrHeap);
+  if (psSched->hEpoll >= 0)
+    close(psSched->hEpoll);
+  if (psSched->arrWake[0] >= 0)
+    close(psSched->arrWake[0]);
+  if (psSched->arrWake[1] >= 0)
+    close(psSched->arrWake[1]);
+  pthread_mutex_destroy(&psSched->ptmMutex);
+}
+
+static int initScheduler(sCoroSched *psSched, int iId)
+{
+  struct epoll_event sEvent;
+
+  memset(psSched, 0, sizeof(sCoroSched));
+  psSched->iId = iId;
+  psSched->arrWake[0] = psSched->arrWake[1] = -1;
+  pthread_mutex_init(&psSched->ptmMutex, NULL);
+
+  if ((psSched->hEpoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return FAILURE;
+
+  if (pipe(psSched->arrWake) != 0)
+  {
+    psSched->arrWake[0] = psSched->arrWake[1] = -1;
+    return FAILURE;
+  }
+  fcntl(psSched->arrWake[0], F_SETFL, O_NONBLOCK);
+  fcntl(psSched->arrWake[1], F_SETFL, O_NONBLOCK);
+
+  memset(&sEvent, 0, sizeof(sEvent));
+  sEvent.events = EPOLLIN;
+  sEvent.data.ptr = NULL;
+  if (epoll_ctl(psSched->hEpoll, EPOLL_CTL_ADD, psSched->arrWake[0], &sEvent) != 0)
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+/*
+  Start the schedulers (nThreads, 0 for one per CPU). Audits running at the
+  same time share them; the last to call coroStop() stops them.
+*/
+int coroStart(int nThreads)
+{
+  int i, ret = SUCCESS;
+
+  pthread_once(&poSched, createKey);
+  pthread_mutex_lock(&ptmRuntime);
+
+  if (iRuntimeUsers++ > 0)
+  {
+    pthread_mutex_unlock(&ptmRuntime);
+    return SUCCESS;
+  }
+
+  if (nThreads <= 0)
+    nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nThreads <= 0)
+    nThreads = 1;
+
+  arrSched = malloc(nThreads * sizeof(sCoroSched));
+  for (i = 0; i < nThreads; i++)
+  {
+    if (initScheduler(&arrSched[i], i) != SUCCESS)
+    {
+      writeError(ERR_ERROR, "Failed to set up coroutine scheduler - %s", strerror(errno));
+      freeScheduler(&arrSched[i]);
+      ret = FAILURE;
+      break;
+    }
+
+    if (pthread_create(&arrSched[i].thrSched, NULL, runScheduler, &arrSched[i]) != 0)
+    {
+      writeError(ERR_ERROR, "Failed to start coroutine scheduler thread.");
+      freeScheduler(&arrSched[i]);
+      ret = FAILURE;
+      break;
+    }
+  }
+
+  nSched = i;
+  pthread_mutex_unlock(&ptmRuntime);
+
+  if (ret == FAILURE)
+  {
+    coroStop();
+    return FAILURE;
+  }
+
+  writeError(ERR_DEBUG, "[coroStart] Coroutine scheduler threads: %d", nSched);
+  return SUCCESS;
+}
+
+/* Stop the schedulers once the coroutines of all audits ended */
+void coroStop(void)
+{
+  int i, n;
+
+  pthread_mutex_lock(&ptmRuntime);
+  if ((iRuntimeUsers == 0) || (--iRuntimeUsers > 0))
+  {
+    pthread_mutex_unlock(&ptmRuntime);
+    return;
+  }
+
+  for (i = 0; i < nSched; i++)
+  {
+    pthread_mutex_lock(&arrSched[i].ptmMutex);
+    arrSched[i].iStop = TRUE;
+    pthread_mutex_unlock(&arrSched[i].ptmMutex);
+    n = write(arrSched[i].arrWake[1], "", 1);
+    (void)n;
+  }
+
+  for (i = 0; i < nSched; i++)
+  {
+    pthread_join(arrSched[i].thrSched, NULL);
+    freeScheduler(&arrSched[i]);
+  }
+
+  FREE(arrSched);
+  nSched = 0;
+  pthread_mutex_unlock(&ptmRuntime);
+}
+
+/* Run pfnStart(pArg) as a coroutine of the next scheduler */
+int coroSpawn(sCoroGroup *psGroup, void (*pfnStart)(void *), void *pArg)
+{
+  sCoroSched *psSched;
+  sCoro *psCoro;
+  int n;
+
+  if (nSched == 0)
+    return FAILURE;
+
+  psSched = &arrSched[__atomic_fetch_add(&nNextSched, 1, __ATOMIC_RELAXED) % nSched];
+
+  psCoro = malloc(sizeof(sCoro));
+  memset(psCoro, 0, sizeof(sCoro));
+  psCoro->pfnStart = pfnStart;
+  psCoro->pArg = pArg;
+  psCoro->psGroup = psGroup;
+  psCoro->hWait = -1;
+  psCoro->iHeap = -1;
+
+  pthread_mutex_lock(&psGroup->ptmMutex);
+  psGroup->iActive++;
+  pthread_mutex_unlock(&psGroup->ptmMutex);
+
+  pthread_mutex_lock(&psSched->ptmMutex);
+  psCoro->psNext = psSched->psIncoming;
+  psSched->psIncoming = psCoro;
+  pthread_mutex_unlock(&psSched->ptmMutex);
+
+  n = write(psSched->arrWake[1], "", 1);
+  (void)n;
+
+  return SUCCESS;
+}
+
+/* TRUE when the caller is a coroutine which may yield */
+int coroActive(void)
+{
+  sCoro *psCoro;
+
+  psCoro = getCurrent(NULL);
+  return ((psCoro) && (psCoro->iNoYield == 0)) ? TRUE : FALSE;
+}
+
+/*
+  Wait up to nWait microseconds (forever if negative) for nEvents (POLLIN,
+  POLLOUT) on hFd. Returns as select() does: 1 once ready (or on error or
+  hang-up), 0 after the timeout, -1 on error. Callers check coroActive().
+*/
+int coroWait(int hFd, short nEvents, long nWait)
+{
+  sCoroSched *psSched;
+  sCoro *psCoro;
+  struct epoll_event sEvent;
+  struct pollfd sPoll;
+
+  psCoro = getCurrent(&psSched);
+
+  /* nothing to wait for - check the descriptor without yielding */
+  if ((nWait == 0) || (psCoro == NULL) || (psCoro->iNoYield))
+  {
+    sPoll.fd = hFd;
+    sPoll.events = nEvents;
+    sPoll.revents = 0;
+    return poll(&sPoll, 1, (nWait < 0) ? -1 : (int)((nWait + 999) / 1000));
+  }
+
+  memset(&sEvent, 0, sizeof(sEvent));
+  sEvent.events = ((nEvents & POLLIN) ? EPOLLIN : 0) | ((nEvents & POLLOUT) ? EPOLLOUT : 0);
+  sEvent.data.ptr = psCoro;
+
+  if (epoll_ctl(psSched->hEpoll, EPOLL_CTL_ADD, hFd, &sEvent) != 0)
+  {
+    /* regular files are always ready */
+    if (errno == EPERM)
+      return 1;
+
+    return -1;
+  }
+
+  psCoro->hWait = hFd;
+  if (nWait > 0)
+  {
+    psCoro->nDeadline = getNow() + (int64_t)nWait * 1000;
+    heapPush(psSched, psCoro);
+  }
+
+  psCoro->iWaiting = TRUE;
+  swapcontext(&psCoro->ucContext, &psSched->ucSched);
+
+  return (psCoro->iEvents) ? 1 : 0;
+}
+
+/* Sleep nWait microseconds, yielding to the other coroutines if possible */
+void coroSleep(long nWait)
+{
+  sCoroSched *psSched;
+  sCoro *psCoro;
+
+  psCoro = getCurrent(&psSched);
+  if ((psCoro == NULL) || (psCoro->iNoYield))
+  {
+    if (nWait >= 1000000)
+      sleep(nWait / 1000000);
+    usleep(nWait % 1000000);
+    return;
+  }
+
+  psCoro->hWait = -1;
+  psCoro->nDeadline = getNow() + (int64_t)nWait * 1000;
+  heapPush(psSched, psCoro);
+
+  psCoro->iWaiting = TRUE;
+  swapcontext(&psCoro->ucContext, &psSched->ucSched);
+}
+
+/* Enter (TRUE) or leave (FALSE) a section in which the coroutine does not yield */
+void coroBlock(int iBlock)
+{
+  sCoro *psCoro;
+
+  if ((psCoro = getCurrent(NULL)) != NULL)
+    psCoro->iNoYield += (iBlock) ? 1 : -1;
+}
+
+#else
+
+int coroStart(int nThreads __attribute__((unused)))
+{
+  writeError(ERR_ALERT, "Medusa was built without coroutine support (ucontext, epoll) - logins run on threads.");
+  return FAILURE;
+}
+
+void coroStop(void)
+{
+}
+
+int coroSpawn(sCoroGroup *psGroup __attribute__((unused)), void (*pfnStart)(void *) __attribute__((unused)), void *pArg __attribute__((unused)))
+{
+  return FAILURE;
+}
+
+int coroActive(void)
+{
+  return FALSE;
+}
+
+int coroWait(int hFd, short nEvents, long nWait)
+{
+  struct pollfd sPoll;
+
+  sPoll.fd = hFd;
+  sPoll.events = nEvents;
+  sPoll.revents = 0;
+  return poll(&sPoll, 1, (nWait < 0) ? -1 : (int)((nWait + 999) / 1000));
+}
+
+void coroSleep(long nWait)
+{
+  if (nWait >= 1000000)
+    sleep(nWait / 1000000);
+  usleep(nWait % 1000000);
+}
+
+void coroBlock(int iBlock __attribute__((unused)))
+{
+}
+
+#endif
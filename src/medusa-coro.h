@@ -0,0 +1,109 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_CORO_H
+#define _MEDUSA_CORO_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+  Coroutine login runtime (-E). Instead of a thread each, the logins of a
+  host run as coroutines on a few scheduler threads (one per CPU by default).
+  Where a module would block in medusa-net (connect, waiting for data,
+  sending to a full socket), its coroutine yields to the scheduler, which
+  waits for the descriptors and timeouts of all its coroutines in one epoll
+  loop. Modules are unchanged; those blocking elsewhere (external libraries,
+  sleep()) export isBlocking() and keep their login threads.
+
+  A coroutine must not yield while it holds a mutex: another coroutine of the
+  same scheduler locking it would stop the scheduler. Such sections (SSL
+  connects) are bracketed by coroBlock(), in which medusa-net blocks as it
+  does on login threads.
+*/
+#define CORO_STACK_SIZE (256 * 1024)        // guard page included
+#define CORO_STACK_POOL 64                  // free stacks kept by each scheduler
+#define CORO_EVENTS 256                     // epoll events read at once
+
+/* Logins of a host - waited for by its server thread */
+typedef struct __sCoroGroup {
+  pthread_mutex_t ptmMutex;
+  pthread_cond_t ptcDone;
+  int iActive;
+} sCoroGroup;
+
+#if defined(HAVE_MAKECONTEXT) && defined(HAVE_SYS_EPOLL_H)
+
+#define HAVE_COROUTINES 1
+
+#include <ucontext.h>
+
+typedef struct __sCoro {
+  struct __sCoro *psNext;                 // ready or incoming queue
+  ucontext_t ucContext;
+  char *pStack;
+  void (*pfnStart)(void *);
+  void *pArg;
+  sCoroGroup *psGroup;
+  int iWaiting;                           // waiting for hWait and/or nDeadline
+  int hWait;                              // descriptor waited for, -1 if none
+  int iEvents;                            // epoll events received, 0 on timeout
+  int64_t nDeadline;                      // monotonic nanoseconds
+  int iHeap;                              // index in the timer heap, -1 if none
+  int iNoYield;                           // coroBlock() depth
+  int iDone;
+} sCoro;
+
+typedef struct __sCoroSched {
+  int iId;
+  pthread_t thrSched;
+  ucontext_t ucSched;
+  sCoro *psCurrent;                       // coroutine running, NULL in the scheduler
+  int hEpoll;
+  int arrWake[2];                         // pipe written when coroutines are handed over
+  pthread_mutex_t ptmMutex;
+  sCoro *psIncoming;                      // spawned by other threads (ptmMutex)
+  int iStop;                              // (ptmMutex)
+  sCoro *psReady;
+  sCoro *psReadyTail;
+  sCoro **arrHeap;                        // waiting coroutines by deadline
+  int nHeap;
+  int nHeapAlloc;
+  char *arrStacks[CORO_STACK_POOL];
+  int nStacks;
+  int iCoros;                             // coroutines started and not done
+} sCoroSched;
+
+#endif
+
+extern int coroStart(int nThreads);
+extern void coroStop(void);
+extern sCoroGroup* coroGroupCreate(void);
+extern void coroGroupWait(sCoroGroup *psGroup);
+extern void coroGroupFree(sCoroGroup *psGroup);
+extern int coroSpawn(sCoroGroup *psGroup, void (*pfnStart)(void *), void *pArg);
+extern int coroActive(void);
+extern int coroWait(int hFd, short nEvents, long nWait);
+extern void coroSleep(long nWait);
+extern void coroBlock(int iBlock);
+
+#endif
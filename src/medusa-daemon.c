@@ -0,0 +1,959 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Daemon mode: audits submitted on a local socket (see medusa-daemon.h)
+ *
+*/
+
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "medusa.h"
+#include "medusa-daemon.h"
+
+static sDaemon *psDaemon = NULL;            // daemon run by this process
+static sMedusaAudit *psJobAudit = NULL;     // audit of a job process
+static int hSubmitConn = -1;                // connection of medusaDaemonSubmit()
+
+/* Signals of the daemon are handled by its main loop */
+static void daemonSignal(int sig)
+{
+  unsigned char c = sig;
+  int iErrno = errno;
+  ssize_t nWritten;
+
+  nWritten = write(psDaemon->arrSignal[1], &c, 1);
+  (void)nWritten;
+  errno = iErrno;
+}
+
+/*
+  SIGINT received by a job, or sent by the daemon once its client is gone.
+  The job ends as a SIGINT would end medusa: a resume map is written.
+*/
+static void jobSigint(int sig __attribute__((unused)))
+{
+  struct sigaction sig_action;
+
+  /* a second SIGINT really ends the job */
+  sig_action.sa_flags = 0;
+  sigemptyset(&sig_action.sa_mask);
+  sigaddset(&sig_action.sa_mask, SIGINT);
+  sig_action.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &sig_action, 0);
+  sigprocmask(SIG_UNBLOCK, &sig_action.sa_mask, 0);
+
+  writeError(ERR_ALERT, "Medusa received SIGINT - Sending notification to login threads that we are aborting.");
+  medusaAuditStop(psJobAudit);
+
+  writeError(ERR_INFO, "Waiting for login threads to terminate...");
+}
+
+/* SIGINT of a client closes its end of the socket, which stops the job */
+static void submitSigint(int sig __attribute__((unused)))
+{
+  shutdown(hSubmitConn, SHUT_WR);
+}
+
+static void setCloseOnExec(int hFd)
+{
+  fcntl(hFd, F_SETFD, fcntl(hFd, F_GETFD) | FD_CLOEXEC);
+}
+
+static int getJobOption(sJob *psJob, char cOpt)
+{
+  char *pValue;
+  int iValue = 1;
+
+  if ((findOption(psJob->argc, psJob->argv, MEDUSA_OPTIONS, cOpt, &pValue) >= 0) && (pValue))
+    iValue = atoi(pValue);
+
+  return (iValue > 0 ? iValue : 1);
+}
+
+/*
+  Load what the job will use while the daemon is idle: its module and the
+  list files named on its command line (relative to the client directory).
+  Jobs forked afterwards find them in memory.
+*/
+static void prefetchJob(sJob *psJob)
+{
+  const char *pLists = "UPHCX";
+  char *pValue, *pPath;
+  int i;
+
+  for (i = 0; pLists[i]; i++)
+  {
+    if ((findOption(psJob->argc, psJob->argv, MEDUSA_OPTIONS, pLists[i], &pValue) < 0) || (pValue == NULL) || (strcmp(pValue, "-") == 0))
+      continue;
+
+    pPath = malloc(strlen(psJob->pCwd) + strlen(pValue) + 2);
+    if (pValue[0] == '/')
+      strcpy(pPath, pValue);
+    else
+      sprintf(pPath, "%s/%s", psJob->pCwd, pValue);
+
+    listCachePrefetch(pPath);
+    free(pPath);
+  }
+
+  if ((findOption(psJob->argc, psJob->argv, MEDUSA_OPTIONS, 'M', &pValue) >= 0) && (pValue) && (preloadModule(pValue) != SUCCESS))
+    writeError(ERR_DEBUG, "[prefetchJob] Failed to preload module %s.", pValue);
+}
+
+static void freeJob(sJob *psJob)
+{
+  int i;
+
+  if (psJob->hConn >= 0)
+    close(psJob->hConn);
+
+  for (i = 0; i < 3; i++)
+    if (psJob->arrFd[i] >= 0)
+      close(psJob->arrFd[i]);
+
+  FREE(psJob->argv);
+  FREE(psJob->pRequest);
+  free(psJob);
+}
+
+/*
+  Remove a job from the daemon. The exit status is sent to the client
+  (unless iStatus is negative).
+*/
+static void endJob(sDaemon *_psDaemon, sJob **ppsJob, int iStatus)
+{
+  sJob *psJob = *ppsJob;
+  uint32_t nStatus;
+
+  if ((iStatus >= 0) && (psJob->hConn >= 0))
+  {
+    nStatus = htonl(iStatus);
+    sendAll(psJob->hConn, &nStatus, sizeof(nStatus));
+  }
+
+  if (psJob->pidJob)
+    _psDaemon->iUsed -= psJob->iCost;
+
+  *ppsJob = psJob->psNext;
+  freeJob(psJob);
+}
+
+/*
+  Receive more of the request of a client without blocking the daemon: its
+  command line, directory and standard descriptors. Returns 1 once the
+  request is complete, 0 while more is to come and -1 if it is invalid.
+*/
+static int receiveJob(sDaemon *_psDaemon, sJob *psJob)
+{
+  struct msghdr sMsg;
+  struct iovec sIov;
+  struct cmsghdr *psCmsg;
+  union {
+    struct cmsghdr sAlign;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } uControl;
+  size_t nFd, nDone;
+  ssize_t nRead;
+  char *pEntry;
+  int hFd, i, iFlags = 0, iValid = TRUE;
+
+  /* the descriptors come with the length of the request */
+  if (psJob->nReceived < sizeof(psJob->nLen))
+  {
+    memset(&sMsg, 0, sizeof(sMsg));
+    sIov.iov_base = (char *)&psJob->nLen + psJob->nReceived;
+    sIov.iov_len = sizeof(psJob->nLen) - psJob->nReceived;
+    sMsg.msg_iov = &sIov;
+    sMsg.msg_iovlen = 1;
+    sMsg.msg_control = uControl.buf;
+    sMsg.msg_controllen = sizeof(uControl.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+    iFlags = MSG_CMSG_CLOEXEC;
+#endif
+
+    nRead = recvmsg(psJob->hConn, &sMsg, iFlags);
+    if ((nRead < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+      return 0;
+
+    /* descriptors other than the three expected are closed */
+    for (psCmsg = CMSG_FIRSTHDR(&sMsg); (nRead >= 0) && (psCmsg); psCmsg = CMSG_NXTHDR(&sMsg, psCmsg))
+    {
+      if ((psCmsg->cmsg_level != SOL_SOCKET) || (psCmsg->cmsg_type != SCM_RIGHTS))
+        continue;
+
+      nFd = (psCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if ((nFd == 3) && (psJob->arrFd[0] < 0))
+        memcpy(psJob->arrFd, CMSG_DATA(psCmsg), 3 * sizeof(int));
+      else
+      {
+        for (nDone = 0; nDone < nFd; nDone++)
+        {
+          memcpy(&hFd, CMSG_DATA(psCmsg) + nDone * sizeof(int), sizeof(int));
+          close(hFd);
+        }
+        iValid = FALSE;
+      }
+    }
+
+    if ((nRead <= 0) || (!iValid) || (psJob->arrFd[0] < 0) || (sMsg.msg_flags & MSG_CTRUNC))
+    {
+      writeError(ERR_ERROR, "Invalid job request received (no command line or descriptors).");
+      return -1;
+    }
+
+    psJob->nReceived += nRead;
+    if (psJob->nReceived < sizeof(psJob->nLen))
+      return 0;
+
+    psJob->nLen = ntohl(psJob->nLen);
+    if ((psJob->nLen == 0) || (psJob->nLen > DAEMON_MAX_REQUEST))
+    {
+      writeError(ERR_ERROR, "Invalid job request received (length %u).", psJob->nLen);
+      return -1;
+    }
+
+    psJob->pRequest = malloc(psJob->nLen);
+  }
+
+  nDone = psJob->nReceived - sizeof(psJob->nLen);
+  nRead = recv(psJob->hConn, psJob->pRequest + nDone, psJob->nLen - nDone, 0);
+  if ((nRead < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+    return 0;
+
+  if (nRead > 0)
+    psJob->nReceived += nRead;
+
+  if ((nRead > 0) && (psJob->nReceived < sizeof(psJob->nLen) + psJob->nLen))
+    return 0;
+
+  if ((nRead <= 0) || (psJob->pRequest[psJob->nLen - 1] != '\0'))
+  {
+    writeError(ERR_ERROR, "Invalid job request received (incomplete command line).");
+    return -1;
+  }
+
+  /* directory, then the arguments */
+  psJob->pCwd = psJob->pRequest;
+  for (pEntry = psJob->pRequest; pEntry < psJob->pRequest + psJob->nLen; pEntry += strlen(pEntry) + 1)
+    psJob->argc++;
+
+  psJob->argc--;
+  if ((psJob->argc < 1) || (psJob->pCwd[0] != '/'))
+  {
+    writeError(ERR_ERROR, "Invalid job request received (no arguments).");
+    return -1;
+  }
+
+  psJob->argv = malloc((psJob->argc + 1) * sizeof(char *));
+  pEntry = psJob->pCwd + strlen(psJob->pCwd) + 1;
+  for (i = 0; i < psJob->argc; i++)
+  {
+    psJob->argv[i] = pEntry;
+    pEntry += strlen(pEntry) + 1;
+  }
+  psJob->argv[psJob->argc] = NULL;
+
+  /* the exit status is sent with a blocking write */
+  fcntl(psJob->hConn, F_SETFL, fcntl(psJob->hConn, F_GETFL) & ~O_NONBLOCK);
+
+  psJob->iId = ++_psDaemon->iJobCnt;
+  psJob->iCost = getJobOption(psJob, 'T') * getJobOption(psJob, 't');
+
+  writeVerbose(VB_GENERAL, "Job %d submitted (%d login threads) from %s", psJob->iId, psJob->iCost, psJob->pCwd);
+  prefetchJob(psJob);
+
+  return 1;
+}
+
+/* A new client - its request is received by receiveJob() as it arrives */
+static void acceptJob(sDaemon *_psDaemon)
+{
+  sJob *psJob;
+  int hConn, i;
+
+  if ((hConn = accept(_psDaemon->hListen, NULL, NULL)) < 0)
+    return;
+
+  setCloseOnExec(hConn);
+  fcntl(hConn, F_SETFL, fcntl(hConn, F_GETFL) | O_NONBLOCK);
+
+  psJob = malloc(sizeof(sJob));
+  memset(psJob, 0, sizeof(sJob));
+  psJob->hConn = hConn;
+  for (i = 0; i < 3; i++)
+    psJob->arrFd[i] = -1;
+
+  psJob->tExpire = time(NULL) + DAEMON_REQUEST_TIMEOUT;
+  psJob->psNext = _psDaemon->psPending;
+  _psDaemon->psPending = psJob;
+}
+
+/*
+  Receive the pending requests which are readable (arrReady, NULL if none)
+  and drop those not complete in time. Complete requests are queued.
+*/
+static void receiveJobs(sDaemon *_psDaemon, sJob **arrReady, int nReady)
+{
+  sJob **ppsPending, *psJob, **ppsLast;
+  time_t tNow = time(NULL);
+  int i, iResult;
+
+  ppsPending = &_psDaemon->psPending;
+  while ((psJob = *ppsPending))
+  {
+    iResult = 0;
+    for (i = 0; i < nReady; i++)
+      if (arrReady[i] == psJob)
+        iResult = receiveJob(_psDaemon, psJob);
+
+    if ((iResult == 0) && (psJob->tExpire <= tNow))
+    {
+      writeError(ERR_ERROR, "Invalid job request received (not complete within %d seconds).", DAEMON_REQUEST_TIMEOUT);
+      iResult = -1;
+    }
+
+    if (iResult == 0)
+    {
+      ppsPending = &psJob->psNext;
+      continue;
+    }
+
+    *ppsPending = psJob->psNext;
+    psJob->psNext = NULL;
+
+    if (iResult < 0)
+      freeJob(psJob);
+    else
+    {
+      for (ppsLast = &_psDaemon->psJobs; *ppsLast; ppsLast = &(*ppsLast)->psNext);
+      *ppsLast = psJob;
+    }
+  }
+}
+
+/* Run by the process of a job - never returns */
+static void runJob(sDaemon *_psDaemon, sJob *psJob)
+{
+  struct sigaction sig_action;
+  sJob *psOther;
+  int i, iResult;
+
+  /* keep the standard descriptors of the client only */
+  close(_psDaemon->hListen);
+  close(_psDaemon->arrSignal[0]);
+  close(_psDaemon->arrSignal[1]);
+
+  for (psOther = _psDaemon->psJobs; psOther; psOther = psOther->psNext)
+  {
+    if (psOther->hConn >= 0)
+      close(psOther->hConn);
+
+    for (i = 0; (i < 3) && (psOther != psJob); i++)
+      close(psOther->arrFd[i]);
+  }
+
+  for (psOther = _psDaemon->psPending; psOther; psOther = psOther->psNext)
+  {
+    close(psOther->hConn);
+
+    for (i = 0; i < 3; i++)
+      if (psOther->arrFd[i] >= 0)
+        close(psOther->arrFd[i]);
+  }
+
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  sig_action.sa_flags = 0;
+  sigemptyset(&sig_action.sa_mask);
+  sigaddset(&sig_action.sa_mask, SIGINT);
+  sig_action.sa_handler = jobSigint;
+  sigaction(SIGINT, &sig_action, 0);
+
+  for (i = 0; i < 3; i++)
+  {
+    if (psJob->arrFd[i] != i)
+    {
+      dup2(psJob->arrFd[i], i);
+      close(psJob->arrFd[i]);
+    }
+  }
+
+  if (chdir(psJob->pCwd) != 0)
+  {
+    writeError(ERR_ALERT, "Failed to change to directory %s - %s", psJob->pCwd, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if ((psJobAudit = medusaAuditCreate()) == NULL)
+    exit(EXIT_FAILURE);
+
+  if ((medusaAuditParseArgs(psJobAudit, psJob->argc, psJob->argv) != MEDUSA_SUCCESS) || (medusaAuditValidate(psJobAudit) != MEDUSA_SUCCESS))
+    exit(MEDUSA_DAEMON_USAGE);
+
+  iResult = medusaAuditRun(psJobAudit);
+
+  signal(SIGINT, SIG_DFL);
+  medusaAuditFree(psJobAudit);
+
+  exit((iResult == MEDUSA_FAILURE) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+  Start the queued jobs, in order, while their login threads fit in the
+  budget. A job larger than the budget is started once nothing else runs.
+*/
+static void startJobs(sDaemon *_psDaemon)
+{
+  sJob **ppsJob, *psJob;
+
+  ppsJob = &_psDaemon->psJobs;
+  while ((psJob = *ppsJob))
+  {
+    if (psJob->pidJob)
+    {
+      ppsJob = &psJob->psNext;
+      continue;
+    }
+
+    if ((_psDaemon->iUsed > 0) && (_psDaemon->iUsed + psJob->iCost > _psDaemon->iBudget))
+      break;
+
+    /* output not yet written would be written by the job as well */
+    fflush(stdout);
+    fflush(stderr);
+
+    gettimeofday(&psJob->tvStart, NULL);
+    psJob->pidJob = fork();
+
+    if (psJob->pidJob == 0)
+      runJob(_psDaemon, psJob);
+
+    if (psJob->pidJob < 0)
+    {
+      writeError(ERR_ERROR, "Failed to start job %d - %s", psJob->iId, strerror(errno));
+      psJob->pidJob = 0;
+      endJob(_psDaemon, ppsJob, EXIT_FAILURE);
+      continue;
+    }
+
+    _psDaemon->iUsed += psJob->iCost;
+    writeVerbose(VB_GENERAL, "Job %d started (process %d, %d of %d login threads in use)", psJob->iId, psJob->pidJob, _psDaemon->iUsed, _psDaemon->iBudget);
+    ppsJob = &psJob->psNext;
+  }
+}
+
+static void reapJobs(sDaemon *_psDaemon)
+{
+  struct timeval tvNow;
+  sJob **ppsJob;
+  pid_t pid;
+  int iStatus, iExit;
+
+  while ((pid = waitpid(-1, &iStatus, WNOHANG)) > 0)
+  {
+    for (ppsJob = &_psDaemon->psJobs; (*ppsJob) && ((*ppsJob)->pidJob != pid); ppsJob = &(*ppsJob)->psNext);
+
+    if (*ppsJob == NULL)
+      continue;
+
+    iExit = WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : 128 + WTERMSIG(iStatus);
+
+    gettimeofday(&tvNow, NULL);
+    writeVerbose(VB_GENERAL, "Job %d finished with status %d (%.1f seconds)", (*ppsJob)->iId, iExit,
+                 (tvNow.tv_sec - (*ppsJob)->tvStart.tv_sec) + (tvNow.tv_usec - (*ppsJob)->tvStart.tv_usec) / 1000000.0);
+
+    endJob(_psDaemon, ppsJob, iExit);
+  }
+}
+
+/*
+  A client closed its end of the socket (e.g. on SIGINT). Its running job is
+  stopped and still reports its status; a queued job is dropped.
+*/
+static void dropClient(sDaemon *_psDaemon, sJob *psJob)
+{
+  sJob **ppsJob;
+
+  if (psJob->pidJob)
+  {
+    writeVerbose(VB_GENERAL, "Client of job %d is gone - stopping job.", psJob->iId);
+    kill(psJob->pidJob, SIGINT);
+    psJob->iDetached = TRUE;
+    return;
+  }
+
+  writeVerbose(VB_GENERAL, "Client of job %d is gone - job removed from queue.", psJob->iId);
+  for (ppsJob = &_psDaemon->psJobs; *ppsJob != psJob; ppsJob = &(*ppsJob)->psNext);
+  endJob(_psDaemon, ppsJob, EXIT_FAILURE);
+}
+
+/* Stop accepting jobs, stop the running ones and drop those queued */
+static void stopDaemon(sDaemon *_psDaemon)
+{
+  sJob **ppsJob, *psJob;
+
+  if (_psDaemon->iStopping)
+    return;
+
+  _psDaemon->iStopping = 1;
+  close(_psDaemon->hListen);
+  _psDaemon->hListen = -1;
+  unlink(_psDaemon->pSocket);
+
+  writeVerbose(VB_NONE, "Daemon stopping - waiting for running jobs to end.");
+
+  while ((psJob = _psDaemon->psPending))
+  {
+    _psDaemon->psPending = psJob->psNext;
+    freeJob(psJob);
+  }
+
+  ppsJob = &_psDaemon->psJobs;
+  while (*ppsJob)
+  {
+    if ((*ppsJob)->pidJob)
+    {
+      kill((*ppsJob)->pidJob, SIGINT);
+      ppsJob = &(*ppsJob)->psNext;
+    }
+    else
+      endJob(_psDaemon, ppsJob, EXIT_FAILURE);
+  }
+}
+
+static void serveJobs(sDaemon *_psDaemon)
+{
+  struct pollfd *psPoll = NULL;
+  sJob **arrJobs = NULL, *psJob;
+  unsigned char arrSig[64];
+  char buf[64];
+  ssize_t nRead;
+  time_t tExpire;
+  int nPoll, nPending, nAlloc = 0, i, iTimeout, iStop = FALSE;
+
+  while ((!_psDaemon->iStopping) || (_psDaemon->psJobs))
+  {
+    /* signals, new clients, requests being received and the clients of the jobs */
+    nPoll = 2;
+    for (psJob = _psDaemon->psPending; psJob; psJob = psJob->psNext)
+      nPoll++;
+    for (psJob = _psDaemon->psJobs; psJob; psJob = psJob->psNext)
+      nPoll++;
+
+    if (nPoll > nAlloc)
+    {
+      nAlloc = nPoll * 2;
+      psPoll = realloc(psPoll, nAlloc * sizeof(struct pollfd));
+      arrJobs = realloc(arrJobs, nAlloc * sizeof(sJob *));
+    }
+
+    psPoll[0].fd = _psDaemon->arrSignal[0];
+    psPoll[0].events = POLLIN;
+    psPoll[1].fd = _psDaemon->hListen;    // -1 (ignored) when stopping
+    psPoll[1].events = POLLIN;
+
+    /* pending requests are dropped once they expire */
+    nPoll = 2;
+    iTimeout = -1;
+    for (psJob = _psDaemon->psPending; psJob; psJob = psJob->psNext)
+    {
+      arrJobs[nPoll] = psJob;
+      psPoll[nPoll].fd = psJob->hConn;
+      psPoll[nPoll].events = POLLIN;
+      nPoll++;
+
+      tExpire = psJob->tExpire - time(NULL);
+      if ((iTimeout < 0) || (tExpire * 1000 < iTimeout))
+        iTimeout = (tExpire > 0) ? tExpire * 1000 : 0;
+    }
+
+    nPending = nPoll;
+    for (psJob = _psDaemon->psJobs; psJob; psJob = psJob->psNext)
+    {
+      arrJobs[nPoll] = psJob;
+      psPoll[nPoll].fd = psJob->iDetached ? -1 : psJob->hConn;
+      psPoll[nPoll].events = POLLIN;
+      nPoll++;
+    }
+
+    if (poll(psPoll, nPoll, iTimeout) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      writeError(ERR_CRITICAL, "Daemon failed to wait for events - %s", strerror(errno));
+      stopDaemon(_psDaemon);
+      continue;
+    }
+
+    /* clients gone (closed or shut down) - a job is only freed below */
+    for (i = nPending; i < nPoll; i++)
+    {
+      if (psPoll[i].revents == 0)
+        continue;
+
+      nRead = recv(psPoll[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if ((nRead == 0) || ((nRead < 0) && (errno != EAGAIN) && (errno != EINTR)))
+        dropClient(_psDaemon, arrJobs[i]);
+    }
+
+    /* the readable requests - entries of those not readable are cleared */
+    for (i = 2; i < nPending; i++)
+      if (psPoll[i].revents == 0)
+        arrJobs[i] = NULL;
+
+    if (!_psDaemon->iStopping)
+      receiveJobs(_psDaemon, arrJobs + 2, nPending - 2);
+
+    if (psPoll[0].revents & POLLIN)
+    {
+      while ((nRead = read(_psDaemon->arrSignal[0], arrSig, sizeof(arrSig))) > 0)
+      {
+        for (i = 0; i < nRead; i++)
+          if ((arrSig[i] == SIGTERM) || (arrSig[i] == SIGINT))
+            iStop = TRUE;
+      }
+
+      reapJobs(_psDaemon);
+
+      if (iStop)
+        stopDaemon(_psDaemon);
+    }
+
+    if ((!_psDaemon->iStopping) && (psPoll[1].revents & POLLIN))
+      acceptJob(_psDaemon);
+
+    if (!_psDaemon->iStopping)
+      startJobs(_psDaemon);
+  }
+
+  FREE(psPoll);
+  FREE(arrJobs);
+}
+
+static int listenSocket(sDaemon *_psDaemon)
+{
+  struct sockaddr_un sAddr;
+  struct stat sStat;
+  mode_t tMask;
+  int hSocket;
+
+  if (strlen(_psDaemon->pSocket) >= sizeof(sAddr.sun_path))
+  {
+    writeError(ERR_ALERT, "Daemon socket name is too long: %s", _psDaemon->pSocket);
+    return FAILURE;
+  }
+
+  memset(&sAddr, 0, sizeof(sAddr));
+  sAddr.sun_family = AF_UNIX;
+  strcpy(sAddr.sun_path, _psDaemon->pSocket);
+
+  /* replace the socket of a daemon which is not running anymore */
+  if ((hSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return FAILURE;
+
+  if (connect(hSocket, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+  {
+    writeError(ERR_ALERT, "A daemon is already listening on %s.", _psDaemon->pSocket);
+    close(hSocket);
+    return FAILURE;
+  }
+
+  /* never remove a file which is not a socket */
+  if (lstat(_psDaemon->pSocket, &sStat) == 0)
+  {
+    if (!S_ISSOCK(sStat.st_mode))
+    {
+      writeError(ERR_ALERT, "Daemon socket %s exists and is not a socket.", _psDaemon->pSocket);
+      close(hSocket);
+      return FAILURE;
+    }
+
+    unlink(_psDaemon->pSocket);
+  }
+
+  /* only the user running the daemon may submit jobs */
+  tMask = umask(077);
+  if (bind(hSocket, (struct sockaddr *)&sAddr, sizeof(sAddr)) != 0)
+  {
+    umask(tMask);
+    writeError(ERR_ALERT, "Failed to create daemon socket %s - %s", _psDaemon->pSocket, strerror(errno));
+    close(hSocket);
+    return FAILURE;
+  }
+  umask(tMask);
+
+  if (listen(hSocket, 16) != 0)
+  {
+    writeError(ERR_ALERT, "Failed to listen on daemon socket %s - %s", _psDaemon->pSocket, strerror(errno));
+    close(hSocket);
+    unlink(_psDaemon->pSocket);
+    return FAILURE;
+  }
+
+  setCloseOnExec(hSocket);
+  fcntl(hSocket, F_SETFL, fcntl(hSocket, F_GETFL) | O_NONBLOCK);
+  _psDaemon->hListen = hSocket;
+  return SUCCESS;
+}
+
+/* Daemon options: -Y SOCKET [-t NUM] [-v NUM] [-w NUM] [-b] */
+int medusaDaemonRun(int argc, char **argv)
+{
+  struct sigaction sig_action;
+  int opt, i, nIgnoreBanner = 0;
+  int ret = MEDUSA_SUCCESS;
+
+  if (psDaemon)
+    return MEDUSA_FAILURE;
+
+  psDaemon = malloc(sizeof(sDaemon));
+  memset(psDaemon, 0, sizeof(sDaemon));
+  psDaemon->hListen = -1;
+  psDaemon->iBudget = DAEMON_DEFAULT_BUDGET;
+
+  /* the daemon logs and its jobs (which write to their client) are watched as they run */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  iVerboseLevel = 5;
+  iErrorLevel = 5;
+
+  optind = 1;
+  while ((opt = getopt(argc, argv, "Y:t:v:w:b")) != EOF)
+  {
+    switch (opt)
+    {
+      case 'Y':
+        psDaemon->pSocket = optarg;
+        break;
+      case 't':
+        psDaemon->iBudget = atoi(optarg);
+        break;
+      case 'v':
+        iVerboseLevel = atoi(optarg);
+        break;
+      case 'w':
+        iErrorLevel = atoi(optarg);
+        break;
+      case 'b':
+        nIgnoreBanner = 1;
+        break;
+      default:
+        writeError(ERR_ALERT, "Daemon mode (option 'Y') only accepts options 't', 'v', 'w' and 'b'.");
+        ret = MEDUSA_FAILURE;
+        break;
+    }
+  }
+
+  if (nIgnoreBanner == 0)
+    writeVerbose(VB_NONE, "%s v%s [%s] (C) %s %s\n", PROGRAM, VERSION, WWW, AUTHOR, EMAIL);
+
+  if (psDaemon->iBudget < 1)
+  {
+    writeError(ERR_ALERT, "Invalid number of login threads for the daemon (option 't').");
+    ret = MEDUSA_FAILURE;
+  }
+
+  if ((ret != MEDUSA_SUCCESS) || (listenSocket(psDaemon) != SUCCESS))
+  {
+    FREE(psDaemon);
+    return MEDUSA_FAILURE;
+  }
+
+  /* caches kept warm for the jobs */
+  setModulePaths();
+  listCacheEnable(DAEMON_LIST_CACHE_SIZE);
+
+  if (resolveCacheShare(DAEMON_RESOLVE_SLOTS) != SUCCESS)
+    writeError(ERR_WARNING, "Host addresses will not be shared between jobs.");
+
+  if (sslShareSessions(DAEMON_SSL_SESSIONS) != SUCCESS)
+    writeError(ERR_WARNING, "SSL sessions will not be shared between jobs.");
+
+  if (pipe(psDaemon->arrSignal) != 0)
+    writeError(ERR_FATAL, "Failed to create daemon signal pipe - %s", strerror(errno));
+
+  for (i = 0; i < 2; i++)
+  {
+    setCloseOnExec(psDaemon->arrSignal[i]);
+    fcntl(psDaemon->arrSignal[i], F_SETFL, fcntl(psDaemon->arrSignal[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  sig_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&sig_action.sa_mask);
+  sig_action.sa_handler = daemonSignal;
+  sigaction(SIGCHLD, &sig_action, 0);
+  sigaction(SIGTERM, &sig_action, 0);
+  sigaction(SIGINT, &sig_action, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  writeVerbose(VB_NONE, "Daemon listening on %s (%d login threads)", psDaemon->pSocket, psDaemon->iBudget);
+  serveJobs(psDaemon);
+  writeVerbose(VB_NONE, "Daemon stopped after %d jobs.", psDaemon->iJobCnt);
+
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  close(psDaemon->arrSignal[0]);
+  close(psDaemon->arrSignal[1]);
+  listCacheFree();
+  listCacheEnable(0);
+
+  FREE(psDaemon);
+  return MEDUSA_SUCCESS;
+}
+
+/*
+  Submit a job to the daemon listening on pSocket and wait for its exit
+  status. The job writes to the standard output and error of the caller.
+*/
+int medusaDaemonSubmit(const char *pSocket, int argc, char **argv)
+{
+  struct sockaddr_un sAddr;
+  struct msghdr sMsg;
+  struct iovec sIov;
+  struct cmsghdr *psCmsg;
+  union {
+    struct cmsghdr sAlign;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } uControl;
+  struct sigaction sig_action, sig_saved;
+  int arrFd[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char szCwd[PATH_MAX];
+  char *pRequest, *pEntry;
+  uint32_t nLen, nStatus;
+  size_t nSize;
+  ssize_t nSent;
+  int i, ret;
+
+  iVerboseLevel = 5;
+  iErrorLevel = 5;
+
+  if (strlen(pSocket) >= sizeof(sAddr.sun_path))
+  {
+    writeError(ERR_ALERT, "Daemon socket name is too long: %s", pSocket);
+    return MEDUSA_FAILURE;
+  }
+
+  if (getcwd(szCwd, sizeof(szCwd)) == NULL)
+  {
+    writeError(ERR_ALERT, "Failed to get the current directory - %s", strerror(errno));
+    return MEDUSA_FAILURE;
+  }
+
+  /* length, directory and arguments */
+  nSize = sizeof(nLen) + strlen(szCwd) + 1;
+  for (i = 0; i < argc; i++)
+    nSize += strlen(argv[i]) + 1;
+
+  if (nSize - sizeof(nLen) > DAEMON_MAX_REQUEST)
+  {
+    writeError(ERR_ALERT, "Command line is too long to be submitted to the daemon.");
+    return MEDUSA_FAILURE;
+  }
+
+  pRequest = malloc(nSize);
+  nLen = htonl(nSize - sizeof(nLen));
+  memcpy(pRequest, &nLen, sizeof(nLen));
+
+  pEntry = pRequest + sizeof(nLen);
+  strcpy(pEntry, szCwd);
+  pEntry += strlen(pEntry) + 1;
+  for (i = 0; i < argc; i++)
+  {
+    strcpy(pEntry, argv[i]);
+    pEntry += strlen(pEntry) + 1;
+  }
+
+  memset(&sAddr, 0, sizeof(sAddr));
+  sAddr.sun_family = AF_UNIX;
+  strcpy(sAddr.sun_path, pSocket);
+
+  if (((hSubmitConn = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) || (connect(hSubmitConn, (struct sockaddr *)&sAddr, sizeof(sAddr)) != 0))
+  {
+    writeError(ERR_ALERT, "Failed to connect to daemon socket %s - %s", pSocket, strerror(errno));
+    if (hSubmitConn >= 0)
+      close(hSubmitConn);
+    hSubmitConn = -1;
+    free(pRequest);
+    return MEDUSA_FAILURE;
+  }
+
+  /* the standard descriptors are sent with the request */
+  memset(&sMsg, 0, sizeof(sMsg));
+  memset(&uControl, 0, sizeof(uControl));
+  sIov.iov_base = pRequest;
+  sIov.iov_len = nSize;
+  sMsg.msg_iov = &sIov;
+  sMsg.msg_iovlen = 1;
+  sMsg.msg_control = uControl.buf;
+  sMsg.msg_controllen = sizeof(uControl.buf);
+
+  psCmsg = CMSG_FIRSTHDR(&sMsg);
+  psCmsg->cmsg_level = SOL_SOCKET;
+  psCmsg->cmsg_type = SCM_RIGHTS;
+  psCmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(psCmsg), arrFd, 3 * sizeof(int));
+
+  while (((nSent = sendmsg(hSubmitConn, &sMsg, MSG_NOSIGNAL)) < 0) && (errno == EINTR));
+
+  if ((nSent <= 0) || (sendAll(hSubmitConn, pRequest + nSent, nSize - nSent) != SUCCESS))
+  {
+    writeError(ERR_ALERT, "Failed to submit job to daemon socket %s - %s", pSocket, strerror(errno));
+    close(hSubmitConn);
+    hSubmitConn = -1;
+    free(pRequest);
+    return MEDUSA_FAILURE;
+  }
+
+  free(pRequest);
+
+  /* SIGINT stops the job - a second one ends the client */
+  sig_action.sa_flags = SA_RESETHAND | SA_RESTART;
+  sigemptyset(&sig_action.sa_mask);
+  sig_action.sa_handler = submitSigint;
+  sigaction(SIGINT, &sig_action, &sig_saved);
+
+  if (recvAll(hSubmitConn, &nStatus, sizeof(nStatus)) == SUCCESS)
+    ret = ntohl(nStatus);
+  else
+  {
+    writeError(ERR_ALERT, "Daemon ended the job without reporting its status.");
+    ret = MEDUSA_FAILURE;
+  }
+
+  sigaction(SIGINT, &sig_saved, 0);
+  close(hSubmitConn);
+  hSubmitConn = -1;
+
+  return ret;
+}
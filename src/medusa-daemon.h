@@ -0,0 +1,85 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_DAEMON_H
+#define _MEDUSA_DAEMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+  Daemon mode (-Y). Audits (jobs) are submitted on a local socket by
+  "medusa -y SOCKET [options]". The client sends one request:
+
+    uint32 length (network order), then length bytes:
+    current directory\0 argv[0]\0 argv[1]\0 ... argv[argc - 1]\0
+
+  with its standard input, output and error attached (SCM_RIGHTS). Requests
+  are received without blocking the daemon; those not complete within
+  DAEMON_REQUEST_TIMEOUT seconds are dropped. Each job is run by a process
+  forked from the daemon, so it starts with the modules, list files, host
+  addresses and SSL sessions loaded by earlier jobs. Once the job ended,
+  its exit status is sent back (uint32, network order). A client closing
+  its end of the socket stops the job as SIGINT would.
+
+  Jobs run concurrently as long as their login threads (-T x -t) fit in the
+  budget of the daemon. Others wait, in order of submission.
+*/
+#define DAEMON_DEFAULT_BUDGET 64
+#define DAEMON_MAX_REQUEST (1024 * 1024)
+#define DAEMON_REQUEST_TIMEOUT 5                  // seconds to receive a request
+#define DAEMON_LIST_CACHE_SIZE (256 * 1024 * 1024)
+#define DAEMON_RESOLVE_SLOTS 4096
+#define DAEMON_SSL_SESSIONS 1024
+
+typedef struct __sJob {
+  struct __sJob *psNext;
+  int iId;
+  int hConn;
+  int iDetached;                          // client closed its end of the socket
+  int arrFd[3];                           // standard input, output and error of the client
+  char *pRequest;
+  char *pCwd;                             // points into pRequest
+  int argc;
+  char **argv;                            // point into pRequest
+  int iCost;                              // login threads
+  pid_t pidJob;                           // 0 while queued
+  struct timeval tvStart;
+  uint32_t nLen;                          // length of the request
+  size_t nReceived;                       // bytes of the length and request received so far
+  time_t tExpire;                         // request being received: time at which it is dropped
+} sJob;
+
+typedef struct __sDaemon {
+  char *pSocket;
+  int hListen;
+  int arrSignal[2];                       // self-pipe written by the signal handlers
+  int iBudget;
+  int iUsed;                              // login threads of the running jobs
+  int iJobCnt;                            // jobs submitted so far
+  sJob *psJobs;                           // in order of submission
+  sJob *psPending;                        // connections whose request is being received
+  int iStopping;
+} sDaemon;
+
+#endif
@@ -0,0 +1,1611 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Distributed mode: coordinator leasing logins to workers (see medusa-dist.h)
+ *
+*/
+
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "medusa.h"
+#include "medusa-dist.h"
+
+/* Append pField to the message, escaped and preceded by a TAB unless it is the first */
+static void msgField(sDistMsg *psMsg, const char *pField)
+{
+  size_t nNeed;
+  const char *p;
+  char *q;
+
+  if (pField == NULL)
+    pField = "";
+
+  nNeed = psMsg->nLen + 2 * strlen(pField) + 3;
+  if (nNeed > psMsg->nAlloc)
+  {
+    psMsg->nAlloc = (nNeed > 2 * psMsg->nAlloc) ? nNeed : 2 * psMsg->nAlloc;
+    psMsg->pBuf = realloc(psMsg->pBuf, psMsg->nAlloc);
+  }
+
+  q = psMsg->pBuf + psMsg->nLen;
+  if (psMsg->nLen)
+    *q++ = '\t';
+
+  for (p = pField; *p != '\0'; p++)
+  {
+    switch (*p)
+    {
+      case '\\': *q++ = '\\'; *q++ = '\\'; break;
+      case '\t': *q++ = '\\'; *q++ = 't'; break;
+      case '\r': *q++ = '\\'; *q++ = 'r'; break;
+      case '\n': *q++ = '\\'; *q++ = 'n'; break;
+      default: *q++ = *p; break;
+    }
+  }
+
+  psMsg->nLen = q - psMsg->pBuf;
+}
+
+static void msgFieldInt(sDistMsg *psMsg, int iValue)
+{
+  char szValue[12];
+
+  snprintf(szValue, sizeof(szValue), "%d", iValue);
+  msgField(psMsg, szValue);
+}
+
+/* Send the message as one line. The message is emptied. */
+static int msgSend(int hSocket, sDistMsg *psMsg)
+{
+  int ret;
+
+  msgField(psMsg, "");
+  psMsg->pBuf[psMsg->nLen - 1] = '\n';
+  ret = sendAll(hSocket, psMsg->pBuf, psMsg->nLen);
+
+  FREE(psMsg->pBuf);
+  psMsg->nLen = 0;
+  psMsg->nAlloc = 0;
+  return ret;
+}
+
+/*
+  Split a line into its fields, in place. Returns the number of fields;
+  *parrFields must be freed.
+*/
+static int splitLine(char *pLine, char ***parrFields)
+{
+  char **arrFields;
+  char *p, *q;
+  int nFields = 1;
+
+  for (p = pLine; *p != '\0'; p++)
+  {
+    if (*p == '\t')
+      nFields++;
+  }
+
+  arrFields = malloc(nFields * sizeof(char*));
+  nFields = 0;
+  arrFields[nFields++] = pLine;
+
+  for (p = q = pLine; *p != '\0'; p++)
+  {
+    if (*p == '\t')
+    {
+      *q++ = '\0';
+      arrFields[nFields++] = q;
+    }
+    else if ((*p == '\\') && (*(p + 1) != '\0'))
+    {
+      p++;
+      switch (*p)
+      {
+        case 't': *q++ = '\t'; break;
+        case 'r': *q++ = '\r'; break;
+        case 'n': *q++ = '\n'; break;
+        default: *q++ = *p; break;
+      }
+    }
+    else
+      *q++ = *p;
+  }
+  *q = '\0';
+
+  *parrFields = arrFields;
+  return nFields;
+}
+
+/* Read the data available on the connection. Returns FAILURE on end of file or error. */
+static int connRead(sDistConn *psConn)
+{
+  ssize_t nRead;
+
+  if (psConn->nAlloc - psConn->nLen < 4096)
+  {
+    if (psConn->nLen > DIST_MAX_LINE)
+    {
+      writeError(ERR_ERROR, "[connRead] Message too long.");
+      return FAILURE;
+    }
+
+    psConn->nAlloc = (psConn->nAlloc) ? 2 * psConn->nAlloc : 16384;
+    psConn->pBuf = realloc(psConn->pBuf, psConn->nAlloc);
+  }
+
+  while (((nRead = recv(psConn->hSocket, psConn->pBuf + psConn->nLen, psConn->nAlloc - psConn->nLen - 1, 0)) < 0) && (errno == EINTR));
+
+  if (nRead <= 0)
+    return FAILURE;
+
+  psConn->nLen += nRead;
+  return SUCCESS;
+}
+
+/* Next complete line received, NULL if none. The line must be freed. */
+static char* connLine(sDistConn *psConn)
+{
+  char *pEnd, *pLine;
+  size_t nLine;
+
+  if ((psConn->nLen == 0) || ((pEnd = memchr(psConn->pBuf, '\n', psConn->nLen)) == NULL))
+    return NULL;
+
+  nLine = pEnd - psConn->pBuf;
+  pLine = malloc(nLine + 1);
+  memcpy(pLine, psConn->pBuf, nLine);
+  pLine[nLine] = '\0';
+
+  psConn->nLen -= nLine + 1;
+  memmove(psConn->pBuf, pEnd + 1, psConn->nLen);
+
+  return pLine;
+}
+
+/* Split [ADDR:]PORT (ADDR may be a bracketed IPv6 address). pSpec is modified. */
+static int splitAddress(char *pSpec, char **ppAddr, char **ppPort)
+{
+  char *pTmp;
+
+  if (pSpec[0] == '[')
+  {
+    if (((pTmp = index(pSpec, ']')) == NULL) || (*(pTmp + 1) != ':'))
+      return FAILURE;
+
+    *pTmp = '\0';
+    *ppAddr = pSpec + 1;
+    *ppPort = pTmp + 2;
+  }
+  else if ((pTmp = rindex(pSpec, ':')) != NULL)
+  {
+    *pTmp = '\0';
+    *ppAddr = pSpec;
+    *ppPort = pTmp + 1;
+  }
+  else
+  {
+    *ppAddr = NULL;
+    *ppPort = pSpec;
+  }
+
+  if ((atoi(*ppPort) < 1) || (atoi(*ppPort) > 65535) || (strspn(*ppPort, "0123456789") != strlen(*ppPort)))
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+static void setSocketOptions(int hSocket)
+{
+  struct timeval tvTimeout;
+  int iOn = 1;
+
+  /* messages are short and answered at once */
+  setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn));
+
+  /* a peer which stopped reading is dropped rather than blocking the sender */
+  tvTimeout.tv_sec = DIST_NODE_TIMEOUT;
+  tvTimeout.tv_usec = 0;
+  setsockopt(hSocket, SOL_SOCKET, SO_SNDTIMEO, &tvTimeout, sizeof(tvTimeout));
+}
+
+/*
+  Coordinator
+*/
+
+/* Host as a target specification of the worker's audit */
+static void formatHost(sHostEntry *psHost, char *pBuf, size_t nLen)
+{
+  int iBracket = (index(psHost->szHost, ':') != NULL);
+
+  if (psHost->iPort)
+    snprintf(pBuf, nLen, "%s%s%s:%d", (iBracket) ? "[" : "", psHost->szHost, (iBracket) ? "]" : "", psHost->iPort);
+  else
+    snprintf(pBuf, nLen, "%s", psHost->szHost);
+}
+
+/* Fingerprint of a user (iUser >= 0) or host (iUser -1) in the set of those done */
+static uint64_t doneKey(int iHostId, int iUser)
+{
+  uint64_t nKey = ((uint64_t)(uint32_t)iHostId << 32) | (uint32_t)iUser;
+
+  return fpset_hash((char *)&nKey, sizeof(nKey));
+}
+
+static int isDone(sDistCoord *psCoord, int iHostId, int iUser)
+{
+  return (fpset_has_fp(&psCoord->sDone, doneKey(iHostId, -1)) || ((iUser >= 0) && (fpset_has_fp(&psCoord->sDone, doneKey(iHostId, iUser)))));
+}
+
+static void freeLease(sDistLease *psLease)
+{
+  FREE(psLease->arrPass);
+  FREE(psLease->pTested);
+  FREE(psLease);
+}
+
+static void unlinkLease(sDistCoord *psCoord, sDistLease *psLease)
+{
+  sDistLease **ppsLease;
+
+  for (ppsLease = &psCoord->psLeases; *ppsLease; ppsLease = &(*ppsLease)->psNext)
+  {
+    if (*ppsLease == psLease)
+    {
+      *ppsLease = psLease->psNext;
+      break;
+    }
+  }
+}
+
+static sDistLease* findLease(sDistCoord *psCoord, sDistNode *psNode, int iId)
+{
+  sDistLease *psLease;
+
+  for (psLease = psCoord->psLeases; psLease; psLease = psLease->psNext)
+  {
+    if ((psLease->iId == iId) && (psLease->psNode == psNode))
+      return psLease;
+  }
+
+  return NULL;
+}
+
+/*
+  Keep the logins of a lease its worker did not report, to be issued again.
+  Returns FALSE if none are left.
+*/
+static int requeueLease(sDistLease *psLease)
+{
+  int i, nLeft = 0;
+
+  for (i = 0; i < psLease->nPass; i++)
+  {
+    if (!psLease->pTested[i])
+      psLease->arrPass[nLeft++] = psLease->arrPass[i];
+  }
+
+  psLease->nPass = nLeft;
+  memset(psLease->pTested, 0, nLeft);
+  psLease->iResults = 0;
+  psLease->psNode = NULL;
+
+  return ((nLeft) || (psLease->iExtra));
+}
+
+/* Ledger: logins which failed in a previous run are not leased */
+static int isLedgerFailed(sDistCoord *psCoord, char *pUser, char *pPass)
+{
+  if ((psCoord->psAudit->psLedger == NULL) || (!ledgerFailed(psCoord->psAudit->psLedger, ledgerKey(psCoord->nHostKey, pUser, pPass))))
+    return FALSE;
+
+  psCoord->psAudit->iLoginsSkipped++;
+  return TRUE;
+}
+
+/*
+  Next lease for a worker testing iThreads logins at a time: a lease given
+  up by another worker, or the next block of passwords of the current user.
+  Returns NULL once all logins were leased.
+*/
+static sDistLease* nextLease(sDistCoord *psCoord, int iThreads)
+{
+  sAudit *psAudit = psCoord->psAudit;
+  sDistLease *psLease, *psNext;
+  char *pUser;
+  int nMax;
+
+  for (psLease = psCoord->psLeases; psLease; psLease = psNext)
+  {
+    psNext = psLease->psNext;
+
+    if (psLease->psNode)
+      continue;
+
+    if (!isDone(psCoord, psLease->sHost.iId, psLease->iUser))
+      return psLease;
+
+    unlinkLease(psCoord, psLease);
+    freeLease(psLease);
+  }
+
+  nMax = iThreads * DIST_LEASE_PER_THREAD;
+
+  while (!psCoord->iExhausted)
+  {
+    if (!psCoord->iHostValid)
+    {
+      if (!hostListNext(&psAudit->sHostList, &psCoord->sHost))
+      {
+        psCoord->iExhausted = TRUE;
+        break;
+      }
+
+      psCoord->iHostValid = TRUE;
+      psCoord->iUser = 0;
+      psCoord->iPass = 0;
+
+      if (psAudit->psLedger)
+        psCoord->nHostKey = ledgerHostKey(psCoord->sHost.szHost, (psCoord->sHost.iPort) ? psCoord->sHost.iPort : psAudit->iPortOverride, szModuleName, psAudit->iUseSSL, arrModuleParams, nModuleParamCount);
+    }
+
+    if ((psCoord->iUser >= psCoord->nUsers) || (isDone(psCoord, psCoord->sHost.iId, -1)))
+    {
+      psCoord->iHostValid = FALSE;
+      continue;
+    }
+
+    if (isDone(psCoord, psCoord->sHost.iId, psCoord->iUser))
+    {
+      psCoord->iUser++;
+      psCoord->iPass = 0;
+      continue;
+    }
+
+    pUser = psCoord->arrUsers[psCoord->iUser];
+
+    psLease = malloc(sizeof(sDistLease));
+    memset(psLease, 0, sizeof(sDistLease));
+    memcpy(&psLease->sHost, &psCoord->sHost, sizeof(sHostEntry));
+    psLease->nLedgerKey = psCoord->nHostKey;
+    psLease->iUser = psCoord->iUser;
+    psLease->pUser = pUser;
+    psLease->arrPass = malloc(nMax * sizeof(char*));
+    psLease->pTested = malloc(nMax);
+
+    /* additional checks (-e) go with the first block of the user */
+    if (psCoord->iPass == 0)
+    {
+      if ((psAudit->iPasswordBlankFlag) && (!isLedgerFailed(psCoord, pUser, "")))
+        psLease->iExtra |= DIST_EXTRA_BLANK;
+
+      if ((psAudit->iPasswordUsernameFlag) && (!isLedgerFailed(psCoord, pUser, pUser)))
+        psLease->iExtra |= DIST_EXTRA_USER;
+    }
+
+    while ((psLease->nPass < nMax) && (psCoord->iPass < psCoord->nPasses))
+    {
+      if (!isLedgerFailed(psCoord, pUser, psCoord->arrPasses[psCoord->iPass]))
+        psLease->arrPass[psLease->nPass++] = psCoord->arrPasses[psCoord->iPass];
+
+      psCoord->iPass++;
+    }
+
+    memset(psLease->pTested, 0, nMax);
+
+    if (psCoord->iPass >= psCoord->nPasses)
+    {
+      psCoord->iUser++;
+      psCoord->iPass = 0;
+    }
+
+    if ((psLease->nPass == 0) && (psLease->iExtra == 0))
+    {
+      freeLease(psLease);
+      continue;
+    }
+
+    psLease->psNext = psCoord->psLeases;
+    psCoord->psLeases = psLease;
+    return psLease;
+  }
+
+  return NULL;
+}
+
+static void sendLease(sDistNode *psNode, sDistLease *psLease)
+{
+  sDistMsg sMsg;
+  char szHost[HOST_SPEC_MAX_LEN + 16];
+  int i;
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  formatHost(&psLease->sHost, szHost, sizeof(szHost));
+
+  msgField(&sMsg, "LEASE");
+  msgFieldInt(&sMsg, psLease->iId);
+  msgField(&sMsg, szHost);
+
+  if (psLease->iExtra == (DIST_EXTRA_BLANK | DIST_EXTRA_USER))
+    msgField(&sMsg, "ns");
+  else if (psLease->iExtra == DIST_EXTRA_BLANK)
+    msgField(&sMsg, "n");
+  else if (psLease->iExtra == DIST_EXTRA_USER)
+    msgField(&sMsg, "s");
+  else
+    msgField(&sMsg, "");
+
+  msgField(&sMsg, psLease->pUser);
+  for (i = 0; i < psLease->nPass; i++)
+    msgField(&sMsg, psLease->arrPass[i]);
+
+  msgSend(psNode->sConn.hSocket, &sMsg);
+}
+
+static void sendSimple(sDistNode *psNode, char *pType, int iValue)
+{
+  sDistMsg sMsg;
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  msgField(&sMsg, pType);
+  if (iValue >= 0)
+    msgFieldInt(&sMsg, iValue);
+
+  msgSend(psNode->sConn.hSocket, &sMsg);
+}
+
+/*
+  Drop the remaining logins of a user (iUser >= 0) or host once it is done.
+  Workers holding them are asked to stop.
+*/
+static void cancelLeases(sDistCoord *psCoord, int iHostId, int iUser)
+{
+  sDistLease *psLease, *psNext;
+
+  fpset_add_fp(&psCoord->sDone, doneKey(iHostId, iUser));
+
+  for (psLease = psCoord->psLeases; psLease; psLease = psNext)
+  {
+    psNext = psLease->psNext;
+
+    if ((psLease->sHost.iId != iHostId) || ((iUser >= 0) && (psLease->iUser != iUser)) || (psLease->iCancelled))
+      continue;
+
+    if (psLease->psNode)
+    {
+      psLease->iCancelled = TRUE;
+      sendSimple(psLease->psNode, "CANCEL", psLease->iId);
+    }
+    else
+    {
+      unlinkLease(psCoord, psLease);
+      freeLease(psLease);
+    }
+  }
+}
+
+/* Login reported by a worker - reported as setPassResult() does for local logins */
+static void reportResult(sDistCoord *psCoord, sDistNode *psNode, sDistLease *psLease, int iResult, char *pPass, char *pMessage)
+{
+  sAudit *psAudit = psCoord->psAudit;
+  sService *psService = &psAudit->psServices[psLease->sHost.iService];
+  char *pHost = psLease->sHost.szHost;
+  char *pUser = psLease->pUser;
+  int iPort;
+
+  iPort = (psLease->sHost.iPort) ? psLease->sHost.iPort : ((psAudit->iPortOverride) ? psAudit->iPortOverride : psService->iDefaultPort);
+
+  writeVerbose(VB_CHECK, "[%s] Host: %s User: %s Password: %s (worker %s, lease %d)", psService->pModuleName, pHost, pUser, pPass, psNode->pName, psLease->iId);
+
+  /* errors are inconclusive - only record logins which were answered */
+  if ((psAudit->psLedger) && ((iResult == LOGIN_RESULT_SUCCESS) || (iResult == LOGIN_RESULT_FAIL)))
+    ledgerRecord(psAudit->psLedger, ledgerKey(psLease->nLedgerKey, pUser, pPass), iResult);
+
+  if ((iResult == LOGIN_RESULT_SUCCESS) || (iResult == LOGIN_RESULT_FAIL) || (iResult == LOGIN_RESULT_ERROR))
+    sendEvent(psAudit, MEDUSA_EVENT_ATTEMPT, psService->pModuleName, pHost, iPort, pUser, pPass, iResult, pMessage);
+
+  switch (iResult)
+  {
+  case LOGIN_RESULT_SUCCESS:
+    if (pMessage)
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS (%s)]", psService->pModuleName, pHost, pUser, pPass, pMessage);
+    else
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS]", psService->pModuleName, pHost, pUser, pPass);
+
+    psAudit->iValidPairFound = TRUE;
+    psCoord->iFound++;
+
+    if (psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_AUDIT)
+      psCoord->iFinished = TRUE;
+    else if (psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_HOST)
+      cancelLeases(psCoord, psLease->sHost.iId, -1);
+    else
+      cancelLeases(psCoord, psLease->sHost.iId, psLease->iUser);
+    break;
+  case LOGIN_RESULT_FAIL:
+    if (pMessage)
+      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED (%s)]", psService->pModuleName, pHost, pUser, pMessage);
+    else
+      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED]", psService->pModuleName, pHost, pUser);
+    break;
+  case LOGIN_RESULT_ERROR:
+    if (pMessage)
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR (%s)]", psService->pModuleName, pHost, pUser, pPass, pMessage);
+    else
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR]", psService->pModuleName, pHost, pUser, pPass);
+
+    cancelLeases(psCoord, psLease->sHost.iId, psLease->iUser);
+    break;
+  default:
+    writeError(ERR_INFO, "[%s] Host: %s User: %s [UNKNOWN %d]", psService->pModuleName, pHost, pUser, iResult);
+    break;
+  }
+}
+
+/*
+  Only logins of the lease which were not reported yet are accepted: a
+  worker cannot report (nor record in the ledger) logins it was not given.
+*/
+static void onResult(sDistCoord *psCoord, sDistNode *psNode, char **arrFields, int nFields)
+{
+  sDistLease *psLease;
+  char *pPass;
+  int i, iKnown;
+
+  if ((nFields < 5) || ((psLease = findLease(psCoord, psNode, atoi(arrFields[1]))) == NULL))
+  {
+    writeError(ERR_DEBUG, "[onResult] Result of unknown lease from worker %s.", psNode->pName);
+    return;
+  }
+
+  /* mark the login as tested - additional checks first */
+  pPass = arrFields[4];
+  iKnown = FALSE;
+  if (strcmp(arrFields[3], psLease->pUser) == 0)
+  {
+    if ((psLease->iExtra & DIST_EXTRA_BLANK) && (*pPass == '\0'))
+    {
+      psLease->iExtra &= ~DIST_EXTRA_BLANK;
+      iKnown = TRUE;
+    }
+    else if ((psLease->iExtra & DIST_EXTRA_USER) && (strcmp(pPass, psLease->pUser) == 0))
+    {
+      psLease->iExtra &= ~DIST_EXTRA_USER;
+      iKnown = TRUE;
+    }
+    else
+    {
+      for (i = 0; i < psLease->nPass; i++)
+      {
+        if ((!psLease->pTested[i]) && (strcmp(psLease->arrPass[i], pPass) == 0))
+        {
+          psLease->pTested[i] = TRUE;
+          iKnown = TRUE;
+          break;
+        }
+      }
+    }
+  }
+
+  if (!iKnown)
+  {
+    writeError(ERR_ERROR, "Worker %s reported a login outside of lease %d. Ignored.", psNode->pName, psLease->iId);
+    return;
+  }
+
+  psLease->iResults++;
+  psNode->iLogins++;
+  psCoord->iLogins++;
+
+  reportResult(psCoord, psNode, psLease, atoi(arrFields[2]), pPass, (nFields > 5) ? arrFields[5] : NULL);
+}
+
+/*
+  A lease was completed. Medusa gives up a host it cannot connect to; a
+  lease of which no login could be tested is taken as such.
+*/
+static void onDone(sDistCoord *psCoord, sDistNode *psNode, int iId)
+{
+  sAudit *psAudit = psCoord->psAudit;
+  sDistLease *psLease;
+
+  if ((psLease = findLease(psCoord, psNode, iId)) == NULL)
+    return;
+
+  unlinkLease(psCoord, psLease);
+
+  if ((!psLease->iCancelled) && (psLease->iResults == 0))
+  {
+    writeError(ERR_ERROR, "[%s] Host: %s - No login was tested by worker %s. Skipping host.", psAudit->psServices[psLease->sHost.iService].pModuleName, psLease->sHost.szHost, psNode->pName);
+    cancelLeases(psCoord, psLease->sHost.iId, -1);
+  }
+
+  freeLease(psLease);
+}
+
+static void onLease(sDistCoord *psCoord, sDistNode *psNode)
+{
+  sDistLease *psLease;
+
+  if (psCoord->iFinished)
+    return;
+
+  if ((psLease = nextLease(psCoord, psNode->iThreads)) != NULL)
+  {
+    if (psLease->iId)
+    {
+      writeError(ERR_NOTICE, "[%s] Host: %s User: %s - Lease %d issued again to worker %s.", psCoord->psAudit->psServices[psLease->sHost.iService].pModuleName, psLease->sHost.szHost, psLease->pUser, psLease->iId, psNode->pName);
+      psCoord->iReissued++;
+    }
+
+    psLease->iId = ++psCoord->iLeaseCnt;
+    psLease->psNode = psNode;
+    sendLease(psNode, psLease);
+  }
+  else if (psCoord->psLeases)
+  {
+    /* leases still held by other workers may be given up */
+    sendSimple(psNode, "WAIT", DIST_WAIT);
+  }
+  else
+  {
+    psCoord->iFinished = TRUE;
+  }
+}
+
+/* Compare the secret of a worker - in time independent of where they differ */
+static int isSecret(char *pSecret, char *pGiven)
+{
+  size_t i, nLen = strlen(pSecret);
+  unsigned char iDiff = 0;
+
+  if (strlen(pGiven) != nLen)
+    return FALSE;
+
+  for (i = 0; i < nLen; i++)
+    iDiff |= pSecret[i] ^ pGiven[i];
+
+  return (iDiff == 0);
+}
+
+static int onHello(sDistCoord *psCoord, sDistNode *psNode, char **arrFields, int nFields)
+{
+  sDistMsg sMsg;
+  int i;
+
+  if ((nFields < 5) || (strcmp(arrFields[1], DIST_PROTOCOL) != 0))
+  {
+    writeError(ERR_ERROR, "Worker %d uses an unsupported protocol version.", psNode->iId);
+    return FAILURE;
+  }
+
+  if (!isSecret(psCoord->pSecret, arrFields[4]))
+  {
+    writeError(ERR_ERROR, "Worker %d did not give the shared secret (%s).", psNode->iId, DIST_SECRET_ENV);
+    return FAILURE;
+  }
+
+  psNode->pName = strdup(arrFields[2]);
+  psNode->iThreads = (atoi(arrFields[3]) > 0) ? atoi(arrFields[3]) : psCoord->psAudit->iLoginCnt;
+  writeVerbose(VB_GENERAL, "Worker %s joined (%d login threads).", psNode->pName, psNode->iThreads);
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  msgField(&sMsg, "JOB");
+  for (i = 0; i < psCoord->nJob; i++)
+    msgField(&sMsg, psCoord->arrJob[i]);
+
+  return msgSend(psNode->sConn.hSocket, &sMsg);
+}
+
+static int processLine(sDistCoord *psCoord, sDistNode *psNode, char *pLine)
+{
+  char **arrFields;
+  int nFields, ret = SUCCESS;
+
+  nFields = splitLine(pLine, &arrFields);
+
+  if (strcmp(arrFields[0], "HELLO") == 0)
+    ret = (psNode->pName) ? FAILURE : onHello(psCoord, psNode, arrFields, nFields);
+  else if (psNode->pName == NULL)
+    ret = FAILURE;
+  else if (strcmp(arrFields[0], "LEASE") == 0)
+    onLease(psCoord, psNode);
+  else if (strcmp(arrFields[0], "RESULT") == 0)
+    onResult(psCoord, psNode, arrFields, nFields);
+  else if ((strcmp(arrFields[0], "DONE") == 0) && (nFields > 1))
+    onDone(psCoord, psNode, atoi(arrFields[1]));
+  else if (strcmp(arrFields[0], "PING") != 0)
+    ret = FAILURE;
+
+  free(arrFields);
+  return ret;
+}
+
+/* Leases held by a worker which is gone are issued again to the others. pReason is NULL once the audit ended. */
+static void dropNode(sDistCoord *psCoord, sDistNode *psNode, char *pReason)
+{
+  sDistNode **ppsNode;
+  sDistLease *psLease, *psNext;
+  int nLeases = 0;
+
+  for (psLease = psCoord->psLeases; psLease; psLease = psNext)
+  {
+    psNext = psLease->psNext;
+
+    if (psLease->psNode != psNode)
+      continue;
+
+    if ((psLease->iCancelled) || (!requeueLease(psLease)))
+    {
+      unlinkLease(psCoord, psLease);
+      freeLease(psLease);
+    }
+    else
+      nLeases++;
+  }
+
+  if ((psNode->pName) && (pReason))
+    writeError(ERR_ALERT, "Worker %s left (%s) - %d leases will be issued again.", psNode->pName, pReason, nLeases);
+
+  for (ppsNode = &psCoord->psNodes; *ppsNode; ppsNode = &(*ppsNode)->psNext)
+  {
+    if (*ppsNode == psNode)
+    {
+      *ppsNode = psNode->psNext;
+      break;
+    }
+  }
+
+  close(psNode->sConn.hSocket);
+  FREE(psNode->sConn.pBuf);
+  FREE(psNode->pName);
+  FREE(psNode);
+}
+
+static void acceptNode(sDistCoord *psCoord)
+{
+  sDistNode *psNode;
+  int hSocket;
+
+  if ((hSocket = accept(psCoord->hListen, NULL, NULL)) < 0)
+    return;
+
+  setSocketOptions(hSocket);
+
+  psNode = malloc(sizeof(sDistNode));
+  memset(psNode, 0, sizeof(sDistNode));
+  psNode->iId = ++psCoord->iNodeCnt;
+  psNode->sConn.hSocket = hSocket;
+  psNode->tSeen = time(NULL);
+  psNode->psNext = psCoord->psNodes;
+  psCoord->psNodes = psNode;
+}
+
+static int listenCoordinator(sDistCoord *psCoord, char *pOption)
+{
+  struct addrinfo sHints, *psResult;
+  char *pSpec, *pAddr, *pPort;
+  int hSocket, iOn = 1, iRet;
+
+  pSpec = strdup(pOption);
+  if (splitAddress(pSpec, &pAddr, &pPort) != SUCCESS)
+  {
+    writeError(ERR_ALERT, "Invalid coordinator address: %s (expected [ADDR:]PORT)", pOption);
+    free(pSpec);
+    return FAILURE;
+  }
+
+  memset(&sHints, 0, sizeof(sHints));
+  sHints.ai_family = AF_UNSPEC;
+  sHints.ai_socktype = SOCK_STREAM;
+  sHints.ai_flags = AI_PASSIVE;
+
+  if ((iRet = getaddrinfo((pAddr) ? pAddr : DIST_DEFAULT_ADDR, pPort, &sHints, &psResult)) != 0)
+  {
+    writeError(ERR_ALERT, "Invalid coordinator address: %s - %s", pOption, gai_strerror(iRet));
+    free(pSpec);
+    return FAILURE;
+  }
+
+  if ((hSocket = socket(psResult->ai_family, psResult->ai_socktype, psResult->ai_protocol)) < 0)
+  {
+    writeError(ERR_ALERT, "Failed to create coordinator socket - %s", strerror(errno));
+    freeaddrinfo(psResult);
+    free(pSpec);
+    return FAILURE;
+  }
+
+  setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+
+  if ((bind(hSocket, psResult->ai_addr, psResult->ai_addrlen) != 0) || (listen(hSocket, 64) != 0))
+  {
+    writeError(ERR_ALERT, "Failed to listen on %s - %s", pOption, strerror(errno));
+    close(hSocket);
+    freeaddrinfo(psResult);
+    free(pSpec);
+    return FAILURE;
+  }
+
+  fcntl(hSocket, F_SETFL, fcntl(hSocket, F_GETFL) | O_NONBLOCK);
+  psCoord->hListen = hSocket;
+
+  freeaddrinfo(psResult);
+  free(pSpec);
+  return SUCCESS;
+}
+
+static void addJobOption(sDistCoord *psCoord, char *pOption, char *pValue)
+{
+  psCoord->arrJob = realloc(psCoord->arrJob, (psCoord->nJob + 2) * sizeof(char*));
+  psCoord->arrJob[psCoord->nJob++] = strdup(pOption);
+
+  if (pValue)
+    psCoord->arrJob[psCoord->nJob++] = strdup(pValue);
+}
+
+static void addJobNumber(sDistCoord *psCoord, char *pOption, int iValue)
+{
+  char szValue[12];
+
+  snprintf(szValue, sizeof(szValue), "%d", iValue);
+  addJobOption(psCoord, pOption, szValue);
+}
+
+/* Options of the audits run by the workers, one per lease */
+static void buildJob(sDistCoord *psCoord)
+{
+  sAudit *psAudit = psCoord->psAudit;
+  int i;
+
+  addJobOption(psCoord, "-M", szModuleName);
+
+  for (i = 0; i < nModuleParamCount; i++)
+    addJobOption(psCoord, "-m", arrModuleParams[i]);
+
+  if (psAudit->iUseSSL)
+    addJobOption(psCoord, "-s", NULL);
+
+  if (psAudit->iPortOverride)
+    addJobNumber(psCoord, "-n", psAudit->iPortOverride);
+
+  addJobNumber(psCoord, "-t", psAudit->iLoginCnt);
+  addJobNumber(psCoord, "-g", psAudit->iTimeout);
+  addJobNumber(psCoord, "-r", psAudit->iRetryWait);
+  addJobNumber(psCoord, "-R", psAudit->iRetries);
+  addJobNumber(psCoord, "-c", psAudit->iSocketWait);
+}
+
+/* Index the user and password lists loaded by auditLoad() */
+static char** indexList(char *pList, int nCount)
+{
+  char **arrList;
+  int i;
+
+  arrList = malloc((nCount + 1) * sizeof(char*));
+  for (i = 0; i < nCount; i++)
+  {
+    arrList[i] = pList;
+    pList += strlen(pList) + 1;
+  }
+
+  return arrList;
+}
+
+static void serveNodes(sDistCoord *psCoord)
+{
+  sAudit *psAudit = psCoord->psAudit;
+  struct pollfd *arrPoll = NULL;
+  sDistNode *psNode, *psNext, **arrNodes = NULL;
+  char *pLine;
+  time_t tNow;
+  int i, nNodes, nAlloc = 0, iDrop;
+
+  while ((!psCoord->iFinished) && (!psAudit->iStopped))
+  {
+    nNodes = 0;
+    for (psNode = psCoord->psNodes; psNode; psNode = psNode->psNext)
+      nNodes++;
+
+    if (nNodes + 1 > nAlloc)
+    {
+      nAlloc = nNodes + 16;
+      arrPoll = realloc(arrPoll, nAlloc * sizeof(struct pollfd));
+      arrNodes = realloc(arrNodes, nAlloc * sizeof(sDistNode*));
+    }
+
+    arrPoll[0].fd = psCoord->hListen;
+    arrPoll[0].events = POLLIN;
+    for (i = 1, psNode = psCoord->psNodes; psNode; psNode = psNode->psNext, i++)
+    {
+      arrNodes[i] = psNode;
+      arrPoll[i].fd = psNode->sConn.hSocket;
+      arrPoll[i].events = POLLIN;
+    }
+
+    /* SIGINT interrupts the poll - the audit is then stopped */
+    if (poll(arrPoll, nNodes + 1, 1000) < 0)
+      continue;
+
+    if (arrPoll[0].revents & POLLIN)
+      acceptNode(psCoord);
+
+    tNow = time(NULL);
+
+    for (i = 1; i <= nNodes; i++)
+    {
+      psNode = arrNodes[i];
+      iDrop = FALSE;
+
+      if (arrPoll[i].revents)
+      {
+        if (connRead(&psNode->sConn) != SUCCESS)
+        {
+          dropNode(psCoord, psNode, "connection closed");
+          continue;
+        }
+
+        psNode->tSeen = tNow;
+
+        while ((!iDrop) && (!psCoord->iFinished) && ((pLine = connLine(&psNode->sConn)) != NULL))
+        {
+          if (processLine(psCoord, psNode, pLine) != SUCCESS)
+            iDrop = TRUE;
+
+          free(pLine);
+        }
+
+        if (iDrop)
+        {
+          writeError(ERR_ERROR, "Invalid message from worker %d.", psNode->iId);
+          dropNode(psCoord, psNode, "protocol error");
+        }
+      }
+    }
+
+    /* workers which were not heard from */
+    for (psNode = psCoord->psNodes; psNode; psNode = psNext)
+    {
+      psNext = psNode->psNext;
+
+      if (psNode->tSeen + DIST_NODE_TIMEOUT < tNow)
+        dropNode(psCoord, psNode, "timed out");
+    }
+  }
+
+  FREE(arrPoll);
+  FREE(arrNodes);
+}
+
+/*
+  Run the audit as coordinator (-J): lease its logins to the workers which
+  connect until all were tested. The ledger (-l), if any, records the
+  logins tested by all workers, so that an audit which was stopped resumes
+  where it ended.
+*/
+int distCoordinate(sAudit *_psAudit)
+{
+  sDistCoord *psCoord;
+  sDistLease *psLease;
+  int i;
+
+  psCoord = malloc(sizeof(sDistCoord));
+  memset(psCoord, 0, sizeof(sDistCoord));
+  psCoord->psAudit = _psAudit;
+
+  if (((psCoord->pSecret = getenv(DIST_SECRET_ENV)) == NULL) || (*psCoord->pSecret == '\0'))
+  {
+    writeError(ERR_ALERT, "Distributed mode requires a secret shared with the workers in %s.", DIST_SECRET_ENV);
+    FREE(psCoord);
+    return FAILURE;
+  }
+
+  if (listenCoordinator(psCoord, _psAudit->pOptCoordinator) != SUCCESS)
+  {
+    FREE(psCoord);
+    return FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  buildJob(psCoord);
+  fpset_init(&psCoord->sDone, 0);
+  psCoord->nUsers = _psAudit->iUserCnt;
+  psCoord->arrUsers = indexList(_psAudit->pGlobalUser, _psAudit->iUserCnt);
+  psCoord->nPasses = (_psAudit->pGlobalPass) ? _psAudit->iPassCnt : 0;
+  psCoord->arrPasses = indexList(_psAudit->pGlobalPass, psCoord->nPasses);
+
+  writeVerbose(VB_NONE, "Coordinator listening on %s (%d hosts, %d users, %d passwords)", _psAudit->pOptCoordinator, _psAudit->iHostCnt, psCoord->nUsers, psCoord->nPasses);
+
+  serveNodes(psCoord);
+
+  /* workers end their audit at once */
+  while (psCoord->psNodes)
+  {
+    if (psCoord->psNodes->pName)
+      sendSimple(psCoord->psNodes, "END", -1);
+
+    dropNode(psCoord, psCoord->psNodes, NULL);
+  }
+
+  if (_psAudit->iStopped)
+    writeError(ERR_ALERT, "Coordinator stopped before all logins were tested.%s", (_psAudit->psLedger) ? " Run it again with the same ledger (-l) to resume." : "");
+
+  writeVerbose(VB_GENERAL, "Coordinator: %d logins tested by %d workers, %d leases issued (%d again), %d valid logins found.", psCoord->iLogins, psCoord->iNodeCnt, psCoord->iLeaseCnt, psCoord->iReissued, psCoord->iFound);
+
+  while ((psLease = psCoord->psLeases) != NULL)
+  {
+    psCoord->psLeases = psLease->psNext;
+    freeLease(psLease);
+  }
+
+  for (i = 0; i < psCoord->nJob; i++)
+    FREE(psCoord->arrJob[i]);
+
+  FREE(psCoord->arrJob);
+  FREE(psCoord->arrUsers);
+  FREE(psCoord->arrPasses);
+  fpset_free(&psCoord->sDone);
+  close(psCoord->hListen);
+  signal(SIGPIPE, SIG_DFL);
+  FREE(psCoord);
+
+  return SUCCESS;
+}
+
+/*
+  Worker
+*/
+
+static int workerSend(sDistWorker *psWorker, sDistMsg *psMsg)
+{
+  int ret;
+
+  pthread_mutex_lock(&psWorker->ptmSend);
+  ret = msgSend(psWorker->sConn.hSocket, psMsg);
+  pthread_mutex_unlock(&psWorker->ptmSend);
+
+  return ret;
+}
+
+static void workerSendSimple(sDistWorker *psWorker, char *pType, int iValue)
+{
+  sDistMsg sMsg;
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  msgField(&sMsg, pType);
+  if (iValue >= 0)
+    msgFieldInt(&sMsg, iValue);
+
+  workerSend(psWorker, &sMsg);
+}
+
+/* Logins tested by the audit of a lease are reported as they happen */
+static void workerEvent(const sMedusaEvent *psEvent, void *pArg)
+{
+  sDistWorker *psWorker = (sDistWorker *)pArg;
+  sDistMsg sMsg;
+
+  if (psEvent->iType != MEDUSA_EVENT_ATTEMPT)
+    return;
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  msgField(&sMsg, "RESULT");
+  msgFieldInt(&sMsg, psWorker->iLease);
+  msgFieldInt(&sMsg, psEvent->iResult);
+  msgField(&sMsg, psEvent->pUser);
+  msgField(&sMsg, psEvent->pPass);
+  if (psEvent->pMessage)
+    msgField(&sMsg, psEvent->pMessage);
+
+  workerSend(psWorker, &sMsg);
+}
+
+/*
+  Messages of the coordinator are read by this thread. Replies are queued
+  for the main thread; CANCEL and END stop the audit of the lease at once.
+*/
+static void* workerLink(void *arg)
+{
+  sDistWorker *psWorker = (sDistWorker *)arg;
+  sDistReply *psReply, **ppsTail;
+  struct pollfd sPoll;
+  time_t tPing = time(NULL);
+  char *pLine;
+
+  sPoll.fd = psWorker->sConn.hSocket;
+  sPoll.events = POLLIN;
+
+  while (TRUE)
+  {
+    if ((poll(&sPoll, 1, 1000) > 0) && (connRead(&psWorker->sConn) != SUCCESS))
+      break;
+
+    if (time(NULL) - tPing >= DIST_PING_INTERVAL)
+    {
+      workerSendSimple(psWorker, "PING", -1);
+      tPing = time(NULL);
+    }
+
+    while ((pLine = connLine(&psWorker->sConn)) != NULL)
+    {
+      pthread_mutex_lock(&psWorker->ptmMutex);
+
+      if (strncmp(pLine, "CANCEL\t", 7) == 0)
+      {
+        if ((psWorker->psCurrent) && (psWorker->iLease == atoi(pLine + 7)))
+          medusaAuditStop(psWorker->psCurrent);
+
+        free(pLine);
+      }
+      else if (strcmp(pLine, "END") == 0)
+      {
+        psWorker->iEnd = TRUE;
+        if (psWorker->psCurrent)
+          medusaAuditStop(psWorker->psCurrent);
+
+        free(pLine);
+      }
+      else
+      {
+        psReply = malloc(sizeof(sDistReply));
+        psReply->psNext = NULL;
+        psReply->pLine = pLine;
+
+        for (ppsTail = &psWorker->psReplies; *ppsTail; ppsTail = &(*ppsTail)->psNext);
+        *ppsTail = psReply;
+      }
+
+      pthread_cond_broadcast(&psWorker->ptcReply);
+      pthread_mutex_unlock(&psWorker->ptmMutex);
+    }
+  }
+
+  pthread_mutex_lock(&psWorker->ptmMutex);
+  psWorker->iLost = TRUE;
+  if (psWorker->psCurrent)
+    medusaAuditStop(psWorker->psCurrent);
+  pthread_cond_broadcast(&psWorker->ptcReply);
+  pthread_mutex_unlock(&psWorker->ptmMutex);
+
+  return NULL;
+}
+
+/*
+  Next reply of the coordinator. Returns NULL once END was received or the
+  connection was lost. The reply must be freed.
+*/
+static char* workerReply(sDistWorker *psWorker)
+{
+  sDistReply *psReply;
+  char *pLine = NULL;
+
+  pthread_mutex_lock(&psWorker->ptmMutex);
+
+  while ((psWorker->psReplies == NULL) && (!psWorker->iEnd) && (!psWorker->iLost))
+    pthread_cond_wait(&psWorker->ptcReply, &psWorker->ptmMutex);
+
+  if ((psWorker->psReplies) && (!psWorker->iEnd) && (!psWorker->iLost))
+  {
+    psReply = psWorker->psReplies;
+    psWorker->psReplies = psReply->psNext;
+    pLine = psReply->pLine;
+    free(psReply);
+  }
+
+  pthread_mutex_unlock(&psWorker->ptmMutex);
+  return pLine;
+}
+
+/* Wait iSeconds before asking for a lease again, unless the audit ends */
+static void workerPause(sDistWorker *psWorker, int iSeconds)
+{
+  struct timespec tsEnd;
+
+  clock_gettime(CLOCK_REALTIME, &tsEnd);
+  tsEnd.tv_sec += iSeconds;
+
+  pthread_mutex_lock(&psWorker->ptmMutex);
+  while ((!psWorker->iEnd) && (!psWorker->iLost))
+  {
+    if (pthread_cond_timedwait(&psWorker->ptcReply, &psWorker->ptmMutex, &tsEnd) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&psWorker->ptmMutex);
+}
+
+/* Test the logins of a lease with an audit of their own */
+static int workerLease(sDistWorker *psWorker, char **arrFields, int nFields)
+{
+  sMedusaAudit *psMedusa;
+  char **argv;
+  char szThreads[12], szVerbose[12], szError[12];
+  int argc = 0, i, iLease, ret = SUCCESS;
+
+  if (nFields < 5)
+    return FAILURE;
+
+  iLease = atoi(arrFields[1]);
+
+  argv = malloc((psWorker->nJob + 14) * sizeof(char*));
+  argv[argc++] = PROGRAM;
+  argv[argc++] = "-b";
+
+  for (i = 0; i < psWorker->nJob; i++)
+    argv[argc++] = psWorker->arrJob[i];
+
+  if (arrFields[3][0] != '\0')
+  {
+    argv[argc++] = "-e";
+    argv[argc++] = arrFields[3];
+  }
+
+  if (psWorker->iThreads)
+  {
+    snprintf(szThreads, sizeof(szThreads), "%d", psWorker->iThreads);
+    argv[argc++] = "-t";
+    argv[argc++] = szThreads;
+  }
+
+  if (psWorker->iUring)
+    argv[argc++] = "-I";
+
+  if (psWorker->pCoroutines)
+  {
+    argv[argc++] = "-E";
+    argv[argc++] = psWorker->pCoroutines;
+  }
+
+  snprintf(szVerbose, sizeof(szVerbose), "%d", psWorker->iVerbose);
+  snprintf(szError, sizeof(szError), "%d", psWorker->iError);
+  argv[argc++] = "-v";
+  argv[argc++] = szVerbose;
+  argv[argc++] = "-w";
+  argv[argc++] = szError;
+  argv[argc] = NULL;
+
+  if ((psMedusa = medusaAuditCreate()) == NULL)
+  {
+    free(argv);
+    return FAILURE;
+  }
+
+  if ((medusaAuditParseArgs(psMedusa, argc, argv) != MEDUSA_SUCCESS) || (medusaAuditAddHost(psMedusa, arrFields[2]) != MEDUSA_SUCCESS) || (medusaAuditAddUser(psMedusa, arrFields[4]) != MEDUSA_SUCCESS))
+    ret = FAILURE;
+
+  for (i = 5; (ret == SUCCESS) && (i < nFields); i++)
+  {
+    if (medusaAuditAddPassword(psMedusa, arrFields[i]) != MEDUSA_SUCCESS)
+      ret = FAILURE;
+  }
+
+  medusaAuditSetEventHandler(psMedusa, workerEvent, psWorker);
+  medusaAuditSetLeased(psMedusa);
+
+  if ((ret != SUCCESS) || (medusaAuditValidate(psMedusa) != MEDUSA_SUCCESS))
+  {
+    writeError(ERR_ALERT, "Failed to set up the audit of lease %d.", iLease);
+    medusaAuditFree(psMedusa);
+    free(argv);
+    return FAILURE;
+  }
+
+  pthread_mutex_lock(&psWorker->ptmMutex);
+  psWorker->iLease = iLease;
+  psWorker->psCurrent = psMedusa;
+  if ((psWorker->iEnd) || (psWorker->iLost))
+    medusaAuditStop(psMedusa);
+  pthread_mutex_unlock(&psWorker->ptmMutex);
+
+  writeVerbose(VB_GENERAL, "Lease %d: host %s, user %s, %d passwords", iLease, arrFields[2], arrFields[4], nFields - 5);
+  medusaAuditRun(psMedusa);
+
+  pthread_mutex_lock(&psWorker->ptmMutex);
+  psWorker->psCurrent = NULL;
+  psWorker->iLease = 0;
+  pthread_mutex_unlock(&psWorker->ptmMutex);
+
+  medusaAuditFree(psMedusa);
+  free(argv);
+
+  workerSendSimple(psWorker, "DONE", iLease);
+  return SUCCESS;
+}
+
+static int connectCoordinator(sDistWorker *psWorker, char *pOption)
+{
+  struct addrinfo sHints, *psResult, *psAddr;
+  char *pSpec, *pAddr, *pPort;
+  int hSocket = -1, iRet;
+
+  pSpec = strdup(pOption);
+  if ((splitAddress(pSpec, &pAddr, &pPort) != SUCCESS) || (pAddr == NULL))
+  {
+    writeError(ERR_ALERT, "Invalid coordinator address: %s (expected HOST:PORT)", pOption);
+    free(pSpec);
+    return FAILURE;
+  }
+
+  memset(&sHints, 0, sizeof(sHints));
+  sHints.ai_family = AF_UNSPEC;
+  sHints.ai_socktype = SOCK_STREAM;
+
+  if ((iRet = getaddrinfo(pAddr, pPort, &sHints, &psResult)) != 0)
+  {
+    writeError(ERR_ALERT, "Failed to resolve coordinator %s - %s", pOption, gai_strerror(iRet));
+    free(pSpec);
+    return FAILURE;
+  }
+
+  for (psAddr = psResult; psAddr; psAddr = psAddr->ai_next)
+  {
+    if ((hSocket = socket(psAddr->ai_family, psAddr->ai_socktype, psAddr->ai_protocol)) < 0)
+      continue;
+
+    if (connect(hSocket, psAddr->ai_addr, psAddr->ai_addrlen) == 0)
+      break;
+
+    close(hSocket);
+    hSocket = -1;
+  }
+
+  freeaddrinfo(psResult);
+  free(pSpec);
+
+  if (hSocket < 0)
+  {
+    writeError(ERR_ALERT, "Failed to connect to coordinator %s - %s", pOption, strerror(errno));
+    return FAILURE;
+  }
+
+  setSocketOptions(hSocket);
+  psWorker->sConn.hSocket = hSocket;
+  return SUCCESS;
+}
+
+/*
+  The coordinator only sends the options of buildJob(). Any other (-O, -Z,
+  -C...) is refused, as is a module name which is not a plain file name.
+*/
+static int isJobAllowed(char **arrJob, int nJob)
+{
+  char *pOption;
+  int i;
+
+  for (i = 0; i < nJob; i++)
+  {
+    pOption = arrJob[i];
+
+    if (strcmp(pOption, "-s") == 0)
+      continue;
+
+    if ((i + 1 < nJob) && (strcmp(pOption, "-M") == 0) && (arrJob[i + 1][0] != '.') &&
+        (strspn(arrJob[i + 1], "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == strlen(arrJob[i + 1])))
+    {
+      i++;
+      continue;
+    }
+
+    if ((i + 1 < nJob) && (strcmp(pOption, "-m") == 0))
+    {
+      i++;
+      continue;
+    }
+
+    if ((i + 1 < nJob) && (pOption[0] == '-') && (pOption[1] != '\0') && (pOption[2] == '\0') && (strchr("ntgrRc", pOption[1])) &&
+        (arrJob[i + 1][0] != '\0') && (strspn(arrJob[i + 1], "0123456789") == strlen(arrJob[i + 1])))
+    {
+      i++;
+      continue;
+    }
+
+    writeError(ERR_ALERT, "Coordinator sent an option workers do not accept: %s", pOption);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int runWorker(sDistWorker *psWorker)
+{
+  sDistMsg sMsg;
+  char *pLine, **arrFields;
+  int i, nFields, ret = SUCCESS;
+
+  memset(&sMsg, 0, sizeof(sDistMsg));
+  msgField(&sMsg, "HELLO");
+  msgField(&sMsg, DIST_PROTOCOL);
+  msgField(&sMsg, psWorker->pName);
+  msgFieldInt(&sMsg, psWorker->iThreads);
+  msgField(&sMsg, psWorker->pSecret);
+  workerSend(psWorker, &sMsg);
+
+  /* options of the audits */
+  if ((pLine = workerReply(psWorker)) == NULL)
+    return (psWorker->iEnd) ? SUCCESS : FAILURE;
+
+  nFields = splitLine(pLine, &arrFields);
+  if ((strcmp(arrFields[0], "JOB") != 0) || (!isJobAllowed(arrFields + 1, nFields - 1)))
+  {
+    free(arrFields);
+    free(pLine);
+    writeError(ERR_ALERT, "Unexpected reply from coordinator.");
+    return FAILURE;
+  }
+
+  psWorker->nJob = nFields - 1;
+  psWorker->arrJob = malloc(nFields * sizeof(char*));
+  for (i = 1; i < nFields; i++)
+    psWorker->arrJob[i - 1] = strdup(arrFields[i]);
+
+  free(arrFields);
+  free(pLine);
+
+  while ((ret == SUCCESS) && (!psWorker->iEnd) && (!psWorker->iLost))
+  {
+    workerSendSimple(psWorker, "LEASE", -1);
+
+    if ((pLine = workerReply(psWorker)) == NULL)
+      break;
+
+    nFields = splitLine(pLine, &arrFields);
+
+    if (strcmp(arrFields[0], "LEASE") == 0)
+      ret = workerLease(psWorker, arrFields, nFields);
+    else if ((strcmp(arrFields[0], "WAIT") == 0) && (nFields > 1))
+      workerPause(psWorker, atoi(arrFields[1]));
+    else
+    {
+      writeError(ERR_ALERT, "Unexpected reply from coordinator.");
+      ret = FAILURE;
+    }
+
+    free(arrFields);
+    free(pLine);
+  }
+
+  if ((ret == SUCCESS) && (psWorker->iLost) && (!psWorker->iEnd))
+  {
+    writeError(ERR_ALERT, "Lost connection to coordinator.");
+    ret = FAILURE;
+  }
+
+  for (i = 0; i < psWorker->nJob; i++)
+    FREE(psWorker->arrJob[i]);
+  FREE(psWorker->arrJob);
+
+  return ret;
+}
+
+/* Worker options: -j HOST:PORT [-t NUM] [-I] [-v NUM] [-w NUM] [-b] */
+int medusaWorkerRun(int argc, char **argv)
+{
+  sDistWorker *psWorker;
+  sDistReply *psReply;
+  char szHost[256], szName[300];
+  char *pCoordinator = NULL;
+  int opt, nIgnoreBanner = 0;
+  int ret = MEDUSA_SUCCESS;
+
+  psWorker = malloc(sizeof(sDistWorker));
+  memset(psWorker, 0, sizeof(sDistWorker));
+  psWorker->iVerbose = 5;
+  psWorker->iError = 5;
+
+  iVerboseLevel = 5;
+  iErrorLevel = 5;
+
+  optind = 1;
+  while ((opt = getopt(argc, argv, "j:t:IE:v:w:b")) != EOF)
+  {
+    switch (opt)
+    {
+      case 'j':
+        pCoordinator = optarg;
+        break;
+      case 't':
+        psWorker->iThreads = atoi(optarg);
+        break;
+      case 'I':
+        psWorker->iUring = TRUE;
+        break;
+      case 'E':
+        psWorker->pCoroutines = optarg;
+        break;
+      case 'v':
+        iVerboseLevel = psWorker->iVerbose = atoi(optarg);
+        break;
+      case 'w':
+        iErrorLevel = psWorker->iError = atoi(optarg);
+        break;
+      case 'b':
+        nIgnoreBanner = 1;
+        break;
+      default:
+        writeError(ERR_ALERT, "Workers (option 'j') only accept options 't', 'I', 'E', 'v', 'w' and 'b'.");
+        ret = MEDUSA_FAILURE;
+        break;
+    }
+  }
+
+  if (nIgnoreBanner == 0)
+    writeVerbose(VB_NONE, "%s v%s [%s] (C) %s %s\n", PROGRAM, VERSION, WWW, AUTHOR, EMAIL);
+
+  if (psWorker->iThreads < 0)
+  {
+    writeError(ERR_ALERT, "Invalid number of login threads for the worker (option 't').");
+    ret = MEDUSA_FAILURE;
+  }
+
+  if (((psWorker->pSecret = getenv(DIST_SECRET_ENV)) == NULL) || (*psWorker->pSecret == '\0'))
+  {
+    writeError(ERR_ALERT, "Workers require the secret of their coordinator in %s.", DIST_SECRET_ENV);
+    ret = MEDUSA_FAILURE;
+  }
+
+  if ((ret != MEDUSA_SUCCESS) || (pCoordinator == NULL) || (connectCoordinator(psWorker, pCoordinator) != SUCCESS))
+  {
+    FREE(psWorker);
+    return MEDUSA_FAILURE;
+  }
+
+  if (gethostname(szHost, sizeof(szHost)) != 0)
+    snprintf(szHost, sizeof(szHost), "worker");
+  szHost[sizeof(szHost) - 1] = '\0';
+  snprintf(szName, sizeof(szName), "%s:%d", szHost, (int)getpid());
+  psWorker->pName = szName;
+
+  pthread_mutex_init(&psWorker->ptmSend, NULL);
+  pthread_mutex_init(&psWorker->ptmMutex, NULL);
+  pthread_cond_init(&psWorker->ptcReply, NULL);
+
+  if (pthread_create(&psWorker->thrLink, NULL, workerLink, psWorker) != 0)
+    writeError(ERR_FATAL, "Failed to create worker thread - %s", strerror(errno));
+
+  writeVerbose(VB_NONE, "Worker %s connected to coordinator %s", szName, pCoordinator);
+
+  if (runWorker(psWorker) != SUCCESS)
+    ret = MEDUSA_FAILURE;
+
+  writeVerbose(VB_NONE, "Worker %s stopped.", szName);
+
+  /* the link thread ends once the connection is closed */
+  shutdown(psWorker->sConn.hSocket, SHUT_RDWR);
+  pthread_join(psWorker->thrLink, NULL);
+  close(psWorker->sConn.hSocket);
+
+  while ((psReply = psWorker->psReplies) != NULL)
+  {
+    psWorker->psReplies = psReply->psNext;
+    free(psReply->pLine);
+    free(psReply);
+  }
+
+  pthread_cond_destroy(&psWorker->ptcReply);
+  pthread_mutex_destroy(&psWorker->ptmMutex);
+  pthread_mutex_destroy(&psWorker->ptmSend);
+  FREE(psWorker->sConn.pBuf);
+  FREE(psWorker);
+
+  return ret;
+}
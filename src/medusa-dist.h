@@ -0,0 +1,168 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_DIST_H
+#define _MEDUSA_DIST_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "medusa-hosts.h"
+
+/*
+  Distributed mode. The coordinator (-J) is an audit which, instead of
+  testing the logins itself, leases them to workers (-j) connected over TCP.
+  A lease is one host and user with a block of passwords. Workers report
+  each login tested and ask for the next lease once done. Leases held by a
+  worker which disconnected or was not heard from for DIST_NODE_TIMEOUT
+  seconds are issued again, less the logins it reported.
+
+  Messages are lines of fields separated by TAB, with backslash, TAB, CR and
+  LF escaped (\\, \t, \r, \n):
+
+    worker                              coordinator
+    HELLO 2 NAME THREADS SECRET     ->
+                                    <-  JOB ARG...            (options of the audits)
+    LEASE                           ->
+                                    <-  LEASE ID HOST EXTRA USER PASS...
+                                    <-  WAIT SECONDS          (all logins leased)
+                                    <-  END                   (audit complete)
+    RESULT ID CODE USER PASS [MSG]  ->
+    DONE ID                         ->
+                                    <-  CANCEL ID             (user or host done)
+    PING                            ->
+
+  EXTRA is "n", "s", "ns" (see -e) or empty. CODE is a login result
+  (MEDUSA_RESULT_*). SECRET is the value of DIST_SECRET_ENV, which the
+  coordinator and its workers must share; other workers are dropped. Results
+  are only accepted for the user and passwords of a lease held by the worker,
+  and workers only accept the options buildJob() sends in JOB.
+*/
+#define DIST_PROTOCOL "2"
+#define DIST_DEFAULT_ADDR "127.0.0.1"
+#define DIST_SECRET_ENV "MEDUSA_DIST_SECRET"
+#define DIST_LEASE_PER_THREAD 16            // passwords leased per login thread of the worker
+#define DIST_NODE_TIMEOUT 30                // seconds without a message before a worker is dropped
+#define DIST_PING_INTERVAL 5
+#define DIST_WAIT 1                         // seconds a worker waits before asking again
+#define DIST_MAX_LINE (1024 * 1024)
+
+#define DIST_EXTRA_BLANK 1
+#define DIST_EXTRA_USER 2
+
+/* Message being built */
+typedef struct __sDistMsg {
+  char *pBuf;
+  size_t nLen;
+  size_t nAlloc;
+} sDistMsg;
+
+/* Connection to a worker (coordinator) or to the coordinator (worker) */
+typedef struct __sDistConn {
+  int hSocket;
+  char *pBuf;                             // received data not yet processed
+  size_t nLen;
+  size_t nAlloc;
+} sDistConn;
+
+typedef struct __sDistNode {
+  struct __sDistNode *psNext;
+  int iId;
+  sDistConn sConn;
+  char *pName;                            // NULL until HELLO
+  int iThreads;
+  time_t tSeen;                           // last message
+  int iLogins;                            // logins reported
+} sDistNode;
+
+typedef struct __sDistLease {
+  struct __sDistLease *psNext;
+  int iId;
+  sDistNode *psNode;                      // NULL while waiting to be issued again
+  sHostEntry sHost;
+  uint64_t nLedgerKey;
+  int iUser;
+  char *pUser;                            // points into the user list of the audit
+  int iExtra;                             // DIST_EXTRA_* not reported yet
+  int nPass;
+  char **arrPass;                         // point into the password list of the audit
+  char *pTested;                          // passwords reported
+  int iResults;
+  int iCancelled;                         // user or host done - remaining logins are dropped
+} sDistLease;
+
+typedef struct __sDistCoord {
+  sAudit *psAudit;
+  char *pSecret;                          // DIST_SECRET_ENV
+  int hListen;
+  char **arrJob;                          // options sent to the workers
+  int nJob;
+  sDistNode *psNodes;
+  int iNodeCnt;                           // workers connected so far
+  sDistLease *psLeases;                   // issued, and waiting to be issued again
+  int iLeaseCnt;                          // leases issued so far
+  int iReissued;
+  char **arrUsers;
+  int nUsers;
+  char **arrPasses;
+  int nPasses;
+  sHostEntry sHost;                       // enumeration cursor
+  int iHostValid;
+  uint64_t nHostKey;                      // ledger fingerprint of the host
+  int iUser;
+  int iPass;
+  int iExhausted;                         // all logins were leased
+  int iFinished;                          // audit complete (or ended by -F)
+  fpset sDone;                            // users and hosts done
+  int iLogins;
+  int iFound;
+} sDistCoord;
+
+/* Worker */
+typedef struct __sDistReply {
+  struct __sDistReply *psNext;
+  char *pLine;
+} sDistReply;
+
+typedef struct __sDistWorker {
+  sDistConn sConn;
+  char *pName;
+  char *pSecret;                          // DIST_SECRET_ENV
+  int iThreads;                           // -t of the worker, 0 for the coordinator's
+  int iUring;                             // -I of the worker
+  char *pCoroutines;                      // -E of the worker, NULL if not given
+  int iVerbose;                           // -v and -w of the worker
+  int iError;
+  char **arrJob;
+  int nJob;
+  pthread_t thrLink;
+  pthread_mutex_t ptmSend;
+  pthread_mutex_t ptmMutex;
+  pthread_cond_t ptcReply;
+  sDistReply *psReplies;                  // replies to the requests of the main thread
+  int iEnd;                               // END received
+  int iLost;                              // connection to the coordinator lost
+  int iLease;                             // lease being tested, 0 if none
+  sMedusaAudit *psCurrent;                // audit of the lease
+} sDistWorker;
+
+#endif
@@ -0,0 +1,500 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Target host specification parsing and lazy enumeration
+ *
+*/
+
+#include <limits.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "medusa.h"
+#include "uthash.h"
+
+/* Resolved target addresses, shared by every host of every service */
+typedef struct __sResolved {
+  char *pHost;                    /* key --> host name */
+  char szIP[INET6_ADDRSTRLEN];
+  int iFamily;
+
+  UT_hash_handle hh;              /* required for UThash */
+} sResolved;
+
+static sResolved *psResolved = NULL;
+static pthread_mutex_t ptmResolveMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Addresses looked up by any job of the daemon (see resolveCacheShare()) */
+typedef struct __sSharedAddress {
+  int iFamily;
+  char szIP[INET6_ADDRSTRLEN];
+} sSharedAddress;
+
+static sShCache *psResolveShared = NULL;
+
+static int parseIPv4(const char *pAddr, uint32_t *pnAddr)
+{
+  struct in_addr sAddr;
+
+  if (inet_pton(AF_INET, pAddr, &sAddr) != 1)
+    return FAILURE;
+
+  *pnAddr = ntohl(sAddr.s_addr);
+  return SUCCESS;
+}
+
+static int parseNumber(const char *pNum, int iMin, int iMax, int *piValue)
+{
+  char *pEnd;
+  long lValue;
+
+  if ((*pNum < '0') || (*pNum > '9'))
+    return FAILURE;
+
+  lValue = strtol(pNum, &pEnd, 10);
+  if ((*pEnd != '\0') || (lValue < iMin) || (lValue > iMax))
+    return FAILURE;
+
+  *piValue = (int)lValue;
+  return SUCCESS;
+}
+
+static void hostListInsert(sHostList *psList, sHostSpec *psSpec)
+{
+  if (psList->nSpecs == psList->nAlloc)
+  {
+    psList->nAlloc = (psList->nAlloc) ? psList->nAlloc * 2 : 64;
+    psList->psSpecs = realloc(psList->psSpecs, psList->nAlloc * sizeof(sHostSpec));
+    if (psList->psSpecs == NULL)
+      writeError(ERR_FATAL, "Failed to allocate memory for host list.");
+  }
+
+  psList->psSpecs[psList->nSpecs++] = *psSpec;
+  psList->iHostCnt += psSpec->nCount;
+}
+
+/*
+  Parse a host specification and append it to the list. Returns FAILURE if
+  the specification is malformed or the list would exceed INT_MAX hosts.
+*/
+int hostListAdd(sHostList *psList, char *pSpec, int iService)
+{
+  sHostSpec sSpec;
+  char szHost[HOST_SPEC_MAX_LEN];
+  char *pHost = szHost;
+  char *pTmp;
+  uint32_t nEnd;
+  int iValue;
+
+  if (strlen(pSpec) >= HOST_SPEC_MAX_LEN)
+  {
+    writeError(ERR_ERROR, "Host specification is too long: %s", pSpec);
+    return FAILURE;
+  }
+
+  memset(&sSpec, 0, sizeof(sHostSpec));
+  strcpy(szHost, pSpec);
+
+  /* port suffix: [IPv6]:port or host:port (a bare IPv6 address has several colons) */
+  if (szHost[0] == '[')
+  {
+    if ((pTmp = index(szHost, ']')) == NULL)
+    {
+      writeError(ERR_ERROR, "Invalid host specification: %s", pSpec);
+      return FAILURE;
+    }
+
+    *pTmp++ = '\0';
+    pHost = szHost + 1;
+
+    if ((*pTmp == ':') && (parseNumber(pTmp + 1, 1, 65535, &sSpec.iPort) != SUCCESS))
+    {
+      writeError(ERR_ERROR, "Invalid port in host specification: %s", pSpec);
+      return FAILURE;
+    }
+    else if ((*pTmp != ':') && (*pTmp != '\0'))
+    {
+      writeError(ERR_ERROR, "Invalid host specification: %s", pSpec);
+      return FAILURE;
+    }
+  }
+  else if (((pTmp = index(szHost, ':')) != NULL) && (index(pTmp + 1, ':') == NULL))
+  {
+    *pTmp = '\0';
+
+    if (parseNumber(pTmp + 1, 1, 65535, &sSpec.iPort) != SUCCESS)
+    {
+      writeError(ERR_ERROR, "Invalid port in host specification: %s", pSpec);
+      return FAILURE;
+    }
+  }
+
+  if (*pHost == '\0')
+  {
+    writeError(ERR_ERROR, "Invalid host specification: %s", pSpec);
+    return FAILURE;
+  }
+
+  /* CIDR block: 10.0.0.0/12 */
+  if ((pTmp = index(pHost, '/')) != NULL)
+  {
+    *pTmp = '\0';
+
+    if ((parseIPv4(pHost, &sSpec.nStart) != SUCCESS) || (parseNumber(pTmp + 1, 1, 32, &iValue) != SUCCESS))
+    {
+      writeError(ERR_ERROR, "Invalid CIDR host specification: %s", pSpec);
+      return FAILURE;
+    }
+
+    if (iValue == 1)
+    {
+      writeError(ERR_ERROR, "CIDR host specification is too large: %s", pSpec);
+      return FAILURE;
+    }
+
+    sSpec.nCount = (uint32_t)1 << (32 - iValue);
+    sSpec.nStart &= ~(sSpec.nCount - 1);
+  }
+  else
+  {
+    /* address range: 10.1.2.3-200 or 10.0.0.1-10.0.3.254 (hostnames may also contain '-') */
+    if ((pTmp = index(pHost, '-')) != NULL)
+    {
+      *pTmp = '\0';
+      if (parseIPv4(pHost, &sSpec.nStart) != SUCCESS)
+      {
+        *pTmp = '-';
+        pTmp = NULL;
+      }
+    }
+
+    if (pTmp)
+    {
+      if (parseIPv4(pTmp + 1, &nEnd) == SUCCESS)
+      {
+        /* full end address */
+      }
+      else if (parseNumber(pTmp + 1, 0, 255, &iValue) == SUCCESS)
+      {
+        nEnd = (sSpec.nStart & 0xFFFFFF00) | (uint32_t)iValue;
+      }
+      else
+      {
+        writeError(ERR_ERROR, "Invalid host range specification: %s", pSpec);
+        return FAILURE;
+      }
+
+      if ((nEnd < sSpec.nStart) || (nEnd - sSpec.nStart >= (uint32_t)INT_MAX))
+      {
+        writeError(ERR_ERROR, "Invalid host range specification: %s", pSpec);
+        return FAILURE;
+      }
+
+      sSpec.nCount = nEnd - sSpec.nStart + 1;
+    }
+    /* hostname or single address */
+    else
+    {
+      sSpec.pHost = strdup(pHost);
+      sSpec.nCount = 1;
+    }
+  }
+
+  if (sSpec.nCount > (uint32_t)(INT_MAX - psList->iHostCnt))
+  {
+    writeError(ERR_ERROR, "Too many target hosts specified (%s).", pSpec);
+    FREE(sSpec.pHost);
+    return FAILURE;
+  }
+
+  sSpec.iId = psList->iHostCnt + 1;
+  sSpec.iService = iService;
+  hostListInsert(psList, &sSpec);
+
+  writeError(ERR_DEBUG, "Added host specification: %s (%u hosts, port %d)", pSpec, sSpec.nCount, sSpec.iPort);
+
+  return SUCCESS;
+}
+
+/*
+  Append a single host previously returned by hostListNext(), keeping its
+  host ID (e.g. a host which answered the liveness pre-scan).
+*/
+int hostListAppend(sHostList *psList, sHostEntry *psEntry)
+{
+  sHostSpec sSpec;
+
+  memset(&sSpec, 0, sizeof(sHostSpec));
+  sSpec.pHost = strdup(psEntry->szHost);
+  sSpec.nCount = 1;
+  sSpec.iPort = psEntry->iPort;
+  sSpec.iId = psEntry->iId;
+  sSpec.iService = psEntry->iService;
+  hostListInsert(psList, &sSpec);
+
+  return SUCCESS;
+}
+
+/*
+  Fill psEntry with the next host of the enumeration: its name, port suffix
+  (or 0), host ID and service. Returns FALSE once all hosts have been
+  enumerated.
+*/
+int hostListNext(sHostList *psList, sHostEntry *psEntry)
+{
+  sHostSpec *psSpec;
+  struct in_addr sAddr;
+
+  while ((psList->iSpec < psList->nSpecs) && (psList->nOffset >= psList->psSpecs[psList->iSpec].nCount))
+  {
+    psList->iSpec++;
+    psList->nOffset = 0;
+  }
+
+  if (psList->iSpec >= psList->nSpecs)
+    return FALSE;
+
+  psSpec = &psList->psSpecs[psList->iSpec];
+
+  if (psSpec->pHost)
+  {
+    snprintf(psEntry->szHost, HOST_SPEC_MAX_LEN, "%s", psSpec->pHost);
+  }
+  else
+  {
+    sAddr.s_addr = htonl(psSpec->nStart + psList->nOffset);
+    inet_ntop(AF_INET, &sAddr, psEntry->szHost, HOST_SPEC_MAX_LEN);
+  }
+
+  psEntry->iPort = psSpec->iPort;
+  psEntry->iId = psSpec->iId + psList->nOffset;
+  psEntry->iService = psSpec->iService;
+  psList->nOffset++;
+
+  return TRUE;
+}
+
+/* Returns the host ID hostListNext() will return next, or 0 if none remain */
+int hostListNextId(sHostList *psList)
+{
+  int iSpec = psList->iSpec;
+  uint32_t nOffset = psList->nOffset;
+
+  while ((iSpec < psList->nSpecs) && (nOffset >= psList->psSpecs[iSpec].nCount))
+  {
+    iSpec++;
+    nOffset = 0;
+  }
+
+  return (iSpec < psList->nSpecs) ? psList->psSpecs[iSpec].iId + (int)nOffset : 0;
+}
+
+/* Returns TRUE if hostListNext() has further hosts to return */
+int hostListRemaining(sHostList *psList)
+{
+  if (psList->iSpec < psList->nSpecs - 1)
+    return TRUE;
+
+  if ((psList->iSpec == psList->nSpecs - 1) && (psList->nOffset < psList->psSpecs[psList->iSpec].nCount))
+    return TRUE;
+
+  return FALSE;
+}
+
+void hostListReset(sHostList *psList)
+{
+  psList->iSpec = 0;
+  psList->nOffset = 0;
+}
+
+static int hostSpecCompare(const void *a, const void *b)
+{
+  return ((const sHostSpec *)a)->iId - ((const sHostSpec *)b)->iId;
+}
+
+/* Order specifications by host ID */
+void hostListSort(sHostList *psList)
+{
+  if (psList->nSpecs > 1)
+    qsort(psList->psSpecs, psList->nSpecs, sizeof(sHostSpec), hostSpecCompare);
+}
+
+void hostListFree(sHostList *psList)
+{
+  int i;
+
+  for (i = 0; i < psList->nSpecs; i++)
+    FREE(psList->psSpecs[i].pHost);
+
+  FREE(psList->psSpecs);
+  memset(psList, 0, sizeof(sHostList));
+}
+
+/*
+  Resolve a target host to the address tested (the first one returned).
+  Host names are cached, so a host audited by several services (-X) or
+  resumed is only looked up once. At most RESOLVE_CACHE_MAX names are kept.
+  Numeric addresses (e.g. expanded from CIDR ranges) and failed lookups are
+  not cached. Within the daemon, addresses are also shared with the other
+  jobs for RESOLVE_SHARED_TTL seconds.
+*/
+int resolveHost(char *pHost, char *pHostIP, size_t nLen)
+{
+  struct addrinfo hints, *res;
+  sResolved *psEntry, *psFound;
+  sSharedAddress sShared;
+  size_t nShared;
+  void *ptr;
+  int errcode;
+
+  /* numeric addresses need no lookup, and are not worth caching */
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  if (getaddrinfo(pHost, NULL, &hints, &res) == 0)
+  {
+    if (res->ai_family == AF_INET6)
+      ptr = &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr;
+    else
+      ptr = &((struct sockaddr_in *) res->ai_addr)->sin_addr;
+
+    inet_ntop(res->ai_family, ptr, pHostIP, nLen);
+    writeError(ERR_DEBUG_SERVER, "Set IPv%d address: %s", res->ai_family == PF_INET6 ? 6 : 4, pHostIP);
+    freeaddrinfo(res);
+    return SUCCESS;
+  }
+
+  pthread_mutex_lock(&ptmResolveMutex);
+  HASH_FIND_STR(psResolved, pHost, psEntry);
+  if (psEntry)
+    snprintf(pHostIP, nLen, "%s", psEntry->szIP);
+  pthread_mutex_unlock(&ptmResolveMutex);
+
+  if (psEntry)
+  {
+    writeError(ERR_DEBUG_SERVER, "Set IPv%d address: %s (cached)", psEntry->iFamily == PF_INET6 ? 6 : 4, pHostIP);
+    return SUCCESS;
+  }
+
+  psEntry = malloc(sizeof(sResolved));
+  memset(psEntry, 0, sizeof(sResolved));
+  psEntry->pHost = strdup(pHost);
+
+  nShared = sizeof(sShared);
+  if (shcacheGet(psResolveShared, pHost, &sShared, &nShared) == SUCCESS)
+  {
+    psEntry->iFamily = sShared.iFamily;
+    snprintf(psEntry->szIP, sizeof(psEntry->szIP), "%s", sShared.szIP);
+    snprintf(pHostIP, nLen, "%s", sShared.szIP);
+    writeError(ERR_DEBUG_SERVER, "Set IPv%d address: %s (daemon cache)", psEntry->iFamily == PF_INET6 ? 6 : 4, pHostIP);
+  }
+  else
+  {
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags |= AI_CANONNAME;
+
+    errcode = getaddrinfo(pHost, NULL, &hints, &res);
+    if (errcode != 0)
+    {
+      writeError(ERR_CRITICAL, "Failed to resolve hostname: %s - %s", pHost, gai_strerror(errcode));
+      free(psEntry->pHost);
+      free(psEntry);
+      return FAILURE;
+    }
+
+    if (res->ai_next != NULL)
+      writeError(ERR_ERROR, "Hostname resolved to multiple addresses. Selecting first address for testing.");
+
+    if (res->ai_family == AF_INET6)
+      ptr = &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr;
+    else
+      ptr = &((struct sockaddr_in *) res->ai_addr)->sin_addr;
+
+    inet_ntop(res->ai_family, ptr, pHostIP, nLen);
+    writeError(ERR_DEBUG_SERVER, "Set IPv%d address: %s (%s)", res->ai_family == PF_INET6 ? 6 : 4, pHostIP, res->ai_canonname);
+
+    psEntry->iFamily = res->ai_family;
+    snprintf(psEntry->szIP, sizeof(psEntry->szIP), "%s", pHostIP);
+    freeaddrinfo(res);
+
+    if (psResolveShared)
+    {
+      memset(&sShared, 0, sizeof(sShared));
+      sShared.iFamily = psEntry->iFamily;
+      snprintf(sShared.szIP, sizeof(sShared.szIP), "%s", psEntry->szIP);
+      shcachePut(psResolveShared, pHost, &sShared, sizeof(sShared), RESOLVE_SHARED_TTL);
+    }
+  }
+
+  /* another server thread may have resolved the host meanwhile */
+  pthread_mutex_lock(&ptmResolveMutex);
+  HASH_FIND_STR(psResolved, pHost, psFound);
+  if (psFound == NULL)
+  {
+    HASH_ADD_KEYPTR(hh, psResolved, psEntry->pHost, strlen(psEntry->pHost), psEntry);
+    psEntry = NULL;
+
+    /* entries are kept in insertion order - drop the oldest */
+    if (HASH_COUNT(psResolved) > RESOLVE_CACHE_MAX)
+    {
+      psEntry = psResolved;
+      HASH_DEL(psResolved, psEntry);
+    }
+  }
+  pthread_mutex_unlock(&ptmResolveMutex);
+
+  if (psEntry)
+  {
+    free(psEntry->pHost);
+    free(psEntry);
+  }
+
+  return SUCCESS;
+}
+
+void resolveCacheFree()
+{
+  sResolved *psEntry;
+
+  pthread_mutex_lock(&ptmResolveMutex);
+  while (psResolved)
+  {
+    psEntry = psResolved;
+    HASH_DEL(psResolved, psEntry);
+    free(psEntry->pHost);
+    free(psEntry);
+  }
+  pthread_mutex_unlock(&ptmResolveMutex);
+}
+
+/*
+  Share the addresses resolved with the processes forked afterwards (daemon
+  jobs). nSlots addresses are kept.
+*/
+int resolveCacheShare(int nSlots)
+{
+  if (psResolveShared == NULL)
+    psResolveShared = shcacheCreate(nSlots, sizeof(sSharedAddress));
+
+  return (psResolveShared ? SUCCESS : FAILURE);
+}
@@ -0,0 +1,82 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_HOSTS_H
+#define _MEDUSA_HOSTS_H
+
+#include <stdint.h>
+
+/*
+  Target host specifications. Each -h value or -H line may be a hostname,
+  an IPv4 CIDR block (10.0.0.0/12), a last-octet range (10.1.2.3-200) or a
+  full address range (10.0.0.1-10.0.3.254), optionally followed by a port
+  (host:port or [IPv6]:port). Ranges are kept as a start address and count
+  and only turned into host names as they are enumerated.
+*/
+#define HOST_SPEC_MAX_LEN 256
+
+typedef struct __sHostSpec {
+  char *pHost;            // hostname or IPv6 address, NULL for an IPv4 range
+  uint32_t nStart;        // first IPv4 address of range (host byte order)
+  uint32_t nCount;        // number of hosts described by the specification
+  int iPort;              // port suffix, 0 if none
+  int iId;                // host ID (position in the original target list) of first host
+  int iService;           // index of the service (module and options) to audit
+} sHostSpec;
+
+/* A single host returned by hostListNext() */
+typedef struct __sHostEntry {
+  char szHost[HOST_SPEC_MAX_LEN];
+  int iPort;
+  int iId;
+  int iService;
+} sHostEntry;
+
+typedef struct __sHostList {
+  sHostSpec *psSpecs;
+  int nSpecs;
+  int nAlloc;
+  int iHostCnt;           // total number of hosts across all specifications
+  int iSpec;              // enumeration cursor: current specification
+  uint32_t nOffset;       // enumeration cursor: host within specification
+} sHostList;
+
+int hostListAdd(sHostList *psList, char *pSpec, int iService);
+int hostListAppend(sHostList *psList, sHostEntry *psEntry);
+int hostListNext(sHostList *psList, sHostEntry *psEntry);
+int hostListNextId(sHostList *psList);
+int hostListRemaining(sHostList *psList);
+void hostListReset(sHostList *psList);
+void hostListSort(sHostList *psList);
+void hostListFree(sHostList *psList);
+
+/* Lifetime of host addresses shared between the jobs of the daemon */
+#define RESOLVE_SHARED_TTL 300
+
+/* Host names kept resolved within the process; the oldest is evicted first */
+#define RESOLVE_CACHE_MAX 4096
+
+int resolveHost(char *pHost, char *pHostIP, size_t nLen);
+void resolveCacheFree();
+int resolveCacheShare(int nSlots);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Persistent ledger of tested logins
+ *
+*/
+
+#include <sys/stat.h>
+#include "medusa.h"
+
+/*
+  Open (or create) the ledger file. Failed logins recorded within the last
+  iMaxAge days (0: any age) are loaded. A partial record at the end of the
+  file (e.g. an interrupted run) is ignored and overwritten.
+*/
+sLedger* ledgerOpen(char *pFile, int iMaxAge)
+{
+  sLedger *psLedger;
+  sLedgerRecord sRecord;
+  char szMagic[LEDGER_MAGIC_LEN];
+  struct stat sStat;
+  uint32_t nOldest = 0;
+  long lEnd;
+  int iTotal = 0;
+
+  psLedger = malloc(sizeof(sLedger));
+  memset(psLedger, 0, sizeof(sLedger));
+  psLedger->pFile = strdup(pFile);
+
+  if (pthread_mutex_init(&psLedger->ptmMutex, NULL) != 0)
+    writeError(ERR_FATAL, "Ledger mutex initialization failed - %s\n", strerror( errno ) );
+
+  if ((psLedger->pfFile = fopen(pFile, "a+b")) == NULL)
+    writeError(ERR_FATAL, "Failed to open ledger file %s - %s", pFile, strerror( errno ) );
+
+  fstat(fileno(psLedger->pfFile), &sStat);
+  fpset_init(&psLedger->sFailed, sStat.st_size / sizeof(sLedgerRecord));
+
+  if (iMaxAge > 0)
+    nOldest = (uint32_t)(time(NULL) - (time_t)iMaxAge * 86400);
+
+  rewind(psLedger->pfFile);
+
+  if (sStat.st_size == 0)
+  {
+    fwrite(LEDGER_MAGIC, LEDGER_MAGIC_LEN, 1, psLedger->pfFile);
+  }
+  else if ((fread(szMagic, LEDGER_MAGIC_LEN, 1, psLedger->pfFile) != 1) || (memcmp(szMagic, LEDGER_MAGIC, LEDGER_MAGIC_LEN) != 0))
+  {
+    writeError(ERR_FATAL, "File %s is not a Medusa ledger.", pFile);
+  }
+  else
+  {
+    lEnd = LEDGER_MAGIC_LEN;
+
+    while (fread(&sRecord, sizeof(sLedgerRecord), 1, psLedger->pfFile) == 1)
+    {
+      iTotal++;
+      lEnd += sizeof(sLedgerRecord);
+
+      if ((sRecord.nResult == LOGIN_RESULT_FAIL) && (sRecord.nTime >= nOldest) && (fpset_add_fp(&psLedger->sFailed, sRecord.nKey)))
+        psLedger->iLoaded++;
+    }
+
+    if (lEnd != sStat.st_size)
+    {
+      writeError(ERR_NOTICE, "Ledger file %s ends with a partial record - truncating.", pFile);
+      if (ftruncate(fileno(psLedger->pfFile), lEnd) != 0)
+        writeError(ERR_FATAL, "Failed to truncate ledger file %s - %s", pFile, strerror( errno ) );
+    }
+  }
+
+  writeVerbose(VB_GENERAL, "Ledger: %s (%d records, %d failed logins will be skipped)", pFile, iTotal, psLedger->iLoaded);
+
+  return psLedger;
+}
+
+/* Fingerprint of a target service. Combined with each user and password by ledgerKey(). */
+uint64_t ledgerHostKey(char *pHost, int iPort, char *pModuleName, int iUseSSL, char **arrParams, int nParams)
+{
+  uint64_t arrKey[2];
+  char szPort[32];
+  int i;
+
+  snprintf(szPort, sizeof(szPort), "%d/%d", iPort, iUseSSL);
+  arrKey[0] = fpset_hash(pHost, strlen(pHost)) ^ fpset_hash(szPort, strlen(szPort));
+  arrKey[1] = fpset_hash(pModuleName, strlen(pModuleName));
+
+  for (i = 0; i < nParams; i++)
+  {
+    arrKey[0] = fpset_hash((char *)arrKey, sizeof(arrKey));
+    arrKey[1] = fpset_hash(arrParams[i], strlen(arrParams[i]));
+  }
+
+  return fpset_hash((char *)arrKey, sizeof(arrKey));
+}
+
+uint64_t ledgerKey(uint64_t nHostKey, char *pUser, char *pPass)
+{
+  uint64_t arrKey[3];
+
+  arrKey[0] = nHostKey;
+  arrKey[1] = fpset_hash(pUser, strlen(pUser));
+  arrKey[2] = fpset_hash(pPass, strlen(pPass));
+
+  return fpset_hash((char *)arrKey, sizeof(arrKey));
+}
+
+/* Returns TRUE if the login failed in a previous run. The set is not modified during the audit. */
+int ledgerFailed(sLedger *psLedger, uint64_t nKey)
+{
+  return fpset_has_fp(&psLedger->sFailed, nKey);
+}
+
+/*
+  Records are flushed one by one: a run which crashes or is killed loses at
+  most the record being written, which ledgerOpen() truncates.
+*/
+void ledgerRecord(sLedger *psLedger, uint64_t nKey, int iResult)
+{
+  sLedgerRecord sRecord;
+
+  memset(&sRecord, 0, sizeof(sLedgerRecord));
+  sRecord.nKey = nKey;
+  sRecord.nTime = (uint32_t)time(NULL);
+  sRecord.nResult = (uint32_t)iResult;
+
+  pthread_mutex_lock(&psLedger->ptmMutex);
+
+  if ((fwrite(&sRecord, sizeof(sLedgerRecord), 1, psLedger->pfFile) == 1) && (fflush(psLedger->pfFile) == 0))
+    psLedger->iRecorded++;
+  else
+    writeError(ERR_ERROR, "Failed to write ledger file %s - %s", psLedger->pFile, strerror( errno ) );
+
+  pthread_mutex_unlock(&psLedger->ptmMutex);
+}
+
+void ledgerClose(sLedger *psLedger)
+{
+  if (psLedger == NULL)
+    return;
+
+  if (fclose(psLedger->pfFile) != 0)
+    writeError(ERR_ERROR, "Failed to write ledger file %s - %s", psLedger->pFile, strerror( errno ) );
+
+  writeVerbose(VB_GENERAL, "Ledger: recorded %d logins to %s", psLedger->iRecorded, psLedger->pFile);
+
+  pthread_mutex_destroy(&psLedger->ptmMutex);
+  fpset_free(&psLedger->sFailed);
+  FREE(psLedger->pFile);
+  free(psLedger);
+}
@@ -0,0 +1,64 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_LEDGER_H
+#define _MEDUSA_LEDGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "medusa-utils.h"
+
+/*
+  Attempt ledger (-l). Every tested login is appended to the ledger file as
+  a fixed-size record: a 64-bit fingerprint of (host, port, module, module
+  options, user, password), the time of the attempt and its result. Records
+  of failed logins are loaded into a fingerprint set when the audit starts,
+  and those logins are not tested again. Only fingerprints are stored, never
+  the credentials themselves.
+*/
+#define LEDGER_MAGIC "MEDUSA-LEDGER-1\n"
+#define LEDGER_MAGIC_LEN 16
+
+typedef struct __sLedgerRecord {
+  uint64_t nKey;
+  uint32_t nTime;         // seconds since the epoch
+  uint32_t nResult;       // LOGIN_RESULT_*
+} sLedgerRecord;
+
+typedef struct __sLedger {
+  FILE *pfFile;
+  char *pFile;
+  fpset sFailed;          // logins which failed within the age limit
+  int iLoaded;
+  int iRecorded;
+  pthread_mutex_t ptmMutex;
+} sLedger;
+
+sLedger* ledgerOpen(char *pFile, int iMaxAge);
+uint64_t ledgerHostKey(char *pHost, int iPort, char *pModuleName, int iUseSSL, char **arrParams, int nParams);
+uint64_t ledgerKey(uint64_t nHostKey, char *pUser, char *pPass);
+int ledgerFailed(sLedger *psLedger, uint64_t nKey);
+void ledgerRecord(sLedger *psLedger, uint64_t nKey, int iResult);
+void ledgerClose(sLedger *psLedger);
+
+#endif
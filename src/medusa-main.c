@@ -0,0 +1,218 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption 
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Based on ideas from Hydra 3.1 by VanHauser [vh@thc.org]
+ * Do only use for legal purposes. Illegal purposes cost $1 each.
+ *
+*/
+
+#include <signal.h>
+#include "medusa.h"
+
+/*
+  The medusa binary is a client of libmedusa (see medusa-api.h): the audit
+  is described by the command-line options and run in the main thread.
+*/
+sMedusaAudit *psMedusa = NULL;
+
+/*
+  Display appropriate usage information for application.
+*/
+void usage()
+{
+  writeVerbose(VB_NONE, "");
+  writeVerbose(VB_NONE, "Syntax: %s [-h host|-H file] [-u username|-U file] [-p password|-P file] [-C file] -M module [OPT]", PROGRAM);
+  writeVerbose(VB_NONE, "        %s -X file [-u username|-U file] [-p password|-P file] [OPT]", PROGRAM);
+  writeVerbose(VB_NONE, "  -h [TEXT]    : Target hostname, IP address, CIDR block (10.0.0.0/24) or range");
+  writeVerbose(VB_NONE, "                 (10.0.0.1-254, 10.0.0.1-10.0.3.254), optionally followed by :PORT");
+  writeVerbose(VB_NONE, "  -H [FILE]    : File containing target specifications (as for -h)");
+  writeVerbose(VB_NONE, "  -u [TEXT]    : Username to test");
+  writeVerbose(VB_NONE, "  -U [FILE]    : File containing usernames to test");
+  writeVerbose(VB_NONE, "  -p [TEXT]    : Password to test");
+  writeVerbose(VB_NONE, "  -P [FILE]    : File containing passwords to test");
+  writeVerbose(VB_NONE, "  -C [FILE]    : File containing combo entries. See README for more information.");
+  writeVerbose(VB_NONE, "                 Any FILE may be \"-\" (standard input), a FIFO or a gzip, xz or zstd");
+  writeVerbose(VB_NONE, "                 compressed file. Such password lists are streamed during the audit.");
+  writeVerbose(VB_NONE, "  -X [FILE]    : File of tasks (TARGET:MODULE [-s] [-m PARAM ...]) or nmap grepable (-oG)");
+  writeVerbose(VB_NONE, "                 output. Audits several services in one run (replaces -h/-H/-M/-m).");
+  writeVerbose(VB_NONE, "  -O [FILE]    : File to append log information to");
+  writeVerbose(VB_NONE, "  -l [FILE]    : Ledger of tested logins. Logins which failed in a previous run using the same");
+  writeVerbose(VB_NONE, "                 ledger are skipped; all logins tested are appended to it.");
+  writeVerbose(VB_NONE, "  -a [NUM]     : Test logins again if they failed more than NUM days ago (with -l)");
+  writeVerbose(VB_NONE, "  -e [n/s/ns]  : Additional password checks ([n] No Password, [s] Password = Username)");
+  writeVerbose(VB_NONE, "  -M [TEXT]    : Name of the module to execute (without the .mod extension)");
+  writeVerbose(VB_NONE, "  -m [TEXT]    : Parameter to pass to the module. This can be passed multiple times with a"); 
+  writeVerbose(VB_NONE, "                 different parameter each time and they will all be sent to the module (i.e.");
+  writeVerbose(VB_NONE, "                 -m Param1 -m Param2, etc.)"); 
+  writeVerbose(VB_NONE, "  -d           : Dump all known modules");
+  writeVerbose(VB_NONE, "  -n [NUM]     : Use for non-default TCP port number");
+  writeVerbose(VB_NONE, "  -s           : Enable SSL");
+  writeVerbose(VB_NONE, "  -g [NUM]     : Give up after trying to connect for NUM seconds (default 3)"); 
+  writeVerbose(VB_NONE, "  -r [NUM]     : Sleep NUM seconds between retry attempts (default 3)");   
+  writeVerbose(VB_NONE, "  -R [NUM]     : Attempt NUM retries before giving up. The total number of attempts will be NUM + 1.");
+  writeVerbose(VB_NONE, "  -c [NUM]     : Time to wait in usec to verify socket is available (default 500 usec).");
+  writeVerbose(VB_NONE, "  -I           : Use io_uring for the connects and receives of the modules (Linux 5.6 and");
+  writeVerbose(VB_NONE, "                 later). The select() based functions are used when it is unavailable.");
+  writeVerbose(VB_NONE, "  -E [NUM]     : Run the logins as coroutines on NUM scheduler threads (0 for one per CPU)");
+  writeVerbose(VB_NONE, "                 instead of a thread each. Modules using external libraries keep their threads.");
+  writeVerbose(VB_NONE, "  -t [NUM]     : Total number of logins to be tested concurrently");
+  writeVerbose(VB_NONE, "  -T [NUM]     : Total number of hosts to be tested concurrently");
+  writeVerbose(VB_NONE, "  -S [NUM]     : Probe the target port of all hosts before testing, NUM connects at a time");
+  writeVerbose(VB_NONE, "                 (e.g. 1024). Hosts which do not accept the connection are skipped.");
+  writeVerbose(VB_NONE, "  -L           : Parallelize logins using one username per thread. The default is to process ");
+  writeVerbose(VB_NONE, "                 the entire username before proceeding.");
+  writeVerbose(VB_NONE, "  -D [NUM]     : Test the password list in rounds of NUM passwords. Each round is tested against");
+  writeVerbose(VB_NONE, "                 all hosts and users before the next one is started.");
+  writeVerbose(VB_NONE, "  -W           : Password file lines are \"COUNT PASSWORD\" (e.g. from uniq -c). Passwords");
+  writeVerbose(VB_NONE, "                 are tested most frequent first.");
+  writeVerbose(VB_NONE, "  -B [TIME]    : Stop the audit TIME seconds (or NUMm minutes, NUMh hours) after it started.");
+  writeVerbose(VB_NONE, "                 Each user is tested to the password depth the measured login rate allows.");
+  writeVerbose(VB_NONE, "                 Logins left untested are reported as a resume map (-Z).");
+  writeVerbose(VB_NONE, "  -A [NUM:TIME]: Test each account at most NUM times within any TIME seconds (or NUMm, NUMh),");
+  writeVerbose(VB_NONE, "                 e.g. below the lockout threshold. Users of a host are tested in turn.");
+  writeVerbose(VB_NONE, "  -K           : Test passwords found valid on one host first for the same user on all other");
+  writeVerbose(VB_NONE, "                 hosts. Domain accounts (smbnt GROUP:DOMAIN) are not tested again.");
+  writeVerbose(VB_NONE, "  -f           : Stop scanning host after first valid username/password found.");
+  writeVerbose(VB_NONE, "  -F           : Stop audit after first valid username/password found on any host.");
+  writeVerbose(VB_NONE, "  -b           : Suppress startup banner");
+  writeVerbose(VB_NONE, "  -q           : Display module's usage information");
+  writeVerbose(VB_NONE, "  -v [NUM]     : Verbose level [0 - 6 (more)]");
+  writeVerbose(VB_NONE, "  -w [NUM]     : Error debug level [0 - 10 (more)]");
+  writeVerbose(VB_NONE, "  -V           : Display version");
+  writeVerbose(VB_NONE, "  -Z [TEXT]    : Resume scan based on map of previous scan");
+  writeVerbose(VB_NONE, "  -Y [FILE]    : Run as a daemon serving audits submitted on the local socket FILE. Only -t");
+  writeVerbose(VB_NONE, "                 (login threads shared by the audits, default 64), -v, -w and -b apply.");
+  writeVerbose(VB_NONE, "  -y [FILE]    : Run the audit in the daemon listening on the local socket FILE");
+  writeVerbose(VB_NONE, "  -J [ADDR:]PORT: Coordinate a distributed audit: lease its logins to the workers connecting");
+  writeVerbose(VB_NONE, "                 to PORT (127.0.0.1 unless ADDR is given). Use a ledger (-l) to resume it once stopped.");
+  writeVerbose(VB_NONE, "                 The coordinator and its workers share a secret in MEDUSA_DIST_SECRET.");
+  writeVerbose(VB_NONE, "  -j [HOST:PORT]: Run as a worker testing the logins leased by the coordinator at HOST:PORT.");
+  writeVerbose(VB_NONE, "                 Only -t (login threads, default the coordinator's), -I, -E, -v, -w and -b apply.");
+  writeVerbose(VB_NONE, "\n");
+  return;
+}
+
+/*
+  Function called on SIGINT. We notify the login threads that the audit is
+  ending. Once they have stopped, a resume map of the audit is written (see
+  writeResumeMap()).
+*/
+void sigint_handler(int sig __attribute__((unused)))
+{
+  struct sigaction sig_action;
+ 
+  /* SIGINT is blocked by default within the handler. We explicitly unblock it here.
+     This allows us to hit CTRL-C a second time and really quit the application 
+     without waiting for the threads to complete their work.
+  */
+  sig_action.sa_flags = 0;
+  sigemptyset(&sig_action.sa_mask);
+  sigaddset(&sig_action.sa_mask, SIGINT);
+  sig_action.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &sig_action, 0);
+  sigprocmask(SIG_UNBLOCK, &sig_action.sa_mask, 0);
+
+  /* notify threads that they should be exiting - medusaAuditRun() waits for them to finish */
+  writeError(ERR_ALERT, "Medusa received SIGINT - Sending notification to login threads that we are aborting.");
+  medusaAuditStop(psMedusa);
+
+  writeError(ERR_INFO, "Waiting for login threads to terminate...");
+}
+
+/*
+  Run the audit in the daemon listening on pSocket (-y). The option is
+  removed from the command line of the job.
+*/
+int submitJob(int argc, char **argv, int iArg, char *pSocket)
+{
+  char **argvJob;
+  int i, argcJob = 0, iResult;
+
+  if ((pSocket == NULL) || (strncmp(argv[iArg], "-y", 2) != 0))
+  {
+    writeError(ERR_ALERT, "Option 'y' must be given on its own (-y SOCKET).");
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  argvJob = malloc((argc + 1) * sizeof(char*));
+  for (i = 0; i < argc; i++)
+  {
+    if ((i == iArg) || ((i == iArg + 1) && (argv[iArg][2] == '\0')))
+      continue;
+
+    argvJob[argcJob++] = argv[i];
+  }
+  argvJob[argcJob] = NULL;
+
+  iResult = medusaDaemonSubmit(pSocket, argcJob, argvJob);
+  free(argvJob);
+
+  if (iResult == MEDUSA_DAEMON_USAGE)
+  {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  return ((iResult == MEDUSA_FAILURE) ? EXIT_FAILURE : iResult);
+}
+
+int main(int argc, char **argv, char *envp[] __attribute__((unused)))
+{
+  struct sigaction sig_action;
+  char *pSocket;
+  int iArg, iResult;
+
+  /* daemon mode (-Y) and audits submitted to a daemon (-y) */
+  if (findOption(argc, argv, MEDUSA_OPTIONS "Y:y:j:", 'Y', &pSocket) >= 0)
+    exit((medusaDaemonRun(argc, argv) == MEDUSA_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  if ((iArg = findOption(argc, argv, MEDUSA_OPTIONS "Y:y:j:", 'y', &pSocket)) >= 0)
+    exit(submitJob(argc, argv, iArg, pSocket));
+
+  /* worker of a distributed audit (-j) */
+  if (findOption(argc, argv, MEDUSA_OPTIONS "Y:y:j:", 'j', &pSocket) >= 0)
+    exit((medusaWorkerRun(argc, argv) == MEDUSA_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  if ((psMedusa = medusaAuditCreate()) == NULL)
+    exit(EXIT_FAILURE);
+
+  /* set signal handling for SIGINT */
+  sig_action.sa_flags = 0;
+  sigemptyset(&sig_action.sa_mask);
+  sigaddset(&sig_action.sa_mask, SIGINT);
+  sig_action.sa_handler = sigint_handler;
+  sigaction(SIGINT, &sig_action, 0);
+
+  /* parse user-supplied parameters - populate module parameters */
+  if ((medusaAuditParseArgs(psMedusa, argc, argv) != MEDUSA_SUCCESS) || (medusaAuditValidate(psMedusa) != MEDUSA_SUCCESS))
+  {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  iResult = medusaAuditRun(psMedusa);
+
+  /* SIGINT after this point ends the process at once */
+  signal(SIGINT, SIG_DFL);
+  medusaAuditFree(psMedusa);
+
+  exit((iResult == MEDUSA_FAILURE) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -35,8 +35,11 @@
 #include "medusa.h"
 #include "medusa-trace.h"
 #include "medusa-net.h"
+#include "medusa-uring.h"
+#include "medusa-coro.h"
 #include "uthash.h"
 #include <pthread.h>
+#include <poll.h>
 #include <regex.h>
 
 #ifdef HAVE_LIBSSL
@@ -72,6 +75,17 @@ struct SSLSOCKETINFO {
 struct SSLSOCKETINFO *psSSLSocketInfo = NULL; 
 pthread_mutex_t ptmSSLMutex;
 
+/*
+  Within the daemon, a single client context is used by the connections of
+  all jobs. The sessions it negotiates are stored in a cache shared by the
+  jobs (see sslShareSessions()), so later connections to the same service
+  resume them instead of performing a full handshake.
+*/
+#define SSL_SESSION_MAX 4096
+
+SSL_CTX *sslSharedContext = NULL;
+sShCache *psSSLSessions = NULL;
+
 #endif
 
 // Modules can call this function to set up the sConnectParams structure needed for connection functions.
@@ -99,18 +113,173 @@ void initConnectionParams(sLogin* pLogin, sConnectParams* pParams)
     pParams->nType = 6;
 }
 
-int medusaConnectInternal(unsigned long nHost, int nPort, int nProtocol, int nType, int nWaitTime, int nRetries, int nRetryWait,unsigned long nProxyStringIP, int nProxyStringPort, char* szProxyAuthentication, int nSourcePort)
+/*
+  Wait for the connection of socket s with select(), which requires a
+  non-blocking socket. Returns 0 once connected, -1 (socket closed) otherwise.
+  Coroutine logins (-E) wait on their scheduler instead.
+*/
+static int connectSelect(int s, struct sockaddr_in *psTarget, int nWaitTime, int nRetries, int nRetryWait)
 {
-  int s, ret = -1;
-  int nFail = 0;
-  struct sockaddr_in target, source;
-  char *buf, *tmpptr = NULL;
+  int ret, nFail = 0;
   char out[16];
   long flag;
   int nOpt;
   unsigned int nSize;
   fd_set myset; 
   struct timeval tv;
+
+  // Set non-blocking 
+  if((flag = fcntl(s, F_GETFL, NULL)) < 0) 
+  { 
+    writeError(ERR_ERROR, "Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
+    close(s);
+    return -1; 
+  } 
+  flag |= O_NONBLOCK; 
+  if(fcntl(s, F_SETFL, flag) < 0) 
+  { 
+    writeError(ERR_ERROR, "Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
+    close(s);
+    return -1; 
+  } 
+ 
+  nFail = 0;    
+  ret = connect(s, (struct sockaddr*)psTarget, sizeof(struct sockaddr_in));
+  if (errno == EINPROGRESS) 
+  { 
+    do 
+    { 
+        if (nFail > 0 && nFail <= nRetries)
+        {
+          writeError(ERR_ERROR, "Thread %X: Host: %s Cannot connect [unreachable], retrying (%d of %d retries)", (int)pthread_self(), inet_ntop(AF_INET, &psTarget->sin_addr, out, sizeof(out)), nFail, nRetries);
+          coroSleep(nRetryWait * 1000000L);
+        }
+        else if (nFail > nRetries)
+        {
+          close(s);
+          return -1;
+        }
+          
+        if (coroActive() == TRUE)
+          ret = coroWait(s, POLLOUT, nWaitTime * 1000000L);
+        else
+        {
+          tv.tv_sec = nWaitTime; 
+          tv.tv_usec = 0; 
+          FD_ZERO(&myset); 
+          FD_SET(s, &myset); 
+          ret = select(s + 1, NULL, &myset, NULL, &tv); 
+        }
+        if (ret < 0 && errno != EINTR) 
+        { 
+          writeError(ERR_ERROR, "Error connecting to host: %s", strerror(errno)); 
+          close(s);
+          return -1; 
+        } 
+        else if (ret > 0) 
+        { 
+          nSize = sizeof(int);
+          if (getsockopt(s, SOL_SOCKET, SO_ERROR, (void*)(&nOpt), &nSize) < 0) 
+          { 
+            writeError(ERR_ERROR, "Error in getsockopt() %s", strerror(errno)); 
+            close(s);
+            return -1;
+          } 
+          if (nOpt != 0) 
+          { 
+            // Socket is not valid - connection failed
+            writeVerbose(VB_GENERAL, "Unable to connect (invalid socket): unreachable destination - %s", inet_ntop(AF_INET, &psTarget->sin_addr, out, sizeof(out)));
+            close(s);
+            return -1; 
+          }
+          
+          // If we get here, the socket should be valid
+          ret = 0;
+          break; 
+        } 
+        else 
+        { 
+          nFail++; 
+        } 
+    } while (1); 
+  }       
+  if (ret != 0 || nFail > nRetries)
+  {
+    writeVerbose(VB_GENERAL, "Unable to connect: unreachable destination");
+
+    close(s);
+    return -1;
+  }
+
+  // Set the socket to be blocking again
+  if((flag = fcntl(s, F_GETFL, NULL)) < 0) 
+  { 
+    writeError(ERR_ERROR, "Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
+    close(s);
+    return -1; 
+  } 
+  flag &= ~O_NONBLOCK; 
+  if(fcntl(s, F_SETFL, flag) < 0) 
+  { 
+    writeError(ERR_ERROR, "Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
+    close(s);
+    return -1; 
+  }
+
+  return 0;
+}
+
+/*
+  io_uring backend (-I): the connect is submitted with its timeout and the
+  socket stays blocking. After a timeout, the connection still in progress
+  is waited for again, as connectSelect() does.
+*/
+static int connectUring(int s, struct sockaddr_in *psTarget, int nWaitTime, int nRetries, int nRetryWait)
+{
+  int ret, nFail = 0;
+  char out[16];
+  int nOpt;
+  unsigned int nSize;
+
+  ret = uringConnect(s, (struct sockaddr*)psTarget, sizeof(struct sockaddr_in), nWaitTime * 1000000L);
+  while ((ret == URING_TIMEOUT) && (nFail < nRetries))
+  {
+    nFail++;
+    writeError(ERR_ERROR, "Thread %X: Host: %s Cannot connect [unreachable], retrying (%d of %d retries)", (int)pthread_self(), inet_ntop(AF_INET, &psTarget->sin_addr, out, sizeof(out)), nFail, nRetries);
+    sleep(nRetryWait);
+
+    ret = uringPoll(s, POLLOUT, nWaitTime * 1000000L);
+    if (ret > 0)
+    {
+      nSize = sizeof(int);
+      if (getsockopt(s, SOL_SOCKET, SO_ERROR, (void*)(&nOpt), &nSize) < 0) 
+      { 
+        writeError(ERR_ERROR, "Error in getsockopt() %s", strerror(errno)); 
+        close(s);
+        return -1;
+      } 
+      ret = -nOpt;
+    }
+  }
+
+  if (ret < 0)
+  {
+    // Socket is not valid - connection failed
+    if (ret != URING_TIMEOUT)
+      writeVerbose(VB_GENERAL, "Unable to connect (invalid socket): unreachable destination - %s (%s)", inet_ntop(AF_INET, &psTarget->sin_addr, out, sizeof(out)), strerror(-ret));
+    close(s);
+    return -1;
+  }
+
+  return 0;
+}
+
+int medusaConnectInternal(unsigned long nHost, int nPort, int nProtocol, int nType, int nWaitTime, int nRetries, int nRetryWait,unsigned long nProxyStringIP, int nProxyStringPort, char* szProxyAuthentication, int nSourcePort)
+{
+  int s, ret = -1;
+  struct sockaddr_in target, source;
+  char *buf, *tmpptr = NULL;
+  char out[16];
   int nUseProxy = nProxyStringIP > 0 ? 1 : 0;
 
   s = socket(PF_INET, nProtocol, nType);
@@ -140,6 +309,7 @@ int medusaConnectInternal(unsigned long nHost, int nPort, int nProtocol, int nTy
             if (errno == EACCES && (getuid() > 0))
             {
               writeError(ERR_ERROR, "Source port for this service requires root privileges.");
+              close(s);
               return FAILURE;
             }
           }
@@ -162,88 +332,14 @@ int medusaConnectInternal(unsigned long nHost, int nPort, int nProtocol, int nTy
     }
     target.sin_family = AF_INET;
 
-    // Set non-blocking 
-    if((flag = fcntl(s, F_GETFL, NULL)) < 0) 
-    { 
-      writeError(ERR_ERROR, "Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
-      return -1; 
-    } 
-    flag |= O_NONBLOCK; 
-    if(fcntl(s, F_SETFL, flag) < 0) 
-    { 
-      writeError(ERR_ERROR, "Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
-      return -1; 
-    } 
- 
-    nFail = 0;    
-    ret = connect(s, (struct sockaddr*)&target, sizeof(struct sockaddr_in));
-    if (errno == EINPROGRESS) 
-    { 
-      do 
-      { 
-          if (nFail > 0 && nFail <= nRetries)
-          {
-            writeError(ERR_ERROR, "Thread %X: Host: %s Cannot connect [unreachable], retrying (%d of %d retries)", (int)pthread_self(), inet_ntop(AF_INET, &target.sin_addr, out, sizeof(out)), nFail, nRetries);
-            sleep(nRetryWait);
-          }
-          else if (nFail > nRetries)
-            return -1;
-            
-          tv.tv_sec = nWaitTime; 
-          tv.tv_usec = 0; 
-          FD_ZERO(&myset); 
-          FD_SET(s, &myset); 
-          ret = select(s + 1, NULL, &myset, NULL, &tv); 
-          if (ret < 0 && errno != EINTR) 
-          { 
-            writeError(ERR_ERROR, "Error connecting to host: %s", strerror(errno)); 
-            return -1; 
-          } 
-          else if (ret > 0) 
-          { 
-            nSize = sizeof(int);
-            if (getsockopt(s, SOL_SOCKET, SO_ERROR, (void*)(&nOpt), &nSize) < 0) 
-            { 
-              writeError(ERR_ERROR, "Error in getsockopt() %s", strerror(errno)); 
-              return -1;
-            } 
-            if (nOpt != 0) 
-            { 
-              // Socket is not valid - connection failed
-              writeVerbose(VB_GENERAL, "Unable to connect (invalid socket): unreachable destination - %s", inet_ntop(AF_INET, &target.sin_addr, out, sizeof(out)));
-              return -1; 
-            }
-            
-            // If we get here, the socket should be valid
-            ret = 0;
-            break; 
-          } 
-          else 
-          { 
-            nFail++; 
-          } 
-      } while (1); 
-    }       
-    if (ret != 0 || nFail > nRetries)
-    {
-      writeVerbose(VB_GENERAL, "Unable to connect: unreachable destination");
+    if ((coroActive() == FALSE) && (uringActive() == TRUE))
+      ret = connectUring(s, &target, nWaitTime, nRetries, nRetryWait);
+    else
+      ret = connectSelect(s, &target, nWaitTime, nRetries, nRetryWait);
 
-      ret = -1;
-      return ret;
-    }
+    if (ret < 0)
+      return -1;
 
-    // Set the socket to be blocking again
-    if((flag = fcntl(s, F_GETFL, NULL)) < 0) 
-    { 
-      writeError(ERR_ERROR, "Error fcntl(..., F_GETFL) (%s)", strerror(errno)); 
-      return -1; 
-    } 
-    flag &= ~O_NONBLOCK; 
-    if(fcntl(s, F_SETFL, flag) < 0) 
-    { 
-      writeError(ERR_ERROR, "Error fcntl(..., F_SETFL) (%s)", strerror(errno)); 
-      return -1; 
-    } 
     ret = s;
 
     /*
@@ -311,7 +407,6 @@ int medusaConnectInternal(unsigned long nHost, int nPort, int nProtocol, int nTy
       }
       free(buf);
     }
-    nFail = 0;
 
     return ret;
   }
@@ -333,14 +428,10 @@ RSA *sslTempRSACallback(SSL * ssl __attribute__((unused)), int export __attribut
   return rsa;
 }
 
-int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
+static SSL_CTX* sslCreateContext()
 {
   int err;
-  struct SSLSOCKETINFO *s;
-  SSL *ssl = NULL;
   SSL_CTX *sslContext = NULL;
-  
-  pthread_mutex_lock(&ptmSSLMutex);
 
   SSL_load_error_strings();
   SSLeay_add_ssl_algorithms();
@@ -351,8 +442,7 @@ int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
   {
     err = ERR_get_error();
     writeError(ERR_ERROR, "SSL: Error allocating context: %s", ERR_error_string(err, NULL));
-    pthread_mutex_unlock(&ptmSSLMutex);
-    return -1;
+    return NULL;
   }
 
   // set the compatbility mode
@@ -362,9 +452,133 @@ int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
   SSL_CTX_set_default_verify_paths(sslContext);
   SSL_CTX_set_verify(sslContext, SSL_VERIFY_NONE, NULL);
 
+  return sslContext;
+}
+
+/* Sessions are stored by the address and port of the service */
+static int sslSessionKey(int hSocket, char *szKey, size_t nLen)
+{
+  struct sockaddr_storage sAddr;
+  socklen_t nAddrLen = sizeof(sAddr);
+  char szIP[INET6_ADDRSTRLEN];
+
+  if (getpeername(hSocket, (struct sockaddr *)&sAddr, &nAddrLen) != 0)
+    return FAILURE;
+
+  if (sAddr.ss_family == AF_INET6)
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&sAddr)->sin6_addr, szIP, sizeof(szIP));
+    snprintf(szKey, nLen, "ssl:[%s]:%d", szIP, ntohs(((struct sockaddr_in6 *)&sAddr)->sin6_port));
+  }
+  else if (sAddr.ss_family == AF_INET)
+  {
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&sAddr)->sin_addr, szIP, sizeof(szIP));
+    snprintf(szKey, nLen, "ssl:%s:%d", szIP, ntohs(((struct sockaddr_in *)&sAddr)->sin_port));
+  }
+  else
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+/* Called by OpenSSL for each session negotiated with the shared context */
+static int sslNewSession(SSL *ssl, SSL_SESSION *session)
+{
+  unsigned char buf[SSL_SESSION_MAX];
+  unsigned char *p = buf;
+  char szKey[SHCACHE_KEY_MAX];
+  int nLen;
+
+  nLen = i2d_SSL_SESSION(session, NULL);
+  if ((nLen <= 0) || (nLen > SSL_SESSION_MAX))
+    return 0;
+
+  if (sslSessionKey(SSL_get_fd(ssl), szKey, sizeof(szKey)) == SUCCESS)
+  {
+    i2d_SSL_SESSION(session, &p);
+    shcachePut(psSSLSessions, szKey, buf, nLen, SSL_SESSION_get_timeout(session));
+  }
+
+  /* no reference to the session was kept */
+  return 0;
+}
+
+/* Resume the session stored for the service, if any */
+static void sslResumeSession(SSL *ssl, int hSocket)
+{
+  unsigned char buf[SSL_SESSION_MAX];
+  const unsigned char *p = buf;
+  char szKey[SHCACHE_KEY_MAX];
+  size_t nLen = sizeof(buf);
+  SSL_SESSION *session;
+
+  if (sslSessionKey(hSocket, szKey, sizeof(szKey)) != SUCCESS)
+    return;
+
+  if (shcacheGet(psSSLSessions, szKey, buf, &nLen) != SUCCESS)
+    return;
+
+  if ((session = d2i_SSL_SESSION(NULL, &p, nLen)))
+  {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
+}
+#endif
+
+/*
+  Use a single SSL context with a session cache shared by the processes
+  forked afterwards (daemon jobs). nSlots sessions are kept.
+*/
+int sslShareSessions(int nSlots)
+{
+#ifdef HAVE_LIBSSL
+  if (sslSharedContext)
+    return SUCCESS;
+
+  if ((psSSLSessions = shcacheCreate(nSlots, SSL_SESSION_MAX)) == NULL)
+    return FAILURE;
+
+  if ((sslSharedContext = sslCreateContext()) == NULL)
+  {
+    shcacheFree(psSSLSessions);
+    psSSLSessions = NULL;
+    return FAILURE;
+  }
+
+  SSL_CTX_set_session_cache_mode(sslSharedContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(sslSharedContext, sslNewSession);
+#else
+  (void)nSlots;
+#endif
+  return SUCCESS;
+}
+
+#ifdef HAVE_LIBSSL
+int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
+{
+  int err;
+  struct SSLSOCKETINFO *s;
+  SSL *ssl = NULL;
+  SSL_CTX *sslContext = NULL;
+  
+  /* the global SSL lock is held throughout - a coroutine must not yield */
+  coroBlock(TRUE);
+  pthread_mutex_lock(&ptmSSLMutex);
+
+  if (sslSharedContext)
+    sslContext = sslSharedContext;
+  else if ((sslContext = sslCreateContext()) == NULL)
+  {
+    pthread_mutex_unlock(&ptmSSLMutex);
+    coroBlock(FALSE);
+    return -1;
+  }
+
   if ((hSocket < 0) && ((hSocket = medusaConnect(pParams)) < 0))
   {
     pthread_mutex_unlock(&ptmSSLMutex);
+    coroBlock(FALSE);
     return -1;
   }
 
@@ -373,19 +587,24 @@ int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
     err = ERR_get_error();
     writeError(ERR_ERROR, "Error preparing an SSL context: %s", ERR_error_string(err, NULL));
     pthread_mutex_unlock(&ptmSSLMutex);
+    coroBlock(FALSE);
     return -1;
   }
 
   SSL_set_fd(ssl, hSocket);
+  if (psSSLSessions)
+    sslResumeSession(ssl, hSocket);
+
   if (SSL_connect(ssl) <= 0)
   {
     err = ERR_get_error();
     writeError(ERR_ERROR, "Could not create an SSL session: %s", ERR_error_string(err, NULL));
     pthread_mutex_unlock(&ptmSSLMutex);
+    coroBlock(FALSE);
     return -1;
   }
 
-  writeError(ERR_DEBUG, "SSL negotiated cipher: %s", SSL_get_cipher(ssl));
+  writeError(ERR_DEBUG, "SSL negotiated cipher: %s%s", SSL_get_cipher(ssl), SSL_session_reused(ssl) ? " (session resumed)" : "");
 
   s = malloc(sizeof(struct SSLSOCKETINFO));
   memset(s, 0, sizeof(struct SSLSOCKETINFO));
@@ -397,6 +616,7 @@ int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
   HASH_ADD_INT( psSSLSocketInfo, id, s ); 
   
   pthread_mutex_unlock(&ptmSSLMutex);
+  coroBlock(FALSE);
 
   return hSocket;
 }
@@ -404,9 +624,9 @@ int medusaConnectSSLInternal(sConnectParams* pParams, int hSocket)
 
 int medusaReceiveInternal(int socket, unsigned char *buf, int length)
 {
+  int nRet;
 #ifdef HAVE_LIBSSL
   int err;
-  int nRet;
   struct SSLSOCKETINFO *s;
 
   HASH_FIND_INT( psSSLSocketInfo, &socket, s );
@@ -441,10 +661,72 @@ int medusaReceiveInternal(int socket, unsigned char *buf, int length)
   }
   else
 #endif
+  if (coroActive() == TRUE)
+  {
+    /* coroutine logins yield until data arrives */
+    while (1)
+    {
+      nRet = recv(socket, buf, length, MSG_DONTWAIT);
+      if ((nRet >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        return nRet;
+
+      if (coroWait(socket, POLLIN, -1) < 0)
+        return -1;
+    }
+  }
+  else
     return recv(socket, buf, length, 0);
 }
 
 
+/*
+  Wait up to nWait microseconds for data and receive it. Returns as select()
+  does (> 0 data waiting, 0 none, < 0 error), with the result of the receive
+  in *pnReceived. With the io_uring backend, the wait and the receive of a
+  non-SSL socket are a single operation.
+*/
+static int medusaReceiveTimed(int socket, unsigned char *buf, int length, long nWait, int *pnReceived)
+{
+  int ret, iPlain = TRUE;
+#ifdef HAVE_LIBSSL
+  struct SSLSOCKETINFO *s;
+
+  HASH_FIND_INT( psSSLSocketInfo, &socket, s );
+  if ((s != NULL) && (s->nUseSSL))
+    iPlain = FALSE;
+#endif
+
+  if ((iPlain) && (coroActive() == FALSE) && (uringActive() == TRUE))
+  {
+    if (nWait == 0)
+    {
+      ret = recv(socket, buf, length, MSG_DONTWAIT);
+      if (ret < 0)
+        ret = -errno;
+    }
+    else
+      ret = uringRecv(socket, buf, length, 0, nWait);
+
+    if ((ret == URING_TIMEOUT) || (ret == -EAGAIN) || (ret == -EWOULDBLOCK))
+      return 0;
+
+    if (ret < 0)
+    {
+      errno = -ret;
+      ret = -1;
+    }
+    *pnReceived = ret;
+    writeError(ERR_DEBUG, "Data received (%d): %s", ret, buf);
+    return 1;
+  }
+
+  ret = medusaDataReadyTimed(socket, nWait / 1000000, nWait % 1000000);
+  if (ret > 0)
+    *pnReceived = medusaReceive(socket, buf, length);
+
+  return ret;
+}
+
 /*
   This is a more robust receive function that can optionally convert NULLS to spaces
   Callers should check the value of *nBufferSize on return - IT MAY HAVE BEEN CHANGED
@@ -479,24 +761,16 @@ unsigned char* medusaReceiveDataInternal(int socket, int* nBufferSize, int nConv
   unsigned char *szBufReceive, *szBufReceiveTmp;
   int nBufReceive = 0, nBufReceiveTmp = 0, BufReceiveIndex = 0;
   int bSocketStatus = 0;
-  int nReceiveDelay1sec = 0, nReceiveDelay1usec = 0;
-  int nReceiveDelay2sec = 0, nReceiveDelay2usec = 0;
   
   *nBufferSize = 0;
 
   szBufReceive = malloc(BUFFER_SIZE + 1);
   memset(szBufReceive, 0, BUFFER_SIZE + 1);
 
-  nReceiveDelay1sec = nReceiveDelay1 / 1000000;
-  nReceiveDelay1usec = nReceiveDelay1 % 1000000;
-  nReceiveDelay2sec = nReceiveDelay2 / 1000000;
-  nReceiveDelay2usec = nReceiveDelay2 % 1000000;
-
-  bSocketStatus = medusaDataReadyTimed(socket, nReceiveDelay1sec, nReceiveDelay1usec);
+  bSocketStatus = medusaReceiveTimed(socket, szBufReceive, BUFFER_SIZE, nReceiveDelay1, &nBufReceive);
   if (bSocketStatus > 0)
   {
     writeError(ERR_DEBUG, "Data receive: Data waiting.");
-    nBufReceive = medusaReceive(socket, szBufReceive, BUFFER_SIZE);
     if (nBufReceive <= 0)
     {
       writeError(ERR_DEBUG, "Data receive: Socket indicated data present, but none found.");
@@ -518,15 +792,16 @@ unsigned char* medusaReceiveDataInternal(int socket, int* nBufferSize, int nConv
   }
 
   /* check for any addition data which may have been sent */
-  while (medusaDataReadyTimed(socket, nReceiveDelay2sec, nReceiveDelay2usec) > 0)
+  szBufReceiveTmp = malloc(BUFFER_SIZE + 1);
+  while (1)
   {
-    szBufReceiveTmp = malloc(BUFFER_SIZE + 1);
     memset(szBufReceiveTmp, 0, BUFFER_SIZE + 1);
-    nBufReceiveTmp = medusaReceive(socket, szBufReceiveTmp, BUFFER_SIZE);
+    if (medusaReceiveTimed(socket, szBufReceiveTmp, BUFFER_SIZE, nReceiveDelay2, &nBufReceiveTmp) <= 0)
+      break;
+
     if (nBufReceiveTmp <= 0)
     {
       writeError(ERR_DEBUG, "Data receive: No additional data.");
-      free(szBufReceiveTmp);
       break;
     }
    
@@ -540,8 +815,8 @@ unsigned char* medusaReceiveDataInternal(int socket, int* nBufferSize, int nConv
     nBufReceive += nBufReceiveTmp;
 
     nBufReceiveTmp = 0;
-    free(szBufReceiveTmp);
   }
+  free(szBufReceiveTmp);
 
   szBufReceive[nBufReceive] = 0; /* explicit NULL termination */
 
@@ -557,6 +832,31 @@ unsigned char* medusaReceiveDataInternal(int socket, int* nBufferSize, int nConv
   return szBufReceive;
 }
 
+/* send() of coroutine logins, which yield while the socket buffer is full */
+static int sendCoro(int socket, unsigned char *buf, int size, int options)
+{
+  int nRet, nSent = 0;
+
+  while (nSent < size)
+  {
+    nRet = send(socket, buf + nSent, size - nSent, options | MSG_DONTWAIT);
+    if (nRet < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        return (nSent > 0) ? nSent : -1;
+
+      if (coroWait(socket, POLLOUT, -1) < 0)
+        return (nSent > 0) ? nSent : -1;
+
+      continue;
+    }
+
+    nSent += nRet;
+  }
+
+  return nSent;
+}
+
 int medusaSendInternal(int socket, unsigned char *buf, int size, int options)
 {
 #ifdef HAVE_LIBSSL
@@ -582,7 +882,10 @@ int medusaSendInternal(int socket, unsigned char *buf, int size, int options)
     //  if (bufReceive == NULL) { break; }
     //}
  
-    nRet = send(socket, buf, size, options); 
+    if (coroActive() == TRUE)
+      nRet = sendCoro(socket, buf, size, options);
+    else
+      nRet = send(socket, buf, size, options); 
     if (nRet < 0)
     {
       writeError(ERR_ERROR, "Error in send() %s", strerror(errno)); 
@@ -712,6 +1015,9 @@ int medusaDataReadyTimed(int socket, time_t sec, time_t usec)
   fd_set fds;
   struct timeval tv;
 
+  if (coroActive() == TRUE)
+    return (coroWait(socket, POLLIN, sec * 1000000L + usec));
+
   FD_ZERO(&fds);
   FD_SET(socket, &fds);
   tv.tv_sec = sec;
@@ -807,12 +1113,11 @@ int medusaReceiveRegex(int hSocket, unsigned char **szBufReceive, int* nBufRecei
       writeError(ERR_DEBUG, "Failed to match regex. Checking for additional data.");
 
       /* there more be more data waiting for us... */
-      if (medusaDataReadyTimed(hSocket, 0, 20000 * nAttempt) > 0)
-      {
-        szBufReceiveTmp = malloc(BUFFER_SIZE + 1);
-        memset(szBufReceiveTmp, 0, BUFFER_SIZE + 1);
+      szBufReceiveTmp = malloc(BUFFER_SIZE + 1);
+      memset(szBufReceiveTmp, 0, BUFFER_SIZE + 1);
 
-        nBufReceiveTmp = medusaReceive(hSocket, szBufReceiveTmp, BUFFER_SIZE);
+      if (medusaReceiveTimed(hSocket, szBufReceiveTmp, BUFFER_SIZE, 20000 * nAttempt, &nBufReceiveTmp) > 0)
+      {
         if (nBufReceiveTmp <= 0)
         {
           writeError(ERR_DEBUG, "Data receive: No additional data.");
@@ -835,6 +1140,7 @@ int medusaReceiveRegex(int hSocket, unsigned char **szBufReceive, int* nBufRecei
       else
       {
         /* no additional data found... let's check it a few times */
+        free(szBufReceiveTmp);
         writeError(ERR_DEBUG, "No additional data found (attempt %d/5)", nAttempt);
         nAttempt++;
       }
@@ -71,6 +71,7 @@ extern int medusaConnect(sConnectParams* pParams);
 extern int medusaConnectSSL(sConnectParams* pParams);
 extern int medusaConnectSocketSSL(sConnectParams* pParams, int hSocket);
 extern int medusaConnectTCP(sConnectParams* pParams);
+extern int sslShareSessions(int nSlots);
 extern int medusaConnectUDP(sConnectParams* pParams);
 extern int medusaDisconnect(int socket);
 extern int medusaDataReadyWritingTimed(int socket, time_t sec, time_t usec);
@@ -0,0 +1,163 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Per-account attempt budget
+ *
+*/
+
+#include <sys/time.h>
+#include "medusa.h"
+
+#define PACE_SWEEP_MIN 1024
+
+double paceNow()
+{
+  struct timeval tvNow;
+
+  gettimeofday(&tvNow, NULL);
+  return tvNow.tv_sec + tvNow.tv_usec / 1000000.0;
+}
+
+sPacer* paceOpen(int iAttempts, int iWindow)
+{
+  sPacer *psPacer;
+
+  psPacer = malloc(sizeof(sPacer));
+  memset(psPacer, 0, sizeof(sPacer));
+  psPacer->iAttempts = iAttempts;
+  psPacer->iWindow = iWindow;
+  psPacer->iSweepAt = PACE_SWEEP_MIN;
+
+  if (pthread_mutex_init(&psPacer->ptmMutex, NULL) != 0)
+    writeError(ERR_FATAL, "Pacer mutex initialization failed - %s\n", strerror( errno ) );
+
+  return psPacer;
+}
+
+static void paceDelete(sPacer *psPacer, sPaceAccount *psAccount)
+{
+  HASH_DEL(psPacer->psAccounts, psAccount);
+  free(psAccount->arrTime);
+  free(psAccount);
+  psPacer->iAccounts--;
+}
+
+/* drop the accounts with no attempt left in the window - they have their full budget again */
+static void paceSweep(sPacer *psPacer, double fNow)
+{
+  sPaceAccount *psAccount, *psTmp;
+  int i, iActive;
+
+  for (psAccount = psPacer->psAccounts; psAccount; psAccount = psTmp)
+  {
+    psTmp = psAccount->hh.next;
+
+    iActive = FALSE;
+    for (i = 0; (i < psPacer->iAttempts) && (!iActive); i++)
+      iActive = (psAccount->arrTime[i] > fNow - psPacer->iWindow);
+
+    if (!iActive)
+      paceDelete(psPacer, psAccount);
+  }
+
+  psPacer->iSweepAt = (psPacer->iAccounts * 2 > PACE_SWEEP_MIN) ? psPacer->iAccounts * 2 : PACE_SWEEP_MIN;
+  writeError(ERR_DEBUG, "[paceSweep] %d accounts tested within the last %d seconds", psPacer->iAccounts, psPacer->iWindow);
+}
+
+/*
+  Take one attempt of an account's budget. Returns TRUE and the time the
+  attempt was recorded with, or FALSE and the number of seconds until the
+  oldest attempt of the account leaves the window.
+*/
+int paceReserve(sPacer *psPacer, uint64_t nKey, double *pfStamp, double *pfWait)
+{
+  sPaceAccount *psAccount;
+  double fNow = paceNow();
+  int i, iOldest = 0;
+  int iRet = TRUE;
+
+  pthread_mutex_lock(&psPacer->ptmMutex);
+
+  HASH_FIND(hh, psPacer->psAccounts, &nKey, sizeof(uint64_t), psAccount);
+  if (psAccount == NULL)
+  {
+    if (psPacer->iAccounts >= psPacer->iSweepAt)
+      paceSweep(psPacer, fNow);
+
+    psAccount = malloc(sizeof(sPaceAccount));
+    memset(psAccount, 0, sizeof(sPaceAccount));
+    psAccount->nKey = nKey;
+    psAccount->arrTime = calloc(psPacer->iAttempts, sizeof(double));
+    HASH_ADD(hh, psPacer->psAccounts, nKey, sizeof(uint64_t), psAccount);
+    psPacer->iAccounts++;
+  }
+
+  for (i = 1; i < psPacer->iAttempts; i++)
+    if (psAccount->arrTime[i] < psAccount->arrTime[iOldest])
+      iOldest = i;
+
+  if (psAccount->arrTime[iOldest] > fNow - psPacer->iWindow)
+  {
+    *pfWait = psAccount->arrTime[iOldest] + psPacer->iWindow - fNow;
+    iRet = FALSE;
+  }
+  else
+  {
+    psAccount->arrTime[iOldest] = fNow;
+    *pfStamp = fNow;
+  }
+
+  pthread_mutex_unlock(&psPacer->ptmMutex);
+
+  return iRet;
+}
+
+/* Give back an attempt taken by paceReserve() which was not made */
+void paceRelease(sPacer *psPacer, uint64_t nKey, double fStamp)
+{
+  sPaceAccount *psAccount;
+  int i;
+
+  pthread_mutex_lock(&psPacer->ptmMutex);
+
+  HASH_FIND(hh, psPacer->psAccounts, &nKey, sizeof(uint64_t), psAccount);
+  for (i = 0; (psAccount) && (i < psPacer->iAttempts); i++)
+  {
+    if (psAccount->arrTime[i] == fStamp)
+    {
+      psAccount->arrTime[i] = 0;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&psPacer->ptmMutex);
+}
+
+void paceClose(sPacer *psPacer)
+{
+  if (psPacer == NULL)
+    return;
+
+  while (psPacer->psAccounts)
+    paceDelete(psPacer, psPacer->psAccounts);
+
+  pthread_mutex_destroy(&psPacer->ptmMutex);
+  free(psPacer);
+}
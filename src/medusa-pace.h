@@ -0,0 +1,60 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_PACE_H
+#define _MEDUSA_PACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "uthash.h"
+
+/*
+  Account attempt budget (-A). No account is tested more than iAttempts
+  times within any window of iWindow seconds. The time of each attempt
+  handed out is kept per account (a 64-bit fingerprint of host or domain
+  service and username). Accounts whose attempts have all left the window
+  are dropped, so only the accounts tested recently are held in memory.
+*/
+#define PACE_MAX_ATTEMPTS 1000
+
+typedef struct __sPaceAccount {
+  uint64_t nKey;
+  double *arrTime;          // times of the last iAttempts attempts, 0 if unused
+  UT_hash_handle hh;
+} sPaceAccount;
+
+typedef struct __sPacer {
+  int iAttempts;
+  int iWindow;
+  sPaceAccount *psAccounts;
+  int iAccounts;
+  int iSweepAt;             // account count at which expired accounts are dropped
+  pthread_mutex_t ptmMutex;
+} sPacer;
+
+double paceNow();
+sPacer* paceOpen(int iAttempts, int iWindow);
+int paceReserve(sPacer *psPacer, uint64_t nKey, double *pfStamp, double *pfWait);
+void paceRelease(sPacer *psPacer, uint64_t nKey, double fStamp);
+void paceClose(sPacer *psPacer);
+
+#endif
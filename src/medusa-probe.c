@@ -0,0 +1,274 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Asynchronous TCP liveness pre-scan of target hosts
+ *
+*/
+
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "medusa.h"
+
+#define PROBE_RESERVED_FDS 64   // descriptors left for output files, modules, etc.
+
+typedef struct __sProbeSlot {
+  int hSocket;
+  int iPort;
+  void *pCookie;
+  long lDeadline;               // monotonic time (msec) at which the probe times out
+  char szHost[HOST_SPEC_MAX_LEN];
+} sProbeSlot;
+
+static long probeNow()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int probeError(int iErr)
+{
+  if (iErr == ECONNREFUSED)
+    return PROBE_CLOSED;
+  else if (iErr == ETIMEDOUT)
+    return PROBE_TIMEOUT;
+  else
+    return PROBE_UNREACHABLE;
+}
+
+/*
+  Start a non-blocking connect to the slot's target. Returns 0 if the connect
+  is in progress, otherwise the result of the probe.
+*/
+static int probeStart(sProbeSlot *psSlot)
+{
+  struct addrinfo hints, *res;
+  char szPort[NI_MAXSERV];
+  int hSocket;
+  int iErr;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(szPort, sizeof(szPort), "%d", psSlot->iPort);
+
+  if (getaddrinfo(psSlot->szHost, szPort, &hints, &res) != 0)
+    return PROBE_UNRESOLVED;
+
+  hSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (hSocket < 0)
+  {
+    writeError(ERR_ERROR, "Failed to create probe socket for host: %s - %s", psSlot->szHost, strerror(errno));
+    freeaddrinfo(res);
+    return PROBE_UNREACHABLE;
+  }
+
+  fcntl(hSocket, F_SETFL, fcntl(hSocket, F_GETFL, 0) | O_NONBLOCK);
+
+  if (connect(hSocket, res->ai_addr, res->ai_addrlen) == 0)
+  {
+    freeaddrinfo(res);
+    close(hSocket);
+    return PROBE_OPEN;
+  }
+
+  iErr = errno;
+  freeaddrinfo(res);
+
+  if (iErr == EINPROGRESS)
+  {
+    psSlot->hSocket = hSocket;
+    return 0;
+  }
+
+  close(hSocket);
+  return probeError(iErr);
+}
+
+char* probeResultString(int iResult)
+{
+  switch (iResult)
+  {
+    case PROBE_OPEN:
+      return "open";
+    case PROBE_CLOSED:
+      return "closed";
+    case PROBE_TIMEOUT:
+      return "no response";
+    case PROBE_UNREACHABLE:
+      return "unreachable";
+    case PROBE_UNRESOLVED:
+      return "unresolved";
+    case PROBE_SKIPPED:
+      return "not probed";
+    default:
+      return "unknown";
+  }
+}
+
+/*
+  Probe every target returned by pNext, keeping up to iProbeCnt connects in
+  flight, each limited to iTimeout seconds. pResult is called once for each
+  target, in completion order. Returns FAILURE if probing stopped before
+  pNext ran out of targets.
+*/
+int probeHosts(int iProbeCnt, int iTimeout, probe_next_t pNext, probe_result_t pResult, void *pArg)
+{
+  sProbeSlot *psSlots;
+  sProbeSlot *psSlot;
+  struct pollfd *psPoll;
+  struct rlimit sLimit;
+  char *pHost;
+  void *pCookie;
+  int iPort;
+  int iMore = TRUE;
+  int nActive = 0;
+  int iResult;
+  int iErr;
+  socklen_t nLen;
+  long lNow;
+  long lWait;
+  int i;
+
+  if (iProbeCnt <= 0)
+    iProbeCnt = PROBE_DEFAULT_CNT;
+
+  /* each probe in flight holds a descriptor */
+  if ((getrlimit(RLIMIT_NOFILE, &sLimit) == 0) && (sLimit.rlim_cur != RLIM_INFINITY) && ((rlim_t)iProbeCnt + 2 * PROBE_RESERVED_FDS > sLimit.rlim_cur))
+  {
+    iProbeCnt = (sLimit.rlim_cur > 3 * PROBE_RESERVED_FDS) ? (int)sLimit.rlim_cur - 2 * PROBE_RESERVED_FDS : PROBE_RESERVED_FDS;
+    writeError(ERR_NOTICE, "Limiting concurrent probes to %d (open file limit: %d).", iProbeCnt, (int)sLimit.rlim_cur);
+  }
+
+  if (iTimeout <= 0)
+    iTimeout = 1;
+
+  psSlots = malloc(iProbeCnt * sizeof(sProbeSlot));
+  psPoll = malloc(iProbeCnt * sizeof(struct pollfd));
+  if ((psSlots == NULL) || (psPoll == NULL))
+  {
+    writeError(ERR_ERROR, "Failed to allocate memory for host probes.");
+    free(psSlots);
+    free(psPoll);
+    return FAILURE;
+  }
+
+  while ((iMore) || (nActive > 0))
+  {
+    /* fill free slots with new targets */
+    while ((iMore) && (nActive < iProbeCnt))
+    {
+      if (!pNext(pArg, &pHost, &iPort, &pCookie))
+      {
+        iMore = FALSE;
+        break;
+      }
+
+      psSlot = &psSlots[nActive];
+      snprintf(psSlot->szHost, HOST_SPEC_MAX_LEN, "%s", pHost);
+      psSlot->iPort = iPort;
+      psSlot->pCookie = pCookie;
+
+      iResult = (iPort > 0) ? probeStart(psSlot) : PROBE_SKIPPED;
+      if (iResult)
+      {
+        pResult(pArg, pCookie, psSlot->szHost, iPort, iResult);
+        continue;
+      }
+
+      psSlot->lDeadline = probeNow() + iTimeout * 1000;
+      psPoll[nActive].fd = psSlot->hSocket;
+      psPoll[nActive].events = POLLOUT;
+      psPoll[nActive].revents = 0;
+      nActive++;
+    }
+
+    if (nActive == 0)
+      continue;
+
+    /* wait for a connect to complete or the earliest probe to time out */
+    lNow = probeNow();
+    lWait = psSlots[0].lDeadline;
+    for (i = 1; i < nActive; i++)
+    {
+      if (psSlots[i].lDeadline < lWait)
+        lWait = psSlots[i].lDeadline;
+    }
+    lWait = (lWait > lNow) ? lWait - lNow : 0;
+
+    if ((poll(psPoll, nActive, (int)lWait) < 0) && (errno != EINTR))
+    {
+      writeError(ERR_ERROR, "Host probe poll() failed - %s", strerror(errno));
+      break;
+    }
+
+    lNow = probeNow();
+
+    for (i = nActive - 1; i >= 0; i--)
+    {
+      psSlot = &psSlots[i];
+
+      if (psPoll[i].revents)
+      {
+        iErr = 0;
+        nLen = sizeof(iErr);
+        if (getsockopt(psSlot->hSocket, SOL_SOCKET, SO_ERROR, (void *)&iErr, &nLen) < 0)
+          iErr = errno;
+
+        iResult = (iErr == 0) ? PROBE_OPEN : probeError(iErr);
+      }
+      else if (lNow >= psSlot->lDeadline)
+      {
+        iResult = PROBE_TIMEOUT;
+      }
+      else
+      {
+        continue;
+      }
+
+      close(psSlot->hSocket);
+      pResult(pArg, psSlot->pCookie, psSlot->szHost, psSlot->iPort, iResult);
+
+      /* move the last active probe into the free slot */
+      nActive--;
+      if (i != nActive)
+      {
+        psSlots[i] = psSlots[nActive];
+        psPoll[i] = psPoll[nActive];
+      }
+    }
+  }
+
+  /* poll() failure - what is still outstanding was not probed */
+  for (i = 0; i < nActive; i++)
+  {
+    close(psSlots[i].hSocket);
+    pResult(pArg, psSlots[i].pCookie, psSlots[i].szHost, psSlots[i].iPort, PROBE_SKIPPED);
+  }
+
+  free(psSlots);
+  free(psPoll);
+
+  return (iMore) ? FAILURE : SUCCESS;
+}
@@ -0,0 +1,48 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_PROBE_H
+#define _MEDUSA_PROBE_H
+
+/*
+  Liveness pre-scan. A single thread keeps up to iProbeCnt non-blocking TCP
+  connects in flight and reports whether each target's port accepted the
+  connection. Targets are pulled from and reported to the caller through
+  callbacks, so the set of hosts being probed is never held in memory.
+*/
+#define PROBE_DEFAULT_CNT 1024
+
+#define PROBE_OPEN 1            // connection accepted
+#define PROBE_CLOSED 2          // connection refused (port closed)
+#define PROBE_TIMEOUT 3         // no response within timeout
+#define PROBE_UNREACHABLE 4     // network/host unreachable or other socket error
+#define PROBE_UNRESOLVED 5      // hostname could not be resolved
+#define PROBE_SKIPPED 6         // no port known for target - not probed
+
+/* Return FALSE once there are no more targets. *ppCookie is handed back with the result. */
+typedef int (*probe_next_t)(void *pArg, char **ppHost, int *piPort, void **ppCookie);
+typedef void (*probe_result_t)(void *pArg, void *pCookie, char *pHost, int iPort, int iResult);
+
+int probeHosts(int iProbeCnt, int iTimeout, probe_next_t pNext, probe_result_t pResult, void *pArg);
+char* probeResultString(int iResult);
+
+#endif
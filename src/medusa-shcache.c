@@ -0,0 +1,191 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Key/value cache shared by the processes of the daemon
+ *
+*/
+
+#include <sys/mman.h>
+#include "medusa.h"
+#include "medusa-shcache.h"
+
+#ifndef MAP_ANONYMOUS
+  #define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static sShCacheSlot* getSlot(sShCache *psCache, int iSlot)
+{
+  return (sShCacheSlot *)((char *)psCache + sizeof(sShCache) + (size_t)iSlot * psCache->nSlotSize);
+}
+
+/*
+  A job may end while holding the lock. With robust mutexes the next owner is
+  told and the slots it was writing are dropped; elsewhere the cache would
+  stay locked, which is why the jobs hold it only to copy an entry.
+*/
+static void lockCache(sShCache *psCache, uint64_t nHash)
+{
+  int i;
+
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  if (pthread_mutex_lock(&psCache->ptmMutex) == EOWNERDEAD)
+  {
+    writeError(ERR_DEBUG, "[lockCache] Previous owner of shared cache ended - dropping slots in use.");
+    for (i = 0; i < SHCACHE_PROBE; i++)
+      getSlot(psCache, (nHash + i) % psCache->nSlots)->tExpire = 0;
+    pthread_mutex_consistent(&psCache->ptmMutex);
+  }
+#else
+  (void)i;
+  (void)nHash;
+  pthread_mutex_lock(&psCache->ptmMutex);
+#endif
+}
+
+sShCache* shcacheCreate(int nSlots, size_t nValueMax)
+{
+  sShCache *psCache;
+  pthread_mutexattr_t ptmAttr;
+  size_t nSlotSize, nMapSize;
+
+  nSlotSize = (sizeof(sShCacheSlot) + nValueMax + 7) & ~(size_t)7;
+  nMapSize = sizeof(sShCache) + (size_t)nSlots * nSlotSize;
+
+  psCache = mmap(NULL, nMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (psCache == MAP_FAILED)
+  {
+    writeError(ERR_ERROR, "Failed to map shared cache - %s", strerror(errno));
+    return NULL;
+  }
+
+  /* anonymous mappings are zero filled - all slots are unused */
+  psCache->nMapSize = nMapSize;
+  psCache->nSlots = nSlots;
+  psCache->nValueMax = nValueMax;
+  psCache->nSlotSize = nSlotSize;
+
+  pthread_mutexattr_init(&ptmAttr);
+  pthread_mutexattr_setpshared(&ptmAttr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  pthread_mutexattr_setrobust(&ptmAttr, PTHREAD_MUTEX_ROBUST);
+#endif
+
+  if (pthread_mutex_init(&psCache->ptmMutex, &ptmAttr) != 0)
+  {
+    writeError(ERR_ERROR, "Shared cache mutex initialization failed.");
+    pthread_mutexattr_destroy(&ptmAttr);
+    munmap(psCache, nMapSize);
+    return NULL;
+  }
+
+  pthread_mutexattr_destroy(&ptmAttr);
+  return psCache;
+}
+
+void shcacheFree(sShCache *psCache)
+{
+  if (psCache == NULL)
+    return;
+
+  pthread_mutex_destroy(&psCache->ptmMutex);
+  munmap(psCache, psCache->nMapSize);
+}
+
+/*
+  Copy the value stored for pKey. *pnLen is the size of pValue on input and
+  the length of the value on output.
+*/
+int shcacheGet(sShCache *psCache, const char *pKey, void *pValue, size_t *pnLen)
+{
+  sShCacheSlot *psSlot;
+  uint64_t nHash;
+  time_t tNow;
+  int i, ret = FAILURE;
+
+  if ((psCache == NULL) || (strlen(pKey) >= SHCACHE_KEY_MAX))
+    return FAILURE;
+
+  nHash = fpset_hash(pKey, strlen(pKey));
+  tNow = time(NULL);
+
+  lockCache(psCache, nHash);
+  for (i = 0; i < SHCACHE_PROBE; i++)
+  {
+    psSlot = getSlot(psCache, (nHash + i) % psCache->nSlots);
+
+    if ((psSlot->tExpire > tNow) && (psSlot->nHash == nHash) && (strcmp(psSlot->szKey, pKey) == 0))
+    {
+      if (psSlot->nLen <= *pnLen)
+      {
+        memcpy(pValue, (char *)psSlot + sizeof(sShCacheSlot), psSlot->nLen);
+        *pnLen = psSlot->nLen;
+        ret = SUCCESS;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&psCache->ptmMutex);
+
+  return ret;
+}
+
+/*
+  Store a value for iTTL seconds, replacing the current value of pKey.
+  Values larger than the slots of the cache are not stored.
+*/
+int shcachePut(sShCache *psCache, const char *pKey, const void *pValue, size_t nLen, int iTTL)
+{
+  sShCacheSlot *psSlot, *psVictim = NULL;
+  uint64_t nHash;
+  time_t tNow;
+  int i;
+
+  if ((psCache == NULL) || (strlen(pKey) >= SHCACHE_KEY_MAX) || (nLen > psCache->nValueMax) || (iTTL <= 0))
+    return FAILURE;
+
+  nHash = fpset_hash(pKey, strlen(pKey));
+  tNow = time(NULL);
+
+  lockCache(psCache, nHash);
+  for (i = 0; i < SHCACHE_PROBE; i++)
+  {
+    psSlot = getSlot(psCache, (nHash + i) % psCache->nSlots);
+
+    if ((psSlot->nHash == nHash) && (strcmp(psSlot->szKey, pKey) == 0))
+    {
+      psVictim = psSlot;
+      break;
+    }
+
+    /* unused and expired slots first, then the one expiring first */
+    if ((psVictim == NULL) || ((psVictim->tExpire > tNow) && (psSlot->tExpire < psVictim->tExpire)))
+      psVictim = psSlot;
+  }
+
+  psVictim->tExpire = 0;
+  psVictim->nHash = nHash;
+  snprintf(psVictim->szKey, SHCACHE_KEY_MAX, "%s", pKey);
+  memcpy((char *)psVictim + sizeof(sShCacheSlot), pValue, nLen);
+  psVictim->nLen = nLen;
+  psVictim->tExpire = tNow + iTTL;
+  pthread_mutex_unlock(&psCache->ptmMutex);
+
+  return SUCCESS;
+}
@@ -0,0 +1,61 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_SHCACHE_H
+#define _MEDUSA_SHCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+  Fixed-size key/value cache in anonymous shared memory. It is created by the
+  daemon (see medusa-daemon.c) before the jobs are forked, so entries stored
+  by one job are seen by all others. Each key may be stored in one of
+  SHCACHE_PROBE slots following its hash; the entry expiring first is
+  replaced when they are all in use.
+*/
+#define SHCACHE_KEY_MAX 128
+#define SHCACHE_PROBE 8
+
+typedef struct __sShCacheSlot {
+  uint64_t nHash;
+  time_t tExpire;                         // 0 if unused
+  size_t nLen;
+  char szKey[SHCACHE_KEY_MAX];
+} sShCacheSlot;
+
+typedef struct __sShCache {
+  pthread_mutex_t ptmMutex;               // process-shared
+  size_t nMapSize;
+  int nSlots;
+  size_t nValueMax;
+  size_t nSlotSize;                       // slot header and value
+} sShCache;
+
+sShCache* shcacheCreate(int nSlots, size_t nValueMax);
+void shcacheFree(sShCache *psCache);
+int shcacheGet(sShCache *psCache, const char *pKey, void *pValue, size_t *pnLen);
+int shcachePut(sShCache *psCache, const char *pKey, const void *pValue, size_t nLen, int iTTL);
+
+#endif
@@ -0,0 +1,666 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Streaming candidate sources (stdin, FIFOs and compressed wordlists)
+ *
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "medusa.h"
+
+/*
+  Compressed lists are decoded by the matching external tool, which runs
+  alongside the reader and feeds it through a pipe. Regular files are
+  identified by their magic bytes; FIFOs can not be peeked at, so they fall
+  back to the file extension.
+*/
+static char* getFilterProgram(char *pFile, int fd)
+{
+  struct stat sStat;
+  unsigned char bufMagic[6];
+  size_t nLen = strlen(pFile);
+
+  memset(bufMagic, 0, sizeof(bufMagic));
+  if ((fstat(fd, &sStat) == 0) && (S_ISREG(sStat.st_mode)))
+  {
+    if (pread(fd, bufMagic, sizeof(bufMagic), 0) < 4)
+      return NULL;
+
+    if ((bufMagic[0] == 0x1f) && (bufMagic[1] == 0x8b))
+      return "gzip";
+    else if (memcmp(bufMagic, "\xfd" "7zXZ\x00", 6) == 0)
+      return "xz";
+    else if (memcmp(bufMagic, "\x28\xb5\x2f\xfd", 4) == 0)
+      return "zstd";
+
+    return NULL;
+  }
+
+  if ((nLen > 3) && (strcmp(pFile + nLen - 3, ".gz") == 0))
+    return "gzip";
+  else if ((nLen > 3) && (strcmp(pFile + nLen - 3, ".xz") == 0))
+    return "xz";
+  else if ((nLen > 4) && (strcmp(pFile + nLen - 4, ".zst") == 0))
+    return "zstd";
+
+  return NULL;
+}
+
+/*
+  Open a user supplied candidate list. "-" refers to standard input. If the
+  list is compressed, a decompression process is started and its output is
+  returned instead. pidFilter is set to the process ID of that process, or 0.
+*/
+FILE* openCandidateFile(char *pFile, pid_t *pidFilter)
+{
+  FILE *pfFile = NULL;
+  char *pFilter = NULL;
+  int fd;
+  int fdPipe[2];
+
+  *pidFilter = 0;
+
+  if (strcmp(pFile, "-") == 0)
+    return stdin;
+
+  if ((fd = open(pFile, O_RDONLY)) < 0)
+    return NULL;
+
+  if ((pFilter = getFilterProgram(pFile, fd)) == NULL)
+  {
+    if ((pfFile = fdopen(fd, "r")) == NULL)
+      close(fd);
+
+    return pfFile;
+  }
+
+  writeError(ERR_DEBUG, "Decompressing file %s using %s.", pFile, pFilter);
+
+  if (pipe(fdPipe) < 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  if ((*pidFilter = fork()) < 0)
+  {
+    *pidFilter = 0;
+    close(fd);
+    close(fdPipe[0]);
+    close(fdPipe[1]);
+    return NULL;
+  }
+  else if (*pidFilter == 0)
+  {
+    dup2(fd, STDIN_FILENO);
+    dup2(fdPipe[1], STDOUT_FILENO);
+    close(fd);
+    close(fdPipe[0]);
+    close(fdPipe[1]);
+    execlp(pFilter, pFilter, "-dc", (char *)NULL);
+    _exit(127);
+  }
+
+  close(fd);
+  close(fdPipe[1]);
+
+  if ((pfFile = fdopen(fdPipe[0], "r")) == NULL)
+  {
+    close(fdPipe[0]);
+    closeCandidateFile(NULL, *pidFilter);
+    *pidFilter = 0;
+  }
+
+  return pfFile;
+}
+
+/*
+  Close a candidate list and collect its decompression process, if any.
+  Returns FAILURE if the decompression process did not exit cleanly.
+*/
+int closeCandidateFile(FILE *pfFile, pid_t pidFilter)
+{
+  int iStatus = 0;
+
+  if ((pfFile) && (pfFile != stdin))
+    fclose(pfFile);
+
+  if (pidFilter > 0)
+  {
+    if ((waitpid(pidFilter, &iStatus, 0) < 0) || (!WIFEXITED(iStatus)) || (WEXITSTATUS(iStatus) != 0))
+      return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/*
+  Lists which can not be rewound or need to be decompressed are streamed
+  rather than loaded into memory up front. Only regular files are opened
+  to read their magic bytes. Opening a FIFO here would release a waiting
+  writer, which then fails once we close it again.
+*/
+int isStreamSource(char *pFile)
+{
+  struct stat sStat;
+  int fd;
+  int iStream = FALSE;
+
+  if (strcmp(pFile, "-") == 0)
+    return TRUE;
+
+  if (stat(pFile, &sStat) < 0)
+    return FALSE;   /* let the regular loader report the error */
+
+  if (!S_ISREG(sStat.st_mode))
+    return TRUE;
+
+  if ((fd = open(pFile, O_RDONLY)) < 0)
+    return FALSE;
+
+  if (getFilterProgram(pFile, fd))
+    iStream = TRUE;
+
+  close(fd);
+
+  return iStream;
+}
+
+/* Free unreferenced blocks from the head of the chain. Caller holds ptmMutex. */
+static void streamCollect(sStream *psStream)
+{
+  sStreamBlock *psBlock;
+
+  while ((psStream->psHead != psStream->psTail) && (psStream->psHead->iRef == 0))
+  {
+    psBlock = psStream->psHead;
+    psStream->psHead = psBlock->psNext;
+    psStream->iBlocks--;
+    psStream->iOverflow = FALSE;
+    free(psBlock);
+  }
+
+  pthread_cond_signal(&psStream->ptcSpace);
+}
+
+static sStreamBlock* streamNewBlock()
+{
+  sStreamBlock *psBlock;
+
+  psBlock = malloc(sizeof(sStreamBlock));
+  if (psBlock == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for candidate stream.");
+
+  psBlock->psNext = NULL;
+  psBlock->nUsed = 0;
+  psBlock->iRef = 0;
+  psBlock->pData[0] = '\0';
+
+  return psBlock;
+}
+
+/* Next line of the file, or next entry returned by the callback of the stream */
+static char* streamReadEntry(sStream *psStream, char *pBuf)
+{
+  const char *pEntry;
+
+  if (psStream->pfnNext == NULL)
+    return fgets(pBuf, MAX_BUF, psStream->pfFile);
+
+  if ((psStream->iAbort) || ((pEntry = psStream->pfnNext(psStream->pNextArg)) == NULL))
+    return NULL;
+
+  snprintf(pBuf, MAX_BUF, "%s", pEntry);
+  return pBuf;
+}
+
+/*
+  Background reader. Entries are appended to the tail block and published
+  to waiting consumers. Once STREAM_MAX_BLOCKS blocks are held the reader
+  waits for blocks to be released. If consumers stall on the tail of the
+  full chain instead (the oldest block is held by a user or host which has
+  not reached it yet, or by a module batching its credentials), the chain
+  grows whenever a consumer is waiting, until a block is released again.
+*/
+static void* streamReader(void *arg)
+{
+  sStream *psStream = (sStream *)arg;
+  sStreamBlock *psBlock;
+  struct timespec tsWait;
+  char tmp[MAX_BUF];
+  size_t nLen;
+  int iNotice;
+
+  while (streamReadEntry(psStream, tmp) != NULL)
+  {
+    nLen = strlen(tmp);
+    if ((nLen > 0) && (tmp[nLen - 1] == '\n')) tmp[--nLen] = '\0';
+    if ((nLen > 0) && (tmp[nLen - 1] == '\r')) tmp[--nLen] = '\0';
+
+    /* ignore blank lines */
+    if (nLen == 0)
+    {
+      writeError(ERR_DEBUG, "Ignoring blank line in stream: %s.", psStream->pName);
+      continue;
+    }
+
+    /* ignore duplicate entries, as long as the fingerprint table is within its limit */
+    if (psStream->sSeen.pSlots)
+    {
+      if (!fpset_add(&psStream->sSeen, tmp, nLen))
+      {
+        psStream->iDuplicates++;
+        continue;
+      }
+
+      if (psStream->sSeen.nUsed >= STREAM_DEDUPE_MAX)
+      {
+        writeError(ERR_NOTICE, "Stream %s exceeded %d unique entries. Duplicate removal disabled for the remaining entries.", psStream->pName, STREAM_DEDUPE_MAX);
+        fpset_free(&psStream->sSeen);
+      }
+    }
+
+    pthread_mutex_lock(&psStream->ptmMutex);
+    iNotice = FALSE;
+
+    if (psStream->psTail->nUsed + nLen + 1 > STREAM_BLOCK_SIZE)
+    {
+      while ((psStream->iBlocks >= STREAM_MAX_BLOCKS) && ((!psStream->iOverflow) || (psStream->iWaiting == 0)) && (!psStream->iAbort))
+      {
+        clock_gettime(CLOCK_REALTIME, &tsWait);
+        tsWait.tv_sec += 1;
+        pthread_cond_timedwait(&psStream->ptcSpace, &psStream->ptmMutex, &tsWait);
+      }
+
+      if (psStream->iAbort)
+      {
+        pthread_mutex_unlock(&psStream->ptmMutex);
+        break;
+      }
+
+      if ((psStream->iBlocks >= STREAM_MAX_BLOCKS) && (!psStream->iOverflowNoticed))
+        iNotice = psStream->iOverflowNoticed = TRUE;
+
+      psBlock = streamNewBlock();
+      psStream->psTail->psNext = psBlock;
+      psStream->psTail = psBlock;
+      psStream->iBlocks++;
+    }
+
+    memcpy(psStream->psTail->pData + psStream->psTail->nUsed, tmp, nLen + 1);
+    psStream->psTail->nUsed += nLen + 1;
+    psStream->iCount++;
+
+    pthread_cond_broadcast(&psStream->ptcData);
+    pthread_mutex_unlock(&psStream->ptmMutex);
+
+    if (iNotice)
+      writeError(ERR_NOTICE, "Stream %s: holding more than %d KB of entries in memory for the users, hosts or logins which are not done with them yet.", psStream->pName, STREAM_MAX_BLOCKS * STREAM_BLOCK_SIZE / 1024);
+  }
+
+  if (closeCandidateFile(psStream->pfFile, psStream->pidFilter) != SUCCESS)
+    writeError(ERR_ERROR, "Decompression of %s did not complete successfully. Using the %d entries read.", psStream->pName, psStream->iCount);
+
+  fpset_free(&psStream->sSeen);
+
+  if (psStream->iDuplicates)
+    writeError(ERR_NOTICE, "Removed %d duplicate entries from stream: %s (%d remaining)", psStream->iDuplicates, psStream->pName, psStream->iCount);
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+  psStream->pfFile = NULL;
+  psStream->iEOF = TRUE;
+  writeError(ERR_DEBUG, "End of stream %s reached after %d entries.", psStream->pName, psStream->iCount);
+  pthread_cond_broadcast(&psStream->ptcData);
+  pthread_mutex_unlock(&psStream->ptmMutex);
+
+  return NULL;
+}
+
+/*
+  Start the reader thread of a new stream. ppsCursor is set to the head of
+  the chain and keeps the head pinned until the caller has attached all of
+  its consumers and released it.
+*/
+static sStream* streamStart(sStream *psStream, char *pName, sStreamBlock **ppsCursor)
+{
+  psStream->pName = strdup(pName);
+  fpset_init(&psStream->sSeen, 0);
+  psStream->psHead = streamNewBlock();
+  psStream->psTail = psStream->psHead;
+  psStream->iBlocks = 1;
+
+  psStream->psHead->iRef = 1;
+  *ppsCursor = psStream->psHead;
+
+  if ((pthread_mutex_init(&psStream->ptmMutex, NULL) != 0) || (pthread_cond_init(&psStream->ptcData, NULL) != 0) || (pthread_cond_init(&psStream->ptcSpace, NULL) != 0))
+    writeError(ERR_FATAL, "Stream (%s) mutex initialization failed - %s\n", pName, strerror( errno ) );
+
+  if (pthread_create(&psStream->thrReader, NULL, streamReader, (void *)psStream) != 0)
+    writeError(ERR_FATAL, "Failed to create reader thread for %s.", pName);
+
+  writeError(ERR_DEBUG, "Streaming candidates from %s.", pName);
+
+  return psStream;
+}
+
+/* Start streaming a candidate list (see streamStart()) */
+sStream* streamOpen(char *pFile, sStreamBlock **ppsCursor)
+{
+  sStream *psStream;
+
+  psStream = malloc(sizeof(sStream));
+  memset(psStream, 0, sizeof(sStream));
+
+  if ((psStream->pfFile = openCandidateFile(pFile, &psStream->pidFilter)) == NULL)
+  {
+    writeError(ERR_FATAL, "Failed to open file %s - %s", pFile, strerror( errno ) );
+  }
+
+  return streamStart(psStream, pFile, ppsCursor);
+}
+
+/*
+  Stream the candidates returned by pfnNext until it returns NULL (library
+  candidate iterators). The callback is only called by the reader thread.
+*/
+sStream* streamOpenCallback(char *pName, const char* (*pfnNext)(void *), void *pArg, sStreamBlock **ppsCursor)
+{
+  sStream *psStream;
+
+  psStream = malloc(sizeof(sStream));
+  memset(psStream, 0, sizeof(sStream));
+
+  psStream->pfnNext = pfnNext;
+  psStream->pNextArg = pArg;
+
+  return streamStart(psStream, pName, ppsCursor);
+}
+
+/*
+  Flag the stream as aborting. Waiting consumers and the reader notice the
+  flag within a second. Safe to call from a signal handler.
+*/
+void streamAbort(sStream *psStream)
+{
+  if (psStream)
+    psStream->iAbort = TRUE;
+}
+
+/*
+  Tear down the stream. If the reader is still blocked on its input (e.g.
+  -F ended the audit while a generator was running) it is left detached,
+  as we are about to exit anyway.
+*/
+void streamClose(sStream *psStream)
+{
+  sStreamBlock *psBlock;
+  int iEOF;
+
+  if (psStream == NULL)
+    return;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+  psStream->iAbort = TRUE;
+  iEOF = psStream->iEOF;
+  pthread_cond_broadcast(&psStream->ptcSpace);
+  pthread_mutex_unlock(&psStream->ptmMutex);
+
+  if (!iEOF)
+  {
+    if (psStream->pidFilter > 0)
+      kill(psStream->pidFilter, SIGTERM);
+
+    pthread_detach(psStream->thrReader);
+    return;
+  }
+
+  pthread_join(psStream->thrReader, NULL);
+
+  while (psStream->psHead)
+  {
+    psBlock = psStream->psHead;
+    psStream->psHead = psBlock->psNext;
+    free(psBlock);
+  }
+
+  pthread_cond_destroy(&psStream->ptcData);
+  pthread_cond_destroy(&psStream->ptcSpace);
+  pthread_mutex_destroy(&psStream->ptmMutex);
+  free(psStream->pName);
+  free(psStream);
+}
+
+/* Position a new cursor at the head of the chain */
+void streamAttach(sStream *psStream, sStreamBlock **ppsCursor, size_t *pnOffset)
+{
+  pthread_mutex_lock(&psStream->ptmMutex);
+  psStream->psHead->iRef++;
+  *ppsCursor = psStream->psHead;
+  *pnOffset = 0;
+  pthread_mutex_unlock(&psStream->ptmMutex);
+}
+
+/* Release a cursor (or the pin returned by streamOpen()) */
+void streamRelease(sStream *psStream, sStreamBlock **ppsCursor)
+{
+  if ((psStream == NULL) || (*ppsCursor == NULL))
+    return;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+  (*ppsCursor)->iRef--;
+  *ppsCursor = NULL;
+  streamCollect(psStream);
+  pthread_mutex_unlock(&psStream->ptmMutex);
+}
+
+/*
+  Keep the block of an entry handed out to a login thread alive until its
+  result has been reported. Modules may test several credentials at once,
+  so a login thread can hold any number of entries.
+*/
+void streamHoldEntry(sStream *psStream, sStreamHolds *psHolds, sStreamBlock *psBlock, char *pEntry)
+{
+  pthread_mutex_lock(&psStream->ptmMutex);
+
+  if (psHolds->nHeld == psHolds->nAlloc)
+  {
+    psHolds->nAlloc = (psHolds->nAlloc) ? psHolds->nAlloc * 2 : 8;
+    psHolds->psHeld = realloc(psHolds->psHeld, psHolds->nAlloc * sizeof(sStreamHeld));
+    if (psHolds->psHeld == NULL)
+      writeError(ERR_FATAL, "Failed to allocate memory for candidate stream.");
+  }
+
+  psBlock->iRef++;
+  psHolds->psHeld[psHolds->nHeld].pEntry = pEntry;
+  psHolds->psHeld[psHolds->nHeld].psBlock = psBlock;
+  psHolds->psHeld[psHolds->nHeld].iDone = FALSE;
+  psHolds->nHeld++;
+
+  pthread_mutex_unlock(&psStream->ptmMutex);
+}
+
+/*
+  The result of an entry held by streamHoldEntry() has been reported (or the
+  entry was skipped). The module may still be using it, so its block is only
+  released by the next streamReleaseDone(). Entries which are not held (e.g.
+  missed credentials) are ignored. Some modules report a copy of the entry,
+  which is matched by its value instead.
+*/
+void streamDoneEntry(sStream *psStream, sStreamHolds *psHolds, char *pEntry)
+{
+  int i, iMatch = -1;
+
+  if ((psStream == NULL) || (pEntry == NULL) || (psHolds->nHeld == 0))
+    return;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+
+  for (i = psHolds->iFirst; (i < psHolds->nHeld) && (iMatch < 0); i++)
+  {
+    if ((!psHolds->psHeld[i].iDone) && (psHolds->psHeld[i].pEntry == pEntry))
+      iMatch = i;
+  }
+
+  for (i = psHolds->iFirst; (i < psHolds->nHeld) && (iMatch < 0); i++)
+  {
+    if ((!psHolds->psHeld[i].iDone) && (strcmp(psHolds->psHeld[i].pEntry, pEntry) == 0))
+      iMatch = i;
+  }
+
+  if (iMatch >= 0)
+  {
+    psHolds->psHeld[iMatch].iDone = TRUE;
+    psHolds->nDone++;
+  }
+
+  while ((psHolds->iFirst < psHolds->nHeld) && (psHolds->psHeld[psHolds->iFirst].iDone))
+    psHolds->iFirst++;
+
+  pthread_mutex_unlock(&psStream->ptmMutex);
+}
+
+/* Release the blocks of the entries reported since the last call */
+void streamReleaseDone(sStream *psStream, sStreamHolds *psHolds)
+{
+  int i, nKept = 0;
+
+  if ((psStream == NULL) || (psHolds->nDone == 0))
+    return;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+
+  for (i = 0; i < psHolds->nHeld; i++)
+  {
+    if (psHolds->psHeld[i].iDone)
+      psHolds->psHeld[i].psBlock->iRef--;
+    else
+      psHolds->psHeld[nKept++] = psHolds->psHeld[i];
+  }
+
+  psHolds->nHeld = nKept;
+  psHolds->nDone = 0;
+  psHolds->iFirst = 0;
+  streamCollect(psStream);
+
+  pthread_mutex_unlock(&psStream->ptmMutex);
+}
+
+/* Release every entry held by a login thread which is ending */
+void streamReleaseHolds(sStream *psStream, sStreamHolds *psHolds)
+{
+  int i;
+
+  if (psStream)
+  {
+    pthread_mutex_lock(&psStream->ptmMutex);
+
+    for (i = 0; i < psHolds->nHeld; i++)
+      psHolds->psHeld[i].psBlock->iRef--;
+
+    streamCollect(psStream);
+    pthread_mutex_unlock(&psStream->ptmMutex);
+  }
+
+  free(psHolds->psHeld);
+  memset(psHolds, 0, sizeof(sStreamHolds));
+}
+
+/*
+  Return the next entry for the given cursor, waiting for the reader if
+  needed. NULL is returned at the end of the stream or when aborting. The
+  returned entry stays valid while the caller holds a reference on the
+  cursor's block (see streamHoldEntry()).
+*/
+char* streamNextEntry(sStream *psStream, sStreamBlock **ppsCursor, size_t *pnOffset)
+{
+  sStreamBlock *psBlock;
+  struct timespec tsWait;
+  char *pEntry = NULL;
+
+  if (*ppsCursor == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+
+  while (pEntry == NULL)
+  {
+    psBlock = *ppsCursor;
+
+    if (*pnOffset < psBlock->nUsed)
+    {
+      pEntry = psBlock->pData + *pnOffset;
+      *pnOffset += strlen(pEntry) + 1;
+    }
+    else if (psBlock->psNext)
+    {
+      psBlock->psNext->iRef++;
+      psBlock->iRef--;
+      *ppsCursor = psBlock->psNext;
+      *pnOffset = 0;
+      streamCollect(psStream);
+    }
+    else if ((psStream->iEOF) || (psStream->iAbort))
+    {
+      break;
+    }
+    else
+    {
+      psStream->iWaiting++;
+      if (psStream->iOverflow)
+        pthread_cond_signal(&psStream->ptcSpace);
+
+      clock_gettime(CLOCK_REALTIME, &tsWait);
+      tsWait.tv_sec += STREAM_STALL;
+
+      /* nothing released while the reader waits on a full chain - let it grow */
+      if ((pthread_cond_timedwait(&psStream->ptcData, &psStream->ptmMutex, &tsWait) == ETIMEDOUT) &&
+          (psStream->iBlocks >= STREAM_MAX_BLOCKS) && (psBlock == psStream->psTail) && (*pnOffset >= psBlock->nUsed))
+      {
+        psStream->iOverflow = TRUE;
+        pthread_cond_signal(&psStream->ptcSpace);
+      }
+
+      psStream->iWaiting--;
+    }
+  }
+
+  pthread_mutex_unlock(&psStream->ptmMutex);
+
+  return pEntry;
+}
+
+/*
+  Number of entries read so far. Returns TRUE once the end of the stream
+  has been reached and the count is final.
+*/
+int streamCount(sStream *psStream, int *piCount)
+{
+  int iEOF;
+
+  pthread_mutex_lock(&psStream->ptmMutex);
+  *piCount = psStream->iCount;
+  iEOF = psStream->iEOF;
+  pthread_mutex_unlock(&psStream->ptmMutex);
+
+  return iEOF;
+}
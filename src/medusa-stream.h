@@ -0,0 +1,108 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_STREAM_H
+#define _MEDUSA_STREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "medusa-utils.h"
+
+/*
+  Candidate lists which cannot be rewound (stdin, FIFOs, compressed files)
+  are read by a background thread into a chain of fixed-size blocks. Each
+  block holds NUL-separated entries. Consumers walk the chain with their own
+  cursor and hold a reference on the block they are positioned in. Every
+  entry handed out to a login thread holds a reference on its block as well,
+  until its result is reported. Blocks are released from the head of the
+  chain once nothing references them.
+*/
+#define STREAM_BLOCK_SIZE (64 * 1024)
+#define STREAM_MAX_BLOCKS 64              // read-ahead limit before the reader waits
+#define STREAM_STALL 1                    // seconds consumers wait on a full chain before it may grow
+#define STREAM_DEDUPE_MAX (4 * 1024 * 1024) // unique entries tracked for duplicate removal
+
+typedef struct __sStreamBlock {
+  struct __sStreamBlock *psNext;
+  size_t nUsed;                           // bytes of entries published to consumers
+  int iRef;                               // cursors and entries handed out using block
+  char pData[STREAM_BLOCK_SIZE + 1];
+} sStreamBlock;
+
+/* Entry handed out to a login thread */
+typedef struct __sStreamHeld {
+  char *pEntry;
+  sStreamBlock *psBlock;
+  int iDone;                              // result reported - released on the next streamReleaseDone()
+} sStreamHeld;
+
+/* Entries held by a login thread, in the order they were handed out */
+typedef struct __sStreamHolds {
+  sStreamHeld *psHeld;
+  int iFirst;                             // first entry not reported
+  int nHeld;
+  int nDone;
+  int nAlloc;
+} sStreamHolds;
+
+typedef struct __sStream {
+  char *pName;
+  FILE *pfFile;
+  pid_t pidFilter;                        // decompression process, 0 if none
+  const char* (*pfnNext)(void *);         // callback supplying the entries instead of pfFile (libmedusa)
+  void *pNextArg;
+  pthread_t thrReader;
+  pthread_mutex_t ptmMutex;
+  pthread_cond_t ptcData;                 // entries appended or end of stream
+  pthread_cond_t ptcSpace;                // blocks released or consumers stalled on a full chain
+  sStreamBlock *psHead;
+  sStreamBlock *psTail;
+  int iBlocks;
+  int iWaiting;                           // consumers waiting on the tail of the chain
+  int iOverflow;                          // consumers stalled on a full chain - grow it on demand until a block is released
+  int iOverflowNoticed;
+  int iCount;                             // entries read so far
+  int iDuplicates;                        // duplicate entries dropped
+  fpset sSeen;
+  int iEOF;
+  int iAbort;
+} sStream;
+
+FILE* openCandidateFile(char *pFile, pid_t *pidFilter);
+int closeCandidateFile(FILE *pfFile, pid_t pidFilter);
+int isStreamSource(char *pFile);
+
+sStream* streamOpen(char *pFile, sStreamBlock **ppsCursor);
+sStream* streamOpenCallback(char *pName, const char* (*pfnNext)(void *), void *pArg, sStreamBlock **ppsCursor);
+void streamClose(sStream *psStream);
+void streamAbort(sStream *psStream);
+void streamAttach(sStream *psStream, sStreamBlock **ppsCursor, size_t *pnOffset);
+void streamRelease(sStream *psStream, sStreamBlock **ppsCursor);
+void streamHoldEntry(sStream *psStream, sStreamHolds *psHolds, sStreamBlock *psBlock, char *pEntry);
+void streamDoneEntry(sStream *psStream, sStreamHolds *psHolds, char *pEntry);
+void streamReleaseDone(sStream *psStream, sStreamHolds *psHolds);
+void streamReleaseHolds(sStream *psStream, sStreamHolds *psHolds);
+char* streamNextEntry(sStream *psStream, sStreamBlock **ppsCursor, size_t *pnOffset);
+int streamCount(sStream *psStream, int *piCount);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * Multi-service task files
+ *
+*/
+
+#include "medusa.h"
+
+/* nmap service names and the module used to audit them */
+typedef struct __sServiceMap {
+  char *pService;
+  char *pModuleName;
+  int iUseSSL;
+} sServiceMap;
+
+static sServiceMap arrServiceMap[] = {
+  { "afp",            "afp",        0 },
+  { "cvspserver",     "cvs",        0 },
+  { "exec",           "rexec",      0 },
+  { "ftp",            "ftp",        0 },
+  { "http",           "http",       0 },
+  { "http-alt",       "http",       0 },
+  { "http-proxy",     "http",       0 },
+  { "https",          "http",       1 },
+  { "https-alt",      "http",       1 },
+  { "imap",           "imap",       0 },
+  { "imaps",          "imap",       1 },
+  { "login",          "rlogin",     0 },
+  { "microsoft-ds",   "smbnt",      0 },
+  { "ms-sql-s",       "mssql",      0 },
+  { "ms-wbt-server",  "rdp",        0 },
+  { "mysql",          "mysql",      0 },
+  { "netbios-ssn",    "smbnt",      0 },
+  { "nntp",           "nntp",       0 },
+  { "pcanywheredata", "pcanywhere", 0 },
+  { "pop3",           "pop3",       0 },
+  { "pop3s",          "pop3",       1 },
+  { "postgresql",     "postgres",   0 },
+  { "shell",          "rsh",        0 },
+  { "smtp",           "smtp",       0 },
+  { "smtps",          "smtp",       1 },
+  { "ssh",            "ssh",        0 },
+  { "submission",     "smtp",       0 },
+  { "svn",            "svn",        0 },
+  { "telnet",         "telnet",     0 },
+  { "vmware-auth",    "vmauthd",    0 },
+  { "vnc",            "vnc",        0 },
+  { NULL,             NULL,         0 }
+};
+
+/*
+  Return the index of the service using the given module and options,
+  adding it if it is new. Hosts sharing a service share its settings.
+*/
+int addService(sAudit *_psAudit, char *_pModuleName, char **_arrParams, int _nParams, int _iUseSSL)
+{
+  sService *psService;
+  int i, j;
+
+  for (i = 0; i < _psAudit->nServices; i++)
+  {
+    psService = &_psAudit->psServices[i];
+
+    if ((strcmp(psService->pModuleName, _pModuleName) != 0) || (psService->iUseSSL != _iUseSSL) || (psService->nModuleParamCount != _nParams))
+      continue;
+
+    for (j = 0; j < _nParams; j++)
+    {
+      if (strcmp(psService->arrModuleParams[j], _arrParams[j]) != 0)
+        break;
+    }
+
+    if (j == _nParams)
+      return i;
+  }
+
+  _psAudit->psServices = realloc(_psAudit->psServices, (_psAudit->nServices + 1) * sizeof(sService));
+  if (_psAudit->psServices == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for services.");
+
+  psService = &_psAudit->psServices[_psAudit->nServices];
+  memset(psService, 0, sizeof(sService));
+  psService->pModuleName = strdup(_pModuleName);
+  psService->iUseSSL = _iUseSSL;
+  psService->nModuleParamCount = _nParams;
+  psService->arrModuleParams = malloc((_nParams + 1) * sizeof(char*));
+  for (j = 0; j < _nParams; j++)
+    psService->arrModuleParams[j] = strdup(_arrParams[j]);
+  psService->arrModuleParams[_nParams] = NULL;
+
+  writeError(ERR_DEBUG, "Added service %d: module %s (SSL: %d, %d module parameters)", _psAudit->nServices, _pModuleName, _iUseSSL, _nParams);
+
+  return _psAudit->nServices++;
+}
+
+void freeServices(sAudit *_psAudit)
+{
+  int i, j;
+
+  for (i = 0; i < _psAudit->nServices; i++)
+  {
+    for (j = 0; j < _psAudit->psServices[i].nModuleParamCount; j++)
+      FREE(_psAudit->psServices[i].arrModuleParams[j]);
+
+    FREE(_psAudit->psServices[i].arrModuleParams);
+    FREE(_psAudit->psServices[i].pModuleName);
+  }
+
+  FREE(_psAudit->psServices);
+  _psAudit->nServices = 0;
+}
+
+/*
+  Native task line: TARGET:MODULE [-s] [-m PARAM ...]
+*/
+static int loadTaskLine(sAudit *_psAudit, char *_pLine)
+{
+  char *arrParams[TASK_MAX_PARAMS];
+  char *pTarget, *pModule, *pToken;
+  char *pSave = NULL;
+  char *pTask;
+  int nParams = 0;
+  int iUseSSL = 0;
+  int iRet;
+
+  /* the line is tokenized in place - keep it whole for error messages */
+  pTask = strdup(_pLine);
+
+  pTarget = strtok_r(_pLine, " \t", &pSave);
+  if ((pTarget == NULL) || ((pModule = rindex(pTarget, ':')) == NULL) || (pModule[1] == '\0'))
+  {
+    writeError(ERR_ERROR, "Task is missing a module (TARGET:MODULE): %s", pTask);
+    free(pTask);
+    return FAILURE;
+  }
+
+  *pModule++ = '\0';
+
+  while ((pToken = strtok_r(NULL, " \t", &pSave)) != NULL)
+  {
+    if (strcmp(pToken, "-s") == 0)
+    {
+      iUseSSL = 1;
+    }
+    else if ((strcmp(pToken, "-m") == 0) && ((pToken = strtok_r(NULL, " \t", &pSave)) != NULL) && (nParams < TASK_MAX_PARAMS))
+    {
+      arrParams[nParams++] = pToken;
+    }
+    else
+    {
+      writeError(ERR_ERROR, "Invalid option %s in task: %s", (pToken) ? pToken : "-m", pTask);
+      free(pTask);
+      return FAILURE;
+    }
+  }
+
+  iRet = hostListAdd(&_psAudit->sHostList, pTarget, addService(_psAudit, pModule, arrParams, nParams, iUseSSL));
+  free(pTask);
+
+  return iRet;
+}
+
+/*
+  nmap grepable output (-oG):
+    Host: 10.0.0.1 (name)	Ports: 22/open/tcp//ssh///, 443/open/tcp//ssl|http///	Ignored State: ...
+  Port fields are port/state/protocol/owner/service/rpc/version.
+*/
+static int loadNmapLine(sAudit *_psAudit, char *_pLine)
+{
+  char szTarget[HOST_SPEC_MAX_LEN];
+  char *pHost, *pPorts, *pEntry, *pField;
+  char *pPort, *pState, *pProto, *pService;
+  char *pSave = NULL;
+  int iUseSSL;
+  int i;
+
+  pPorts = strstr(_pLine, "\tPorts: ");
+  if (pPorts == NULL)
+    return SUCCESS;   /* status line (e.g. "Status: Up") */
+
+  pHost = _pLine + strlen("Host: ");
+  pHost[strcspn(pHost, " \t")] = '\0';
+
+  pPorts += strlen("\tPorts: ");
+  pPorts[strcspn(pPorts, "\t")] = '\0';
+
+  for (pEntry = strtok_r(pPorts, ",", &pSave); pEntry; pEntry = strtok_r(NULL, ",", &pSave))
+  {
+    while (*pEntry == ' ')
+      pEntry++;
+
+    pField = pEntry;
+    pPort = strsep(&pField, "/");
+    pState = strsep(&pField, "/");
+    pProto = strsep(&pField, "/");
+    strsep(&pField, "/");
+    pService = strsep(&pField, "/");
+
+    if ((pService == NULL) || (strcmp(pState, "open") != 0) || (strcmp(pProto, "tcp") != 0))
+      continue;
+
+    /* service behind an SSL/TLS tunnel */
+    iUseSSL = 0;
+    if (strncmp(pService, "ssl|", 4) == 0)
+    {
+      iUseSSL = 1;
+      pService += 4;
+    }
+
+    for (i = 0; arrServiceMap[i].pService; i++)
+    {
+      if (strcmp(arrServiceMap[i].pService, pService) == 0)
+        break;
+    }
+
+    if (arrServiceMap[i].pService == NULL)
+    {
+      writeError(ERR_DEBUG, "No module for nmap service: %s (host: %s port: %s)", pService, pHost, pPort);
+      continue;
+    }
+
+    snprintf(szTarget, sizeof(szTarget), (index(pHost, ':')) ? "[%s]:%s" : "%s:%s", pHost, pPort);
+    if (hostListAdd(&_psAudit->sHostList, szTarget, addService(_psAudit, arrServiceMap[i].pModuleName, NULL, 0, iUseSSL | arrServiceMap[i].iUseSSL)) == FAILURE)
+      return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/*
+  Read a task file (-X) into the target list. Every task references the
+  service (module and options) it is audited with.
+*/
+int loadTaskFile(sAudit *_psAudit, char *_pFile)
+{
+  char *pTaskFile = NULL;
+  char *pLine, *pNext;
+  int iCnt;
+  int iRet = SUCCESS;
+
+  /* loadFile() frees the name it is given */
+  loadFile(strdup(_pFile), &pTaskFile, &iCnt);
+
+  /* lines are tokenized in place - find the next one first */
+  for (pLine = pTaskFile; (*pLine != '\0') && (iRet == SUCCESS); pLine = pNext)
+  {
+    pNext = pLine + strlen(pLine) + 1;
+
+    if (pLine[0] == '#')
+      continue;
+    else if (strncmp(pLine, "Host: ", 6) == 0)
+      iRet = loadNmapLine(_psAudit, pLine);
+    else
+      iRet = loadTaskLine(_psAudit, pLine);
+  }
+
+  FREE(pTaskFile);
+
+  if ((iRet == SUCCESS) && (_psAudit->sHostList.iHostCnt == 0))
+  {
+    writeError(ERR_ERROR, "Task file contains no tasks: %s", _pFile);
+    iRet = FAILURE;
+  }
+
+  writeError(ERR_DEBUG, "Loaded %d tasks (%d services) from file: %s", _psAudit->sHostList.iHostCnt, _psAudit->nServices, _pFile);
+
+  return iRet;
+}
@@ -0,0 +1,44 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_TASK_H
+#define _MEDUSA_TASK_H
+
+/*
+  Task files (-X) audit several services in one run. Each line maps a target
+  to the module used to test it:
+
+    TARGET:MODULE [-s] [-m PARAM ...]
+
+  TARGET is any -h host specification (host, CIDR block or range, with an
+  optional :PORT). Lines of nmap grepable output (-oG) are also accepted;
+  every open TCP port with a known service becomes a task.
+*/
+#define TASK_MAX_PARAMS 32
+
+struct __sAudit;
+
+int addService(struct __sAudit *_psAudit, char *_pModuleName, char **_arrParams, int _nParams, int _iUseSSL);
+void freeServices(struct __sAudit *_psAudit);
+int loadTaskFile(struct __sAudit *_psAudit, char *_pFile);
+
+#endif
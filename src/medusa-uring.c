@@ -0,0 +1,419 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+ * io_uring network backend used by medusa-net (-I)
+ *
+*/
+
+#include "medusa.h"
+#include "medusa-uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <stdint.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* user_data of the completions */
+#define URING_OP 0
+#define URING_OP_TIMEOUT 1
+
+static int iUringEnabled = FALSE;
+static pthread_key_t pkUring;
+static pthread_once_t poUring = PTHREAD_ONCE_INIT;
+
+/* liburing is not required - the rings are set up with the system calls */
+static int sysSetup(unsigned nEntries, struct io_uring_params *psParams)
+{
+  return (int)syscall(__NR_io_uring_setup, nEntries, psParams);
+}
+
+static int sysEnter(int hRing, unsigned nSubmit, unsigned nComplete, unsigned nFlags)
+{
+  return (int)syscall(__NR_io_uring_enter, hRing, nSubmit, nComplete, nFlags, NULL, 0);
+}
+
+static int sysRegister(int hRing, unsigned nOpcode, void *pArg, unsigned nArgs)
+{
+  return (int)syscall(__NR_io_uring_register, hRing, nOpcode, pArg, nArgs);
+}
+
+static void ringClose(sUring *psRing)
+{
+  if (psRing->arrSqe)
+    munmap(psRing->arrSqe, psRing->nSqeMap);
+  if ((psRing->pCqMap) && (psRing->pCqMap != psRing->pSqMap))
+    munmap(psRing->pCqMap, psRing->nCqMap);
+  if (psRing->pSqMap)
+    munmap(psRing->pSqMap, psRing->nSqMap);
+  if (psRing->hRing >= 0)
+    close(psRing->hRing);
+
+  memset(psRing, 0, sizeof(sUring));
+  psRing->hRing = -1;
+}
+
+static int ringOpen(sUring *psRing)
+{
+  struct io_uring_params sParams;
+  char *pSq, *pCq;
+
+  memset(psRing, 0, sizeof(sUring));
+  memset(&sParams, 0, sizeof(sParams));
+
+  psRing->hRing = sysSetup(URING_ENTRIES, &sParams);
+  if (psRing->hRing < 0)
+    return FAILURE;
+
+  psRing->nSqMap = sParams.sq_off.array + sParams.sq_entries * sizeof(unsigned);
+  psRing->nCqMap = sParams.cq_off.cqes + sParams.cq_entries * sizeof(struct io_uring_cqe);
+  if (sParams.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (psRing->nCqMap > psRing->nSqMap)
+      psRing->nSqMap = psRing->nCqMap;
+    psRing->nCqMap = psRing->nSqMap;
+  }
+
+  psRing->pSqMap = mmap(NULL, psRing->nSqMap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, psRing->hRing, IORING_OFF_SQ_RING);
+  if (psRing->pSqMap == MAP_FAILED)
+  {
+    psRing->pSqMap = NULL;
+    ringClose(psRing);
+    return FAILURE;
+  }
+
+  if (sParams.features & IORING_FEAT_SINGLE_MMAP)
+    psRing->pCqMap = psRing->pSqMap;
+  else
+  {
+    psRing->pCqMap = mmap(NULL, psRing->nCqMap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, psRing->hRing, IORING_OFF_CQ_RING);
+    if (psRing->pCqMap == MAP_FAILED)
+    {
+      psRing->pCqMap = NULL;
+      ringClose(psRing);
+      return FAILURE;
+    }
+  }
+
+  psRing->nSqeMap = sParams.sq_entries * sizeof(struct io_uring_sqe);
+  psRing->arrSqe = mmap(NULL, psRing->nSqeMap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, psRing->hRing, IORING_OFF_SQES);
+  if (psRing->arrSqe == MAP_FAILED)
+  {
+    psRing->arrSqe = NULL;
+    ringClose(psRing);
+    return FAILURE;
+  }
+
+  pSq = psRing->pSqMap;
+  psRing->pSqHead = (unsigned *)(pSq + sParams.sq_off.head);
+  psRing->pSqTail = (unsigned *)(pSq + sParams.sq_off.tail);
+  psRing->pSqMask = (unsigned *)(pSq + sParams.sq_off.ring_mask);
+  psRing->pSqArray = (unsigned *)(pSq + sParams.sq_off.array);
+
+  pCq = psRing->pCqMap;
+  psRing->pCqHead = (unsigned *)(pCq + sParams.cq_off.head);
+  psRing->pCqTail = (unsigned *)(pCq + sParams.cq_off.tail);
+  psRing->pCqMask = (unsigned *)(pCq + sParams.cq_off.ring_mask);
+  psRing->arrCqe = (struct io_uring_cqe *)(pCq + sParams.cq_off.cqes);
+
+  return SUCCESS;
+}
+
+/* thread exit - operations still in flight are cancelled when the ring is closed */
+static void ringFree(void *pRing)
+{
+  ringClose((sUring *)pRing);
+  free(pRing);
+}
+
+static void createKey(void)
+{
+  pthread_key_create(&pkUring, ringFree);
+}
+
+/* ring of the calling thread, NULL if it could not be set up */
+static sUring* getRing(void)
+{
+  sUring *psRing;
+
+  psRing = pthread_getspecific(pkUring);
+  if (psRing == NULL)
+  {
+    psRing = malloc(sizeof(sUring));
+    if (ringOpen(psRing) == FAILURE)
+      writeError(ERR_DEBUG, "[getRing] io_uring setup failed (%s) - thread uses the select() based network functions.", strerror(errno));
+    pthread_setspecific(pkUring, psRing);
+  }
+
+  return (psRing->hRing < 0) ? NULL : psRing;
+}
+
+static struct io_uring_sqe* getSqe(sUring *psRing, int iOpcode, int hSocket, uint64_t nUserData)
+{
+  struct io_uring_sqe *psSqe;
+  unsigned nIndex;
+
+  nIndex = (*psRing->pSqTail + psRing->nQueued) & *psRing->pSqMask;
+  psSqe = &psRing->arrSqe[nIndex];
+  memset(psSqe, 0, sizeof(struct io_uring_sqe));
+  psSqe->opcode = iOpcode;
+  psSqe->fd = hSocket;
+  psSqe->user_data = nUserData;
+
+  psRing->pSqArray[nIndex] = nIndex;
+  psRing->nQueued++;
+
+  return psSqe;
+}
+
+/*
+  Submit the queued entries and wait for their nWait completions, whose
+  results are stored in arrResult by user_data. The thread may be cancelled
+  once the wait is over - every operation is bounded by its timeout.
+*/
+static int submitWait(sUring *psRing, int *arrResult, unsigned nWait)
+{
+  struct io_uring_cqe *psCqe;
+  unsigned nSubmit, nDone = 0, nHead, nTail;
+  int ret;
+
+  nSubmit = psRing->nQueued;
+  __atomic_store_n(psRing->pSqTail, *psRing->pSqTail + psRing->nQueued, __ATOMIC_RELEASE);
+  psRing->nQueued = 0;
+
+  while (1)
+  {
+    nHead = *psRing->pCqHead;
+    nTail = __atomic_load_n(psRing->pCqTail, __ATOMIC_ACQUIRE);
+    while (nHead != nTail)
+    {
+      psCqe = &psRing->arrCqe[nHead & *psRing->pCqMask];
+      if (psCqe->user_data <= URING_OP_TIMEOUT)
+        arrResult[psCqe->user_data] = psCqe->res;
+      nHead++;
+      nDone++;
+    }
+    __atomic_store_n(psRing->pCqHead, nHead, __ATOMIC_RELEASE);
+
+    if (nDone >= nWait)
+      break;
+
+    ret = sysEnter(psRing->hRing, nSubmit, nWait - nDone, IORING_ENTER_GETEVENTS);
+    if (ret >= 0)
+      nSubmit -= ((unsigned)ret < nSubmit) ? (unsigned)ret : nSubmit;
+    else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+    {
+      /* the state of the ring is unknown - the thread goes back to select() */
+      writeError(ERR_ERROR, "io_uring_enter() failed (%s) - using the select() based network functions.", strerror(errno));
+      ringClose(psRing);
+      return FAILURE;
+    }
+  }
+
+  pthread_testcancel();
+  return SUCCESS;
+}
+
+/*
+  Submit the queued operation (URING_OP) with a timeout of nWait
+  microseconds. Returns its result, or URING_TIMEOUT.
+*/
+static int submitTimed(sUring *psRing, struct io_uring_sqe *psOp, long nWait)
+{
+  struct io_uring_sqe *psSqe;
+  struct __kernel_timespec sTimeout;
+  int arrResult[2] = { -ECANCELED, 0 };
+
+  if (nWait < 0)
+    nWait = 0;
+  sTimeout.tv_sec = nWait / 1000000;
+  sTimeout.tv_nsec = (nWait % 1000000) * 1000;
+
+  psOp->flags |= IOSQE_IO_LINK;
+  psSqe = getSqe(psRing, IORING_OP_LINK_TIMEOUT, -1, URING_OP_TIMEOUT);
+  psSqe->addr = (uintptr_t)&sTimeout;
+  psSqe->len = 1;
+
+  if (submitWait(psRing, arrResult, 2) == FAILURE)
+    return -EIO;
+
+  /* an operation completing as its timeout expires keeps its result */
+  if ((arrResult[URING_OP] == -ECANCELED) && (arrResult[URING_OP_TIMEOUT] == -ETIME))
+    return URING_TIMEOUT;
+
+  return arrResult[URING_OP];
+}
+
+/*
+  Check that io_uring may be used and provides the operations needed. Login
+  threads started afterwards use it for their connections.
+*/
+int uringEnable(void)
+{
+  sUring sRing;
+  struct io_uring_probe *psProbe;
+  size_t nProbe;
+  int arrOps[] = { IORING_OP_CONNECT, IORING_OP_RECV, IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT };
+  int i, ret = SUCCESS;
+
+  if (iUringEnabled)
+    return SUCCESS;
+
+  if (ringOpen(&sRing) == FAILURE)
+  {
+    writeError(ERR_ALERT, "io_uring is not available (%s) - using the select() based network functions.", strerror(errno));
+    return FAILURE;
+  }
+
+  nProbe = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  psProbe = malloc(nProbe);
+  memset(psProbe, 0, nProbe);
+
+  if (sysRegister(sRing.hRing, IORING_REGISTER_PROBE, psProbe, 256) < 0)
+  {
+    writeError(ERR_ALERT, "io_uring is too old (%s) - using the select() based network functions.", strerror(errno));
+    ret = FAILURE;
+  }
+  else
+  {
+    for (i = 0; i < (int)(sizeof(arrOps) / sizeof(int)); i++)
+    {
+      if ((arrOps[i] > psProbe->last_op) || (!(psProbe->ops[arrOps[i]].flags & IO_URING_OP_SUPPORTED)))
+      {
+        writeError(ERR_ALERT, "io_uring does not support operation %d - using the select() based network functions.", arrOps[i]);
+        ret = FAILURE;
+        break;
+      }
+    }
+  }
+
+  free(psProbe);
+  ringClose(&sRing);
+
+  if (ret == SUCCESS)
+  {
+    pthread_once(&poUring, createKey);
+    iUringEnabled = TRUE;
+    writeError(ERR_DEBUG, "[uringEnable] Using the io_uring network backend.");
+  }
+
+  return ret;
+}
+
+/* TRUE when the calling thread performs its network operations with io_uring */
+int uringActive(void)
+{
+  if (!iUringEnabled)
+    return FALSE;
+
+  return (getRing() != NULL) ? TRUE : FALSE;
+}
+
+/*
+  Connect hSocket, waiting up to nWait microseconds. Returns 0 once
+  connected, URING_TIMEOUT or -errno. The socket keeps connecting after a
+  timeout: wait for it with uringPoll(POLLOUT).
+*/
+int uringConnect(int hSocket, const struct sockaddr *psAddr, socklen_t nLen, long nWait)
+{
+  sUring *psRing;
+  struct io_uring_sqe *psSqe;
+
+  if ((psRing = getRing()) == NULL)
+    return -ENOSYS;
+
+  psSqe = getSqe(psRing, IORING_OP_CONNECT, hSocket, URING_OP);
+  psSqe->addr = (uintptr_t)psAddr;
+  psSqe->off = nLen;
+
+  return submitTimed(psRing, psSqe, nWait);
+}
+
+/* Wait up to nWait microseconds for nEvents. Returns the events, URING_TIMEOUT or -errno. */
+int uringPoll(int hSocket, short nEvents, long nWait)
+{
+  sUring *psRing;
+  struct io_uring_sqe *psSqe;
+
+  if ((psRing = getRing()) == NULL)
+    return -ENOSYS;
+
+  psSqe = getSqe(psRing, IORING_OP_POLL_ADD, hSocket, URING_OP);
+#if __BYTE_ORDER == __BIG_ENDIAN
+  psSqe->poll32_events = ((uint32_t)nEvents << 16) | ((uint32_t)nEvents >> 16);
+#else
+  psSqe->poll32_events = (uint16_t)nEvents;
+#endif
+
+  return submitTimed(psRing, psSqe, nWait);
+}
+
+/*
+  Receive up to nLength bytes, waiting up to nWait microseconds for them.
+  Returns the bytes received (0 once the peer closed the connection),
+  URING_TIMEOUT or -errno.
+*/
+int uringRecv(int hSocket, void *pBuf, int nLength, int nFlags, long nWait)
+{
+  sUring *psRing;
+  struct io_uring_sqe *psSqe;
+
+  if ((psRing = getRing()) == NULL)
+    return -ENOSYS;
+
+  psSqe = getSqe(psRing, IORING_OP_RECV, hSocket, URING_OP);
+  psSqe->addr = (uintptr_t)pBuf;
+  psSqe->len = nLength;
+  psSqe->msg_flags = nFlags;
+
+  return submitTimed(psRing, psSqe, nWait);
+}
+
+#else
+
+int uringEnable(void)
+{
+  writeError(ERR_ALERT, "Medusa was built without io_uring support - using the select() based network functions.");
+  return FAILURE;
+}
+
+int uringActive(void)
+{
+  return FALSE;
+}
+
+int uringConnect(int hSocket __attribute__((unused)), const struct sockaddr *psAddr __attribute__((unused)), socklen_t nLen __attribute__((unused)), long nWait __attribute__((unused)))
+{
+  return -ENOSYS;
+}
+
+int uringPoll(int hSocket __attribute__((unused)), short nEvents __attribute__((unused)), long nWait __attribute__((unused)))
+{
+  return -ENOSYS;
+}
+
+int uringRecv(int hSocket __attribute__((unused)), void *pBuf __attribute__((unused)), int nLength __attribute__((unused)), int nFlags __attribute__((unused)), long nWait __attribute__((unused)))
+{
+  return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Medusa Parallel Login Auditor
+ *
+ *    Copyright (C) 2006 Joe Mondloch
+ *    JoMo-Kun / jmk@foofus.net
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License version 2,
+ *    as published by the Free Software Foundation
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    http://www.gnu.org/licenses/gpl.txt
+ *
+ *    This program is released under the GPL with the additional exemption
+ *    that compiling, linking, and/or using OpenSSL is allowed.
+ *
+*/
+
+#ifndef _MEDUSA_URING_H
+#define _MEDUSA_URING_H
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+  io_uring network backend (-I). Each login thread owns a small ring, set up
+  the first time it connects. Waits on the network are submitted together
+  with a linked timeout, so one system call replaces:
+
+    connect       fcntl x4, connect, select, getsockopt   CONNECT + LINK_TIMEOUT
+    receive       select, recv                            RECV + LINK_TIMEOUT
+
+  Sockets are left blocking, so SSL and modules passing their socket to other
+  libraries are not affected. Without io_uring (older kernel, disabled by
+  kernel.io_uring_disabled or a seccomp filter) the select() based functions
+  are used.
+*/
+#define URING_ENTRIES 8
+#define URING_TIMEOUT (-ETIME)          // result of an operation whose timeout expired
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+typedef struct __sUring {
+  int hRing;                            // -1 when the ring could not be set up
+  void *pSqMap;
+  size_t nSqMap;
+  void *pCqMap;                         // same as pSqMap with IORING_FEAT_SINGLE_MMAP
+  size_t nCqMap;
+  struct io_uring_sqe *arrSqe;
+  size_t nSqeMap;
+  unsigned *pSqHead;
+  unsigned *pSqTail;
+  unsigned *pSqMask;
+  unsigned *pSqArray;
+  unsigned *pCqHead;
+  unsigned *pCqTail;
+  unsigned *pCqMask;
+  struct io_uring_cqe *arrCqe;
+  unsigned nQueued;                     // entries prepared, not submitted yet
+} sUring;
+
+#endif
+
+extern int uringEnable(void);
+extern int uringActive(void);
+extern int uringConnect(int hSocket, const struct sockaddr *psAddr, socklen_t nLen, long nWait);
+extern int uringPoll(int hSocket, short nEvents, long nWait);
+extern int uringRecv(int hSocket, void *pBuf, int nLength, int nFlags, long nWait);
+
+#endif
@@ -20,12 +20,164 @@
  *
 */
 
+#include <sys/socket.h>
 #include "medusa.h"
 #include "medusa-trace.h"
 #include "medusa-utils.h"
 
+/* Send or receive all of a buffer on a blocking socket */
+int recvAll(int hSocket, void *pBuf, size_t nLen)
+{
+  ssize_t nRead;
+  size_t nDone = 0;
+
+  while (nDone < nLen)
+  {
+    nRead = recv(hSocket, (char *)pBuf + nDone, nLen - nDone, 0);
+
+    if ((nRead < 0) && (errno == EINTR))
+      continue;
+
+    if (nRead <= 0)
+      return FAILURE;
+
+    nDone += nRead;
+  }
+
+  return SUCCESS;
+}
+
+int sendAll(int hSocket, const void *pBuf, size_t nLen)
+{
+  ssize_t nSent;
+  size_t nDone = 0;
+
+  while (nDone < nLen)
+  {
+    nSent = send(hSocket, (const char *)pBuf + nDone, nLen - nDone, MSG_NOSIGNAL);
+
+    if ((nSent < 0) && (errno == EINTR))
+      continue;
+
+    if (nSent <= 0)
+      return FAILURE;
+
+    nDone += nSent;
+  }
+
+  return SUCCESS;
+}
+
 /* Base64 Functions used from Wget (http://wget.sunsite.dk/) */
 
+/* Conversion table.  */
+static const char base64_tbl[64] = {
+  'A','B','C','D','E','F','G','H',
+  'I','J','K','L','M','N','O','P',
+  'Q','R','S','T','U','V','W','X',
+  'Y','Z','a','b','c','d','e','f',
+  'g','h','i','j','k','l','m','n',
+  'o','p','q','r','s','t','u','v',
+  'w','x','y','z','0','1','2','3',
+  '4','5','6','7','8','9','+','/'
+};
+
+/* Value of each base64 character. -1 marks all other characters.  */
+static const signed char base64_char_to_value[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* Incremental encoder, so that data held in several pieces can be encoded
+   without first being copied into one buffer.  */
+typedef struct
+{
+  char *p;
+  unsigned char carry[3];
+  int nCarry;
+} base64_state;
+
+static void base64_update(base64_state *st, const unsigned char *s, int length)
+{
+  unsigned long v;
+  char *p = st->p;
+
+  /* complete a group left over from the previous piece */
+  while ((st->nCarry > 0) && (st->nCarry < 3) && (length > 0))
+  {
+    st->carry[st->nCarry++] = *s++;
+    length--;
+  }
+
+  if (st->nCarry == 3)
+  {
+    v = (st->carry[0] << 16) | (st->carry[1] << 8) | st->carry[2];
+    *p++ = base64_tbl[(v >> 18) & 0x3f];
+    *p++ = base64_tbl[(v >> 12) & 0x3f];
+    *p++ = base64_tbl[(v >> 6) & 0x3f];
+    *p++ = base64_tbl[v & 0x3f];
+    st->nCarry = 0;
+  }
+
+  /* Transform the 3x8 bits to 4x6 bits, as required by base64.  */
+  while (length >= 3)
+  {
+    v = (s[0] << 16) | (s[1] << 8) | s[2];
+    *p++ = base64_tbl[(v >> 18) & 0x3f];
+    *p++ = base64_tbl[(v >> 12) & 0x3f];
+    *p++ = base64_tbl[(v >> 6) & 0x3f];
+    *p++ = base64_tbl[v & 0x3f];
+    s += 3;
+    length -= 3;
+  }
+
+  while (length-- > 0)
+    st->carry[st->nCarry++] = *s++;
+
+  st->p = p;
+}
+
+static void base64_final(base64_state *st)
+{
+  char *p = st->p;
+
+  /* Pad the result if necessary...  */
+  if (st->nCarry == 1)
+  {
+    *p++ = base64_tbl[st->carry[0] >> 2];
+    *p++ = base64_tbl[(st->carry[0] & 3) << 4];
+    *p++ = '=';
+    *p++ = '=';
+  }
+  else if (st->nCarry == 2)
+  {
+    *p++ = base64_tbl[st->carry[0] >> 2];
+    *p++ = base64_tbl[((st->carry[0] & 3) << 4) | (st->carry[1] >> 4)];
+    *p++ = base64_tbl[(st->carry[1] & 0xf) << 2];
+    *p++ = '=';
+  }
+
+  /* ...and zero-terminate it.  */
+  *p = '\0';
+
+  st->p = p;
+  st->nCarry = 0;
+}
+
 /* Encode the string STR of length LENGTH to base64 format and place it
    to B64STORE.  The output will be \0-terminated, and must point to a
    writable buffer of at least 1+BASE64_LENGTH(length) bytes.  It
@@ -36,45 +188,17 @@
    base64 data.  */
 int base64_encode(const char *str, int length, char *b64store)
 {
-  /* Conversion table.  */
-  static char tbl[64] = {
-    'A','B','C','D','E','F','G','H',
-    'I','J','K','L','M','N','O','P',
-    'Q','R','S','T','U','V','W','X',
-    'Y','Z','a','b','c','d','e','f',
-    'g','h','i','j','k','l','m','n',
-    'o','p','q','r','s','t','u','v',
-    'w','x','y','z','0','1','2','3',
-    '4','5','6','7','8','9','+','/'
-  };
-  int i;
-  const unsigned char *s = (const unsigned char *) str;
-  char *p = b64store;
+  base64_state st;
 
-  /* Transform the 3x8 bits to 4x6 bits, as required by base64.  */
-  for (i = 0; i < length; i += 3)
-    {
-      *p++ = tbl[s[0] >> 2];
-      *p++ = tbl[((s[0] & 3) << 4) + (s[1] >> 4)];
-      *p++ = tbl[((s[1] & 0xf) << 2) + (s[2] >> 6)];
-      *p++ = tbl[s[2] & 0x3f];
-      s += 3;
-    }
-
-  /* Pad the result if necessary...  */
-  if (i == length + 1)
-    *(p - 1) = '=';
-  else if (i == length + 2)
-    *(p - 1) = *(p - 2) = '=';
+  st.p = b64store;
+  st.nCarry = 0;
+  base64_update(&st, (const unsigned char *) str, length);
+  base64_final(&st);
 
-  /* ...and zero-terminate it.  */
-  *p = '\0';
-
-  return p - b64store;
+  return st.p - b64store;
 }
 
-#define IS_ASCII(c) (((c) & 0x80) == 0)
-#define IS_BASE64(c) ((IS_ASCII (c) && base64_char_to_value[c] >= 0) || c == '=')
+#define IS_BASE64(c) (base64_char_to_value[c] >= 0 || c == '=')
 
 /* Get next character from the string, except that non-base64
    characters are ignored, as mandated by rfc2045.  */
@@ -95,28 +219,25 @@ int base64_encode(const char *str, int length, char *b64store)
 int
 base64_decode (const char *base64, char *to)
 {
-  /* Table of base64 values for first 128 characters.  Note that this
-     assumes ASCII (but so does Wget in other places).  */
-  static short base64_char_to_value[128] =
-    {
-      -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  /*   0-  9 */
-      -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  /*  10- 19 */
-      -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  /*  20- 29 */
-      -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  /*  30- 39 */
-      -1,  -1,  -1,  62,  -1,  -1,  -1,  63,  52,  53,  /*  40- 49 */
-      54,  55,  56,  57,  58,  59,  60,  61,  -1,  -1,  /*  50- 59 */
-      -1,  -1,  -1,  -1,  -1,  0,   1,   2,   3,   4, /*  60- 69 */
-      5,   6,   7,   8,   9,   10,  11,  12,  13,  14,  /*  70- 79 */
-      15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  /*  80- 89 */
-      25,  -1,  -1,  -1,  -1,  -1,  -1,  26,  27,  28,  /*  90- 99 */
-      29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  /* 100-109 */
-      39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  /* 110-119 */
-      49,  50,  51,  -1,  -1,  -1,  -1,  -1   /* 120-127 */
-    };
-
-  const char *p = base64;
+  const unsigned char *p = (const unsigned char *) base64;
   char *q = to;
+  int a, b, c, d;
 
+  /* Fast path: whole quadruplets without padding or other characters.  */
+  while (1)
+  {
+    if ((a = base64_char_to_value[p[0]]) < 0) break;
+    if ((b = base64_char_to_value[p[1]]) < 0) break;
+    if ((c = base64_char_to_value[p[2]]) < 0) break;
+    if ((d = base64_char_to_value[p[3]]) < 0) break;
+
+    *q++ = (a << 2) | (b >> 4);
+    *q++ = ((b & 0xf) << 4) | (c >> 2);
+    *q++ = ((c & 0x3) << 6) | d;
+    p += 4;
+  }
+
+  /* Remainder: padding, and characters ignored as mandated by rfc2045.  */
   while (1)
   {
     unsigned char c;
@@ -189,6 +310,205 @@ char *basic_authentication_encode(const char *user, const char *passwd)
 }
 /* End Wget Base64 Functions */
 
+/*
+  Protocol message builders. These write "<prefix>BASE64(data)<suffix>" straight
+  into a caller-supplied buffer (typically one kept per connection by the module),
+  so that building a SASL request allocates nothing. They return the length of
+  the message, not counting the terminating zero, or -1 if the buffer is too small.
+*/
+int base64_build(char *buf, int size, const char *prefix, const char *data, int length, const char *suffix)
+{
+  base64_state st;
+  int nPrefix = prefix ? strlen(prefix) : 0;
+  int nSuffix = suffix ? strlen(suffix) : 0;
+
+  if (nPrefix + BASE64_LENGTH(length) + nSuffix + 1 > size)
+    return -1;
+
+  if (nPrefix)
+    memcpy(buf, prefix, nPrefix);
+  st.p = buf + nPrefix;
+  st.nCarry = 0;
+  base64_update(&st, (const unsigned char *) data, length);
+  base64_final(&st);
+  if (nSuffix)
+    memcpy(st.p, suffix, nSuffix);
+  st.p += nSuffix;
+  *st.p = '\0';
+
+  return st.p - buf;
+}
+
+/* SASL PLAIN (RFC 4616): BASE64(authzid \0 authcid \0 passwd) */
+int sasl_plain_build(char *buf, int size, const char *prefix, const char *authzid, const char *authcid, const char *passwd, const char *suffix)
+{
+  base64_state st;
+  int nPrefix = prefix ? strlen(prefix) : 0;
+  int nSuffix = suffix ? strlen(suffix) : 0;
+  int nAuthzid = authzid ? strlen(authzid) : 0;
+  int nAuthcid = strlen(authcid);
+  int nPasswd = strlen(passwd);
+
+  if (nPrefix + BASE64_LENGTH(nAuthzid + 1 + nAuthcid + 1 + nPasswd) + nSuffix + 1 > size)
+    return -1;
+
+  if (nPrefix)
+    memcpy(buf, prefix, nPrefix);
+  st.p = buf + nPrefix;
+  st.nCarry = 0;
+  base64_update(&st, (const unsigned char *) authzid, nAuthzid);
+  base64_update(&st, (const unsigned char *) "", 1);
+  base64_update(&st, (const unsigned char *) authcid, nAuthcid);
+  base64_update(&st, (const unsigned char *) "", 1);
+  base64_update(&st, (const unsigned char *) passwd, nPasswd);
+  base64_final(&st);
+  if (nSuffix)
+    memcpy(st.p, suffix, nSuffix);
+  st.p += nSuffix;
+  *st.p = '\0';
+
+  return st.p - buf;
+}
+
+/*
+  Fingerprint set used to drop duplicate list entries. Only a 64-bit hash of
+  each entry is kept, in an open-addressed table with linear probing, which
+  costs at most 16 bytes per unique entry. Two distinct entries sharing a
+  fingerprint (roughly n^2 / 2^65 odds) would be treated as duplicates.
+*/
+#define FPSET_EMPTY 0
+#define FPSET_MIN_SLOTS 1024
+
+/* MurmurHash64A (Austin Appleby, public domain) */
+uint64_t fpset_hash(const char *data, size_t len)
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = 0x5bd1e9955bd1e995ULL ^ (len * m);
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + (len & ~(size_t)7);
+  uint64_t k;
+
+  while (p != end)
+  {
+    memcpy(&k, p, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+    p += 8;
+  }
+
+  switch (len & 7)
+  {
+    case 7: h ^= (uint64_t) p[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t) p[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t) p[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t) p[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t) p[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t) p[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t) p[0];
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  /* zero marks an empty slot */
+  return (h == FPSET_EMPTY) ? 1 : h;
+}
+
+static void fpset_insert(fpset *set, uint64_t fp)
+{
+  size_t i = fp & (set->nSlots - 1);
+
+  while (set->pSlots[i] != FPSET_EMPTY)
+    i = (i + 1) & (set->nSlots - 1);
+
+  set->pSlots[i] = fp;
+  set->nUsed++;
+}
+
+void fpset_init(fpset *set, size_t expected)
+{
+  set->nSlots = FPSET_MIN_SLOTS;
+  while (set->nSlots < expected * 2)
+    set->nSlots <<= 1;
+
+  set->nUsed = 0;
+  set->pSlots = calloc(set->nSlots, sizeof(uint64_t));
+  if (set->pSlots == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for duplicate entry table.");
+}
+
+/* Returns TRUE if the fingerprint is in the set */
+int fpset_has_fp(const fpset *set, uint64_t fp)
+{
+  size_t i;
+
+  if (fp == FPSET_EMPTY)
+    fp = 1;
+
+  for (i = fp & (set->nSlots - 1); set->pSlots[i] != FPSET_EMPTY; i = (i + 1) & (set->nSlots - 1))
+  {
+    if (set->pSlots[i] == fp)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Add an entry. Returns TRUE if it was not already present. */
+int fpset_add(fpset *set, const char *data, size_t len)
+{
+  return fpset_add_fp(set, fpset_hash(data, len));
+}
+
+/* Add a fingerprint returned by fpset_hash(). Returns TRUE if it was not already present. */
+int fpset_add_fp(fpset *set, uint64_t fp)
+{
+  uint64_t *pOld;
+  size_t nOld, i;
+
+  if (fp == FPSET_EMPTY)
+    fp = 1;
+
+  if (fpset_has_fp(set, fp))
+    return FALSE;
+
+  /* keep the load factor at or below one half */
+  if ((set->nUsed + 1) * 2 > set->nSlots)
+  {
+    pOld = set->pSlots;
+    nOld = set->nSlots;
+
+    set->nSlots <<= 1;
+    set->nUsed = 0;
+    set->pSlots = calloc(set->nSlots, sizeof(uint64_t));
+    if (set->pSlots == NULL)
+      writeError(ERR_FATAL, "Failed to allocate memory for duplicate entry table.");
+
+    for (i = 0; i < nOld; i++)
+      if (pOld[i] != FPSET_EMPTY)
+        fpset_insert(set, pOld[i]);
+
+    free(pOld);
+  }
+
+  fpset_insert(set, fp);
+
+  return TRUE;
+}
+
+void fpset_free(fpset *set)
+{
+  FREE(set->pSlots);
+  set->nSlots = 0;
+  set->nUsed = 0;
+}
+
 /* Solaris doesn't have a strcasestr */
 #ifndef HAVE_STRCASESTR
 char *strcasestr(const char *a, const char *b) {
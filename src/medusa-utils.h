@@ -23,6 +23,13 @@
 #ifndef _MEDUSA_UTILS_H
 #define _MEDUSA_UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Send or receive all of a buffer on a blocking socket */
+extern int sendAll(int hSocket, const void *pBuf, size_t nLen);
+extern int recvAll(int hSocket, void *pBuf, size_t nLen);
+
 /* How many bytes it will take to store LEN bytes in base64.  */
 #define BASE64_LENGTH(len) (4 * (((len) + 2) / 3))
 
@@ -30,6 +37,26 @@ extern int base64_encode(const char *str, int length, char *b64store);
 extern int base64_decode(const char *base64, char *to);
 extern char *basic_authentication_encode(const char *user, const char *passwd);
 
+/* Size of the per-connection buffer used by modules for SASL messages */
+#define SASL_BUFFER_SIZE 4096
+
+extern int base64_build(char *buf, int size, const char *prefix, const char *data, int length, const char *suffix);
+extern int sasl_plain_build(char *buf, int size, const char *prefix, const char *authzid, const char *authcid, const char *passwd, const char *suffix);
+
+/* Open-addressed set of 64-bit entry fingerprints, used to drop duplicates */
+typedef struct __fpset {
+  uint64_t *pSlots;
+  size_t nSlots;
+  size_t nUsed;
+} fpset;
+
+extern void fpset_init(fpset *set, size_t expected);
+extern uint64_t fpset_hash(const char *data, size_t len);
+extern int fpset_add(fpset *set, const char *data, size_t len);
+extern int fpset_add_fp(fpset *set, uint64_t fp);
+extern int fpset_has_fp(const fpset *set, uint64_t fp);
+extern void fpset_free(fpset *set);
+
 /* solaris doesn't have a strcasestr */
 #ifndef HAVE_STRCASESTR
 char *strcasestr(const char *, const char *);
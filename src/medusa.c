@@ -26,8 +26,13 @@
 #define VERSION_SVN "$Id: medusa.c 9217 2015-05-07 18:07:03Z jmk $" 
 
 #include <dlfcn.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "medusa.h"
+#include "medusa-uring.h"
+#include "medusa-coro.h"
 #include "modsrc/module.h"
+#include "uthash.h"
 
 char* szModuleName;
 char* szTempModuleParam;
@@ -55,46 +60,76 @@ void freeModuleParams()
 }
 
 /*
-  Display appropriate usage information for application.
+  Parse a time given as NUM seconds, or NUMs, NUMm (minutes) and NUMh (hours).
 */
-void usage()
-{
-  writeVerbose(VB_NONE, "");
-  writeVerbose(VB_NONE, "Syntax: %s [-h host|-H file] [-u username|-U file] [-p password|-P file] [-C file] -M module [OPT]", PROGRAM);
-  writeVerbose(VB_NONE, "  -h [TEXT]    : Target hostname or IP address");
-  writeVerbose(VB_NONE, "  -H [FILE]    : File containing target hostnames or IP addresses");
-  writeVerbose(VB_NONE, "  -u [TEXT]    : Username to test");
-  writeVerbose(VB_NONE, "  -U [FILE]    : File containing usernames to test");
-  writeVerbose(VB_NONE, "  -p [TEXT]    : Password to test");
-  writeVerbose(VB_NONE, "  -P [FILE]    : File containing passwords to test");
-  writeVerbose(VB_NONE, "  -C [FILE]    : File containing combo entries. See README for more information.");
-  writeVerbose(VB_NONE, "  -O [FILE]    : File to append log information to");
-  writeVerbose(VB_NONE, "  -e [n/s/ns]  : Additional password checks ([n] No Password, [s] Password = Username)");
-  writeVerbose(VB_NONE, "  -M [TEXT]    : Name of the module to execute (without the .mod extension)");
-  writeVerbose(VB_NONE, "  -m [TEXT]    : Parameter to pass to the module. This can be passed multiple times with a"); 
-  writeVerbose(VB_NONE, "                 different parameter each time and they will all be sent to the module (i.e.");
-  writeVerbose(VB_NONE, "                 -m Param1 -m Param2, etc.)"); 
-  writeVerbose(VB_NONE, "  -d           : Dump all known modules");
-  writeVerbose(VB_NONE, "  -n [NUM]     : Use for non-default TCP port number");
-  writeVerbose(VB_NONE, "  -s           : Enable SSL");
-  writeVerbose(VB_NONE, "  -g [NUM]     : Give up after trying to connect for NUM seconds (default 3)"); 
-  writeVerbose(VB_NONE, "  -r [NUM]     : Sleep NUM seconds between retry attempts (default 3)");   
-  writeVerbose(VB_NONE, "  -R [NUM]     : Attempt NUM retries before giving up. The total number of attempts will be NUM + 1.");
-  writeVerbose(VB_NONE, "  -c [NUM]     : Time to wait in usec to verify socket is available (default 500 usec).");
-  writeVerbose(VB_NONE, "  -t [NUM]     : Total number of logins to be tested concurrently");
-  writeVerbose(VB_NONE, "  -T [NUM]     : Total number of hosts to be tested concurrently");
-  writeVerbose(VB_NONE, "  -L           : Parallelize logins using one username per thread. The default is to process ");
-  writeVerbose(VB_NONE, "                 the entire username before proceeding.");
-  writeVerbose(VB_NONE, "  -f           : Stop scanning host after first valid username/password found.");
-  writeVerbose(VB_NONE, "  -F           : Stop audit after first valid username/password found on any host.");
-  writeVerbose(VB_NONE, "  -b           : Suppress startup banner");
-  writeVerbose(VB_NONE, "  -q           : Display module's usage information");
-  writeVerbose(VB_NONE, "  -v [NUM]     : Verbose level [0 - 6 (more)]");
-  writeVerbose(VB_NONE, "  -w [NUM]     : Error debug level [0 - 10 (more)]");
-  writeVerbose(VB_NONE, "  -V           : Display version");
-  writeVerbose(VB_NONE, "  -Z [TEXT]    : Resume scan based on map of previous scan");
-  writeVerbose(VB_NONE, "\n");
-  return;
+static int parseDuration(char *pArg, int *piSeconds)
+{
+  char *pEnd;
+
+  *piSeconds = strtol(pArg, &pEnd, 10);
+  if ((*pEnd == 'm') || (*pEnd == 'M'))
+    *piSeconds *= 60;
+  else if ((*pEnd == 'h') || (*pEnd == 'H'))
+    *piSeconds *= 3600;
+
+  if ((*pEnd != '\0') && (strchr("sSmMhH", *pEnd)))
+    pEnd++;
+
+  if ((pEnd == pArg) || (*pEnd != '\0') || (*piSeconds < 1))
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+/*
+  Find option cOpt as getopt() would parse argv with the options of pSpec,
+  without processing or reordering argv. The index of the argument holding
+  the last occurrence of the option is returned (-1 if none) and its value
+  is set in *ppValue.
+*/
+int findOption(int argc, char **argv, const char *pSpec, char cOpt, char **ppValue)
+{
+  char *pOpt, *pValue;
+  int i, iArg, iFound = -1;
+
+  *ppValue = NULL;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--") == 0)
+      break;
+
+    if ((argv[i][0] != '-') || (argv[i][1] == '\0'))
+      continue;
+
+    /* options may be grouped (e.g. -bv 6) */
+    iArg = i;
+    for (pOpt = argv[i] + 1; *pOpt; pOpt++)
+    {
+      if ((*pOpt == ':') || (strchr(pSpec, *pOpt) == NULL))
+        break;
+
+      pValue = NULL;
+      if (strchr(pSpec, *pOpt)[1] == ':')
+      {
+        if (pOpt[1] != '\0')
+          pValue = pOpt + 1;
+        else if (i + 1 < argc)
+          pValue = argv[++i];
+      }
+
+      if (*pOpt == cOpt)
+      {
+        iFound = iArg;
+        *ppValue = pValue;
+      }
+
+      if (strchr(pSpec, *pOpt)[1] == ':')
+        break;
+    }
+  }
+
+  return iFound;
 }
 
 /*
@@ -108,20 +143,7 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
   int ret = 0;
   int i = 0;
   int nIgnoreBanner = 0;
-
-  /* initialize options */
-  _psAudit->iServerCnt = 1;
-  _psAudit->iLoginCnt = 1;
-  _psAudit->iParallelLoginFlag = PARALLEL_LOGINS_PASSWORD;
-  _psAudit->iPortOverride = 0;                        /* Use default port */
-  _psAudit->iUseSSL = 0;                              /* No SSL */
-  _psAudit->iTimeout = DEFAULT_WAIT_TIME;             /* Default wait of 3 seconds */
-  _psAudit->iRetryWait = WAIT_BETWEEN_CONNECT_RETRY;  /* Default wait of 3 seconds */
-  _psAudit->iRetries = MAX_CONNECT_RETRY;             /* Default of 2 retries (3 total attempts) */
-  _psAudit->iSocketWait = 500;                        /* Default wait of 500 usec */
-  _psAudit->iShowModuleHelp = 0;
-  iVerboseLevel = 5;
-  iErrorLevel = 5;
+  char *pEnd;
 
   for (i =0; i < argc; i++)
   {
@@ -135,7 +157,7 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
   if (nIgnoreBanner == 0)
     writeVerbose(VB_NONE, "%s v%s [%s] (C) %s %s\n", PROGRAM, VERSION, WWW, AUTHOR, EMAIL);
 
-  while ((opt = getopt(argc, argv, "h:H:u:U:p:P:C:O:e:M:m:g:r:R:c:t:T:n:bqdsLfFVv:w:Z:")) != EOF)
+  while ((opt = getopt(argc, argv, MEDUSA_OPTIONS)) != EOF)
   {
     switch (opt)
     {
@@ -163,6 +185,9 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
         _psAudit->HostType = L_FILE;
       }
       break;
+    case 'X':
+      _psAudit->pOptTask = strdup(optarg);
+      break;
     case 'u':
       if (_psAudit->UserType)
       {
@@ -221,6 +246,17 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
     case 'O':
       _psAudit->pOptOutput = strdup(optarg);
       break;
+    case 'l':
+      _psAudit->pOptLedger = strdup(optarg);
+      break;
+    case 'a':
+      _psAudit->iLedgerMaxAge = atoi(optarg);
+      if (_psAudit->iLedgerMaxAge < 1)
+      {
+        writeError(ERR_ALERT, "Invalid ledger age limit (days): %s", optarg);
+        ret = EXIT_FAILURE;
+      }
+      break;
     case 'e':
       if (strcmp(optarg, "n") == 0)
       {
@@ -249,6 +285,36 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
     case 'L':
       _psAudit->iParallelLoginFlag = PARALLEL_LOGINS_USER;
       break;
+    case 'K':
+      _psAudit->iPropagateFlag = TRUE;
+      break;
+    case 'D':
+      _psAudit->iRoundSize = atoi(optarg);
+      if (_psAudit->iRoundSize < 1)
+      {
+        writeError(ERR_ALERT, "Invalid number of passwords per round: %s", optarg);
+        ret = EXIT_FAILURE;
+      }
+      break;
+    case 'W':
+      _psAudit->iWeightedFlag = TRUE;
+      break;
+    case 'B':
+      if (parseDuration(optarg, &_psAudit->iDeadline) == FAILURE)
+      {
+        writeError(ERR_ALERT, "Invalid deadline: %s", optarg);
+        ret = EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      /* NUM:TIME - attempts per account within the observation window */
+      _psAudit->iPaceAttempts = strtol(optarg, &pEnd, 10);
+      if ((*pEnd != ':') || (_psAudit->iPaceAttempts < 1) || (_psAudit->iPaceAttempts > PACE_MAX_ATTEMPTS) || (parseDuration(pEnd + 1, &_psAudit->iPaceWindow) == FAILURE))
+      {
+        writeError(ERR_ALERT, "Invalid account attempt budget: %s (expected NUM:TIME, NUM 1 to %d)", optarg, PACE_MAX_ATTEMPTS);
+        ret = EXIT_FAILURE;
+      }
+      break;
     case 'f':
       _psAudit->iFoundPairExitFlag = FOUND_PAIR_EXIT_HOST;
       break;
@@ -264,6 +330,14 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
     case 'n':
       _psAudit->iPortOverride = atoi(optarg);
       break;
+    case 'S':
+      _psAudit->iProbeCnt = atoi(optarg);
+      if (_psAudit->iProbeCnt < 1)
+      {
+        writeError(ERR_ALERT, "Invalid number of concurrent host probes: %s", optarg);
+        ret = EXIT_FAILURE;
+      }
+      break;
     case 'v':
       iVerboseLevel = atoi(optarg);
       break;
@@ -304,15 +378,67 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
     case 'c':
       _psAudit->iSocketWait = atoi(optarg);
       break;
+    case 'I':
+      _psAudit->iNetUring = TRUE;
+      break;
+    case 'E':
+      _psAudit->iCoroutines = TRUE;
+      _psAudit->iCoroThreads = atoi(optarg);
+      if (_psAudit->iCoroThreads < 0)
+      {
+        writeError(ERR_ERROR, "Invalid number of coroutine scheduler threads (-E): %s", optarg);
+        ret = EXIT_FAILURE;
+      }
+      break;
     case 'Z':
       _psAudit->pOptResume = strdup(optarg);
       break;
+    case 'J':
+      _psAudit->pOptCoordinator = strdup(optarg);
+      break;
     default:
       writeError(ERR_CRITICAL, "Unknown error processing command-line options.");
       ret = EXIT_FAILURE;
     }
   }
 
+  /* only one list can be read from standard input */
+  i = 0;
+  if ((_psAudit->pOptHost) && (strcmp(_psAudit->pOptHost, "-") == 0)) i++;
+  if ((_psAudit->pOptUser) && (strcmp(_psAudit->pOptUser, "-") == 0)) i++;
+  if ((_psAudit->pOptPass) && (strcmp(_psAudit->pOptPass, "-") == 0)) i++;
+  if ((_psAudit->pOptCombo) && (strcmp(_psAudit->pOptCombo, "-") == 0)) i++;
+
+  if (i > 1)
+  {
+    writeError(ERR_ALERT, "Only one of options 'H', 'U', 'P' and 'C' may read from standard input.");
+    ret = EXIT_FAILURE;
+  }
+
+  if ((_psAudit->iLedgerMaxAge) && (_psAudit->pOptLedger == NULL))
+  {
+    writeError(ERR_ALERT, "Option 'a' requires a ledger file (option 'l').");
+    ret = EXIT_FAILURE;
+  }
+
+  if ((_psAudit->iRoundSize) && ((_psAudit->pOptCombo) || (_psAudit->pOptResume)))
+  {
+    writeError(ERR_ALERT, "Option 'D' cannot be combined with options 'C' or 'Z'.");
+    ret = EXIT_FAILURE;
+  }
+
+  /* task files name the hosts, modules and module options of the audit */
+  if (_psAudit->pOptTask)
+  {
+    if ((_psAudit->HostType) || (_psAudit->pOptCombo) || (_psAudit->pModuleName) || (nModuleParamCount))
+    {
+      writeError(ERR_ALERT, "Option 'X' cannot be combined with options 'h', 'H', 'C', 'M' or 'm'.");
+      ret = EXIT_FAILURE;
+    }
+    else
+      _psAudit->HostType = L_TASK;
+  }
+
   if (argc <= 1) {
     ret = EXIT_FAILURE;
   }
@@ -325,23 +451,55 @@ int checkOptions(int argc, char **argv, sAudit *_psAudit)
       writeError(ERR_CRITICAL, "invokeModule failed - see previous errors for an explanation");
     }
   }
-  else
+
+  return ret;
+}
+
+/*
+  Check that the audit has a module, hosts, users and passwords. These may
+  come from the command-line options or from library calls, so they are only
+  checked once both were processed.
+*/
+int checkAuditInput(sAudit *_psAudit)
+{
+  int ret = SUCCESS;
+
+  if (_psAudit->iShowModuleHelp)
+    return SUCCESS;
+
+  if ( !((_psAudit->HostType) || (_psAudit->pOptCombo)) )
   {
-    if ( !((_psAudit->HostType) || (_psAudit->pOptCombo)) )
-    {
-      writeError(ERR_ALERT, "Host information must be supplied.");
-      ret = EXIT_FAILURE;
-    }
-    else if ( !((_psAudit->UserType) || (_psAudit->pOptCombo)) )
-    {
-      writeError(ERR_ALERT, "User logon information must be supplied.");
-      ret = EXIT_FAILURE;
-    }
-    else if ( !((_psAudit->PassType) || (_psAudit->pOptCombo) || (_psAudit->iPasswordBlankFlag) || ( _psAudit->iPasswordUsernameFlag)) )
-    {
-      writeError(ERR_ALERT, "Password information must be supplied.");
-      ret = EXIT_FAILURE;
-    }
+    writeError(ERR_ALERT, "Host information must be supplied.");
+    ret = FAILURE;
+  }
+  else if ( !((_psAudit->UserType) || (_psAudit->pOptCombo)) )
+  {
+    writeError(ERR_ALERT, "User logon information must be supplied.");
+    ret = FAILURE;
+  }
+  else if ( !((_psAudit->PassType) || (_psAudit->pOptCombo) || (_psAudit->iPasswordBlankFlag) || ( _psAudit->iPasswordUsernameFlag)) )
+  {
+    writeError(ERR_ALERT, "Password information must be supplied.");
+    ret = FAILURE;
+  }
+  else if ((szModuleName == NULL) && (_psAudit->pOptTask == NULL))
+  {
+    writeError(ERR_ALERT, "You must specify a module to execute using -M MODULE_NAME");
+    ret = FAILURE;
+  }
+
+  /* rounds and frequency ordering need a password file which can be read up front */
+  if (((_psAudit->iRoundSize) || (_psAudit->iWeightedFlag)) && ((_psAudit->PassType != L_FILE) || (_psAudit->pOptPass == NULL) || (isStreamSource(_psAudit->pOptPass))))
+  {
+    writeError(ERR_ALERT, "Options 'D' and 'W' require a password file (option 'P') which is not streamed.");
+    ret = FAILURE;
+  }
+
+  /* the coordinator leases users and passwords which are all known up front */
+  if ((_psAudit->pOptCoordinator) && ((_psAudit->pOptCombo) || (_psAudit->pOptTask) || (_psAudit->pOptResume) || (_psAudit->iRoundSize) || (_psAudit->iDeadline) || (_psAudit->iPaceAttempts) || (_psAudit->iProbeCnt) || (_psAudit->iPropagateFlag) || (_psAudit->pfnPassNext) || ((_psAudit->PassType == L_FILE) && (_psAudit->pOptPass) && (isStreamSource(_psAudit->pOptPass)))))
+  {
+    writeError(ERR_ALERT, "Option 'J' cannot be combined with options 'C', 'X', 'Z', 'D', 'B', 'A', 'S', 'K' or streamed passwords.");
+    ret = FAILURE;
   }
 
   return ret;
@@ -391,6 +549,7 @@ int invokeModule(char* pModuleName, sLogin* pLogin, int argc, char* argv[])
 
       if (pLibrary == NULL)
       {
+        FREE(modPath);
         continue;
       }
       else if (!pLogin)
@@ -424,6 +583,7 @@ int invokeModule(char* pModuleName, sLogin* pLogin, int argc, char* argv[])
         else
         {
           nSuccess = 1;
+          FREE(modPath);
           iReturn = pGo(pLogin, argc, argv);
           break;
         }
@@ -442,155 +602,565 @@ int invokeModule(char* pModuleName, sLogin* pLogin, int argc, char* argv[])
 }
 
 /*
-  Read the contents of a user supplied file. Store contents in memory and provide
-  a count of the total file lines processed.
+  Ask the module for the TCP port it connects to by default. Modules may
+  optionally export getDefaultPort(); 0 is returned if they do not.
 */
-void loadFile(char *pFile, char **pFileContent, int *iFileCnt)
+int getModuleDefaultPort(char* pModuleName, int iUseSSL)
 {
-  FILE *pfFile;
-  size_t stFileSize = 0;
-  char tmp[MAX_BUF];
-  char *ptr;
-
-  *iFileCnt = 0;
+  void *pLibrary;
+  function_getDefaultPort pPort;
+  char* modPath;
+  int nPathLength;
+  int iPort = 0;
+  int i;
 
-  if ((pfFile = fopen(pFile, "r")) == NULL)
+  for (i = 0; i < 3; i++)
   {
-    writeError(ERR_FATAL, "Failed to open file %s - %s", pFile, strerror( errno ) );
-  }
-  else
-  {
-    /* get file stats */
-    while (! feof(pfFile) )
-    {
-      if ( fgets(tmp, MAX_BUF, pfFile) != NULL )
-      {
-        if (tmp[0] != '\0')
-        {
-          stFileSize += strlen(tmp) + 1;
-          (*iFileCnt)++;
-        }
-      }
-    }
-    rewind(pfFile);
+    if (szModulePaths[i] == NULL)
+      continue;
 
-    *pFileContent = malloc(stFileSize + 1);    /* extra end NULL */
+    nPathLength = strlen(szModulePaths[i]) + strlen(pModuleName) + strlen(MODULE_EXTENSION) + 2;
+    modPath = malloc(nPathLength);
+    snprintf(modPath, nPathLength, "%s/%s%s", szModulePaths[i], pModuleName, MODULE_EXTENSION);
+    pLibrary = dlopen(modPath, RTLD_NOW);
+    FREE(modPath);
 
-    if (pFileContent == NULL)
-    {
-      writeError(ERR_FATAL, "Failed to allocate memory for file %s.", pFile);
-    }
+    if (pLibrary == NULL)
+      continue;
 
-    memset(*pFileContent, 0, stFileSize + 1);
-    ptr = *pFileContent;
+    if ((pPort = (function_getDefaultPort)dlsym(pLibrary, "getDefaultPort")))
+      iPort = pPort(iUseSSL);
 
-    /* load file into mem */
-    while (! feof(pfFile) )
-    {
-      if (fgets(tmp, MAX_BUF, pfFile) != NULL)
-      {
-        /* ignore blank lines */
-        if ((tmp[0] == '\n') || (tmp[0] == '\r'))
-        {
-          (*iFileCnt)--;
-          writeError(ERR_DEBUG, "Ignoring blank line in file: %s. Resetting total count: %d.", pFile, (*iFileCnt));
-        }
-        else if (tmp[0] != '\0')
-        {
-          if (tmp[strlen(tmp) - 1] == '\n') tmp[strlen(tmp) - 1] = '\0';
-          if (tmp[strlen(tmp) - 1] == '\r') tmp[strlen(tmp) - 1] = '\0';
-          memcpy(ptr, tmp, strlen(tmp) + 1);
-          ptr += strlen(tmp) + 1;
-        }
-      }
-    }
-    *ptr = '\0';  /* extra NULL to identify end of list */
+    dlclose(pLibrary);
+    break;
   }
 
-  if((*iFileCnt) == 0)
+  return iPort;
+}
+
+/*
+  Modules exporting isBlocking() wait outside of medusa-net (external
+  libraries, sleep()) and keep their login threads with -E.
+*/
+int getModuleBlocking(char* pModuleName)
+{
+  void *pLibrary;
+  function_isBlocking pBlocking;
+  char* modPath;
+  int nPathLength;
+  int iBlocking = FALSE;
+  int i;
+
+  for (i = 0; i < 3; i++)
   {
-    writeError(ERR_FATAL, "Error loading user supplied file (%s) -- file may be empty.", pFile);
+    if (szModulePaths[i] == NULL)
+      continue;
+
+    nPathLength = strlen(szModulePaths[i]) + strlen(pModuleName) + strlen(MODULE_EXTENSION) + 2;
+    modPath = malloc(nPathLength);
+    snprintf(modPath, nPathLength, "%s/%s%s", szModulePaths[i], pModuleName, MODULE_EXTENSION);
+    pLibrary = dlopen(modPath, RTLD_NOW);
+    FREE(modPath);
+
+    if (pLibrary == NULL)
+      continue;
+
+    if ((pBlocking = (function_isBlocking)dlsym(pLibrary, "isBlocking")))
+      iBlocking = pBlocking();
+
+    dlclose(pLibrary);
+    break;
   }
 
-  free(pFile);
-  return;
+  return iBlocking;
+}
+
+/* Locations searched for modules, in order */
+void setModulePaths()
+{
+  szModulePaths[0] = getenv("MEDUSA_MODULE_PATH");
+  szModulePaths[1] = ".";
+#ifdef DEFAULT_MOD_PATH
+  szModulePaths[2] = DEFAULT_MOD_PATH;
+#else
+  szModulePaths[2] = "/usr/lib/medusa/modules";
+#endif
 }
 
 /*
-  Examine the first row of the combo file to determine information provided.
-  Combo files are colon separated and in the following format: host:user:password.
-  If any of the three fields are left empty, the respective information should be
-  provided either as a single global value or as a list in a file.
+  Load a module and keep it loaded. Used by the daemon, so that the jobs it
+  forks find the module (and the libraries it uses) mapped and initialized.
+*/
+int preloadModule(char* pModuleName)
+{
+  char* modPath;
+  int nPathLength;
+  int i;
 
-  The following combinations are possible in the combo file:
-  1. foo:bar:fud
-  2. foo:bar:
-  3. foo::
-  4. :bar:fud
-  5. :bar:
-  6. ::fud
-  7. foo::fud
+  for (i = 0; i < 3; i++)
+  {
+    if (szModulePaths[i] == NULL)
+      continue;
 
-  Medusa also supports using PwDump files as a combo file. The format of these
-  files should be user:id:lm:ntlm. We look for ':::' at the end of the first line
-  to determine if the file contains PwDump output. In addition, a LM/NTLM hash
-  pair can be supplied in lieu of a password (e.g. host:user:lm:ntlm).
+    nPathLength = strlen(szModulePaths[i]) + strlen(pModuleName) + strlen(MODULE_EXTENSION) + 2;
+    modPath = malloc(nPathLength);
+    snprintf(modPath, nPathLength, "%s/%s%s", szModulePaths[i], pModuleName, MODULE_EXTENSION);
+
+    if (dlopen(modPath, RTLD_NOW))
+    {
+      writeError(ERR_DEBUG, "[preloadModule] Loaded module %s", modPath);
+      FREE(modPath);
+      return SUCCESS;
+    }
+
+    FREE(modPath);
+  }
+
+  return FAILURE;
+}
+
+/*
+  Read a list file into NUL-separated entries followed by an extra NUL. The
+  file is read in a single pass, so standard input ("-"), FIFOs and
+  compressed files are accepted. Duplicate entries are dropped, keeping the
+  first occurrence. Errors are reported at iErrLevel.
 */
-int processComboFile(sAudit **_psAudit)
+static int readListFile(char *pFile, char **ppContent, size_t *pnSize, int *piCnt, int *piDuplicates, int iErrLevel)
 {
-  int ret = 0, iColonCount = 0;
-  char *pComboTmp;
+  FILE *pfFile;
+  pid_t pidFilter;
+  size_t stFileSize = 0;
+  size_t stAlloc = MAX_BUF;
+  size_t stLen;
+  char tmp[MAX_BUF];
+  char *pContent;
+  fpset sSeen;
 
-  writeError(ERR_DEBUG, "[processComboFile] Processing user supplied combo file.");
+  *piCnt = 0;
+  *piDuplicates = 0;
 
-  pComboTmp = (*_psAudit)->pGlobalCombo;
+  if ((pfFile = openCandidateFile(pFile, &pidFilter)) == NULL)
+  {
+    writeError(iErrLevel, "Failed to open file %s - %s", pFile, strerror( errno ) );
+    return FAILURE;
+  }
 
-  /* PwDump file check */
-  /* USERNAME:ID:LM HASH:NTLM HASH::: */
-  writeError(ERR_DEBUG, "[processComboFile] PwDump file check.");
-  while (*pComboTmp != '\0')
+  if ((pContent = malloc(stAlloc)) == NULL)
   {
-    if (strcmp(pComboTmp, ":::") == 0)
-    {
-      iColonCount += 3;
-      pComboTmp += 3;
-    }
-    else if (*pComboTmp == ':')
+    writeError(iErrLevel, "Failed to allocate memory for file %s.", pFile);
+    closeCandidateFile(pfFile, pidFilter);
+    return FAILURE;
+  }
+
+  fpset_init(&sSeen, 0);
+
+  /* load file into mem */
+  while (fgets(tmp, MAX_BUF, pfFile) != NULL)
+  {
+    /* ignore blank lines */
+    if ((tmp[0] == '\n') || (tmp[0] == '\r'))
     {
-      iColonCount++;
-      pComboTmp++;
+      writeError(ERR_DEBUG, "Ignoring blank line in file: %s.", pFile);
     }
-    else 
+    else if (tmp[0] != '\0')
     {
-      pComboTmp++;
-    }
-
-    if ((iColonCount == 6) && (*pComboTmp == '\0')) {
-      writeError(ERR_DEBUG, "[processComboFile] Combo format scan detected PwDump file.");
+      stLen = strlen(tmp);
+      if (tmp[stLen - 1] == '\n') tmp[--stLen] = '\0';
+      if ((stLen > 0) && (tmp[stLen - 1] == '\r')) tmp[--stLen] = '\0';
 
-      if (((*_psAudit)->HostType != L_SINGLE) && ((*_psAudit)->HostType != L_FILE))
+      /* ignore duplicate entries */
+      if (!fpset_add(&sSeen, tmp, stLen))
       {
-        writeError(ERR_FATAL, "Combo format used requires host information via (-h/-H).");
+        (*piDuplicates)++;
+        continue;
       }
 
-      if (((*_psAudit)->UserType != L_SINGLE) && ((*_psAudit)->UserType != L_FILE))
+      /* keep room for this entry and the extra end NULL */
+      if (stFileSize + stLen + 2 > stAlloc)
       {
-        (*_psAudit)->UserType = L_PWDUMP;
-      }
+        while (stFileSize + stLen + 2 > stAlloc)
+          stAlloc *= 2;
 
-      (*_psAudit)->PassType = L_PWDUMP;
+        if ((pContent = realloc(pContent, stAlloc)) == NULL)
+          writeError(ERR_FATAL, "Failed to allocate memory for file %s.", pFile);
+      }
 
-      return ret;
+      memcpy(pContent + stFileSize, tmp, stLen + 1);
+      stFileSize += stLen + 1;
+      (*piCnt)++;
     }
   }
+  pContent[stFileSize] = '\0';  /* extra NULL to identify end of list */
+  fpset_free(&sSeen);
 
-  if ( ! ((iColonCount == 2) || (iColonCount == 3)) )
+  if (closeCandidateFile(pfFile, pidFilter) != SUCCESS)
   {
-    writeError(ERR_DEBUG, "[processComboFile] Number of colons detected in first entry: %d", iColonCount);
-    writeError(ERR_FATAL, "Invalid combo file format.");
+    writeError(iErrLevel, "Failed to decompress file %s.", pFile);
+    free(pContent);
+    return FAILURE;
   }
 
-  pComboTmp = (*_psAudit)->pGlobalCombo;
+  *ppContent = pContent;
+  *pnSize = stFileSize + 1;
+  return SUCCESS;
+}
+
+/*
+  The daemon keeps the list files of its jobs in memory (listCachePrefetch()),
+  so that the jobs it forks find them loaded. Files are matched by absolute
+  path and checked against the file on disk before use. Least recently used
+  files are dropped once the cache holds more than nListCacheMax bytes.
+*/
+typedef struct __sListCache {
+  struct __sListCache *psNext;            // most recently used first
+  char *pPath;
+  dev_t nDev;
+  ino_t nIno;
+  off_t nFileSize;
+  time_t tModified;
+  char *pContent;
+  size_t nSize;
+  int iCnt;
+  int iDuplicates;
+} sListCache;
+
+static sListCache *psListCache = NULL;
+static size_t nListCacheMax = 0;          // 0 --> cache disabled
+static size_t nListCacheSize = 0;
+
+void listCacheEnable(size_t nMaxBytes)
+{
+  nListCacheMax = nMaxBytes;
+}
+
+static char* listCachePath(char *pFile)
+{
+  char szCwd[PATH_MAX];
+  char *pPath;
+
+  if (pFile[0] == '/')
+    return strdup(pFile);
+
+  if (getcwd(szCwd, sizeof(szCwd)) == NULL)
+    return NULL;
+
+  pPath = malloc(strlen(szCwd) + strlen(pFile) + 2);
+  sprintf(pPath, "%s/%s", szCwd, pFile);
+  return pPath;
+}
+
+static void listCacheRemove(sListCache **ppsPrev)
+{
+  sListCache *psEntry = *ppsPrev;
+
+  *ppsPrev = psEntry->psNext;
+  nListCacheSize -= psEntry->nSize;
+  free(psEntry->pPath);
+  free(psEntry->pContent);
+  free(psEntry);
+}
+
+/*
+  Find the entry of a file which is still current and move it to the front.
+  Entries of files which were changed or removed are dropped.
+*/
+static sListCache* listCacheFind(char *pPath)
+{
+  sListCache **ppsPrev, *psEntry;
+  struct stat sStat;
+
+  for (ppsPrev = &psListCache; *ppsPrev; ppsPrev = &(*ppsPrev)->psNext)
+  {
+    if (strcmp((*ppsPrev)->pPath, pPath) != 0)
+      continue;
+
+    psEntry = *ppsPrev;
+    if ((stat(pPath, &sStat) != 0) || (sStat.st_dev != psEntry->nDev) || (sStat.st_ino != psEntry->nIno) ||
+        (sStat.st_size != psEntry->nFileSize) || (sStat.st_mtime != psEntry->tModified))
+    {
+      writeError(ERR_DEBUG, "[listCacheFind] Dropping changed file from cache: %s", pPath);
+      listCacheRemove(ppsPrev);
+      return NULL;
+    }
+
+    *ppsPrev = psEntry->psNext;
+    psEntry->psNext = psListCache;
+    psListCache = psEntry;
+    return psEntry;
+  }
+
+  return NULL;
+}
+
+/* Load a regular list file into the cache unless it is already current */
+void listCachePrefetch(char *pPath)
+{
+  sListCache *psEntry, **ppsLast;
+  struct stat sStat;
+
+  if ((nListCacheMax == 0) || (listCacheFind(pPath)))
+    return;
+
+  if ((stat(pPath, &sStat) != 0) || (!S_ISREG(sStat.st_mode)) || ((size_t)sStat.st_size > nListCacheMax))
+    return;
+
+  psEntry = malloc(sizeof(sListCache));
+  memset(psEntry, 0, sizeof(sListCache));
+
+  if (readListFile(pPath, &psEntry->pContent, &psEntry->nSize, &psEntry->iCnt, &psEntry->iDuplicates, ERR_ERROR) != SUCCESS)
+  {
+    free(psEntry);
+    return;
+  }
+
+  psEntry->pPath = strdup(pPath);
+  psEntry->nDev = sStat.st_dev;
+  psEntry->nIno = sStat.st_ino;
+  psEntry->nFileSize = sStat.st_size;
+  psEntry->tModified = sStat.st_mtime;
+  psEntry->psNext = psListCache;
+  psListCache = psEntry;
+  nListCacheSize += psEntry->nSize;
+
+  writeError(ERR_DEBUG, "[listCachePrefetch] Cached file %s (%d entries)", pPath, psEntry->iCnt);
+
+  /* drop least recently used files - keep the file just loaded */
+  while ((nListCacheSize > nListCacheMax) && (psListCache->psNext))
+  {
+    for (ppsLast = &psListCache; (*ppsLast)->psNext; ppsLast = &(*ppsLast)->psNext);
+    listCacheRemove(ppsLast);
+  }
+}
+
+void listCacheFree()
+{
+  while (psListCache)
+    listCacheRemove(&psListCache);
+}
+
+/*
+  Read the contents of a user supplied file. Store contents in memory and provide
+  a count of the total file lines processed (see readListFile()). Files found in
+  the cache of the daemon are copied from it.
+*/
+void loadFile(char *pFile, char **pFileContent, int *iFileCnt)
+{
+  sListCache *psEntry = NULL;
+  char *pPath;
+  size_t nSize;
+  int iDuplicates = 0;
+
+  *iFileCnt = 0;
+
+  if ((nListCacheMax) && (pPath = listCachePath(pFile)))
+  {
+    psEntry = listCacheFind(pPath);
+    free(pPath);
+  }
+
+  if (psEntry)
+  {
+    if ((*pFileContent = malloc(psEntry->nSize)) == NULL)
+      writeError(ERR_FATAL, "Failed to allocate memory for file %s.", pFile);
+
+    memcpy(*pFileContent, psEntry->pContent, psEntry->nSize);
+    *iFileCnt = psEntry->iCnt;
+    iDuplicates = psEntry->iDuplicates;
+    writeError(ERR_DEBUG, "Loaded file %s from daemon cache.", pFile);
+  }
+  else
+    readListFile(pFile, pFileContent, &nSize, iFileCnt, &iDuplicates, ERR_FATAL);
+
+  if (iDuplicates)
+    writeError(ERR_NOTICE, "Removed %d duplicate entries from file: %s (%d remaining)", iDuplicates, pFile, *iFileCnt);
+
+  if((*iFileCnt) == 0)
+  {
+    writeError(ERR_FATAL, "Error loading user supplied file (%s) -- file may be empty.", pFile);
+  }
+
+  free(pFile);
+  return;
+}
+
+typedef struct __sWeightedEntry {
+  unsigned long nCount;
+  int iIndex;               // position in file - keeps equal counts in file order
+  char *pEntry;
+} sWeightedEntry;
+
+static int compareWeightedEntry(const void *a, const void *b)
+{
+  const sWeightedEntry *psA = (const sWeightedEntry *)a;
+  const sWeightedEntry *psB = (const sWeightedEntry *)b;
+
+  if (psA->nCount != psB->nCount)
+    return (psA->nCount > psB->nCount) ? -1 : 1;
+
+  return psA->iIndex - psB->iIndex;
+}
+
+/*
+  Order a file loaded by loadFile() whose lines are "COUNT ENTRY" (leading
+  blanks allowed, as produced by "uniq -c") by descending count, and strip
+  the count column. Lines without a count keep a count of zero. An entry
+  listed more than once keeps only its highest count. A count without an
+  entry (the blank password) is dropped.
+*/
+static void sortWeightedFile(char *pFileContent, int *iFileCnt)
+{
+  sWeightedEntry *psEntries;
+  char *pSorted, *pEntry, *pTmp, *pOut;
+  size_t nSize;
+  fpset sSeen;
+  unsigned long nTopCount = 0;
+  int i, iCnt = *iFileCnt;
+
+  psEntries = malloc(iCnt * sizeof(sWeightedEntry));
+  if (psEntries == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for password list.");
+
+  pEntry = pFileContent;
+  for (i = 0; i < iCnt; i++)
+  {
+    psEntries[i].iIndex = i;
+    psEntries[i].nCount = 0;
+    psEntries[i].pEntry = pEntry;
+
+    pTmp = pEntry;
+    while ((*pTmp == ' ') || (*pTmp == '\t'))
+      pTmp++;
+
+    if ((*pTmp >= '0') && (*pTmp <= '9'))
+    {
+      psEntries[i].nCount = strtoul(pTmp, &pTmp, 10);
+      if ((*pTmp == ' ') || (*pTmp == '\t'))
+        psEntries[i].pEntry = pTmp + 1;
+      else
+        psEntries[i].nCount = 0;
+    }
+
+    pEntry += strlen(pEntry) + 1;
+  }
+
+  nSize = pEntry - pFileContent + 1;
+  qsort(psEntries, iCnt, sizeof(sWeightedEntry), compareWeightedEntry);
+
+  /* entries only get shorter - rebuild the list in a copy and move it back */
+  pSorted = malloc(nSize);
+  if (pSorted == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for password list.");
+
+  fpset_init(&sSeen, 0);
+  *iFileCnt = 0;
+
+  pOut = pSorted;
+  for (i = 0; i < iCnt; i++)
+  {
+    /* an empty entry would end the list - blank passwords are tested with "-e n" */
+    if (psEntries[i].pEntry[0] == '\0')
+    {
+      writeError(ERR_DEBUG, "Ignoring blank password (count %lu) in frequency ordered list.", psEntries[i].nCount);
+      continue;
+    }
+
+    if (!fpset_add(&sSeen, psEntries[i].pEntry, strlen(psEntries[i].pEntry)))
+      continue;
+
+    if (*iFileCnt == 0)
+      nTopCount = psEntries[i].nCount;
+
+    strcpy(pOut, psEntries[i].pEntry);
+    pOut += strlen(pOut) + 1;
+    (*iFileCnt)++;
+  }
+  *pOut = '\0';
+
+  memcpy(pFileContent, pSorted, pOut - pSorted + 1);
+
+  if (*iFileCnt)
+    writeError(ERR_DEBUG, "Ordered %d passwords by frequency (most frequent: %s, %lu)", *iFileCnt, pFileContent, nTopCount);
+
+  fpset_free(&sSeen);
+  free(pSorted);
+  free(psEntries);
+}
+
+/*
+  Examine the first row of the combo file to determine information provided.
+  Combo files are colon separated and in the following format: host:user:password.
+  If any of the three fields are left empty, the respective information should be
+  provided either as a single global value or as a list in a file.
+
+  The following combinations are possible in the combo file:
+  1. foo:bar:fud
+  2. foo:bar:
+  3. foo::
+  4. :bar:fud
+  5. :bar:
+  6. ::fud
+  7. foo::fud
+
+  Medusa also supports using PwDump files as a combo file. The format of these
+  files should be user:id:lm:ntlm. We look for ':::' at the end of the first line
+  to determine if the file contains PwDump output. In addition, a LM/NTLM hash
+  pair can be supplied in lieu of a password (e.g. host:user:lm:ntlm).
+*/
+int processComboFile(sAudit **_psAudit)
+{
+  int ret = 0, iColonCount = 0;
+  char *pComboTmp;
+
+  writeError(ERR_DEBUG, "[processComboFile] Processing user supplied combo file.");
+
+  pComboTmp = (*_psAudit)->pGlobalCombo;
+
+  /* PwDump file check */
+  /* USERNAME:ID:LM HASH:NTLM HASH::: */
+  writeError(ERR_DEBUG, "[processComboFile] PwDump file check.");
+  while (*pComboTmp != '\0')
+  {
+    if (strcmp(pComboTmp, ":::") == 0)
+    {
+      iColonCount += 3;
+      pComboTmp += 3;
+    }
+    else if (*pComboTmp == ':')
+    {
+      iColonCount++;
+      pComboTmp++;
+    }
+    else 
+    {
+      pComboTmp++;
+    }
+
+    if ((iColonCount == 6) && (*pComboTmp == '\0')) {
+      writeError(ERR_DEBUG, "[processComboFile] Combo format scan detected PwDump file.");
+
+      if (((*_psAudit)->HostType != L_SINGLE) && ((*_psAudit)->HostType != L_FILE))
+      {
+        writeError(ERR_FATAL, "Combo format used requires host information via (-h/-H).");
+      }
+
+      if (((*_psAudit)->UserType != L_SINGLE) && ((*_psAudit)->UserType != L_FILE))
+      {
+        (*_psAudit)->UserType = L_PWDUMP;
+      }
+
+      (*_psAudit)->PassType = L_PWDUMP;
+
+      return ret;
+    }
+  }
+
+  if ( ! ((iColonCount == 2) || (iColonCount == 3)) )
+  {
+    writeError(ERR_DEBUG, "[processComboFile] Number of colons detected in first entry: %d", iColonCount);
+    writeError(ERR_FATAL, "Invalid combo file format.");
+  }
+
+  pComboTmp = (*_psAudit)->pGlobalCombo;
 
   if (*pComboTmp == ':')
   {               /* no host specified */
@@ -748,33 +1318,24 @@ char* findNextHost(sAudit *_psAudit, char *_pHost)
       _pHost = _psAudit->pGlobalCombo;
     }
   }
-  else if (_psAudit->HostType == L_FILE)
+  else if ((_psAudit->HostType == L_FILE) || (_psAudit->HostType == L_SINGLE) || (_psAudit->HostType == L_TASK))
   {
-    if (*_psAudit->pGlobalHost != '\0')
+    /* host specifications (hostnames, CIDR blocks, ranges) are expanded one host at a time */
+    if (hostListNext(&_psAudit->sHostList, &_psAudit->sHostTmp))
     {
-      _pHost = _psAudit->pGlobalHost;
-
-      /* advancing host list */
-      while (*_psAudit->pGlobalHost != '\0')
-        _psAudit->pGlobalHost++;
-      _psAudit->pGlobalHost++;
+      _pHost = _psAudit->sHostTmp.szHost;
 
-      if (*_psAudit->pGlobalHost != '\0')
+      if (hostListRemaining(&_psAudit->sHostList))
       {
         _psAudit->iHostListFlag = LIST_IN_PROGRESS;
       }
       else
       {
         /* resetting host list */
-        _psAudit->pGlobalHost = _psAudit->pHostFile;
+        hostListReset(&_psAudit->sHostList);
       }
     }
   }
-  else if (_psAudit->HostType == L_SINGLE)
-  {
-    _pHost = _psAudit->pGlobalHost;
-    _psAudit->iAuditFlag = AUDIT_COMPLETE;
-  }
   else
   {
     writeError(ERR_FATAL, "[findNextHost] HostType not properly defined.");
@@ -895,146 +1456,232 @@ char* findLocalPass(sAudit *_psAudit)
   return pPass;
 }
 
-int loadLoginInfo(sAudit *_psAudit)
+/*
+  Create the table for a target host and append it to the audit's host list.
+*/
+sHost* loadHostInfo(sAudit *_psAudit, char *_pHost)
 {
   sHost *psHost = NULL;
-  sHost *psHostPrevTmp = NULL;
-  char *pHost = NULL;
 
+  psHost = malloc(sizeof(sHost));
+  memset(psHost, 0, sizeof(sHost));
+
+  psHost->pHost = strdup(_pHost);
+  psHost->psService = &_psAudit->psServices[_psAudit->sHostTmp.iService];
+  psHost->iPortOverride = (_psAudit->sHostTmp.iPort) ? _psAudit->sHostTmp.iPort : _psAudit->iPortOverride;
+  psHost->iUseSSL = (_psAudit->iUseSSL) ? _psAudit->iUseSSL : psHost->psService->iUseSSL;
+  psHost->iTimeout = _psAudit->iTimeout;
+  psHost->iRetryWait = _psAudit->iRetryWait;
+  psHost->iRetries = _psAudit->iRetries;
+  psHost->iUserCnt = 0;
+  psHost->iId = ++_psAudit->iHostsLoaded;
+
+  if (_psAudit->psLedger)
+    psHost->nLedgerKey = ledgerHostKey(psHost->pHost, psHost->iPortOverride, psHost->psService->pModuleName, psHost->iUseSSL, psHost->psService->arrModuleParams, psHost->psService->nModuleParamCount);
+
+  /* hosts from -h/-H keep their position in the target list (the pre-scan may drop others) */
+  if (_psAudit->pOptCombo == NULL)
+    psHost->iId = _psAudit->sHostTmp.iId;
+
+  /* append host to list - server threads remove completed hosts concurrently */
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+
+  if (_psAudit->psHostRoot == NULL)
+    _psAudit->psHostRoot = psHost;
+  else
+    _psAudit->psHostTail->psHostNext = psHost;
+
+  _psAudit->psHostTail = psHost;
+
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  return psHost;
+}
+
+/*
+  Add the user-specified users (and any combo file passwords) to a host. For
+  combo files this is called once per combo entry.
+*/
+void loadUserInfo(sAudit *_psAudit, sHost *_psHost)
+{
   sUser *psUser = NULL;
   char *pUser = NULL;
 
   sPass *psPass = NULL;
   char *pPass = NULL;
 
-  /* initialize / reset */
-  _psAudit->iHostCnt = 0;
-  _psAudit->iHostsDone = 0;
-
-  while ((pHost = findNextHost(_psAudit, pHost)))
+  while ((pUser = findNextUser(_psAudit, pUser)))
   {
-    /* combo file: search list to see if host has already been added */
-    psHost = _psAudit->psHostRoot;
-    while (psHost)
+    /* combo file: search list to see if user has already been added */
+    psUser = (_psAudit->pOptCombo) ? _psHost->psUser : NULL;
+    while (psUser)
     {
-      if ( strcmp(pHost,psHost->pHost) )
-        psHost = psHost->psHostNext;
+      if ( strcmp(pUser,psUser->pUser) )
+        psUser = psUser->psUserNext;
       else
         break;
     }
 
-    /* create new host table in list */
-    if (psHost == NULL)
+    /* create new user table in list */
+    if (psUser == NULL)
     {
-      _psAudit->iHostCnt++;
-      psHost = malloc(sizeof(sHost));
-      memset(psHost, 0, sizeof(sHost));
+      _psHost->iUserCnt++;
+      psUser = malloc(sizeof(sUser));
+      memset(psUser, 0, sizeof(sUser));
 
-      /* set root pointer if this is the first host */
-      if (_psAudit->psHostRoot == NULL)
+      if (_psHost->psUserPrevTmp)
       {
-        _psAudit->psHostRoot = psHost;
-        psHostPrevTmp = _psAudit->psHostRoot;
+        /* setting host next user pointer */
+        _psHost->psUserPrevTmp->psUserNext = psUser;
       }
       else
       {
-        psHostPrevTmp->psHostNext = psHost;
-        psHostPrevTmp = psHost;
+        /* setting host root user pointer */
+        _psHost->psUser = psUser;
       }
 
-      psHost->pHost = strdup(pHost);
-      psHost->iPortOverride = _psAudit->iPortOverride;
-      psHost->iUseSSL = _psAudit->iUseSSL;
-      psHost->iTimeout = _psAudit->iTimeout;
-      psHost->iRetryWait = _psAudit->iRetryWait;
-      psHost->iRetries = _psAudit->iRetries;
-      psHost->iUserCnt = 0;
-      psHost->iId = _psAudit->iHostCnt; 
-    }
+      _psHost->psUserPrevTmp = psUser;
 
-    while ((pUser = findNextUser(_psAudit, pUser)))
-    {
-      /* combo file: search list to see if user has already been added */
-      psUser = psHost->psUser;
-      while (psUser)
-      {
-        if ( strcmp(pUser,psUser->pUser) )
-          psUser = psUser->psUserNext;
-        else
-          break;
-      }
+      psUser->pUser = strdup(pUser);
+      psUser->iPassCnt = (_psAudit->iRoundSize) ? _psAudit->iRoundPassCnt : _psAudit->iPassCnt;
+      psUser->iPassStatus = PL_UNSET;
+      psUser->iId = _psHost->iUserCnt;
+      _psHost->iUserPassCnt += psUser->iPassCnt;
 
-      /* create new user table in list */
-      if (psUser == NULL)
-      {
-        psHost->iUserCnt++;
-        psUser = malloc(sizeof(sUser));
-        memset(psUser, 0, sizeof(sUser));
+      /* blank and username passwords are tested in the first round only */
+      if (_psAudit->iRound > 0)
+        psUser->iPassStatus = PL_LOCAL;
 
-        if (psHost->psUserPrevTmp)
-        {
-          /* setting host next user pointer */
-          psHost->psUserPrevTmp->psUserNext = psUser;
-        }
-        else
-        {
-          /* setting host root user pointer */
-          psHost->psUser = psUser;
-        }
+      if ((_psAudit->iPasswordUsernameFlag) && (_psAudit->iRound == 0)) {
+        _psHost->iUserPassCnt++;
+        psUser->iPassCnt++;
+      }
 
-        psHost->psUserPrevTmp = psUser;
+      if ((_psAudit->iPasswordBlankFlag) && (_psAudit->iRound == 0)) {
+        _psHost->iUserPassCnt++;
+        psUser->iPassCnt++;
+      }
 
-        psUser->pUser = strdup(pUser);
-        psUser->iPassCnt = _psAudit->iPassCnt;
-        psUser->iPassStatus = PL_UNSET;
-        psUser->iId = psHost->iUserCnt;
-        psHost->iUserPassCnt += _psAudit->iPassCnt;
+      /* streamed passwords: each user walks the stream with its own cursor */
+      if (_psAudit->psPassStream)
+        streamAttach(_psAudit->psPassStream, &psUser->psPassBlock, &psUser->nPassOffset);
+    }
 
-        if (_psAudit->iPasswordUsernameFlag) {
-          psHost->iUserPassCnt++;
-          psUser->iPassCnt++;
-        }
+    pPass = findLocalPass(_psAudit);
+    if (pPass)
+    {
+      psPass = malloc(sizeof(sPass));
+      memset(psPass, 0, sizeof(sPass));
+      psPass->pPass = strdup(pPass);
+      psUser->iPassCnt++;
+      _psHost->iUserPassCnt++;
 
-        if (_psAudit->iPasswordBlankFlag) {
-          psHost->iUserPassCnt++;
-          psUser->iPassCnt++;
-        }
+      if (psUser->psPassPrevTmp)
+      {
+        /* setting user next pass pointer */
+        psUser->psPassPrevTmp->psPassNext = psPass;
       }
-
-      pPass = findLocalPass(_psAudit);
-      if (pPass)
+      else
       {
-        psPass = malloc(sizeof(sPass));
-        memset(psPass, 0, sizeof(sPass));
-        psPass->pPass = strdup(pPass);
-        psUser->iPassCnt++;
-        psHost->iUserPassCnt++;
-
-        if (psUser->psPassPrevTmp)
-        {
-          /* setting user next pass pointer */
-          psUser->psPassPrevTmp->psPassNext = psPass;
-        }
-        else
-        {
-          /* setting user root pass pointer */
-          psUser->psPass = psPass;
-          psUser->psPassCurrent = psPass;
-        }
-
-        psUser->psPassPrevTmp = psPass;
+        /* setting user root pass pointer */
+        psUser->psPass = psPass;
+        psUser->psPassCurrent = psPass;
       }
+
+      psUser->psPassPrevTmp = psPass;
     }
   }
-
-  return SUCCESS;
 }
 
-
 /*
-  Grab the next password for a particular user
+  Unlink a host from the audit's host list and free it along with its users.
 */
-char* getNextPass(sLogin *_psLogin)
+void freeHostInfo(sAudit *_psAudit, sHost *_psHost)
+{
+  sHost *psHostPrev = NULL;
+  sHost *psHost;
+  sUser *psUser;
+  sPass *psPass;
+
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+
+  for (psHost = _psAudit->psHostRoot; psHost && (psHost != _psHost); psHost = psHost->psHostNext)
+    psHostPrev = psHost;
+
+  if (psHost)
+  {
+    if (psHostPrev)
+      psHostPrev->psHostNext = psHost->psHostNext;
+    else
+      _psAudit->psHostRoot = psHost->psHostNext;
+
+    if (_psAudit->psHostTail == psHost)
+      _psAudit->psHostTail = psHostPrev;
+  }
+
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  while ((psUser = _psHost->psUser))
+  {
+    _psHost->psUser = psUser->psUserNext;
+
+    while ((psPass = psUser->psPass))
+    {
+      psUser->psPass = psPass->psPassNext;
+      free(psPass->pPass);
+      free(psPass);
+    }
+
+    free(psUser->pUser);
+    free(psUser);
+  }
+
+  free(_psHost->pHost);
+  free(_psHost);
+}
+
+/*
+  Build the complete host table for combo file audits. Other audits create
+  each host's table as it is dispatched (see startServerThreadPool()).
+*/
+int loadLoginInfo(sAudit *_psAudit)
+{
+  sHost *psHost = NULL;
+  char *pHost = NULL;
+
+  /* initialize / reset */
+  _psAudit->iHostsLoaded = 0;
+  _psAudit->iHostsDone = 0;
+
+  while ((pHost = findNextHost(_psAudit, pHost)))
+  {
+    /* combo file: search list to see if host has already been added */
+    psHost = _psAudit->psHostRoot;
+    while (psHost)
+    {
+      if ( strcmp(pHost,psHost->pHost) )
+        psHost = psHost->psHostNext;
+      else
+        break;
+    }
+
+    /* create new host table in list */
+    if (psHost == NULL)
+      psHost = loadHostInfo(_psAudit, pHost);
+
+    loadUserInfo(_psAudit, psHost);
+  }
+
+  _psAudit->iHostCnt = _psAudit->iHostsLoaded;
+
+  return SUCCESS;
+}
+
+
+/*
+  Grab the next password for a particular user
+*/
+static char* getNextPassEntry(sLogin *_psLogin)
 {
   sAudit *_psAudit = _psLogin->psServer->psAudit;
   sUser *_psUser = _psLogin->psUser;
@@ -1074,6 +1721,24 @@ char* getNextPass(sLogin *_psLogin)
         pPass = _psUser->psPassCurrent->pPass;
         _psUser->psPassCurrent = _psUser->psPassCurrent->psPassNext;
       }
+      /* process streamed global passwords - i.e. "-P" stdin, FIFO or compressed file */
+      else if (_psAudit->psPassStream)
+      {
+        _psUser->iPassStatus = PL_GLOBAL;
+
+        if ((pPass = streamNextEntry(_psAudit->psPassStream, &_psUser->psPassBlock, &_psUser->nPassOffset)))
+        {
+          /* keep the password's block alive until this login thread reports it */
+          streamHoldEntry(_psAudit->psPassStream, &_psLogin->sPassHeld, _psUser->psPassBlock, pPass);
+        }
+        else if (_psAudit->iStatus != AUDIT_ABORT)
+        {
+          /* password auditing of host is complete */
+          streamRelease(_psAudit->psPassStream, &_psUser->psPassBlock);
+          _psUser->iPassStatus = PL_DONE;
+          _psLogin->psServer->psHost->iUsersDone++;
+        }
+      }
       /* process global passwords - i.e. passwords specified via "-p" or "-P" options */
       else if (_psAudit->pGlobalPass)
       {
@@ -1085,7 +1750,8 @@ char* getNextPass(sLogin *_psLogin)
             _psUser->pPass++;
           _psUser->pPass++;
 
-          if (*_psUser->pPass != '\0')
+          /* rounds (-D) end where the next round's passwords start */
+          if ((*_psUser->pPass != '\0') && (_psUser->pPass != _psAudit->pRoundEnd))
           {
             pPass = _psUser->pPass;
           }
@@ -1098,7 +1764,7 @@ char* getNextPass(sLogin *_psLogin)
         }
         else
         {
-          _psUser->pPass = _psAudit->pGlobalPass;
+          _psUser->pPass = _psAudit->pRoundStart;
           pPass = _psUser->pPass;
         }
       }
@@ -1114,6 +1780,354 @@ char* getNextPass(sLogin *_psLogin)
   return pPass;
 }
 
+/*
+  Rounds (-D) create each host's table again for every round. Hosts, users
+  and priority lane passwords (-K) which are complete are remembered by
+  fingerprint, keyed by host ID, so later rounds do not test them again.
+*/
+#define ROUND_HOST 1
+#define ROUND_USER 2
+#define ROUND_PASS 3
+
+uint64_t roundKey(int _iType, int _iHostId, char *_pUser, char *_pPass)
+{
+  uint64_t arrKey[3];
+
+  arrKey[0] = ((uint64_t)_iType << 32) | (uint32_t)_iHostId;
+  arrKey[1] = (_pUser) ? fpset_hash(_pUser, strlen(_pUser)) : 0;
+  arrKey[2] = (_pPass) ? fpset_hash(_pPass, strlen(_pPass)) : 0;
+
+  return fpset_hash((char *)arrKey, sizeof(arrKey));
+}
+
+void setRoundDone(sAudit *_psAudit, int _iType, int _iHostId, char *_pUser, char *_pPass)
+{
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  fpset_add_fp(&_psAudit->sRoundDone, roundKey(_iType, _iHostId, _pUser, _pPass));
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+}
+
+int isRoundDone(sAudit *_psAudit, int _iType, int _iHostId, char *_pUser, char *_pPass)
+{
+  int iDone;
+
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  iDone = fpset_has_fp(&_psAudit->sRoundDone, roundKey(_iType, _iHostId, _pUser, _pPass));
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  return iDone;
+}
+
+/*
+  Mark the users of a host which were completed in earlier rounds. Returns
+  FALSE if nothing is left to test on the host.
+*/
+int resumeRound(sAudit *_psAudit, sHost *_psHost)
+{
+  sUser *psUser;
+
+  if (isRoundDone(_psAudit, ROUND_HOST, _psHost->iId, NULL, NULL))
+    return FALSE;
+
+  for (psUser = _psHost->psUser; psUser; psUser = psUser->psUserNext)
+  {
+    if (isRoundDone(_psAudit, ROUND_USER, _psHost->iId, psUser->pUser, NULL))
+    {
+      psUser->iPassStatus = PASS_AUDIT_COMPLETE;
+      _psHost->iUsersDone++;
+    }
+  }
+
+  return (_psHost->iUsersDone < _psHost->iUserCnt);
+}
+
+/*
+  Valid passwords found during the audit, by username (-K). Each password is
+  offered first to the same user on every other host. Passwords are only
+  added, so users track how many of them they have been offered.
+*/
+typedef struct __sFoundUser {
+  char *pUser;                  /* key --> username */
+  char **arrPass;
+  int nPass;
+  sService *psDomainService;    /* service which found a domain account valid, NULL if none */
+
+  UT_hash_handle hh;            /* required for UThash */
+} sFoundUser;
+
+/* Accounts checked against a domain rather than the host itself (smbnt GROUP:DOMAIN or GROUP_OTHER) */
+int isDomainService(sService *_psService)
+{
+  int i;
+
+  if (strcmp(_psService->pModuleName, "smbnt") != 0)
+    return FALSE;
+
+  for (i = 0; i < _psService->nModuleParamCount; i++)
+  {
+    if ((strcasecmp(_psService->arrModuleParams[i], "GROUP:DOMAIN") == 0) || (strncasecmp(_psService->arrModuleParams[i], "GROUP_OTHER:", 12) == 0))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+void addFoundPass(sAudit *_psAudit, sService *_psService, char *_pUser, char *_pPass)
+{
+  sFoundUser *psFound;
+  int i;
+
+  pthread_mutex_lock(&_psAudit->ptmFoundMutex);
+
+  HASH_FIND_STR(_psAudit->psFound, _pUser, psFound);
+  if (psFound == NULL)
+  {
+    psFound = malloc(sizeof(sFoundUser));
+    memset(psFound, 0, sizeof(sFoundUser));
+    psFound->pUser = strdup(_pUser);
+    HASH_ADD_KEYPTR(hh, _psAudit->psFound, psFound->pUser, strlen(psFound->pUser), psFound);
+  }
+
+  for (i = 0; i < psFound->nPass; i++)
+  {
+    if (strcmp(psFound->arrPass[i], _pPass) == 0)
+      break;
+  }
+
+  if (i == psFound->nPass)
+  {
+    psFound->arrPass = realloc(psFound->arrPass, (psFound->nPass + 1) * sizeof(char*));
+    psFound->arrPass[psFound->nPass++] = strdup(_pPass);
+    writeError(ERR_DEBUG, "[addFoundPass] User: %s Password: %s - will be tested first on other hosts", _pUser, _pPass);
+  }
+
+  if ((psFound->psDomainService == NULL) && (isDomainService(_psService)))
+    psFound->psDomainService = _psService;
+
+  pthread_mutex_unlock(&_psAudit->ptmFoundMutex);
+}
+
+/*
+  Priority lane (-K): the next password found valid for this user on another
+  host, or NULL. Users whose domain account was found valid through the same
+  service are complete.
+*/
+char* getFoundPass(sLogin *_psLogin)
+{
+  sAudit *_psAudit = _psLogin->psServer->psAudit;
+  sUser *_psUser = _psLogin->psUser;
+  sFoundUser *psFound;
+  char *pPass = NULL;
+
+  if ((_psUser->iPassStatus == PL_DONE) || (_psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+    return NULL;
+
+  pthread_mutex_lock(&_psAudit->ptmFoundMutex);
+
+  HASH_FIND_STR(_psAudit->psFound, _psUser->pUser, psFound);
+  if ((psFound) && (psFound->psDomainService == _psLogin->psServer->psHost->psService))
+  {
+    writeError(ERR_INFO, "[%s] Host: %s User: %s - domain account already found valid, skipping user", psFound->psDomainService->pModuleName, _psLogin->psServer->psHost->pHost, _psUser->pUser);
+    _psUser->iPassStatus = PASS_AUDIT_COMPLETE;
+    _psLogin->psServer->psHost->iUsersDone++;
+    streamRelease(_psAudit->psPassStream, &_psUser->psPassBlock);
+  }
+  else if ((psFound) && (_psUser->iFoundSeen < psFound->nPass))
+  {
+    pPass = psFound->arrPass[_psUser->iFoundSeen++];
+    writeError(ERR_DEBUG, "[getFoundPass] Host: %s User: %s Password: %s - found on another host, testing first", _psLogin->psServer->psHost->pHost, _psUser->pUser, pPass);
+  }
+
+  pthread_mutex_unlock(&_psAudit->ptmFoundMutex);
+
+  /* rounds (-D): each lane password is only tested once per host and user */
+  if ((pPass) && (_psAudit->iRoundSize))
+  {
+    if (isRoundDone(_psAudit, ROUND_PASS, _psLogin->psServer->psHost->iId, _psUser->pUser, pPass))
+      return getFoundPass(_psLogin);
+
+    setRoundDone(_psAudit, ROUND_PASS, _psLogin->psServer->psHost->iId, _psUser->pUser, pPass);
+  }
+
+  return pPass;
+}
+
+/* Returns TRUE if the password was already tested for this user through the priority lane */
+int isFoundPassTested(sLogin *_psLogin, char *_pPass)
+{
+  sAudit *_psAudit = _psLogin->psServer->psAudit;
+  sFoundUser *psFound;
+  int iTested = FALSE;
+  int i;
+
+  if (_psLogin->psUser->iFoundSeen == 0)
+    return FALSE;
+
+  pthread_mutex_lock(&_psAudit->ptmFoundMutex);
+
+  HASH_FIND_STR(_psAudit->psFound, _psLogin->psUser->pUser, psFound);
+  for (i = 0; (psFound) && (i < _psLogin->psUser->iFoundSeen) && (!iTested); i++)
+    iTested = (strcmp(psFound->arrPass[i], _pPass) == 0);
+
+  pthread_mutex_unlock(&_psAudit->ptmFoundMutex);
+
+  return iTested;
+}
+
+void freeFoundPass(sAudit *_psAudit)
+{
+  sFoundUser *psFound;
+  int i;
+
+  while (_psAudit->psFound)
+  {
+    psFound = _psAudit->psFound;
+    HASH_DEL(_psAudit->psFound, psFound);
+
+    for (i = 0; i < psFound->nPass; i++)
+      free(psFound->arrPass[i]);
+
+    FREE(psFound->arrPass);
+    free(psFound->pUser);
+    free(psFound);
+  }
+}
+
+/*
+  Deadline (-B) planning. A host's login rate is measured while it is being
+  tested (the average rate of completed hosts is used until enough logins
+  were made). The host's share of the time left is the time left itself
+  while all remaining hosts fit into the server slots, and proportionally
+  less otherwise. Spread over the host's users, this gives the number of
+  passwords each user can be tested with. Hosts which finish early or fail
+  leave a larger share to the others, so the depth is recomputed on every
+  request. Returns 0 if there is no limit (yet).
+*/
+#define DEADLINE_MIN_SAMPLE 2.0       /* seconds a host is tested before its own rate is used */
+#define DEADLINE_POLL_USEC 250000     /* interval at which idle login threads are lent */
+
+static double getElapsed(struct timeval *_ptvStart)
+{
+  struct timeval tvNow;
+
+  gettimeofday(&tvNow, NULL);
+  return (tvNow.tv_sec - _ptvStart->tv_sec) + (tvNow.tv_usec - _ptvStart->tv_usec) / 1000000.0;
+}
+
+int getDeadlineDepth(sServer *_psServer)
+{
+  sAudit *_psAudit = _psServer->psAudit;
+  double fElapsed, fRate, fShare;
+  int iHostsLeft;
+
+  fElapsed = getElapsed(&_psServer->tvStart);
+  if ((fElapsed >= DEADLINE_MIN_SAMPLE) && (_psServer->iLoginsDone > 0))
+    fRate = _psServer->iLoginsDone / fElapsed;
+  else if (_psAudit->fHostRate > 0)
+    fRate = _psAudit->fHostRate;
+  else
+    return 0;
+
+  fShare = difftime(_psAudit->tDeadline, time(NULL));
+  if (fShare <= 0)
+    return 1;
+
+  iHostsLeft = _psAudit->iHostCnt - _psAudit->iHostsDone;
+  if (iHostsLeft > _psAudit->iServerCnt)
+    fShare = fShare * _psAudit->iServerCnt / iHostsLeft;
+
+  fRate = (_psServer->iLoginsDone + fRate * fShare) / _psServer->psHost->iUserCnt;
+
+  return (fRate < 1) ? 1 : (fRate > INT_MAX) ? INT_MAX : (int)fRate;
+}
+
+/*
+  Stop testing a user once it reached the password depth planned for the
+  deadline. The user is reported as incomplete in the resume map.
+*/
+int deferDeadlineUser(sLogin *_psLogin)
+{
+  sHost *psHost = _psLogin->psServer->psHost;
+  sUser *psUser = _psLogin->psUser;
+  int iDepth;
+
+  if ((psUser->iPassStatus == PL_DONE) || (psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+    return FALSE;
+
+  /* nothing is deferred once the user's password list was handed out */
+  if ((psUser->iPassCnt) && (psUser->iPassDepth >= psUser->iPassCnt))
+    return FALSE;
+
+  if (((iDepth = getDeadlineDepth(_psLogin->psServer)) == 0) || (psUser->iPassDepth < iDepth))
+    return FALSE;
+
+  writeError(ERR_DEBUG, "[getNextPass] Host: %s User: %s - deferring passwords after %d to meet the deadline", psHost->pHost, psUser->pUser, psUser->iPassDepth);
+
+  psUser->iPassStatus = PL_DONE;
+  psUser->iDeferred = TRUE;
+  psHost->iUsersDone++;
+  psHost->iUsersDeferred++;
+  psHost->iDeferDepth = psUser->iPassDepth;
+  streamRelease(_psLogin->psServer->psAudit->psPassStream, &psUser->psPassBlock);
+
+  return TRUE;
+}
+
+/*
+  Grab the next password for a particular user. Passwords found for the user
+  on other hosts are tested first (-K). Passwords which the ledger shows
+  failed for this user, host and service in a previous run are skipped.
+*/
+static char* getNextUntestedPass(sLogin *_psLogin)
+{
+  sAudit *_psAudit = _psLogin->psServer->psAudit;
+  sLedger *psLedger = _psAudit->psLedger;
+  char *pPass;
+
+  while ((_psAudit->iPropagateFlag) && ((pPass = getFoundPass(_psLogin)) != NULL))
+  {
+    if ((psLedger == NULL) || (!ledgerFailed(psLedger, ledgerKey(_psLogin->psServer->psHost->nLedgerKey, _psLogin->psUser->pUser, pPass))))
+      return pPass;
+  }
+
+  while ((pPass = getNextPassEntry(_psLogin)) != NULL)
+  {
+    if ((psLedger) && (ledgerFailed(psLedger, ledgerKey(_psLogin->psServer->psHost->nLedgerKey, _psLogin->psUser->pUser, pPass))))
+    {
+      writeError(ERR_DEBUG, "[getNextPass] Host: %s User: %s Password: %s - failed in a previous run (ledger), skipping", _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, pPass);
+      _psLogin->psUser->iLoginsDone++;
+      _psLogin->psServer->iLoginsSkipped++;
+      streamDoneEntry(_psAudit->psPassStream, &_psLogin->sPassHeld, pPass);
+    }
+    else if ((_psAudit->iPropagateFlag) && (isFoundPassTested(_psLogin, pPass)))
+    {
+      writeError(ERR_DEBUG, "[getNextPass] Host: %s User: %s Password: %s - already tested (found on another host), skipping", _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, pPass);
+      streamDoneEntry(_psAudit->psPassStream, &_psLogin->sPassHeld, pPass);
+    }
+    else
+      break;
+  }
+
+  return pPass;
+}
+
+/*
+  Grab the next password for a particular user, unless the user reached the
+  depth planned for the deadline (-B).
+*/
+char* getNextPass(sLogin *_psLogin)
+{
+  char *pPass;
+
+  if ((_psLogin->psServer->psAudit->iDeadline) && (deferDeadlineUser(_psLogin)))
+    return NULL;
+
+  if ((pPass = getNextUntestedPass(_psLogin)) != NULL)
+    _psLogin->psUser->iPassDepth++;
+
+  return pPass;
+}
+
 
 /* 
   Generates the next credential set for login module to test. The module is
@@ -1170,6 +2184,15 @@ int getNextNormalCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
   /* find next available password - if password list is exhausted for user, move on to the next user */
   while ((_psLogin->psUser) && ((_psCredSet->pPass = getNextPass(_psLogin)) == NULL))
   {
+    /* audit aborted while waiting on a password stream */
+    if (_psLogin->psServer->psAudit->iStatus == AUDIT_ABORT)
+    {
+      writeError(ERR_INFO, "Audit aborting... notifying login module: %d", _psLogin->iId);
+      _psCredSet->iStatus = CREDENTIAL_DONE;
+      _psCredSet->psUser = _psLogin->psUser;
+      return SUCCESS;
+    }
+
     /* is password testing for user complete */
     if ((_psLogin->psUser->iPassStatus == PL_DONE) || (_psLogin->psUser->iPassStatus == PASS_AUDIT_COMPLETE))
     {
@@ -1228,34 +2251,177 @@ int getNextNormalCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
 }
 
 /*
-  In certain situations we need to scale back the number of concurrent
-  login threads targetting a specific service. For example, MSDE's workload
-  governor limits the service to no more than 5 concurrent connections. If
-  the user kicked-off 10 parallel login threads, 5 of those are going to
-  fail and terminate. The challenge is that each of those threads was 
-  already assigned a credential set to test.
-
-  The addMissedCredSet() function creates a linked list of credentials
-  which were not tested for a given host. This function retrieves the
-  next credential set from that list for testing.
+  Account attempt budget (-A). An account is the user on a host address -
+  shared by the services and task file lines auditing that address - or,
+  for services checked against a domain (smbnt GROUP:DOMAIN), the user on
+  all hosts audited with that service.
 */
-int getNextMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
+uint64_t paceKey(sServer *_psServer, sUser *_psUser)
 {
-  sCredentialSet *psCredSetMissed = NULL;
+  sAudit *psAudit = _psServer->psAudit;
+  sHost *psHost = _psServer->psHost;
+  char szKey[32];
+  size_t nLen;
+  char *pBuf;
 
-  writeError(ERR_DEBUG, "Retrieving the next available credential set from list of previously missed sets.");
+  if (_psUser->nPaceKey)
+    return _psUser->nPaceKey;
 
-  /* skip credential if user testing is complete (e.g. password found, account locked) */
-  psCredSetMissed = _psLogin->psServer->psCredentialSetMissedCurrent;
-  while ((psCredSetMissed) && (psCredSetMissed->psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+  if (isDomainService(psHost->psService))
+    snprintf(szKey, sizeof(szKey), "d%d:", (int)(psHost->psService - psAudit->psServices));
+  else
+    snprintf(szKey, sizeof(szKey), "a%s:", _psServer->pHostIP);
+
+  nLen = strlen(szKey) + strlen(_psUser->pUser);
+  pBuf = malloc(nLen + 1);
+  sprintf(pBuf, "%s%s", szKey, _psUser->pUser);
+  _psUser->nPaceKey = fpset_hash(pBuf, nLen);
+  free(pBuf);
+
+  return _psUser->nPaceKey;
+}
+
+/*
+  Every remaining user of a paced host (-A) used its attempt budget. The
+  host is set aside for _fWait seconds, ending its login threads, while
+  hosts are left to start or a host set aside earlier has attempts left
+  sooner - startServerThreadPool() queues it again later. Otherwise the
+  login thread waits (without holding the server mutex). Returns TRUE if
+  the login thread is to end. Called with the server mutex held.
+*/
+int paceHostWait(sLogin *_psLogin, double _fWait)
+{
+  sServer *psServer = _psLogin->psServer;
+  sAudit *psAudit = psServer->psAudit;
+  sServer *psParked;
+  double fUntil = paceNow() + _fWait;
+  double fFirst = 0;
+  int iParked = 0;
+  int iPark;
+
+  if (psServer->fParkedUntil > 0)
+    return TRUE;
+
+  pthread_mutex_lock(&psAudit->ptmMutex);
+  for (psParked = psAudit->psServerParked; psParked; psParked = psParked->psServerNext, iParked++)
+    if ((fFirst == 0) || (psParked->fParkedUntil < fFirst))
+      fFirst = psParked->fParkedUntil;
+
+  /* no more than iServerCnt hosts are set aside, bounding the host tables held */
+  iPark = (((!psAudit->iDispatchIdle) && (iParked < psAudit->iServerCnt)) || ((iParked) && (fFirst < fUntil)));
+  pthread_mutex_unlock(&psAudit->ptmMutex);
+
+  if (iPark)
   {
-    psCredSetMissed = _psLogin->psServer->psCredentialSetMissedCurrent->psCredentialSetNext; 
-    _psLogin->psServer->psCredentialSetMissedCurrent = psCredSetMissed;
+    writeError(ERR_INFO, "[%s] Host: %s - all remaining users used their attempt budget, setting host aside for %.1f seconds.", psServer->psHost->psService->pModuleName, psServer->psHost->pHost, _fWait);
+    psServer->fParkedUntil = fUntil;
+    return TRUE;
   }
 
-  /* located next credential set that was not previously tested */
-  if (psCredSetMissed)
-  {
+  writeError(ERR_INFO, "Login Module: %d - all remaining users of host %s used their attempt budget, waiting %.1f seconds.", _psLogin->iId, psServer->psHost->pHost, _fWait);
+
+  pthread_mutex_unlock(&psServer->ptmMutex);
+  coroSleep((long)((_fWait < 1.0) ? _fWait * 1000000 : 1000000) + 1000);
+  pthread_mutex_lock(&psServer->ptmMutex);
+
+  /* a valid pair may have been found while waiting (-f/-F) */
+  return ((psAudit->iStatus == AUDIT_ABORT) ||
+          ((psServer->iValidPairFound) && (psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_HOST)) ||
+          ((psAudit->iValidPairFound) && (psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_AUDIT)));
+}
+
+/*
+  Paced retry of missed credential sets (-A). Takes an attempt of the first
+  remaining set, from *_ppsCredSetMissed on, whose account has one left, and
+  swaps it to *_ppsCredSetMissed (the list's current set). When no account
+  has one left, the host is set aside or the login thread waits
+  (paceHostWait()). Returns FALSE if the login thread is to end.
+*/
+int getPacedMissedCredSet(sLogin *_psLogin, sCredentialSet **_ppsCredSetMissed)
+{
+  sServer *psServer = _psLogin->psServer;
+  sCredentialSet *psCredSet;
+  sUser *psUser;
+  char *pPass;
+  double fStamp, fWait, fMinWait;
+
+  while (*_ppsCredSetMissed)
+  {
+    fMinWait = psServer->psAudit->iPaceWindow;
+
+    for (psCredSet = *_ppsCredSetMissed; psCredSet; psCredSet = psCredSet->psCredentialSetNext)
+    {
+      if (psCredSet->psUser->iPassStatus == PASS_AUDIT_COMPLETE)
+        continue;
+
+      if (paceReserve(psServer->psAudit->psPacer, paceKey(psServer, psCredSet->psUser), &fStamp, &fWait))
+        break;
+      else if (fWait < fMinWait)
+        fMinWait = fWait;
+    }
+
+    if (psCredSet)
+    {
+      psUser = psCredSet->psUser;
+      pPass = psCredSet->pPass;
+      psCredSet->psUser = (*_ppsCredSetMissed)->psUser;
+      psCredSet->pPass = (*_ppsCredSetMissed)->pPass;
+      (*_ppsCredSetMissed)->psUser = psUser;
+      (*_ppsCredSetMissed)->pPass = pPass;
+      return TRUE;
+    }
+
+    if (paceHostWait(_psLogin, fMinWait))
+      return FALSE;
+
+    /* users may have been completed while waiting */
+    while ((*_ppsCredSetMissed) && ((*_ppsCredSetMissed)->psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+    {
+      *_ppsCredSetMissed = (*_ppsCredSetMissed)->psCredentialSetNext;
+      psServer->psCredentialSetMissedCurrent = *_ppsCredSetMissed;
+    }
+  }
+
+  return TRUE;
+}
+
+/*
+  In certain situations we need to scale back the number of concurrent
+  login threads targetting a specific service. For example, MSDE's workload
+  governor limits the service to no more than 5 concurrent connections. If
+  the user kicked-off 10 parallel login threads, 5 of those are going to
+  fail and terminate. The challenge is that each of those threads was 
+  already assigned a credential set to test.
+
+  The addMissedCredSet() function creates a linked list of credentials
+  which were not tested for a given host. This function retrieves the
+  next credential set from that list for testing.
+*/
+int getNextMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
+{
+  sCredentialSet *psCredSetMissed = NULL;
+
+  writeError(ERR_DEBUG, "Retrieving the next available credential set from list of previously missed sets.");
+
+  /* skip credential if user testing is complete (e.g. password found, account locked) */
+  psCredSetMissed = _psLogin->psServer->psCredentialSetMissedCurrent;
+  while ((psCredSetMissed) && (psCredSetMissed->psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+  {
+    psCredSetMissed = _psLogin->psServer->psCredentialSetMissedCurrent->psCredentialSetNext; 
+    _psLogin->psServer->psCredentialSetMissedCurrent = psCredSetMissed;
+  }
+
+  /* attempt budget (-A): retries count against it as well */
+  if ((psCredSetMissed) && (_psLogin->psServer->psAudit->psPacer) && (getPacedMissedCredSet(_psLogin, &psCredSetMissed) == FALSE))
+  {
+    _psCredSet->iStatus = CREDENTIAL_DONE;
+    _psCredSet->psUser = _psLogin->psUser;
+    return SUCCESS;
+  }
+
+  /* located next credential set that was not previously tested */
+  if (psCredSetMissed)
+  {
     _psCredSet->psUser = psCredSetMissed->psUser;
     _psCredSet->pPass = psCredSetMissed->pPass;
     _psLogin->psServer->psCredentialSetMissedCurrent = psCredSetMissed->psCredentialSetNext; 
@@ -1281,6 +2447,97 @@ int getNextMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
   return SUCCESS;
 }
 
+/*
+  Paced counterpart of getNextNormalCredSet() (-A). Users are tested in
+  turn: each request starts with the user after the last one handed out and
+  takes the first one whose account has attempts left in the window. Once
+  every remaining user used its budget, the host is set aside or the login
+  thread waits until the oldest attempt leaves the window (paceHostWait()).
+  Called with the server mutex held.
+*/
+int getNextPacedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
+{
+  sServer *psServer = _psLogin->psServer;
+  sHost *psHost = psServer->psHost;
+  sAudit *psAudit = psServer->psAudit;
+  sUser *psUser, *psStart, *psPrev;
+  uint64_t nKey;
+  double fStamp, fWait, fMinWait;
+  int iRemaining;
+
+  if (psHost->iUserStatus == UL_UNSET)
+    psHost->iUserStatus = UL_NORMAL;
+
+  psPrev = _psLogin->psUser;
+
+  while (psAudit->iStatus != AUDIT_ABORT)
+  {
+    iRemaining = 0;
+    fMinWait = psAudit->iPaceWindow;
+
+    psStart = ((psHost->psUserCurrent) && (psHost->psUserCurrent->psUserNext)) ? psHost->psUserCurrent->psUserNext : psHost->psUser;
+    psUser = psStart;
+
+    do
+    {
+      if ((psUser->iPassStatus != PL_DONE) && (psUser->iPassStatus != PASS_AUDIT_COMPLETE))
+      {
+        nKey = paceKey(psServer, psUser);
+
+        if (paceReserve(psAudit->psPacer, nKey, &fStamp, &fWait))
+        {
+          _psLogin->psUser = psUser;
+
+          if ((_psCredSet->pPass = getNextPass(_psLogin)) != NULL)
+          {
+            psHost->psUserCurrent = psUser;
+            _psCredSet->psUser = psUser;
+            _psCredSet->iStatus = (psUser == psPrev) ? CREDENTIAL_SAME_USER : CREDENTIAL_NEW_USER;
+            return SUCCESS;
+          }
+
+          /* the user's password list is complete - no attempt was made */
+          paceRelease(psAudit->psPacer, nKey, fStamp);
+        }
+        else if (fWait < fMinWait)
+          fMinWait = fWait;
+
+        if ((psUser->iPassStatus != PL_DONE) && (psUser->iPassStatus != PASS_AUDIT_COMPLETE))
+          iRemaining++;
+      }
+
+      psUser = (psUser->psUserNext) ? psUser->psUserNext : psHost->psUser;
+    } while (psUser != psStart);
+
+    if (iRemaining == 0)
+      break;
+
+    if (paceHostWait(_psLogin, fMinWait))
+    {
+      _psCredSet->iStatus = CREDENTIAL_DONE;
+      _psCredSet->psUser = psPrev;
+      _psLogin->psUser = psPrev;
+      return SUCCESS;
+    }
+  }
+
+  if (psAudit->iStatus == AUDIT_ABORT)
+  {
+    writeError(ERR_INFO, "Audit aborting... notifying login module: %d", _psLogin->iId);
+    _psCredSet->iStatus = CREDENTIAL_DONE;
+    _psCredSet->psUser = psPrev;
+    _psLogin->psUser = psPrev;
+    return SUCCESS;
+  }
+
+  writeError(ERR_INFO, "Login Module: %d - No more users/passwords available in the normal queue.", _psLogin->iId);
+  psHost->iUserStatus = UL_MISSED;
+  _psLogin->psUser = NULL;
+  _psCredSet->psUser = NULL;
+
+  return SUCCESS;
+}
+
 /*
   Function returns next available username and password to module for testing.
   The normal host's list of users and their respective passwords (local, global, etc)
@@ -1291,6 +2548,9 @@ int getNextCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
 {
   if (_psCredSet == NULL)
     writeError(ERR_FATAL, "getNextCredSet() called, but not supplied allocated memory for _psCredSet");
+
+  /* the module is done with the streamed passwords it reported before asking for more */
+  streamReleaseDone(_psLogin->psServer->psAudit->psPassStream, &_psLogin->sPassHeld);
   
   memset(_psCredSet, 0, sizeof(sCredentialSet));
   pthread_mutex_lock(&_psLogin->psServer->ptmMutex);
@@ -1313,6 +2573,12 @@ int getNextCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
     writeError(ERR_INFO, "Exiting Login Module: %d [Stop Audit Scans After Valid Pair Found Enabled]", _psLogin->iId);
     _psCredSet->iStatus = CREDENTIAL_DONE;
   }
+  /* paced host set aside until its users have attempts left (-A) */
+  else if (_psLogin->psServer->fParkedUntil > 0)
+  {
+    writeError(ERR_INFO, "Login Module: %d - host set aside, setting credential status to CREDENTIAL_DONE.", _psLogin->iId);
+    _psCredSet->iStatus = CREDENTIAL_DONE;
+  }
   else
   {
     switch (_psLogin->psServer->psHost->iUserStatus)
@@ -1320,7 +2586,12 @@ int getNextCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
       case UL_UNSET:
       case UL_NORMAL:
         /* check for next available login to perform */
-        if (getNextNormalCredSet(_psLogin, _psCredSet) != SUCCESS)
+        if (_psLogin->psServer->psAudit->psPacer)
+        {
+          if (getNextPacedCredSet(_psLogin, _psCredSet) != SUCCESS)
+            writeError(ERR_FATAL, "getNextPacedCredSet() function call failed.");
+        }
+        else if (getNextNormalCredSet(_psLogin, _psCredSet) != SUCCESS)
           writeError(ERR_FATAL, "getNextNormalCredSet() function call failed.");
 
         /* the normal queue is exhausted - check the missed credentials queue */
@@ -1352,13 +2623,55 @@ int getNextCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
 /*
   Process password result from login module
 */
+/*
+  Pass an event to the library event handler (see medusa-api.h), if any.
+*/
+void sendEvent(sAudit *_psAudit, int _iType, char *_pModule, char *_pHost, int _iPort, char *_pUser, char *_pPass, int _iResult, char *_pMessage)
+{
+  sMedusaEvent sEvent;
+
+  if ((_psAudit == NULL) || (_psAudit->pfnEvent == NULL))
+    return;
+
+  memset(&sEvent, 0, sizeof(sMedusaEvent));
+  sEvent.iType = _iType;
+  sEvent.pModule = _pModule;
+  sEvent.pHost = _pHost;
+  sEvent.iPort = _iPort;
+  sEvent.pUser = _pUser;
+  sEvent.pPass = _pPass;
+  sEvent.iResult = _iResult;
+  sEvent.pMessage = _pMessage;
+
+  _psAudit->pfnEvent(&sEvent, _psAudit->pEventArg);
+}
+
+/* Port tested on a host - the module's default unless overridden */
+static int getHostPort(sHost *_psHost)
+{
+  return (_psHost->iPortOverride) ? _psHost->iPortOverride : _psHost->psService->iDefaultPort;
+}
+
 void setPassResult(sLogin *_psLogin, char *_pPass)
 {
+  sAudit *_psAudit = _psLogin->psServer->psAudit;
+  char szPassCnt[12];
+  int iStreamCnt = 0;
+
+  /* before locking the server - another login thread may be waiting on the stream with it held */
+  streamDoneEntry(_psAudit->psPassStream, &_psLogin->sPassHeld, _pPass);
+
   pthread_mutex_lock(&_psLogin->psServer->ptmMutex);
 
+  /* the total number of streamed passwords is unknown until the end of the stream */
+  if ((_psAudit->psPassStream) && (!streamCount(_psAudit->psPassStream, &iStreamCnt)))
+    snprintf(szPassCnt, sizeof(szPassCnt), "?");
+  else
+    snprintf(szPassCnt, sizeof(szPassCnt), "%d", _psLogin->psUser->iPassCnt + iStreamCnt);
+
   writeVerbose(VB_CHECK,
-               "[%s] Host: %s (%d of %d, %d complete) User: %s (%d of %d, %d complete) Password: %s (%d of %d complete)",
-               _psLogin->psServer->psAudit->pModuleName,
+               "[%s] Host: %s (%d of %d, %d complete) User: %s (%d of %d, %d complete) Password: %s (%d of %s complete)",
+               _psLogin->psServer->psHost->psService->pModuleName,
                _psLogin->psServer->psHost->pHost,
                _psLogin->psServer->psHost->iId,
                _psLogin->psServer->psAudit->iHostCnt,
@@ -1369,53 +2682,72 @@ void setPassResult(sLogin *_psLogin, char *_pPass)
                _psLogin->psServer->psHost->iUsersDone,
                _pPass,
                _psLogin->psUser->iLoginsDone + 1,
-               _psLogin->psUser->iPassCnt
+               szPassCnt
               );
 
   _psLogin->iLoginsDone++;
   _psLogin->psUser->iLoginsDone++,
   _psLogin->psServer->iLoginsDone++;
 
+  /* errors are inconclusive - only record logins which were answered */
+  if ((_psAudit->psLedger) && ((_psLogin->iResult == LOGIN_RESULT_SUCCESS) || (_psLogin->iResult == LOGIN_RESULT_FAIL)))
+    ledgerRecord(_psAudit->psLedger, ledgerKey(_psLogin->psServer->psHost->nLedgerKey, _psLogin->psUser->pUser, _pPass), _psLogin->iResult);
+
+  if ((_psLogin->iResult == LOGIN_RESULT_SUCCESS) || (_psLogin->iResult == LOGIN_RESULT_FAIL) || (_psLogin->iResult == LOGIN_RESULT_ERROR))
+    sendEvent(_psAudit, MEDUSA_EVENT_ATTEMPT, _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, getHostPort(_psLogin->psServer->psHost), _psLogin->psUser->pUser, _pPass, _psLogin->iResult, _psLogin->pErrorMsg);
+
   switch (_psLogin->iResult)
   {
   case LOGIN_RESULT_SUCCESS:
     if (_psLogin->pErrorMsg) {
-      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS (%s)]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass, _psLogin->pErrorMsg);
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS (%s)]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass, _psLogin->pErrorMsg);
       free(_psLogin->pErrorMsg);
       _psLogin->pErrorMsg = NULL;
     }
     else
-      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass);
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [SUCCESS]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass);
     
     _psLogin->psServer->psAudit->iValidPairFound = TRUE;
     _psLogin->psServer->iValidPairFound = TRUE;
+
+    if (_psAudit->iPropagateFlag)
+      addFoundPass(_psAudit, _psLogin->psServer->psHost->psService, _psLogin->psUser->pUser, _pPass);
+
+    if (_psAudit->iRoundSize)
+      setRoundDone(_psAudit, ROUND_USER, _psLogin->psServer->psHost->iId, _psLogin->psUser->pUser, NULL);
+
     _psLogin->psUser->iPassStatus = PASS_AUDIT_COMPLETE;
     _psLogin->psServer->psHost->iUsersDone++;
+    streamRelease(_psAudit->psPassStream, &_psLogin->psUser->psPassBlock);
     break;
   case LOGIN_RESULT_FAIL:
     if (_psLogin->pErrorMsg) {
-      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED (%s)]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _psLogin->pErrorMsg);
+      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED (%s)]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _psLogin->pErrorMsg);
       free(_psLogin->pErrorMsg);
       _psLogin->pErrorMsg = NULL;
     }
     else
-      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser);
+      writeError(ERR_INFO, "[%s] Host: %s User: %s [FAILED]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser);
     
     break;
   case LOGIN_RESULT_ERROR:
     if (_psLogin->pErrorMsg) {
-      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR (%s)]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass, _psLogin->pErrorMsg);
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR (%s)]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass, _psLogin->pErrorMsg);
       free(_psLogin->pErrorMsg);
       _psLogin->pErrorMsg = NULL;
     }
     else
-      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass);
+      writeVerbose(VB_FOUND, "[%s] Host: %s User: %s Password: %s [ERROR]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _pPass);
     
     _psLogin->psUser->iPassStatus = PASS_AUDIT_COMPLETE;
     _psLogin->psServer->psHost->iUsersDone++;
+    streamRelease(_psAudit->psPassStream, &_psLogin->psUser->psPassBlock);
+
+    if (_psAudit->iRoundSize)
+      setRoundDone(_psAudit, ROUND_USER, _psLogin->psServer->psHost->iId, _psLogin->psUser->pUser, NULL);
     break;
   default:
-    writeError(ERR_INFO, "[%s] Host: %s User: %s [UNKNOWN %d]", _psLogin->psServer->psAudit->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _psLogin->iResult);
+    writeError(ERR_INFO, "[%s] Host: %s User: %s [UNKNOWN %d]", _psLogin->psServer->psHost->psService->pModuleName, _psLogin->psServer->psHost->pHost, _psLogin->psUser->pUser, _psLogin->iResult);
     break;
   }
 
@@ -1440,7 +2772,7 @@ int addMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
   pthread_mutex_lock(&_psLogin->psServer->ptmMutex);
 
   writeError(ERR_NOTICE, "[%s] Host: %s - Login thread (%d) prematurely ended. The current number of parallel login threads may exceed what this service can reasonably handle. The total number of threads for this host will be decreased.",
-               _psLogin->psServer->psAudit->pModuleName,
+               _psLogin->psServer->psHost->psService->pModuleName,
                _psLogin->psServer->psHost->pHost,
                _psLogin->iId
             );
@@ -1449,7 +2781,7 @@ int addMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
     _psLogin->psServer->iLoginCnt--;
   
   writeError(ERR_NOTICE, "[%s] Host: %s User: %s Password: %s - The noted credentials have been added to the end of the queue for testing.",
-               _psLogin->psServer->psAudit->pModuleName,
+               _psLogin->psServer->psHost->psService->pModuleName,
                _psLogin->psServer->psHost->pHost,
                _psCredSet->psUser->pUser,
                _psCredSet->pPass
@@ -1462,6 +2794,7 @@ int addMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
   psCredSetMissed->psUser = _psCredSet->psUser;
 
   psCredSetMissed->pPass = strdup(_psCredSet->pPass);
+  streamDoneEntry(_psLogin->psServer->psAudit->psPassStream, &_psLogin->sPassHeld, _psCredSet->pPass);
 
   /* append structure to host's list of missed credentials */
   if (_psLogin->psServer->psCredentialSetMissed == NULL) /* first missed credential set */
@@ -1482,6 +2815,79 @@ int addMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet)
 }
 
 
+/*
+  Count the login threads queued or running, per server and for the audit.
+*/
+void addLoginsActive(sServer *_psServer, int _iDelta)
+{
+  pthread_mutex_lock(&_psServer->ptmMutex);
+  _psServer->iLoginsActive += _iDelta;
+  pthread_mutex_unlock(&_psServer->ptmMutex);
+
+  pthread_mutex_lock(&_psServer->psAudit->ptmMutex);
+  _psServer->psAudit->iLoginsActive += _iDelta;
+  pthread_mutex_unlock(&_psServer->psAudit->ptmMutex);
+}
+
+int getLoginsActive(sServer *_psServer)
+{
+  int iLoginsActive;
+
+  pthread_mutex_lock(&_psServer->ptmMutex);
+  iLoginsActive = _psServer->iLoginsActive;
+  pthread_mutex_unlock(&_psServer->ptmMutex);
+
+  return iLoginsActive;
+}
+
+/*
+  Deadline (-B): once no hosts are left to dispatch, the login threads of the
+  idle server slots are lent to the hosts still being tested. Returns TRUE
+  if the host has users left for another login thread and a thread could be
+  reserved within the total of iServerCnt * iLoginCnt.
+*/
+int reserveLentLogin(sServer *_psServer)
+{
+  sAudit *_psAudit = _psServer->psAudit;
+  sUser *psUser;
+  int iLend = FALSE;
+
+  if ((_psAudit->iStatus == AUDIT_ABORT) || (!_psAudit->iDispatchIdle))
+    return FALSE;
+
+  pthread_mutex_lock(&_psServer->ptmMutex);
+
+  if ((_psServer->psHost->iUserStatus == UL_NORMAL) && ((psUser = _psServer->psHost->psUserCurrent)))
+  {
+    /* a new thread joins the current user (default) or takes the next one (-L) */
+    if (psUser->psUserNext)
+      iLend = TRUE;
+    else if (_psAudit->iParallelLoginFlag == PARALLEL_LOGINS_PASSWORD)
+      iLend = ((psUser->iPassStatus != PL_DONE) && (psUser->iPassStatus != PASS_AUDIT_COMPLETE));
+  }
+
+  pthread_mutex_unlock(&_psServer->ptmMutex);
+
+  if (iLend == FALSE)
+    return FALSE;
+
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  if (_psAudit->iLoginsActive < _psAudit->iServerCnt * _psAudit->iLoginCnt)
+    _psAudit->iLoginsActive++;
+  else
+    iLend = FALSE;
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  if (iLend)
+  {
+    pthread_mutex_lock(&_psServer->ptmMutex);
+    _psServer->iLoginsActive++;
+    pthread_mutex_unlock(&_psServer->ptmMutex);
+  }
+
+  return iLend;
+}
+
 void startModule(void* pParams)
 {
   int64_t nRet = 0;
@@ -1498,9 +2904,78 @@ void startModule(void* pParams)
   if (nRet < 0)
     writeVerbose(VB_EXIT, "invokeModule failed - see previous errors for an explanation");
 
+  /* drop the password stream blocks held for credentials the module did not report */
+  streamReleaseHolds(modParams->pLogin->psServer->psAudit->psPassStream, &modParams->pLogin->sPassHeld);
+
+  addLoginsActive(modParams->pLogin->psServer, -1);
+
   return;
 }
 
+/*
+  Release the password stream cursors still held by a host's users (e.g. the
+  host was skipped, aborted or stopped after a valid pair was found).
+*/
+void releaseHostStream(sAudit *_psAudit, sHost *_psHost)
+{
+  sUser *psUser;
+
+  if (_psAudit->psPassStream == NULL)
+    return;
+
+  for (psUser = _psHost->psUser; psUser; psUser = psUser->psUserNext)
+    streamRelease(_psAudit->psPassStream, &psUser->psPassBlock);
+}
+
+
+/*
+  Run a module instance on a login thread, or as a coroutine (-E).
+*/
+static int queueModule(thr_pool_t *_login_pool, sCoroGroup *_psCoroGroup, sModuleStart *_modParams)
+{
+  if (_psCoroGroup)
+    return coroSpawn(_psCoroGroup, startModule, (void *) _modParams);
+
+  return (thr_pool_queue(_login_pool, startModule, (void *) _modParams) < 0) ? FAILURE : SUCCESS;
+}
+
+/* wait for the login threads (coroutines) of a server to end */
+static void waitLogins(thr_pool_t *_login_pool, sCoroGroup *_psCoroGroup)
+{
+  if (_psCoroGroup)
+    coroGroupWait(_psCoroGroup);
+  else
+    thr_pool_wait(_login_pool);
+}
+
+/*
+  Queue a login thread (module instance) for a server.
+*/
+static int queueLogin(sServer *_psServer, thr_pool_t *_login_pool, sCoroGroup *_psCoroGroup, sLogin *_psLogin, sModuleStart *_modParams, int _iLoginId)
+{
+  writeError(ERR_DEBUG_SERVER, "Adding new login task (%d) to server queue (%d)", _iLoginId, _psServer->iId);
+
+  _psLogin[_iLoginId].iId = _iLoginId;
+  _psLogin[_iLoginId].psServer = _psServer;
+  _psLogin[_iLoginId].iResult = LOGIN_RESULT_UNKNOWN;
+  _psLogin[_iLoginId].pErrorMsg = NULL;
+  _psLogin[_iLoginId].iLoginsDone = 0;
+  _psLogin[_iLoginId].psUser = NULL;
+  memset(&_psLogin[_iLoginId].sPassHeld, 0, sizeof(sStreamHolds));
+
+  _modParams[_iLoginId].szModuleName = _psServer->psHost->psService->pModuleName;
+  _modParams[_iLoginId].pLogin = &(_psLogin[_iLoginId]);
+  _modParams[_iLoginId].argc = _psServer->psHost->psService->nModuleParamCount;
+  _modParams[_iLoginId].argv = _psServer->psHost->psService->arrModuleParams;
+
+  if (queueModule(_login_pool, _psCoroGroup, &_modParams[_iLoginId]) != SUCCESS)
+  {
+    writeError(ERR_CRITICAL, "Failed to add module launch task to login thread pool for server queue: %d.", _psServer->iId);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
 
 /*
   Initiate and manage host-specific thread pool for logins. Each target host
@@ -1510,23 +2985,39 @@ void startModule(void* pParams)
 void startLoginThreadPool(void *arg)
 {
   sServer *_psServer = (sServer *)arg;
+  sAudit *_psAudit = _psServer->psAudit;
   thr_pool_t *login_pool = NULL;
-  sLogin psLogin[_psServer->psAudit->iLoginCnt];
-  sModuleStart modParams[_psServer->psAudit->iLoginCnt];
+  sCoroGroup *psCoroGroup = NULL;
+  sLogin *psLogin = NULL;
+  sModuleStart *modParams = NULL;
   int iLoginId = 0;
-  int iLoginCnt = _psServer->psAudit->iLoginCnt;
+  int iLoginCnt = _psAudit->iLoginCnt;
+  int iLoginMax;
+  double fElapsed;
  
-  struct addrinfo hints, *res;
-  int errcode;
-  void *ptr;
-
   writeError(ERR_DEBUG_SERVER, "Server ID: %d Host: %s iUserPassCnt: %d iLoginCnt: %d", _psServer->iId, _psServer->psHost->pHost, _psServer->psHost->iUserPassCnt, iLoginCnt);
+
+  gettimeofday(&_psServer->tvStart, NULL);
+
+  /* deadline (-B): room for the login threads lent by idle server slots */
+  iLoginMax = (_psAudit->iDeadline) ? iLoginCnt * _psAudit->iServerCnt : iLoginCnt;
   
   /* create thread pool - min threads, max threads, linger time, attributes */
-  if (iLoginCnt > _psServer->psHost->iUserPassCnt)
-    iLoginCnt = _psServer->psHost->iUserPassCnt;
+  if ((iLoginMax > _psServer->psHost->iUserPassCnt) && (_psAudit->psPassStream == NULL))
+    iLoginMax = _psServer->psHost->iUserPassCnt;
+
+  if (iLoginCnt > iLoginMax)
+    iLoginCnt = iLoginMax;
+
+  /* -B sizes these by iLoginCnt * iServerCnt - too large for the server thread's stack */
+  psLogin = calloc(iLoginMax, sizeof(sLogin));
+  modParams = calloc(iLoginMax, sizeof(sModuleStart));
+  if ((psLogin == NULL) || (modParams == NULL))
+    writeError(ERR_FATAL, "Failed to allocate memory for login threads of host: %s", _psServer->psHost->pHost);
 
-  if ((login_pool = thr_pool_create(0, iLoginCnt, POOL_THREAD_LINGER, NULL)) == NULL)
+  if ((_psAudit->iCoroutines) && (!_psServer->psHost->psService->iBlocking))
+    psCoroGroup = coroGroupCreate();
+  else if ((login_pool = thr_pool_create(0, iLoginMax, POOL_THREAD_LINGER, NULL)) == NULL)
   {
     writeError(ERR_FATAL, "Failed to create root login thread pool for host: %s", _psServer->psHost->pHost);
   }
@@ -1535,155 +3026,746 @@ void startLoginThreadPool(void *arg)
   _psServer->pHostIP = malloc(100);
   memset(_psServer->pHostIP, 0, 100);
 
-  memset(&hints, 0, sizeof (hints));
-  hints.ai_family = PF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags |= AI_CANONNAME;
-
-  errcode = getaddrinfo(_psServer->psHost->pHost, NULL, &hints, &res);
-  if (errcode != 0)
+  if (resolveHost(_psServer->psHost->pHost, _psServer->pHostIP, 100) != SUCCESS)
   {
-    writeError(ERR_CRITICAL, "Failed to resolve hostname: %s - %s", _psServer->psHost->pHost, gai_strerror(errcode));
+    FREE(psLogin);
+    FREE(modParams);
     return;
   }
 
-  if (res->ai_next != NULL)
-    writeError(ERR_ERROR, "Hostname resolved to multiple addresses. Selecting first address for testing.");
+  /* add login tasks to pool queue */
+  for (iLoginId = 0; iLoginId < iLoginCnt; iLoginId++)
+  {
+    addLoginsActive(_psServer, 1);
 
-  inet_ntop (res->ai_family, res->ai_addr->sa_data, _psServer->pHostIP, 100);
+    if (queueLogin(_psServer, login_pool, psCoroGroup, psLogin, modParams, iLoginId) != SUCCESS)
+    {
+      /* the logins already queued use the login tables */
+      waitLogins(login_pool, psCoroGroup);
+      FREE(psLogin);
+      FREE(modParams);
+      return;
+    }
+  }
 
-  switch (res->ai_family)
+  /* deadline (-B): add the login threads lent by idle server slots while the host is tested */
+  while ((_psAudit->iDeadline) && (getLoginsActive(_psServer) > 0))
   {
-    case AF_INET:
-      ptr = &((struct sockaddr_in *) res->ai_addr)->sin_addr;
-      break;
-    case AF_INET6:
-      ptr = &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr;
-      break;
+    if ((iLoginCnt < iLoginMax) && (reserveLentLogin(_psServer)))
+    {
+      writeError(ERR_DEBUG_SERVER, "Adding lent login task (%d) to server queue (%d)", iLoginCnt, _psServer->iId);
+
+      if (queueLogin(_psServer, login_pool, psCoroGroup, psLogin, modParams, iLoginCnt++) != SUCCESS)
+      {
+        waitLogins(login_pool, psCoroGroup);
+        FREE(psLogin);
+        FREE(modParams);
+        return;
+      }
+    }
+    else
+      usleep(DEADLINE_POLL_USEC);
   }
 
-  inet_ntop (res->ai_family, ptr, _psServer->pHostIP, 100);
-  writeError(ERR_DEBUG_SERVER, "Set IPv%d address: %s (%s)",res->ai_family == PF_INET6 ? 6 : 4, _psServer->pHostIP, res->ai_canonname);
-  freeaddrinfo(res);
+  /* wait for login thread pool to finish */
+  writeError(ERR_DEBUG_SERVER, "waiting for server %d login pool to end", _psServer->iId);
+  waitLogins(login_pool, psCoroGroup);
 
-  /* add login tasks to pool queue */
-  for (iLoginId = 0; iLoginId < iLoginCnt; iLoginId++)
-  {
-    writeError(ERR_DEBUG_SERVER, "Adding new login task (%d) to server queue (%d)", iLoginId, _psServer->iId);
+  /* 
+    In certain situations we need to scale back the number of concurrent
+    login threads targetting a specific service. For example, MSDE's workload
+    governor limits the service to no more than 5 concurrent connections. If
+    the user kicked-off 10 parallel login threads, 5 of those are going to
+    fail and terminate. The challenge is that each of those threads was 
+    already assigned a credential set to test.
 
-    psLogin[iLoginId].iId = iLoginId;
-    psLogin[iLoginId].psServer = _psServer;
+    When these threads failed, we pushed the missed credentials into a queue
+    assigned to the target host. This queue may already have been taken care of 
+    by running threads when they finished their normal tasks. However, if the 
+    missed logons were pushed to the queue by exiting threads after the other
+    threads had terminated, they are still sitting there. To deal with this 
+    problem, we kick off a single thread to run through these.
+  */
+  iLoginId = 0;
+  if ((_psServer->psAudit->iStatus != AUDIT_ABORT) && (_psServer->fParkedUntil == 0) && (_psServer->iCredentialsMissed > 0))
+  {
+    writeError(ERR_DEBUG_SERVER, "Adding new clean-up login task to server queue (%d) for %d missed logins", _psServer->iId, _psServer->iCredentialsMissed);
+   
+    _psServer->psHost->iUserStatus = UL_MISSED; 
     psLogin[iLoginId].iResult = LOGIN_RESULT_UNKNOWN;
     psLogin[iLoginId].pErrorMsg = NULL;
-    psLogin[iLoginId].iLoginsDone = 0;
     psLogin[iLoginId].psUser = NULL;
 
-    modParams[iLoginId].szModuleName = szModuleName;
-    modParams[iLoginId].pLogin = &(psLogin[iLoginId]); //psLogin + (iLoginId * sizeof(sLogin));
-    modParams[iLoginId].argc = nModuleParamCount;
-    modParams[iLoginId].argv = (char**)arrModuleParams;
+    addLoginsActive(_psServer, 1);
 
-    if ( thr_pool_queue(login_pool, startModule, (void *) &modParams[iLoginId]) < 0 )
+    if (queueModule(login_pool, psCoroGroup, &modParams[iLoginId]) != SUCCESS)
     {
       writeError(ERR_CRITICAL, "Failed to add module launch task to login thread pool for server queue: %d.", _psServer->iId);
+      FREE(psLogin);
+      FREE(modParams);
       return;
     }
+  
+    /* wait for login thread pool to finish */
+    writeError(ERR_DEBUG_SERVER, "waiting for server %d login pool to end", _psServer->iId);
+    waitLogins(login_pool, psCoroGroup);
   }
+  
+  writeError(ERR_DEBUG_SERVER, "destroying server %d login pool", _psServer->iId);
+  if (psCoroGroup)
+    coroGroupFree(psCoroGroup);
+  else
+    thr_pool_destroy(login_pool);
 
-  /* wait for login thread pool to finish */
-  writeError(ERR_DEBUG_SERVER, "waiting for server %d login pool to end", _psServer->iId);
-  thr_pool_wait(login_pool);
+  FREE(psLogin);
+  FREE(modParams);
+
+  /* paced host set aside (-A) - it is not complete until queued again */
+  if (_psServer->fParkedUntil > 0)
+  {
+    writeError(ERR_DEBUG_SERVER, "setting aside server: %d", _psServer->iId);
+    FREE(_psServer->pHostIP);
+    return;
+  }
+
+  if (_psServer->iLoginsSkipped)
+    writeError(ERR_INFO, "[%s] Host: %s - skipped %d logins which failed in a previous run (ledger)", _psServer->psHost->psService->pModuleName, _psServer->psHost->pHost, _psServer->iLoginsSkipped);
+
+  if (_psServer->psHost->iUsersDeferred)
+    writeError(ERR_NOTICE, "[%s] Host: %s - %d users were tested with %d passwords only to meet the deadline", _psServer->psHost->psService->pModuleName, _psServer->psHost->pHost, _psServer->psHost->iUsersDeferred, _psServer->psHost->iDeferDepth);
+
+  fElapsed = getElapsed(&_psServer->tvStart);
+
+  /* track the number of hosts which have been completed */
+  pthread_mutex_lock(&_psServer->psAudit->ptmMutex);
+  _psServer->psAudit->iHostsDone++;
+  _psServer->psAudit->iLoginsSkipped += _psServer->iLoginsSkipped;
+  _psServer->psAudit->iUsersDeferred += _psServer->psHost->iUsersDeferred;
+
+  /* deadline (-B): login rate used to plan hosts which were not measured yet */
+  if ((fElapsed >= DEADLINE_MIN_SAMPLE) && (_psServer->iLoginsDone > 0))
+  {
+    if (_psAudit->fHostRate > 0)
+      _psAudit->fHostRate = 0.7 * _psAudit->fHostRate + 0.3 * _psServer->iLoginsDone / fElapsed;
+    else
+      _psAudit->fHostRate = _psServer->iLoginsDone / fElapsed;
+  }
+  pthread_mutex_unlock(&_psServer->psAudit->ptmMutex);
+    
+  /* The logon modules for server have all terminated, however, the server's userlist is not marked
+     as completed. This may be due to the module exiting prematurely (e.g. the service being tested 
+     became unavailable). We mark the host as UL_ERROR to avoid having it added to the resume list.
+  */
+  if ((_psServer->psAudit->iStatus != AUDIT_ABORT) && ((_psServer->psHost->iUserStatus == UL_NORMAL) || (_psServer->psHost->iUserStatus == UL_MISSED)))
+  {
+     writeError(ERR_DEBUG_SERVER, "Server thread exiting and server's userlist testing was marked as in progress. Was this host prematurely aborted?");
+    _psServer->psHost->iUserStatus = UL_ERROR; 
+  }
+
+  if (_psServer->psAudit->iStatus != AUDIT_ABORT)
+    sendEvent(_psAudit, MEDUSA_EVENT_HOST_DONE, _psServer->psHost->psService->pModuleName, _psServer->psHost->pHost, getHostPort(_psServer->psHost), NULL, NULL, 0, NULL);
+
+  writeError(ERR_DEBUG_SERVER, "exiting server: %d", _psServer->iId);
+
+  FREE(_psServer->pHostIP);
+ 
+  return;
+}
+
+
+/* Liveness pre-scan (-S) state */
+typedef struct __sProbe {
+  sAudit *psAudit;
+  sHostList sCursor;          // enumeration of the target list (shares its specifications)
+  sHostList sLive;            // hosts which accepted the connection
+  sHost *psHostCursor;        // combo file audits: next host table to probe
+  int iLive;
+} sProbe;
+
+void writeUnreachable(char *_pModuleName, char *_pHost, int _iPort, int _iResult)
+{
+  struct tm *tm_ptr;
+  time_t the_time;
+  char time_buf[256];
+
+  writeError(ERR_NOTICE, "[%s] Host: %s Port: %d %s - skipping host", _pModuleName, _pHost, _iPort, probeResultString(_iResult));
+
+  (void) time(&the_time);
+  tm_ptr = localtime(&the_time);
+  strftime(time_buf, 256, "%Y-%m-%d %H:%M:%S", tm_ptr);
+  writeVerbose(VB_NONE_FILE, "%s HOST UNREACHABLE: [%s] Host: %s Port: %d (%s)\n", time_buf, _pModuleName, _pHost, _iPort, probeResultString(_iResult));
+
+  sendEvent(psAudit, MEDUSA_EVENT_UNREACHABLE, _pModuleName, _pHost, _iPort, NULL, NULL, MEDUSA_RESULT_ERROR, probeResultString(_iResult));
+}
+
+int probeNextListHost(void *pArg, char **ppHost, int *piPort, void **ppCookie)
+{
+  sProbe *psProbe = (sProbe *)pArg;
+  sAudit *psAudit = psProbe->psAudit;
+  sHostEntry *psEntry;
+
+  psEntry = malloc(sizeof(sHostEntry));
+  if ((psEntry == NULL) || (!hostListNext(&psProbe->sCursor, psEntry)))
+  {
+    free(psEntry);
+    return FALSE;
+  }
+
+  *ppHost = psEntry->szHost;
+  if (psEntry->iPort)
+    *piPort = psEntry->iPort;
+  else if (psAudit->iPortOverride)
+    *piPort = psAudit->iPortOverride;
+  else
+    *piPort = psAudit->psServices[psEntry->iService].iDefaultPort;
+  *ppCookie = psEntry;
+
+  return TRUE;
+}
+
+void probeListResult(void *pArg, void *pCookie, char *pHost, int iPort, int iResult)
+{
+  sProbe *psProbe = (sProbe *)pArg;
+  sHostEntry *psEntry = (sHostEntry *)pCookie;
+
+  if ((iResult == PROBE_OPEN) || (iResult == PROBE_SKIPPED))
+  {
+    hostListAppend(&psProbe->sLive, psEntry);
+    psProbe->iLive++;
+  }
+  else
+    writeUnreachable(psProbe->psAudit->psServices[psEntry->iService].pModuleName, pHost, iPort, iResult);
+
+  free(psEntry);
+}
+
+int probeNextTableHost(void *pArg, char **ppHost, int *piPort, void **ppCookie)
+{
+  sProbe *psProbe = (sProbe *)pArg;
+  sHost *psHost = psProbe->psHostCursor;
+
+  if (psHost == NULL)
+    return FALSE;
+
+  psProbe->psHostCursor = psHost->psHostNext;
+
+  *ppHost = psHost->pHost;
+  *piPort = (psHost->iPortOverride) ? psHost->iPortOverride : psHost->psService->iDefaultPort;
+  *ppCookie = psHost;
+
+  return TRUE;
+}
+
+void probeTableResult(void *pArg, void *pCookie, char *pHost, int iPort, int iResult)
+{
+  sProbe *psProbe = (sProbe *)pArg;
+  sHost *psHost = (sHost *)pCookie;
+
+  if ((iResult == PROBE_OPEN) || (iResult == PROBE_SKIPPED))
+    psProbe->iLive++;
+  else
+  {
+    writeUnreachable(psHost->psService->pModuleName, pHost, iPort, iResult);
+    psHost->iUserStatus = UL_ERROR;
+  }
+}
+
+/* probeHosts() failed - the hosts it did not reach are audited as not probed */
+void probeSkipRemaining(probe_next_t pNext, probe_result_t pResult, sProbe *psProbe)
+{
+  char *pHost;
+  void *pCookie;
+  int iPort;
+
+  writeError(ERR_ALERT, "Host probe failed - the remaining hosts are audited without being probed.");
+
+  while (pNext(psProbe, &pHost, &iPort, &pCookie))
+    pResult(psProbe, pCookie, pHost, iPort, PROBE_SKIPPED);
+}
+
+/*
+  Liveness pre-scan (-S). Connect to the target port of every host before the
+  audit, with many connects in flight on this thread. Only hosts which accept
+  the connection are handed to the server thread pool; the others are
+  reported as unreachable. Hosts keep their IDs, so resume maps stay valid.
+*/
+void probeTargets(sAudit *_psAudit)
+{
+  sProbe sProbe;
+  int i;
+
+  memset(&sProbe, 0, sizeof(sProbe));
+  sProbe.psAudit = _psAudit;
+
+  if (_psAudit->iPortOverride == 0)
+  {
+    for (i = 0; i < _psAudit->nServices; i++)
+    {
+      _psAudit->psServices[i].iDefaultPort = getModuleDefaultPort(_psAudit->psServices[i].pModuleName, (_psAudit->iUseSSL) ? _psAudit->iUseSSL : _psAudit->psServices[i].iUseSSL);
+      if (_psAudit->psServices[i].iDefaultPort == 0)
+        writeError(ERR_ALERT, "Module %s does not report a default TCP port. Only its hosts with a port (-n or host:PORT) are probed.", _psAudit->psServices[i].pModuleName);
+    }
+  }
+
+  writeVerbose(VB_GENERAL, "Probing %d hosts (%d connects at a time)", _psAudit->iHostCnt, _psAudit->iProbeCnt);
+
+  if (_psAudit->pOptCombo)
+  {
+    sProbe.psHostCursor = _psAudit->psHostRoot;
+    if (probeHosts(_psAudit->iProbeCnt, _psAudit->iTimeout, probeNextTableHost, probeTableResult, &sProbe) == FAILURE)
+      probeSkipRemaining(probeNextTableHost, probeTableResult, &sProbe);
+  }
+  else
+  {
+    /* a private cursor over the target list - a resume map built meanwhile still starts at the first host */
+    sProbe.sCursor = _psAudit->sHostList;
+    hostListReset(&sProbe.sCursor);
+    if (probeHosts(_psAudit->iProbeCnt, _psAudit->iTimeout, probeNextListHost, probeListResult, &sProbe) == FAILURE)
+      probeSkipRemaining(probeNextListHost, probeListResult, &sProbe);
+
+    /* probes complete out of order - hosts are dispatched (and resumed) in ID order */
+    hostListSort(&sProbe.sLive);
+    hostListFree(&_psAudit->sHostList);
+    _psAudit->sHostList = sProbe.sLive;
+  }
+
+  writeVerbose(VB_GENERAL, "Host probe complete: %d of %d hosts responded", sProbe.iLive, _psAudit->iHostCnt);
+}
+
+
+/* Bytes of the largest item a resume map may record - ex: h1236 */
+static int getResumeItemSize(sAudit *_psAudit)
+{
+  if (_psAudit->iHostCnt > _psAudit->iUserCnt)
+    return 1 + (int)log10(_psAudit->iHostCnt) + 1;
+  else  
+    return 1 + (int)log10(_psAudit->iUserCnt) + 1;
+}
+
+/*
+  Append the resume map items of an incomplete host to szResumeMap: the
+  host, its incomplete users and its first untouched user. szResumeMap has
+  room for 2 + iUserCnt items.
+*/
+static void addHostResumeMap(char *szResumeMap, sHost *psHost)
+{
+  sUser *psUser;
+  char szTmp[10+1]; // room for u + 9 digits + \0
+
+  writeError(ERR_DEBUG, "Incomplete Host: %d", psHost->iId);
+  memset(szTmp, 0, 10 + 1);
+  snprintf(szTmp, 10, "h%d", psHost->iId);
+  strncat(szResumeMap, szTmp, 10);
+
+  /* identify the users which are not 100% complete for specific host */
+  psUser = psHost->psUser;
+  while ((psUser) && (psUser->iPassStatus != PL_UNSET))
+  {
+    if (((psUser->iPassStatus == PL_DONE) && (!psUser->iDeferred)) || (psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+      writeError(ERR_DEBUG, "Complete User: %d", psUser->iId);
+    else 
+    {    
+      writeError(ERR_DEBUG, "Incomplete User: %d", psUser->iId);
+      memset(szTmp, 0, 10 + 1);
+      snprintf(szTmp, 10, "u%d", psUser->iId);
+      strncat(szResumeMap, szTmp, 10);
+    } 
+
+    psUser = psUser->psUserNext;
+  }
+
+  /* identify the first untouched user */
+  if ((psUser) && (psUser->iPassStatus == PL_UNSET))
+  {
+    writeError(ERR_DEBUG, "First New User: %d", psUser->iId);
+    memset(szTmp, 0, 10 + 1);
+    snprintf(szTmp, 10, "u%d", psUser->iId);
+    strncat(szResumeMap, szTmp, 10);
+  }
+}
+
+/*
+  Deadline (-B): a completed host with deferred users only needs its resume
+  map items. These are kept, so that the host and user tables can be freed
+  rather than held until the end of the audit.
+*/
+static void keepResumeDeferred(sAudit *_psAudit, sHost *_psHost)
+{
+  char *szHostMap;
+  size_t nLen;
+
+  nLen = getResumeItemSize(_psAudit) * (2 + _psHost->iUserCnt) + 1;
+  szHostMap = malloc(nLen);
+  if (szHostMap == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for resume map.");
+
+  memset(szHostMap, 0, nLen);
+  addHostResumeMap(szHostMap, _psHost);
+  nLen = strlen(szHostMap);
+
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  _psAudit->pResumeDeferred = realloc(_psAudit->pResumeDeferred, _psAudit->nResumeDeferred + nLen + 1);
+  if (_psAudit->pResumeDeferred == NULL)
+    writeError(ERR_FATAL, "Failed to allocate memory for resume map.");
+
+  memcpy(_psAudit->pResumeDeferred + _psAudit->nResumeDeferred, szHostMap, nLen + 1);
+  _psAudit->nResumeDeferred += nLen;
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  free(szHostMap);
+}
+
+/*
+  Process the user supplied resume map (-Z) for a host. Users which were
+  completed during the previous run are marked as done. Returns FALSE if
+  the host itself was completed and should be skipped.
+*/
+int resumeHost(sAudit *_psAudit, sHost *_psHost, int *_pnFirstNewHostFound)
+{
+  sUser *psUser;
+  char *szResumeMap = NULL;
+  char *szUserMap = NULL;
+  int nAddHost = TRUE;
+  int nUserMapSize;
+  int nFirstNewUserFound;
+  char szTmp[16];   /* h + 10 digits + . */
+  char szTmp1[16];
+  char szTmp2[16];
+
+  memset(szTmp, 0, 16);
+  memset(szTmp1, 0, 16);
+  snprintf(szTmp, 15, "h%d.", _psHost->iId);
+  snprintf(szTmp1, 15, "h%du", _psHost->iId);
+
+  if (*_pnFirstNewHostFound == TRUE)
+  {    
+    writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (we've passed the point of the previous run)", _psHost->iId);
+  }
+  else if ((szResumeMap = strstr(_psAudit->pOptResume, szTmp1)))
+  {
+    writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (host was located in resume map)", _psHost->iId);
+
+    /* extract host's user resume map */
+    if (index(szResumeMap + 1, 0x68))
+      nUserMapSize = index(szResumeMap + 1, 0x68) - szResumeMap; /* calculate length of host resume map from start to the next "h" */
+    else if (index(szResumeMap + 1, 0x2e))
+      nUserMapSize = index(szResumeMap + 1, 0x2e) - szResumeMap; /* calculate length of host resume map from start to the terminating "." */
+    else
+      nUserMapSize = strlen(szResumeMap); /* single, or last, host resume */ 
+
+    if (nUserMapSize < 4)
+      writeError(ERR_FATAL, "Error extacting user resume map for host: %d", _psHost->iId);
+
+    szUserMap = malloc(nUserMapSize + 1);
+    memset(szUserMap, 0, nUserMapSize + 1);
+    strncpy(szUserMap, szResumeMap, nUserMapSize);
+    writeError(ERR_DEBUG_SERVER, "[Host Resume] Host: %d - Processing host's user resume map: %s", _psHost->iId, szUserMap);
+
+    /* examine each user for the host and mark previously tested accounts as completed */
+    nFirstNewUserFound = FALSE;
+    psUser = _psHost->psUser;
+    while (psUser)
+    {
+      memset(szTmp, 0, 16);
+      memset(szTmp1, 0, 16);
+      snprintf(szTmp, 15, "u%du", psUser->iId);
+      snprintf(szTmp1, 15, "u%dh", psUser->iId);
+      snprintf(szTmp2, 15, "u%d.", psUser->iId);
+
+      if (nFirstNewUserFound == TRUE)
+      {
+        writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (we've passed the point of the previous run)", psUser->iId);
+      }
+      else if (strstr(szResumeMap, szTmp))
+      {
+        writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (user was located in resume map)", psUser->iId);
+      }
+      else if ((strstr(szResumeMap, szTmp1)) || (strstr(szResumeMap, szTmp2)))
+      {
+        writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (user was located in resume map and identified as first untouched account)", psUser->iId);
+        nFirstNewUserFound = TRUE;
+      }
+      else
+      {
+        writeError(ERR_DEBUG_SERVER, "[User Resume] Skipping user: %d (user has already been tested)", psUser->iId);
+        psUser->iPassStatus = PL_DONE;
+      }
+
+      psUser = psUser->psUserNext;
+    }
+
+    free(szUserMap);
+  }
+  else if (strstr(_psAudit->pOptResume, szTmp))
+  {
+    writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (host was located in resume map and identified as first untouched system)", _psHost->iId);
+    *_pnFirstNewHostFound = TRUE;
+  }
+  else
+  {
+    writeError(ERR_DEBUG_SERVER, "[Host Resume] Skipping host: %d (host has already been tested)", _psHost->iId);
+    nAddHost = FALSE;
+    _psHost->iUserStatus = UL_DONE;
+  }
+
+  return nAddHost;
+}
+
+
+/* Release a server task - its host table is freed separately */
+void freeServer(sServer *_psServer)
+{
+  sCredentialSet *psCredSet;
+
+  while ((psCredSet = _psServer->psCredentialSetMissed))
+  {
+    _psServer->psCredentialSetMissed = psCredSet->psCredentialSetNext;
+    free(psCredSet->pPass);
+    free(psCredSet);
+  }
+
+  if (pthread_mutex_destroy(&_psServer->ptmMutex) != 0)
+    writeError(ERR_ERROR, "Server (%d) mutex destroy call failed - %s", _psServer->iId, strerror( errno ) );
+
+  FREE(_psServer->pHostIP);
+  free(_psServer);
+}
+
+/*
+  A server task ended - _psParked is a paced host (-A) set aside, if any.
+  The server slot is handed back to startServerThreadPool().
+*/
+void endServer(sAudit *_psAudit, sServer *_psParked)
+{
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  if (_psParked)
+  {
+    _psParked->psServerNext = _psAudit->psServerParked;
+    _psAudit->psServerParked = _psParked;
+  }
+  _psAudit->iServersActive--;
+  pthread_cond_broadcast(&_psAudit->ptcServerDone);
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  sem_post(&_psAudit->semServers);
+}
+
+/*
+  Server thread pool task. Tests a single host and then releases everything
+  associated with it, so that only the hosts currently being tested are held
+  in memory.
+*/
+void startServer(void *arg)
+{
+  sServer *_psServer = (sServer *)arg;
+  sAudit *_psAudit = _psServer->psAudit;
+
+  startLoginThreadPool(_psServer);
+
+  /* paced host set aside (-A) - startServerThreadPool() queues it again */
+  if (_psServer->fParkedUntil > 0)
+  {
+    endServer(_psAudit, _psServer);
+    return;
+  }
+
+  releaseHostStream(_psAudit, _psServer->psHost);
+
+  /* rounds (-D): do not return to hosts which failed or are finished */
+  if ((_psAudit->iRoundSize) && ((_psServer->psHost->iUserStatus == UL_ERROR) || ((_psServer->iValidPairFound) && (_psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_HOST))))
+    setRoundDone(_psAudit, ROUND_HOST, _psServer->psHost->iId, NULL, NULL);
+
+  /* hosts of an aborted audit are kept for the resume map */
+  if ((_psAudit->pOptCombo == NULL) && (_psAudit->iStatus != AUDIT_ABORT))
+  {
+    /* users deferred to meet the deadline (-B) - only the host's resume map items are kept */
+    if ((_psServer->psHost->iUsersDeferred) && (!_psAudit->iRoundSize))
+      keepResumeDeferred(_psAudit, _psServer->psHost);
+
+    freeHostInfo(_psAudit, _psServer->psHost);
+  }
+
+  freeServer(_psServer);
+  endServer(_psAudit, NULL);
+}
+
+
+/* Queue the server task of a host (new or set aside) */
+int queueServer(sAudit *_psAudit, sServer *_psServer)
+{
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+  _psAudit->iServersActive++;
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  if (thr_pool_queue(_psAudit->server_pool, startServer, (void *) _psServer) < 0)
+  {
+    writeError(ERR_ERROR, "Failed to add host task to server thread pool.");
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/*
+  Take the paced host (-A) set aside whose users have attempts left the
+  soonest, if its wait is over. With _iWait set (no new host is left to
+  start), waits for it - and while none is set aside, for the server tasks
+  still running which may set one aside. Returns NULL if none.
+*/
+sServer* unparkServer(sAudit *_psAudit, int _iWait)
+{
+  sServer *psServer = NULL;
+  sServer **ppsServer, **ppsFirst;
+  struct timespec tsUntil;
+  double fUntil;
+
+  pthread_mutex_lock(&_psAudit->ptmMutex);
+
+  while ((_psAudit->iStatus != AUDIT_ABORT) && (!((_psAudit->iValidPairFound) && (_psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_AUDIT))))
+  {
+    ppsFirst = NULL;
+    for (ppsServer = &_psAudit->psServerParked; *ppsServer; ppsServer = &(*ppsServer)->psServerNext)
+      if ((ppsFirst == NULL) || ((*ppsServer)->fParkedUntil < (*ppsFirst)->fParkedUntil))
+        ppsFirst = ppsServer;
+
+    if ((ppsFirst) && ((*ppsFirst)->fParkedUntil <= paceNow()))
+    {
+      psServer = *ppsFirst;
+      *ppsFirst = psServer->psServerNext;
+      psServer->psServerNext = NULL;
+      psServer->fParkedUntil = 0;
+      writeError(ERR_DEBUG_AUDIT, "queueing server (%d) set aside", psServer->iId);
+      break;
+    }
+
+    if ((!_iWait) || ((ppsFirst == NULL) && (_psAudit->iServersActive == 0)))
+      break;
+
+    /* wake at least once a second to notice the audit being stopped */
+    fUntil = paceNow() + 1;
+    if ((ppsFirst) && ((*ppsFirst)->fParkedUntil < fUntil))
+      fUntil = (*ppsFirst)->fParkedUntil;
+
+    tsUntil.tv_sec = (time_t)fUntil;
+    tsUntil.tv_nsec = (long)((fUntil - tsUntil.tv_sec) * 1000000000);
+    pthread_cond_timedwait(&_psAudit->ptcServerDone, &_psAudit->ptmMutex, &tsUntil);
+  }
+
+  pthread_mutex_unlock(&_psAudit->ptmMutex);
+
+  return psServer;
+}
+
+/*
+  No new host is left to start: queue the paced hosts (-A) set aside as
+  their users have attempts left again, until no server task is left which
+  may set one aside. Called holding a server slot, which is held again on
+  return.
+*/
+int queueParkedServers(sAudit *_psAudit)
+{
+  sServer *psServer;
+
+  while ((psServer = unparkServer(_psAudit, TRUE)) != NULL)
+  {
+    if (queueServer(_psAudit, psServer) == FAILURE)
+      return FAILURE;
+
+    while ((sem_wait(&_psAudit->semServers) != 0) && (errno == EINTR));
+  }
+
+  return SUCCESS;
+}
+
+/*
+  Select the passwords of the next round (-D). Returns FALSE once all
+  passwords have been tested.
+*/
+int startRound(sAudit *_psAudit)
+{
+  char *pPass;
+  int iFirst = _psAudit->iRound * _psAudit->iRoundSize + 1;
+
+  if ((_psAudit->pRoundStart == NULL) || (*_psAudit->pRoundStart == '\0'))
+    return FALSE;
+
+  pPass = _psAudit->pRoundStart;
+  for (_psAudit->iRoundPassCnt = 0; (*pPass != '\0') && (_psAudit->iRoundPassCnt < _psAudit->iRoundSize); _psAudit->iRoundPassCnt++)
+    pPass += strlen(pPass) + 1;
+
+  _psAudit->pRoundEnd = (*pPass != '\0') ? pPass : NULL;
+  _psAudit->iHostsDone = 0;
+
+  writeVerbose(VB_GENERAL, "Round %d: testing passwords %d to %d of %d against all hosts", _psAudit->iRound + 1, iFirst, iFirst + _psAudit->iRoundPassCnt - 1, _psAudit->iPassCnt);
+
+  return TRUE;
+}
+
+/* Deadline (-B) watcher state */
+typedef struct __sDeadline {
+  sAudit *psAudit;
+  pthread_mutex_t ptmMutex;
+  pthread_cond_t ptcDone;
+  int iDone;
+} sDeadline;
+
+/*
+  Stop the audit once the deadline is reached, unless it finished before.
+  Login threads end as after SIGINT and the hosts in progress are kept for
+  the resume map.
+*/
+void *watchDeadline(void *arg)
+{
+  sDeadline *psDeadline = (sDeadline *)arg;
+  sAudit *_psAudit = psDeadline->psAudit;
+  struct timespec tsDeadline;
 
-  /* 
-    In certain situations we need to scale back the number of concurrent
-    login threads targetting a specific service. For example, MSDE's workload
-    governor limits the service to no more than 5 concurrent connections. If
-    the user kicked-off 10 parallel login threads, 5 of those are going to
-    fail and terminate. The challenge is that each of those threads was 
-    already assigned a credential set to test.
+  tsDeadline.tv_sec = _psAudit->tDeadline;
+  tsDeadline.tv_nsec = 0;
 
-    When these threads failed, we pushed the missed credentials into a queue
-    assigned to the target host. This queue may already have been taken care of 
-    by running threads when they finished their normal tasks. However, if the 
-    missed logons were pushed to the queue by exiting threads after the other
-    threads had terminated, they are still sitting there. To deal with this 
-    problem, we kick off a single thread to run through these.
-  */
-  iLoginId = 0;
-  if ((_psServer->psAudit->iStatus != AUDIT_ABORT) && (_psServer->iCredentialsMissed > 0))
-  {
-    writeError(ERR_DEBUG_SERVER, "Adding new clean-up login task to server queue (%d) for %d missed logins", _psServer->iId, _psServer->iCredentialsMissed);
-   
-    _psServer->psHost->iUserStatus = UL_MISSED; 
-    psLogin[iLoginId].iResult = LOGIN_RESULT_UNKNOWN;
-    psLogin[iLoginId].pErrorMsg = NULL;
-    psLogin[iLoginId].psUser = NULL;
+  pthread_mutex_lock(&psDeadline->ptmMutex);
 
-    if ( thr_pool_queue(login_pool, startModule, (void *) &modParams[iLoginId]) < 0 )
-    {
-      writeError(ERR_CRITICAL, "Failed to add module launch task to login thread pool for server queue: %d.", _psServer->iId);
-      return;
-    }
-  
-    /* wait for login thread pool to finish */
-    writeError(ERR_DEBUG_SERVER, "waiting for server %d login pool to end", _psServer->iId);
-    thr_pool_wait(login_pool);
-  }
-  
-  writeError(ERR_DEBUG_SERVER, "destroying server %d login pool", _psServer->iId);
-  thr_pool_destroy(login_pool);
+  while ((!psDeadline->iDone) && (pthread_cond_timedwait(&psDeadline->ptcDone, &psDeadline->ptmMutex, &tsDeadline) != ETIMEDOUT));
 
-  /* track the number of hosts which have been completed */
-  pthread_mutex_lock(&_psServer->psAudit->ptmMutex);
-  _psServer->psAudit->iHostsDone++;
-  pthread_mutex_unlock(&_psServer->psAudit->ptmMutex);
-    
-  /* The logon modules for server have all terminated, however, the server's userlist is not marked
-     as completed. This may be due to the module exiting prematurely (e.g. the service being tested 
-     became unavailable). We mark the host as UL_ERROR to avoid having it added to the resume list.
-  */
-  if ((_psServer->psAudit->iStatus != AUDIT_ABORT) && ((_psServer->psHost->iUserStatus == UL_NORMAL) || (_psServer->psHost->iUserStatus == UL_MISSED)))
+  if (!psDeadline->iDone)
   {
-     writeError(ERR_DEBUG_SERVER, "Server thread exiting and server's userlist testing was marked as in progress. Was this host prematurely aborted?");
-    _psServer->psHost->iUserStatus = UL_ERROR; 
+    writeError(ERR_ALERT, "Deadline of %d seconds reached - Sending notification to login threads that we are aborting.", _psAudit->iDeadline);
+    _psAudit->iDeadlineReached = TRUE;
+    _psAudit->iStatus = AUDIT_ABORT;
+    streamAbort(_psAudit->psPassStream);
   }
 
-  writeError(ERR_DEBUG_SERVER, "exiting server: %d", _psServer->iId);
+  pthread_mutex_unlock(&psDeadline->ptmMutex);
 
-  free(_psServer->pHostIP); 
- 
-  return;
+  return NULL;
 }
 
-
 /*
   Initiate and manage thread pool for target systems. Each target host
   will have a single parent thread, which manages all childs login threads
   specific to that individual machine.
+
+  Host tables are created as hosts are dispatched (combo file audits load
+  them up front) and freed once tested. At most iServerCnt hosts are in
+  flight at any time, so large CIDR blocks and ranges use constant memory.
 */
 int startServerThreadPool(sAudit *_psAudit)
 {
-  sServer psServer[_psAudit->iHostCnt];
-  sHost *psHost;
-  int iServerId;
-
-  sUser *psUser;
-  char *szResumeMap = NULL;
-  char *szUserMap = NULL;
-  int nAddHost;
-  int nUserMapSize;
-  int nFirstNewHostFound;
-  int nFirstNewUserFound;
-  char szTmp[11];
-  char szTmp1[11];
-  char szTmp2[11];
+  sServer *psServer;
+  sHost *psHost = NULL;
+  char *pHost = NULL;
+  int iServerId = 0;
+  int nFirstNewHostFound = FALSE;
+  sDeadline sDeadlineWatch;
+  pthread_t thDeadline;
 
   writeVerbose(VB_GENERAL, "Parallel Hosts: %d Parallel Logins: %d", _psAudit->iServerCnt, _psAudit->iLoginCnt);
 
   writeVerbose(VB_GENERAL, "Total Hosts: %d ", _psAudit->iHostCnt);
   if (_psAudit->iUserCnt == 0) writeVerbose(VB_GENERAL, "Total Users: [combo]");
   else writeVerbose(VB_GENERAL, "Total Users: %d", _psAudit->iUserCnt);
-  if (_psAudit->iPassCnt == 0) writeVerbose(VB_GENERAL, "Total Passwords: [combo]");
+  if (_psAudit->psPassStream) writeVerbose(VB_GENERAL, "Total Passwords: [unknown - streaming]");
+  else if (_psAudit->iPassCnt == 0) writeVerbose(VB_GENERAL, "Total Passwords: [combo]");
   else writeVerbose(VB_GENERAL, "Total Passwords: %d", _psAudit->iPassCnt);
 
   /* create thread pool - min threads, max threads, linger time, attributes */
@@ -1699,130 +3781,171 @@ int startServerThreadPool(sAudit *_psAudit)
     return FAILURE;
   }
 
-  /* initialize servers */
-  memset(psServer, 0, sizeof(sServer) * _psAudit->iHostCnt);
-  psHost = _psAudit->psHostRoot;
+  if (sem_init(&_psAudit->semServers, 0, _psAudit->iServerCnt) != 0)
+    writeError(ERR_FATAL, "Server semaphore initialization failed - %s", strerror( errno ) );
 
-  nFirstNewHostFound = FALSE;
+  if (pthread_cond_init(&_psAudit->ptcServerDone, NULL) != 0)
+    writeError(ERR_FATAL, "Server condition initialization failed - %s", strerror( errno ) );
 
-  /* add server tasks to pool queue (one task per host to be tested) */
-  for (iServerId = 0; iServerId < _psAudit->iHostCnt; iServerId++)
+  if (_psAudit->iDeadline)
   {
-    /* resume map was supplied by user - skip hosts and users which were previously completed */
-    nAddHost = TRUE;
-    if (_psAudit->pOptResume)
-    {
-      memset(szTmp, 0, 11);
-      memset(szTmp1, 0, 11);
-      snprintf(szTmp, 10, "h%d.", psHost->iId);
-      snprintf(szTmp1, 10, "h%du", psHost->iId);
+    memset(&sDeadlineWatch, 0, sizeof(sDeadline));
+    sDeadlineWatch.psAudit = _psAudit;
+    pthread_mutex_init(&sDeadlineWatch.ptmMutex, NULL);
+    pthread_cond_init(&sDeadlineWatch.ptcDone, NULL);
 
-      if (nFirstNewHostFound == TRUE)
-      {    
-        writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (we've passed the point of the previous run)", psHost->iId);
-      }
-      else if ((szResumeMap = strstr(_psAudit->pOptResume, szTmp1)))
-      {
-        writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (host was located in resume map)", psHost->iId);
+    if (pthread_create(&thDeadline, NULL, watchDeadline, &sDeadlineWatch) != 0)
+      writeError(ERR_FATAL, "Failed to create deadline thread - %s", strerror( errno ) );
+  }
 
-        /* extract host's user resume map */
-        if (index(szResumeMap + 1, 0x68))
-          nUserMapSize = index(szResumeMap + 1, 0x68) - szResumeMap; /* calculate length of host resume map from start to the next "h" */
-        else if (index(szResumeMap + 1, 0x2e))
-          nUserMapSize = index(szResumeMap + 1, 0x2e) - szResumeMap; /* calculate length of host resume map from start to the terminating "." */
-        else
-          nUserMapSize = strlen(szResumeMap); /* single, or last, host resume */ 
+  if (_psAudit->iProbeCnt)
+    probeTargets(_psAudit);
 
-        if (nUserMapSize < 4)
-          writeError(ERR_FATAL, "Error extacting user resume map for host: %d", psHost->iId);
+  _psAudit->pRoundStart = _psAudit->pGlobalPass;
+  if (_psAudit->iRoundSize)
+    startRound(_psAudit);
 
-        szUserMap = malloc(nUserMapSize + 1);
-        memset(szUserMap, 0, nUserMapSize + 1);
-        strncpy(szUserMap, szResumeMap, nUserMapSize);
-        writeError(ERR_DEBUG_SERVER, "[Host Resume] Host: %d - Processing host's user resume map: %s", psHost->iId, szUserMap);
+  /* combo file users are all attached to the password stream - let it release consumed blocks */
+  if (_psAudit->pOptCombo)
+    streamRelease(_psAudit->psPassStream, &_psAudit->psPassStreamPin);
 
-        /* examine each user for the host and mark previously tested accounts as completed */
-        nFirstNewUserFound = FALSE;
-        psUser = psHost->psUser;
-        while (psUser)
-        {
-          memset(szTmp, 0, 11);
-          memset(szTmp1, 0, 11);
-          snprintf(szTmp, 10, "u%du", psUser->iId);
-          snprintf(szTmp1, 10, "u%dh", psUser->iId);
-          snprintf(szTmp2, 10, "u%d.", psUser->iId);
+  /* add server tasks to pool queue (one task per host to be tested) */
+  while (TRUE)
+  {
+    /* wait for a free server slot */
+    while ((sem_wait(&_psAudit->semServers) != 0) && (errno == EINTR));
 
-          if (nFirstNewUserFound == TRUE)
-          {
-            writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (we've passed the point of the previous run)", psUser->iId);
-          }
-          else if (strstr(szResumeMap, szTmp))
-          {
-            writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (user was located in resume map)", psUser->iId);
-          }
-          else if ((strstr(szResumeMap, szTmp1)) || (strstr(szResumeMap, szTmp2)))
-          {
-            writeError(ERR_DEBUG_SERVER, "[User Resume] Adding user: %d (user was located in resume map and identified as first untouched account)", psUser->iId);
-            nFirstNewUserFound = TRUE;
-          }
-          else
-          {
-            writeError(ERR_DEBUG_SERVER, "[User Resume] Skipping user: %d (user has already been tested)", psUser->iId);
-            psUser->iPassStatus = PL_DONE;
-          }
+    if ((_psAudit->iStatus == AUDIT_ABORT) || ((_psAudit->iValidPairFound) && (_psAudit->iFoundPairExitFlag == FOUND_PAIR_EXIT_AUDIT)))
+      break;
 
-          psUser = psUser->psUserNext;
-        }
-      }
-      else if (strstr(_psAudit->pOptResume, szTmp))
+    /* paced hosts set aside (-A) whose users have attempts left again come before new hosts */
+    if ((_psAudit->psPacer) && ((psServer = unparkServer(_psAudit, FALSE)) != NULL))
+    {
+      if (queueServer(_psAudit, psServer) == FAILURE)
+        return FAILURE;
+
+      continue;
+    }
+
+    if (_psAudit->pOptCombo)
+    {
+      psHost = (psHost) ? psHost->psHostNext : _psAudit->psHostRoot;
+      if (psHost == NULL)
       {
-        writeError(ERR_DEBUG_SERVER, "[Host Resume] Adding host: %d (host was located in resume map and identified as first untouched system)", psHost->iId);
-        nFirstNewHostFound = TRUE;
+        _psAudit->iDispatchIdle = TRUE;
+
+        if ((_psAudit->psPacer) && (queueParkedServers(_psAudit) == FAILURE))
+          return FAILURE;
+
+        break;
       }
-      else
+    }
+    else
+    {
+      if ((pHost = findNextHost(_psAudit, pHost)) == NULL)
       {
-        writeError(ERR_DEBUG_SERVER, "[Host Resume] Skipping host: %d (host has already been tested)", psHost->iId);
-        nAddHost = FALSE;
-        psHost->iUserStatus = UL_DONE;
+        _psAudit->iDispatchIdle = TRUE;
+
+        if ((_psAudit->psPacer) && (queueParkedServers(_psAudit) == FAILURE))
+          return FAILURE;
+
+        if ((_psAudit->iRoundSize == 0) || (_psAudit->pRoundEnd == NULL))
+          break;
+
+        /* rounds (-D): finish this round on all hosts before testing deeper in the password list */
+        thr_pool_wait(_psAudit->server_pool);
+        sem_post(&_psAudit->semServers);
+
+        _psAudit->iRound++;
+        _psAudit->pRoundStart = _psAudit->pRoundEnd;
+        if (startRound(_psAudit) == FALSE)
+          break;
+
+        _psAudit->iDispatchIdle = FALSE;
+        _psAudit->iAuditFlag = AUDIT_IN_PROGRESS;
+        _psAudit->iHostListFlag = LIST_IN_PROGRESS;
+        hostListReset(&_psAudit->sHostList);
+        continue;
       }
+
+      psHost = loadHostInfo(_psAudit, pHost);
+      loadUserInfo(_psAudit, psHost);
+
+      /* the last host's users are attached - the pin would hold the stream until this host is done */
+      if (_psAudit->iHostListFlag == LIST_COMPLETE)
+        streamRelease(_psAudit->psPassStream, &_psAudit->psPassStreamPin);
     }
 
-    if (nAddHost)
+    /* combo file host did not answer the liveness pre-scan */
+    if (psHost->iUserStatus == UL_ERROR)
     {
-      writeError(ERR_DEBUG_AUDIT, "adding new server (%d) to queue", iServerId);
-      
-      if (pthread_mutex_init(&(psServer[iServerId].ptmMutex), NULL) != 0)
-        writeError(ERR_FATAL, "Server (%d) mutex initialization failed - %s\n", iServerId, strerror( errno ) );
-
-      psServer[iServerId].psAudit = _psAudit;
-      psServer[iServerId].iId = iServerId;
-      psServer[iServerId].psHost = psHost;
-      psServer[iServerId].iLoginCnt = _psAudit->iLoginCnt;
-      psServer[iServerId].iLoginsDone = 0;
-      psServer[iServerId].iCredentialsMissed = 0;
-    
-      if ( thr_pool_queue(_psAudit->server_pool, startLoginThreadPool, (void *) &psServer[iServerId]) < 0 )
-      {
-        writeError(ERR_ERROR, "Failed to add host task to server thread pool.");
-        return FAILURE;
-      }
+      releaseHostStream(_psAudit, psHost);
+      sem_post(&_psAudit->semServers);
+      continue;
     }
 
-    psHost = psHost->psHostNext;
+    /* resume map was supplied by user or an earlier round (-D) completed the host or some of its users */
+    if (((_psAudit->pOptResume) && (resumeHost(_psAudit, psHost, &nFirstNewHostFound) == FALSE)) ||
+        ((_psAudit->iRoundSize) && (resumeRound(_psAudit, psHost) == FALSE)))
+    {
+      releaseHostStream(_psAudit, psHost);
+      if (_psAudit->pOptCombo == NULL)
+        freeHostInfo(_psAudit, psHost);
+
+      sem_post(&_psAudit->semServers);
+      continue;
+    }
+
+    writeError(ERR_DEBUG_AUDIT, "adding new server (%d) to queue", iServerId);
+
+    psServer = malloc(sizeof(sServer));
+    memset(psServer, 0, sizeof(sServer));
+
+    if (pthread_mutex_init(&(psServer->ptmMutex), NULL) != 0)
+      writeError(ERR_FATAL, "Server (%d) mutex initialization failed - %s\n", iServerId, strerror( errno ) );
+
+    psServer->psAudit = _psAudit;
+    psServer->iId = iServerId++;
+    psServer->psHost = psHost;
+    psServer->iLoginCnt = _psAudit->iLoginCnt;
+    psServer->iLoginsDone = 0;
+    psServer->iCredentialsMissed = 0;
+
+    if (queueServer(_psAudit, psServer) == FAILURE)
+      return FAILURE;
   }
 
+  /* dispatch ended before the last host was loaded (e.g. the audit was aborted) */
+  streamRelease(_psAudit->psPassStream, &_psAudit->psPassStreamPin);
+
   /* wait for thread pool to finish */
   writeError(ERR_DEBUG_AUDIT, "waiting for server pool to end");
   thr_pool_wait(_psAudit->server_pool);
   writeError(ERR_DEBUG_AUDIT, "destroying server pool");
   thr_pool_destroy(_psAudit->server_pool);
-  
-  /* destroy and clean-up server objects */
-  for (iServerId = 0; iServerId < _psAudit->iHostCnt; iServerId++)
+
+  /* paced hosts still set aside (-A) once the audit was stopped - their host tables are kept for the resume map */
+  while ((psServer = _psAudit->psServerParked))
+  {
+    _psAudit->psServerParked = psServer->psServerNext;
+    releaseHostStream(_psAudit, psServer->psHost);
+    freeServer(psServer);
+  }
+
+  if (_psAudit->iDeadline)
   {
-    if (pthread_mutex_init(&(psServer[iServerId].ptmMutex), NULL) != 0)
-      writeError(ERR_FATAL, "Server (%d) mutex destroy call failed - %s\n", iServerId, strerror( errno ) );
+    pthread_mutex_lock(&sDeadlineWatch.ptmMutex);
+    sDeadlineWatch.iDone = TRUE;
+    pthread_cond_signal(&sDeadlineWatch.ptcDone);
+    pthread_mutex_unlock(&sDeadlineWatch.ptmMutex);
+
+    pthread_join(thDeadline, NULL);
+    pthread_cond_destroy(&sDeadlineWatch.ptcDone);
+    pthread_mutex_destroy(&sDeadlineWatch.ptmMutex);
   }
+
+  sem_destroy(&_psAudit->semServers);
+  pthread_cond_destroy(&_psAudit->ptcServerDone);
   
   kill_crypto_locks();
 
@@ -1830,39 +3953,31 @@ int startServerThreadPool(sAudit *_psAudit)
 } 
 
 /*
-  Function called on SIGINT. We process the host and user tables and generate
-  a map representing their current state. This map can then be supplied to
-  Medusa to essentially resume the run. It should be noted, however, that users 
-  which were partially tested will be resumed from the start of their password
-  list.
+  Process the host and user tables and generate a map representing their
+  current state. This map can then be supplied to Medusa to essentially
+  resume the run. It should be noted, however, that users which were
+  partially tested will be resumed from the start of their password list.
 */
-void sigint_handler(int sig __attribute__((unused)))
+void writeResumeMap(sAudit *_psAudit)
 {
   sHost *psHost;
-  sUser *psUser;
-  char szTmp[10+1]; // we can only resume h + 7 + . + \0, so 7 digits... 9,999,999 (should be enough) hosts
+  char szTmp[10+1]; // room for h + 9 digits + \0
   char *szResumeMap = NULL;
   int nResumeMapSize = 0;
   int nItemByteSize = 0;
-  struct sigaction sig_action;
- 
-  /* SIGINT is blocked by default within the handler. We explicitly unblock it here.
-     This allows us to hit CTRL-C a second time and really quit the application 
-     without waiting for the threads to complete their work.
-  */
-  sig_action.sa_flags = 0;
-  sigemptyset(&sig_action.sa_mask);
-  sigaddset(&sig_action.sa_mask, SIGINT);
-  sig_action.sa_handler = SIG_DFL;
-  sigaction(SIGINT, &sig_action, 0);
-  sigprocmask(SIG_UNBLOCK, &sig_action.sa_mask, 0);
+  int nItems;
 
-  /* notify threads that they should be exiting and then wait for them to finish */
-  writeError(ERR_ALERT, "Medusa received SIGINT - Sending notification to login threads that we are aborting.");
-  psAudit->iStatus = AUDIT_ABORT; 
-
-  writeError(ERR_INFO, "Waiting for login threads to terminate...");
-  thr_pool_wait(psAudit->server_pool);
+  /* the host and user tables only describe the current round */
+  if (_psAudit->iRoundSize)
+  {
+    writeError(ERR_ALERT, "Audits run in rounds (-D) cannot be resumed. Round %d was in progress.", _psAudit->iRound + 1);
+    return;
+  }
+  else if (_psAudit->iWeightedFlag)
+  {
+    writeError(ERR_ALERT, "Audits ordered by frequency (-W) cannot be resumed.");
+    return;
+  }
 
   /*
     We note each partially finished host and the first new host for which
@@ -1881,53 +3996,30 @@ void sigint_handler(int sig __attribute__((unused)))
                          +---- First host which was not started
   */
 
-  /* base our byte count on the largest number we may need to record - ex: h1236\0 */
-  if (psAudit->iHostCnt > psAudit->iUserCnt)
-    nItemByteSize = 1 + (int)log10(psAudit->iHostCnt) + 1;
-  else  
-    nItemByteSize = 1 + (int)log10(psAudit->iUserCnt) + 1;
+  nItemByteSize = getResumeItemSize(_psAudit);
  
-  nResumeMapSize = nItemByteSize * (psAudit->iServerCnt * psAudit->iLoginCnt + psAudit->iServerCnt + 1) + 1; /* include terminating "." */
+  /* count the host and user tables held */
+  nItems = 1;
+  for (psHost = _psAudit->psHostRoot; psHost; psHost = psHost->psHostNext)
+    nItems += 1 + psHost->iUserCnt;
+
+  nResumeMapSize = nItemByteSize * nItems + 1; /* include terminating "." */
+  nResumeMapSize += _psAudit->nResumeDeferred;
   szResumeMap = malloc(nResumeMapSize + 1);
   memset(szResumeMap, 0, nResumeMapSize + 1);
   memset(szTmp, 0, 10 + 1);
 
-  psHost = psAudit->psHostRoot;
+  /* completed hosts with users deferred to meet the deadline (-B) */
+  if (_psAudit->pResumeDeferred)
+    memcpy(szResumeMap, _psAudit->pResumeDeferred, _psAudit->nResumeDeferred);
+
+  psHost = _psAudit->psHostRoot;
   while ((psHost) && (psHost->iUserStatus != UL_UNSET))
   {
     /* identify the hosts which are not 100% complete */
-    if ((psHost->iUserStatus != UL_DONE) && (psHost->iUserStatus != UL_ERROR))
+    if (((psHost->iUserStatus != UL_DONE) && (psHost->iUserStatus != UL_ERROR)) || (psHost->iUsersDeferred))
     {
-      writeError(ERR_DEBUG, "Incomplete Host: %d", psHost->iId);
-      memset(szTmp, 0, 10 + 1);
-      snprintf(szTmp, 10, "h%d", psHost->iId);
-      strncat(szResumeMap, szTmp, 10);
-
-      /* identify the users which are not 100% complete for specific host */
-      psUser = psHost->psUser;
-      while ((psUser) && (psUser->iPassStatus != PL_UNSET))
-      {
-        if ((psUser->iPassStatus == PL_DONE) || (psUser->iPassStatus == PASS_AUDIT_COMPLETE))
-          writeError(ERR_DEBUG, "Complete User: %d", psUser->iId);
-        else 
-        {    
-          writeError(ERR_DEBUG, "Incomplete User: %d", psUser->iId);
-          memset(szTmp, 0, 10 + 1);
-          snprintf(szTmp, 10, "u%d", psUser->iId);
-          strncat(szResumeMap, szTmp, 10);
-        } 
-
-        psUser = psUser->psUserNext;
-      }
-
-      /* identify the first untouched user */
-      if ((psUser) && (psUser->iPassStatus == PL_UNSET))
-      {
-        writeError(ERR_DEBUG, "First New User: %d", psUser->iId);
-        memset(szTmp, 0, 10 + 1);
-        snprintf(szTmp, 10, "u%d", psUser->iId);
-        strncat(szResumeMap, szTmp, 10);
-      }
+      addHostResumeMap(szResumeMap, psHost);
     }
     else
     {
@@ -1942,8 +4034,16 @@ void sigint_handler(int sig __attribute__((unused)))
   {
     writeError(ERR_DEBUG, "First New Host: %d", psHost->iId);
     memset(szTmp, 0, 10 + 1);
-    snprintf(szTmp, 8, "h%d", psHost->iId);
-    strncat(szResumeMap, szTmp, 8);
+    snprintf(szTmp, 10, "h%d", psHost->iId);
+    strncat(szResumeMap, szTmp, 10);
+  }
+  /* hosts are only loaded as they are dispatched - the first untouched host may not exist yet */
+  else if ((psHost == NULL) && (_psAudit->pOptCombo == NULL) && (_psAudit->iHostListFlag == LIST_IN_PROGRESS) && (hostListNextId(&_psAudit->sHostList)))
+  {
+    writeError(ERR_DEBUG, "First New Host: %d", hostListNextId(&_psAudit->sHostList));
+    memset(szTmp, 0, 10 + 1);
+    snprintf(szTmp, 10, "h%d", hostListNextId(&_psAudit->sHostList));
+    strncat(szResumeMap, szTmp, 10);
   }
 
   /* terminate resume map */
@@ -1952,39 +4052,23 @@ void sigint_handler(int sig __attribute__((unused)))
   writeError(ERR_ALERT, "To resume scan, add the following to your original command: \"-Z %s\"", szResumeMap);
       
   free(szResumeMap);
-
-  exit(0);
 }
 
-int main(int argc, char **argv, char *envp[] __attribute__((unused)))
+/*
+  Create the audit and set the default options. The module settings and the
+  audit are process globals, so a single audit may exist at a time.
+*/
+sAudit* auditCreate()
 {
-  struct sigaction sig_action;
-  int iExitStatus = EXIT_SUCCESS;
-  int i;
-
-  struct tm *tm_ptr;
-  time_t the_time;
-  char time_buf[256];
-
-  /* set signal handling for SIGINT */
-  sig_action.sa_flags = 0;
-  sigemptyset(&sig_action.sa_mask);
-  sigaddset(&sig_action.sa_mask, SIGINT);
-  sig_action.sa_handler = sigint_handler;
-  sigaction(SIGINT, &sig_action, 0);
+  if (psAudit)
+    return NULL;
 
   /* initial module settings and parameters 
      Don't worry if there are NULL or blank values here 
      (they will be checked when loading the module)
   */
   szModuleName = NULL;
-  szModulePaths[0] = getenv("MEDUSA_MODULE_PATH");
-  szModulePaths[1] = ".";
-#ifdef DEFAULT_MOD_PATH
-  szModulePaths[2] = DEFAULT_MOD_PATH;
-#else
-  szModulePaths[2] = "/usr/lib/medusa/modules";
-#endif
+  setModulePaths();
 
   szTempModuleParam = NULL;
   arrModuleParams = malloc(sizeof(char*));
@@ -1998,67 +4082,140 @@ int main(int argc, char **argv, char *envp[] __attribute__((unused)))
   if (pthread_mutex_init(&(psAudit->ptmMutex), NULL) != 0)
     writeError(ERR_FATAL, "Audit mutex initialization failed - %s\n", strerror( errno ) );
 
-  /* parse user-supplied parameters - populate module parameters */
-  if (checkOptions(argc, argv, psAudit))
-  {
-    usage();
-    exit(EXIT_FAILURE);
-  }
+  if (pthread_mutex_init(&(psAudit->ptmFoundMutex), NULL) != 0)
+    writeError(ERR_FATAL, "Audit mutex initialization failed - %s\n", strerror( errno ) );
+
+  /* initialize options */
+  psAudit->iServerCnt = 1;
+  psAudit->iLoginCnt = 1;
+  psAudit->iParallelLoginFlag = PARALLEL_LOGINS_PASSWORD;
+  psAudit->iPortOverride = 0;                        /* Use default port */
+  psAudit->iUseSSL = 0;                              /* No SSL */
+  psAudit->iTimeout = DEFAULT_WAIT_TIME;             /* Default wait of 3 seconds */
+  psAudit->iRetryWait = WAIT_BETWEEN_CONNECT_RETRY;  /* Default wait of 3 seconds */
+  psAudit->iRetries = MAX_CONNECT_RETRY;             /* Default of 2 retries (3 total attempts) */
+  psAudit->iSocketWait = 500;                        /* Default wait of 500 usec */
+  psAudit->iShowModuleHelp = 0;
+  iVerboseLevel = 5;
+  iErrorLevel = 5;
+
+  return psAudit;
+}
+
+/*
+  Load the services, hosts, users and passwords of the audit and open the
+  ledger, attempt budget and output file. argv (may be NULL) is recorded in
+  the output file.
+*/
+int auditLoad(sAudit *_psAudit, int argc, char **argv)
+{
+  struct tm *tm_ptr;
+  time_t the_time;
+  char time_buf[256];
+  char *pHost;
+  int i;
+
+  /* the time budget (-B) includes loading the lists and the liveness pre-scan */
+  if (_psAudit->iDeadline)
+    _psAudit->tDeadline = time(NULL) + _psAudit->iDeadline;
 
   for (i = 0; i < nModuleParamCount; i++)
   {
     writeVerbose(VB_GENERAL, "Module parameter: %s", arrModuleParams[i]);
   }
 
-  if (szModuleName == NULL)
+  /* hosts from -h/-H and combo files are all audited with the -M/-m service */
+  if (_psAudit->pOptTask == NULL)
+    addService(_psAudit, szModuleName, arrModuleParams, nModuleParamCount, 0);
+  else if (loadTaskFile(_psAudit, _psAudit->pOptTask) == FAILURE)
+    writeError(ERR_FATAL, "Failed to process task file: %s", _psAudit->pOptTask);
+
+  if (_psAudit->iRoundSize)
+    fpset_init(&_psAudit->sRoundDone, 0);
+
+  /* host tables created from here on record their ledger fingerprint */
+  if (_psAudit->pOptLedger)
+    _psAudit->psLedger = ledgerOpen(_psAudit->pOptLedger, _psAudit->iLedgerMaxAge);
+
+  if (_psAudit->iPaceAttempts)
   {
-    writeVerbose(VB_EXIT, "You must specify a module to execute using -M MODULE_NAME");
-    freeModuleParams();
-    exit(EXIT_FAILURE);
+    writeVerbose(VB_GENERAL, "Account budget: %d attempts per %d seconds", _psAudit->iPaceAttempts, _psAudit->iPaceWindow);
+    _psAudit->psPacer = paceOpen(_psAudit->iPaceAttempts, _psAudit->iPaceWindow);
   }
 
-  if (psAudit->HostType == L_FILE)
+  if (_psAudit->HostType == L_FILE)
+  {
+    loadFile(_psAudit->pOptHost, &_psAudit->pHostFile, &_psAudit->iHostCnt);
+
+    for (pHost = _psAudit->pHostFile; *pHost != '\0'; pHost += strlen(pHost) + 1)
+    {
+      if (hostListAdd(&_psAudit->sHostList, pHost, 0) == FAILURE)
+        writeError(ERR_FATAL, "Failed to process host file: %s", _psAudit->pOptHost);
+    }
+
+    FREE(_psAudit->pHostFile);
+  }
+  else if ((_psAudit->HostType == L_SINGLE) && (_psAudit->pGlobalHost))
   {
-    loadFile(psAudit->pOptHost, &psAudit->pHostFile, &psAudit->iHostCnt);
-    psAudit->pGlobalHost = psAudit->pHostFile;
+    if (hostListAdd(&_psAudit->sHostList, _psAudit->pGlobalHost, 0) == FAILURE)
+      writeError(ERR_FATAL, "Failed to process host: %s", _psAudit->pGlobalHost);
   }
 
-  if (psAudit->UserType == L_FILE)
+  _psAudit->iHostCnt = _psAudit->sHostList.iHostCnt;
+
+  /* users and passwords added through the library are already held in memory */
+  if ((_psAudit->UserType == L_FILE) && (_psAudit->pOptUser))
   {
-    loadFile(psAudit->pOptUser, &psAudit->pUserFile, &psAudit->iUserCnt);
-    psAudit->pGlobalUser = psAudit->pUserFile;
+    loadFile(_psAudit->pOptUser, &_psAudit->pUserFile, &_psAudit->iUserCnt);
+    _psAudit->pGlobalUser = _psAudit->pUserFile;
   }
 
-  if (psAudit->PassType == L_FILE)
+  if (_psAudit->pfnPassNext)
+  {
+    _psAudit->psPassStream = streamOpenCallback("password callback", _psAudit->pfnPassNext, _psAudit->pPassNextArg, &_psAudit->psPassStreamPin);
+  }
+  else if ((_psAudit->PassType == L_FILE) && (_psAudit->pOptPass) && (isStreamSource(_psAudit->pOptPass)))
   {
-    loadFile(psAudit->pOptPass, &psAudit->pPassFile, &psAudit->iPassCnt);
-    psAudit->pGlobalPass = psAudit->pPassFile;
+    /* passwords are read by a background thread as the audit runs */
+    _psAudit->psPassStream = streamOpen(_psAudit->pOptPass, &_psAudit->psPassStreamPin);
+    free(_psAudit->pOptPass);
+  }
+  else if ((_psAudit->PassType == L_FILE) && (_psAudit->pOptPass))
+  {
+    loadFile(_psAudit->pOptPass, &_psAudit->pPassFile, &_psAudit->iPassCnt);
+
+    if (_psAudit->iWeightedFlag)
+      sortWeightedFile(_psAudit->pPassFile, &_psAudit->iPassCnt);
+
+    _psAudit->pGlobalPass = _psAudit->pPassFile;
   }
 
-  if (psAudit->pOptCombo != NULL)
+  if (_psAudit->pOptCombo != NULL)
   {
-    loadFile(psAudit->pOptCombo, &psAudit->pComboFile, &psAudit->iComboCnt);
-    psAudit->pGlobalCombo = psAudit->pComboFile;
-    if (processComboFile(&psAudit))
+    loadFile(_psAudit->pOptCombo, &_psAudit->pComboFile, &_psAudit->iComboCnt);
+    _psAudit->pGlobalCombo = _psAudit->pComboFile;
+    if (processComboFile(&_psAudit))
     {
-      exit(iExitStatus);
+      return FAILURE;
     }
   }
 
-  if ( loadLoginInfo(psAudit) == SUCCESS )
-    writeError(ERR_DEBUG, "Successfully loaded login information.");
-  else
-    writeError(ERR_FATAL, "Failed to load login information.");
+  /* combo file audits are loaded up front - other hosts are loaded as they are dispatched */
+  if (_psAudit->pOptCombo != NULL)
+  {
+    if ( loadLoginInfo(_psAudit) == SUCCESS )
+      writeError(ERR_DEBUG, "Successfully loaded login information.");
+    else
+      writeError(ERR_FATAL, "Failed to load login information.");
 
-  if (psAudit->pOptCombo != NULL) free(psAudit->pComboFile);
-  if (psAudit->pHostFile != NULL) free(psAudit->pHostFile);
-  if (psAudit->pUserFile != NULL) free(psAudit->pUserFile);
+    free(_psAudit->pComboFile);
+  }
 
-  if (psAudit->pOptOutput != NULL)
+  if (_psAudit->pOptOutput != NULL)
   {
-    if ((pOutputFile = fopen(psAudit->pOptOutput, "a+")) == NULL)
+    if ((pOutputFile = fopen(_psAudit->pOptOutput, "a+")) == NULL)
     {
-      writeError(ERR_FATAL, "Failed to open output file %s - %s", psAudit->pOptOutput, strerror( errno ) );
+      writeError(ERR_FATAL, "Failed to open output file %s - %s", _psAudit->pOptOutput, strerror( errno ) );
     }
     else
     {
@@ -2072,7 +4229,7 @@ int main(int argc, char **argv, char *envp[] __attribute__((unused)))
       writeVerbose(VB_NONE_FILE, "# Medusa v.%s (%s)\n", VERSION, time_buf);
       writeVerbose(VB_NONE_FILE, "# ");
 
-      for (i =0; i < argc; i++)
+      for (i =0; (argv) && (i < argc); i++)
       {
         writeVerbose(VB_NONE_FILE, "%s ", argv[i]);
       }
@@ -2080,44 +4237,146 @@ int main(int argc, char **argv, char *envp[] __attribute__((unused)))
     }
   }
 
-  /* launch actually password auditing threads */
-  if ( startServerThreadPool(psAudit) == SUCCESS )
+  return SUCCESS;
+}
+
+/*
+  Run the loaded audit. Once it was stopped (SIGINT, medusaAuditStop()) or
+  reached its deadline (-B), the logins left untested are reported as a
+  resume map.
+*/
+int auditRun(sAudit *_psAudit)
+{
+  struct tm *tm_ptr;
+  time_t the_time;
+  char time_buf[256];
+  int iRet, i;
+
+  /* launch actually password auditing threads - or lease the logins to workers (-J) */
+  if (_psAudit->pOptCoordinator)
+    iRet = distCoordinate(_psAudit);
+  else
+  {
+    /* io_uring network backend (-I) - the select() based functions are used when unavailable */
+    if (_psAudit->iNetUring)
+      uringEnable();
+
+    /* coroutine logins (-E) - login threads are used when unavailable */
+    if ((_psAudit->iCoroutines) && (coroStart(_psAudit->iCoroThreads) != SUCCESS))
+      _psAudit->iCoroutines = FALSE;
+
+    for (i = 0; (_psAudit->iCoroutines) && (i < _psAudit->nServices); i++)
+    {
+      _psAudit->psServices[i].iBlocking = getModuleBlocking(_psAudit->psServices[i].pModuleName);
+      if (_psAudit->psServices[i].iBlocking)
+        writeError(ERR_INFO, "Module %s blocks outside of medusa-net - its logins run on threads (-E).", _psAudit->psServices[i].pModuleName);
+    }
+
+    iRet = startServerThreadPool(_psAudit);
+
+    if (_psAudit->iCoroutines)
+      coroStop();
+  }
+
+  /* stop time */ 
+  (void) time(&the_time);
+  tm_ptr = localtime(&the_time);
+  strftime(time_buf, 256, "%Y-%m-%d %H:%M:%S", tm_ptr); 
+
+  /* the ledger (-l) is the checkpoint of distributed audits */
+  if (_psAudit->iStopped)
+  {
+    if ((_psAudit->pOptCoordinator == NULL) && (!_psAudit->iLeased))
+      writeResumeMap(_psAudit);
+  }
+  else if (iRet == SUCCESS)
   {
-    /* stop time */ 
-    (void) time(&the_time);
-    tm_ptr = localtime(&the_time);
-    strftime(time_buf, 256, "%Y-%m-%d %H:%M:%S", tm_ptr); 
-    
     writeVerbose(VB_NONE_FILE, "# Medusa has finished (%s).\n", time_buf);
     writeVerbose(VB_GENERAL, "Medusa has finished.");
-    iExitStatus = EXIT_SUCCESS;
   }
   else
   {
-    /* stop time */ 
-    (void) time(&the_time);
-    tm_ptr = localtime(&the_time);
-    strftime(time_buf, 256, "%Y-%m-%d %H:%M:%S", tm_ptr); 
-    
     writeVerbose(VB_NONE_FILE, "# Medusa failed (%s).\n", time_buf);
     writeError(ERR_CRITICAL, "Medusa failed.");
-    iExitStatus = EXIT_FAILURE;
   }
 
+  /* deadline (-B): the logins left untested are resumed with -Z */
+  if ((!_psAudit->iStopped) && ((_psAudit->iDeadlineReached) || (_psAudit->iUsersDeferred)))
+  {
+    writeVerbose(VB_GENERAL, "Deadline: %d users were tested with part of their password list only", _psAudit->iUsersDeferred);
+    writeResumeMap(_psAudit);
+  }
+
+  /* host tables of incomplete hosts were kept for the resume map */
+  while ((_psAudit->pOptCombo == NULL) && (_psAudit->psHostRoot))
+    freeHostInfo(_psAudit, _psAudit->psHostRoot);
+
+  if (_psAudit->psLedger)
+  {
+    writeVerbose(VB_GENERAL, "Ledger: skipped %d logins which failed in a previous run", _psAudit->iLoginsSkipped);
+    ledgerClose(_psAudit->psLedger);
+    _psAudit->psLedger = NULL;
+  }
+
+  return iRet;
+}
+
+/*
+  Ask the login threads to end the audit. Hosts in progress are kept for the
+  resume map. Only sets flags, so it is safe to call from a signal handler or
+  an event handler.
+*/
+void auditStop(sAudit *_psAudit)
+{
+  _psAudit->iStopped = TRUE;
+  _psAudit->iStatus = AUDIT_ABORT; 
+  streamAbort(_psAudit->psPassStream);
+}
+
+/*
+  Free the audit and the module settings. A new audit may be created after.
+*/
+void auditFree(sAudit *_psAudit)
+{
   /* general memory clean-up */
-  if ((psAudit->pOptOutput != NULL) && (pthread_mutex_destroy(&ptmFileMutex) != 0))
-    writeError(ERR_FATAL, "File mutex destroy call failed - %s\n", strerror( errno ) );
+  if (pOutputFile != NULL)
+  {
+    fclose(pOutputFile);
+    pOutputFile = NULL;
+
+    if (pthread_mutex_destroy(&ptmFileMutex) != 0)
+      writeError(ERR_FATAL, "File mutex destroy call failed - %s\n", strerror( errno ) );
+  }
   
-  if (pthread_mutex_destroy(&(psAudit->ptmMutex)) != 0)
+  if (pthread_mutex_destroy(&(_psAudit->ptmMutex)) != 0)
     writeError(ERR_FATAL, "Audit mutex destroy call failed - %s\n", strerror( errno ) );
 
-  free(psAudit->pPassFile);
-  free(psAudit);
+  free(_psAudit->pPassFile);
+  free(_psAudit->pUserFile);
+  free(_psAudit->pGlobalHost);
+  hostListFree(&_psAudit->sHostList);
+  freeServices(_psAudit);
+  resolveCacheFree();
+  FREE(_psAudit->pOptTask);
+  FREE(_psAudit->pOptLedger);
+  FREE(_psAudit->pOptCoordinator);
+  freeFoundPass(_psAudit);
+  FREE(_psAudit->pResumeDeferred);
+  fpset_free(&_psAudit->sRoundDone);
+  paceClose(_psAudit->psPacer);
+  pthread_mutex_destroy(&(_psAudit->ptmFoundMutex));
+  streamClose(_psAudit->psPassStream);
+
+  if (_psAudit == psAudit)
+    psAudit = NULL;
+
+  free(_psAudit);
 
   if (szModuleName != NULL)
     free(szModuleName);
 
+  szModuleName = NULL;
   freeModuleParams();
-
-  exit(iExitStatus);
+  arrModuleParams = NULL;
+  nModuleParamCount = 0;
 }
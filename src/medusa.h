@@ -33,12 +33,21 @@
 #include <strings.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/time.h>
 #include <math.h>
 
 #include "medusa-trace.h"
 #include "medusa-net.h"
 #include "medusa-thread-pool.h"
 #include "medusa-thread-ssl.h"
+#include "medusa-stream.h"
+#include "medusa-hosts.h"
+#include "medusa-probe.h"
+#include "medusa-task.h"
+#include "medusa-ledger.h"
+#include "medusa-pace.h"
+#include "medusa-shcache.h"
+#include "medusa-api.h"
 
 #ifdef HAVE_CONFIG_H
   #include <config.h>
@@ -97,6 +106,7 @@ extern int iErrorLevel;        // Global control over error debugging verbosity
 #define L_FILE 2
 #define L_COMBO 3
 #define L_PWDUMP 4
+#define L_TASK 5
 
 typedef struct __sPass {
   struct __sPass *psPassNext;
@@ -123,6 +133,12 @@ typedef struct __sUser {
   int iLoginsDone;
   int iPassStatus;
   int iId;
+  sStreamBlock *psPassBlock;  // password stream cursor (block and offset within it)
+  size_t nPassOffset;
+  int iFoundSeen;             // passwords found for this user on other hosts already offered (-K)
+  int iPassDepth;             // passwords handed to login threads so far
+  int iDeferred;              // remaining passwords deferred to meet the deadline (-B)
+  uint64_t nPaceKey;          // account fingerprint for the attempt budget (-A), 0 until needed
 } sUser;
 
 /* Used in __sHost to define progress of the audit of the host's users */
@@ -132,9 +148,23 @@ typedef struct __sUser {
 #define UL_DONE 3
 #define UL_ERROR 4
 
+/*
+  Module and module options used to audit a host. A normal run has a single
+  service (-M/-m). A task file (-X) may define a service per target.
+*/
+typedef struct __sService {
+  char *pModuleName;
+  char **arrModuleParams;   // the "argv" for the module
+  int nModuleParamCount;    // the "argc" for the module
+  int iUseSSL;
+  int iDefaultPort;         // module's default TCP port (see getDefaultPort()), 0 if unknown
+  int iBlocking;            // module blocks outside of medusa-net (see isBlocking()), -E
+} sService;
+
 typedef struct __sHost {
   struct __sHost *psHostNext;
   char *pHost;
+  sService *psService;
   int iUseSSL;            // use SSL
   int iPortOverride;      // use this port instead of the module's default port
   int iTimeout;           // Number of seconds to wait before a connection times out
@@ -148,6 +178,9 @@ typedef struct __sHost {
   int iUsersDone;        // number of users tested
   int iUserStatus;
   int iId;
+  uint64_t nLedgerKey;   // fingerprint of host and service for the attempt ledger
+  int iUsersDeferred;    // users whose remaining passwords were deferred to meet the deadline (-B)
+  int iDeferDepth;       // password depth at which the last user was deferred
 } sHost;
 
 /* Used in __sCredentialSet to relay information to module regarding user */
@@ -175,10 +208,16 @@ typedef struct __sServer {
   sCredentialSet *psCredentialSetMissedCurrent;
   sCredentialSet *psCredentialSetMissedTail;
   int iCredentialsMissed;
+  int iLoginsSkipped;    // logins not tested as they failed in a previous run (ledger)
+  int iLoginsActive;     // login threads queued or running against this server
+  struct timeval tvStart;
+  double fParkedUntil;   // paced host (-A) set aside until its users have attempts left, 0 if not
+  struct __sServer *psServerNext;
 
   pthread_mutex_t ptmMutex;
 } sServer;
 
+/* results are passed to library event handlers as is (MEDUSA_RESULT_*) */
 #define LOGIN_RESULT_UNKNOWN 1
 #define LOGIN_RESULT_SUCCESS 2
 #define LOGIN_RESULT_FAIL 3
@@ -191,6 +230,7 @@ typedef struct __sLogin {
   char *pErrorMsg;
   int iId;
   int iLoginsDone;       // number of logins performed by this thread
+  sStreamHolds sPassHeld;     // password stream entries handed out and not yet released
 } sLogin;
 
 
@@ -214,6 +254,9 @@ typedef struct __sAudit {
   char *pOptCombo;        // user specified combo host/username/password file
   char *pOptOutput;       // user specified output file
   char *pOptResume;       // user specified resume command
+  char *pOptTask;         // user specified task file (host, port, module and module options)
+  char *pOptLedger;       // user specified attempt ledger file
+  char *pOptCoordinator;  // user specified coordinator address (distributed mode)
 
   char *pModuleName;      // current module name
 
@@ -241,6 +284,9 @@ typedef struct __sAudit {
   int iRetryWait;         // Number of seconds to wait between retries
   int iRetries;           // Number of retries to attempt
   int iSocketWait;        // Number of usec to wait when module calls medusaCheckSocket function
+  int iNetUring;          // use the io_uring network backend (-I)
+  int iCoroutines;        // run the logins as coroutines (-E)
+  int iCoroThreads;       // coroutine scheduler threads, 0 for one per CPU
   int HostType;
   int UserType;
   int PassType;
@@ -258,8 +304,55 @@ typedef struct __sAudit {
   int iParallelLoginFlag;     /* Parallel logins by user or password */
   int iValidPairFound;
   int iStatus;                /* Flag to indicate to threads that audit is aborting */ 
+  int iProbeCnt;              /* Concurrent connects of the liveness pre-scan, 0 if disabled */
+  int iLedgerMaxAge;          /* Days after which failed logins in the ledger are tested again, 0 for never */
+  int iLoginsSkipped;         /* Logins skipped as the ledger shows they failed before */
+  int iPropagateFlag;         /* Test passwords found on one host first for the same user on other hosts */
+  int iWeightedFlag;          /* Password file lines are "COUNT PASSWORD" - test most frequent first */
+  int iRoundSize;             /* Passwords tested against all hosts per round, 0 for a single pass */
+  int iRound;                 /* Current round (iterative deepening) */
+  int iRoundPassCnt;          /* Passwords in the current round */
+  int iDeadline;              /* Seconds the audit may run (-B), 0 for no limit */
+  time_t tDeadline;           /* Time at which the audit is stopped (-B) */
+  int iDeadlineReached;
+  int iUsersDeferred;         /* Users whose remaining passwords were deferred to meet the deadline */
+  char *pResumeDeferred;      /* Resume map items of completed hosts with deferred users (their tables are freed) */
+  size_t nResumeDeferred;
+  int iLoginsActive;          /* Login threads queued or running against all servers */
+  int iDispatchIdle;          /* No more hosts to dispatch (in this round) - idle login threads may be lent */
+  double fHostRate;           /* Moving average of the login rate of completed hosts (logins/sec) */
+  int iPaceAttempts;          /* Attempts allowed per account within iPaceWindow seconds (-A), 0 for no limit */
+  int iPaceWindow;
+  int iStopped;               /* Audit ended by SIGINT or medusaAuditStop() */
+  int iLeased;                /* Audit of a lease of a distributed audit (-j) */
+
+  pfnMedusaEvent pfnEvent;        /* Library event handler, NULL if none */
+  void *pEventArg;
+  pfnMedusaNext pfnPassNext;      /* Library callback supplying the passwords, NULL if none */
+  void *pPassNextArg;
  
   sHost *psHostRoot;
+  sHost *psHostTail;
+
+  sHostList sHostList;            /* Target host specifications (-h/-H), enumerated as hosts are dispatched */
+  sHostEntry sHostTmp;            /* Host last returned by findNextHost() */
+  sService *psServices;           /* Services (module and options) referenced by hosts */
+  int nServices;
+  int iHostsLoaded;               /* Number of host tables created so far */
+  sem_t semServers;               /* Free server slots - bounds the host tables held in memory */
+  int iServersActive;             /* Server tasks queued or running */
+  struct __sServer *psServerParked; /* Paced hosts (-A) set aside while their users wait for attempts */
+  pthread_cond_t ptcServerDone;   /* Signalled as server tasks end */
+  sLedger *psLedger;              /* Logins tested by previous runs (-l) */
+  sPacer *psPacer;                /* Attempts per account within the observation window (-A) */
+  struct __sFoundUser *psFound;   /* Valid passwords found so far, by username (-K) */
+  char *pRoundStart;              /* First global password of the current round */
+  char *pRoundEnd;                /* First global password of the next round, NULL if none */
+  fpset sRoundDone;               /* Hosts and users completed in earlier rounds (-D) */
+  pthread_mutex_t ptmFoundMutex;
+
+  sStream *psPassStream;          /* Passwords streamed from stdin, a FIFO or a compressed file */
+  sStreamBlock *psPassStreamPin;  /* Holds the head of the stream until all users are attached */
  
   thr_pool_t *server_pool;
  
@@ -282,4 +375,34 @@ int getNextCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet);
 void setPassResult(sLogin *_psLogin, char *_pPass);
 int addMissedCredSet(sLogin *_psLogin, sCredentialSet *_psCredSet);
 
+void loadFile(char *pFile, char **pFileContent, int *iFileCnt);
+void listCacheEnable(size_t nMaxBytes);
+void listCachePrefetch(char *pPath);
+void listCacheFree();
+int getModuleDefaultPort(char* pModuleName, int iUseSSL);
+int getModuleBlocking(char* pModuleName);
+void setModulePaths();
+int preloadModule(char* pModuleName);
+
+extern char* szModuleName;
+extern char** arrModuleParams;
+extern int nModuleParamCount;
+
+/* command-line options of an audit (getopt) */
+#define MEDUSA_OPTIONS "h:H:u:U:p:P:C:O:e:M:m:g:r:R:c:t:T:n:S:X:l:a:D:B:A:J:E:IbqdsLKWfFVv:w:Z:"
+
+sAudit* auditCreate();
+int findOption(int argc, char **argv, const char *pSpec, char cOpt, char **ppValue);
+int checkOptions(int argc, char **argv, sAudit *_psAudit);
+int checkAuditInput(sAudit *_psAudit);
+int auditLoad(sAudit *_psAudit, int argc, char **argv);
+int auditRun(sAudit *_psAudit);
+void auditStop(sAudit *_psAudit);
+void auditFree(sAudit *_psAudit);
+void sendEvent(sAudit *_psAudit, int _iType, char *_pModule, char *_pHost, int _iPort, char *_pUser, char *_pPass, int _iResult, char *_pMessage);
+
+/* distributed mode (medusa-dist.c) */
+int distCoordinate(sAudit *_psAudit);
+void medusaAuditSetLeased(sMedusaAudit *psMedusa);
+
 #endif
@@ -36,7 +36,7 @@
 #define	MODULE_NAME		"http.mod"
 #define MODULE_AUTHOR  "fizzgig <fizzgig@foofus.net>"
 #define	MODULE_SUMMARY_USAGE	"Brute force module for HTTP"
-#define MODULE_VERSION		"2.1"
+#define MODULE_VERSION		"2.2"
 #define MODULE_VERSION_SVN "$Id: http.c 9260 2015-05-27 21:52:57Z jmk $"
 #define MODULE_SUMMARY_FORMAT	"%s : version %s"
 #define MODULE_SUMMARY_FORMAT_WARN  "%s : version %s (%s)"
@@ -56,6 +56,11 @@
 #define AUTH_NTLM 3
 #define AUTH_DIGEST 4
 
+#define DIGEST_NONCE_NEW 0
+#define DIGEST_NONCE_SAME 1
+#define DIGEST_NONCE_STALE 2
+#define DIGEST_RETRY_MAX 2
+
 typedef struct __MODULE_DATA {
   char *szDomain;
   char *szDir;
@@ -64,6 +69,18 @@ typedef struct __MODULE_DATA {
   char *szUserAgent;
   char *szCustomHeader;
   int nAuthType;
+
+  /* Digest challenge retained between attempts */
+  char *szDigestAlg;
+  char *szDigestRealm;
+  char *szDigestNonce;
+  char *szDigestQop;
+  char *szDigestOpaque;
+  unsigned long nDigestNonceCount;
+  int nDigestNonceState;
+  int bDigestNonceReused;
+  int nDigestReuse;
+  int nDigestRetry;
 } _MODULE_DATA;
 
 // Tells us whether we are to continue processing or not
@@ -86,6 +103,12 @@ int getParamNumber()
   return 0;		// we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_HTTPS : PORT_HTTP;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -136,6 +159,7 @@ int go(sLogin* logins, int argc, char *argv[])
 
   psSessionData = malloc(sizeof(_MODULE_DATA));
   memset(psSessionData, 0, sizeof(_MODULE_DATA));
+  psSessionData->nDigestReuse = TRUE;
 
   if ((argc < 0) || (argc > 4))
   {
@@ -253,6 +277,11 @@ int go(sLogin* logins, int argc, char *argv[])
   FREE(psSessionData->szUserAgent);
   FREE(psSessionData->szDomain);
   FREE(psSessionData->szCustomHeader);
+  FREE(psSessionData->szDigestAlg);
+  FREE(psSessionData->szDigestRealm);
+  FREE(psSessionData->szDigestNonce);
+  FREE(psSessionData->szDigestQop);
+  FREE(psSessionData->szDigestOpaque);
   FREE(psSessionData);
   return SUCCESS;
 }
@@ -633,87 +662,54 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   return SUCCESS;
 }
 
-/* http://www.ietf.org/rfc/rfc2617.txt */
-int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
+/* Return the quoted value of a digest parameter (e.g. nonce="...") or NULL */
+char* getDigestParam(char* szHeader, char* szParam)
 {
-  unsigned char* bufSend = NULL;
-  unsigned char* bufReceive = NULL;
-  int nReceiveBufferSize = 0;
-  int nSendBufferSize = 0;
   char *szTmp = NULL;
   char *szTmp1 = NULL;
-  char *szAuthenticate = NULL;
-  char *szAuthorization = NULL;
+  char *szValue = NULL;
+  char *szSearch = NULL;
 
-  char *szNonce = NULL;
-  char *szCNonce = "31337";
-  char *szRealm = NULL; 
-  char *szAlg = NULL;
-  char  szNonceCount[9] = "00000001";
-  char *szQop = NULL;
-  char *szURI = NULL;
-  char *szOpaque = NULL;
-  HASHHEX HA1;
-  HASHHEX HA2 = "";
-  HASHHEX Response;
+  szSearch = malloc(strlen(szParam) + 3);
+  memset(szSearch, 0, strlen(szParam) + 3);
+  sprintf(szSearch, "%s=\"", szParam);
 
-  /* URI should start with a "/" */
-  if (strncmp(_psSessionData->szDir, "/", 1) == 0) 
-  {
-    szURI = strdup(_psSessionData->szDir);
-  }
-  else
-  {
-    szURI = malloc(1 + strlen(_psSessionData->szDir) + 1);
-    memset(szURI, 0, 1 + strlen(_psSessionData->szDir) + 1);
-    strcpy(szURI, "/");
-    strcat(szURI, _psSessionData->szDir);
-  }
-
-  /* Send initial request */
-  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial request for digest authentication.", MODULE_NAME);
-
-  nSendBufferSize = strlen(_psSessionData->szMethod) + 2 + strlen(_psSessionData->szDir) + 17 +
-                    strlen(_psSessionData->szHostHeader) + 14 + strlen(_psSessionData->szUserAgent) + 26 +
-                    strlen(_psSessionData->szCustomHeader) + 2;
+  szTmp = strcasestr(szHeader, szSearch);
+  while ((szTmp) && (szTmp != szHeader) && (isalpha((unsigned char)*(szTmp - 1))))
+    szTmp = strcasestr(szTmp + 1, szSearch);
 
-
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-
-  sprintf((char*)bufSend, "%s /%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n%s\r\n",
-          _psSessionData->szMethod, _psSessionData->szDir, _psSessionData->szHostHeader, _psSessionData->szUserAgent,
-          _psSessionData->szCustomHeader);
-
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  if ((szTmp) && ((szTmp1 = index(szTmp + strlen(szSearch), '"')) != NULL))
   {
-    writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
-    return FAILURE;
+    szTmp += strlen(szSearch);
+    szValue = malloc(szTmp1 - szTmp + 1);
+    memset(szValue, 0, szTmp1 - szTmp + 1);
+    strncpy(szValue, szTmp, szTmp1 - szTmp);
   }
 
-  FREE(bufSend);
-
-  /* Retrieve digest challenge from server */
-  bufReceive = medusaReceiveLine(hSocket, &nReceiveBufferSize);
-  if (bufReceive == NULL)
-  {
-    writeError(ERR_ERROR, "[%s] No data received", MODULE_NAME);
-    return FAILURE;
-  }
+  FREE(szSearch);
+  return szValue;
+}
 
-  if (bufReceive[0] == '\0')
-  {
-    writeError(ERR_ERROR, "[%s] Failed to locate digest challenge.", MODULE_NAME);
-    return FAILURE;
-  }
+/*
+  Parse a WWW-Authenticate Digest challenge and store it within the session.
+  The nonce-count is only reset when the server hands out a different nonce,
+  which allows a nonce to be reused across attempts (RFC 7616 3.3).
+*/
+int parseDigestChallenge(_MODULE_DATA* _psSessionData, char* szResponse)
+{
+  char *szTmp = NULL;
+  char *szTmp1 = NULL;
+  char *szAuthenticate = NULL;
+  char *szNonce = NULL;
+  char *szStale = NULL;
 
   /* Parse WWW-Authenticate Digest Response */
   /* Example: WWW-Authenticate: Digest realm="Inter-Tel 5000 (00103605AB8A)", nonce="86591bebf1330b5e57b8de2e4ac216b2", qop="auth" */
-  if ( (szTmp = strcasestr((char*)bufReceive, "WWW-Authenticate: Digest ")) != NULL )
+  if ( (szTmp = strcasestr(szResponse, "WWW-Authenticate: Digest ")) != NULL )
   {
     szTmp += 18;
   }
-  else if ( (szTmp = strcasestr((char*)bufReceive, "WWW-Authenticate:Digest ")) != NULL )
+  else if ( (szTmp = strcasestr(szResponse, "WWW-Authenticate:Digest ")) != NULL )
   {
     szTmp += 17;
   }
@@ -722,139 +718,243 @@ int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, cha
     writeError(ERR_ERROR, "[%s] Failed to locate digest challenge.", MODULE_NAME);
     return FAILURE;
   }
+
   szTmp1 = index(szTmp, '\r');
+  if (szTmp1 == NULL)
+    szTmp1 = szTmp + strlen(szTmp);
 
   szAuthenticate = malloc(szTmp1 - szTmp + 1);
   memset(szAuthenticate, 0, szTmp1 - szTmp + 1);
   strncpy(szAuthenticate, szTmp, szTmp1 - szTmp);
 
-  FREE(bufReceive);
-
   writeError(ERR_DEBUG_MODULE, "[%s] Server WWW-Authenticate Digest Response: %s", MODULE_NAME, szAuthenticate);
 
+  FREE(_psSessionData->szDigestAlg);
+  FREE(_psSessionData->szDigestRealm);
+  FREE(_psSessionData->szDigestQop);
+  FREE(_psSessionData->szDigestOpaque);
+
   /* Extract Digest Algorithm, if Specified */
   /* We currently only support MD5 and MD5-Sess (session) - Do others exist? */
   if ( strcasestr(szAuthenticate, "algorithm=MD5-sess") || strcasestr(szAuthenticate, "algorithm=\"MD5-sess\"") )
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Server requested Digest MD5-sess algorithm.", MODULE_NAME);
-    szAlg = malloc(9);
-    memset(szAlg, 0, 9);
-    sprintf(szAlg, "MD5-sess"); 
+    _psSessionData->szDigestAlg = strdup("MD5-sess");
   }
   else if ( strcasestr(szAuthenticate, "algorithm=MD5") || strcasestr(szAuthenticate, "algorithm=\"MD5\"") )
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Server requested Digest MD5 algorithm.", MODULE_NAME);
-    szAlg = malloc(4);
-    memset(szAlg, 0, 4);
-    sprintf(szAlg, "MD5"); 
+    _psSessionData->szDigestAlg = strdup("MD5");
   }
   else if ( strcasestr(szAuthenticate, "algorithm=") )
   {
     writeError(ERR_ERROR, "[%s] Server requested unknown Digest algorithm.", MODULE_NAME);
+    FREE(szAuthenticate);
     return FAILURE;
   }
   else
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Server did not specify a Digest algorithm, so we're assuming MD5.", MODULE_NAME);
-    szAlg = malloc(4);
-    memset(szAlg, 0, 4);
-    sprintf(szAlg, "MD5"); 
+    _psSessionData->szDigestAlg = strdup("MD5");
   }
 
   /* Extract Digest Realm */
-  szTmp = strcasestr(szAuthenticate, "realm=\"");
-  if (szTmp)
-  {
-    szTmp += 7;
-    szTmp1 = ((char*)index(szTmp, '"'));
-
-    szRealm = malloc (szTmp1 - szTmp + 1);
-    memset(szRealm, 0, szTmp1 - szTmp + 1);
-    strncpy(szRealm, szTmp, szTmp1 - szTmp);
-    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Realm Response: %s", MODULE_NAME, szRealm);
-  }
+  _psSessionData->szDigestRealm = getDigestParam(szAuthenticate, "realm");
+  if (_psSessionData->szDigestRealm)
+    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Realm Response: %s", MODULE_NAME, _psSessionData->szDigestRealm);
   else
   {
     writeError(ERR_ERROR, "[%s] Failed to extract server Realm response.", MODULE_NAME);
-    szRealm = malloc(1);
-    memset(szRealm, 0, 1);
+    _psSessionData->szDigestRealm = strdup("");
   }
 
   /* Extract Digest Server Nonce */
-  szTmp = strcasestr(szAuthenticate, "nonce=\"");
-  if (szTmp)
+  szNonce = getDigestParam(szAuthenticate, "nonce");
+  if (szNonce)
+    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Nonce Response: %s", MODULE_NAME, szNonce);
+  else
   {
-    szTmp += 7;
-    szTmp1 = index(szTmp, '"');
+    writeError(ERR_ERROR, "[%s] Failed to extract server Nonce response.", MODULE_NAME);
+    szNonce = strdup("");
+  }
 
-    szNonce = malloc (szTmp1 - szTmp + 1);
-    memset(szNonce, 0, szTmp1 - szTmp + 1);
-    strncpy(szNonce, szTmp, szTmp1 - szTmp);
-    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Nonce Response: %s", MODULE_NAME, szNonce);
+  if ((_psSessionData->szDigestNonce) && (strcmp(_psSessionData->szDigestNonce, szNonce) == 0))
+  {
+    _psSessionData->nDigestNonceState = DIGEST_NONCE_SAME;
+    FREE(szNonce);
   }
   else
   {
-    writeError(ERR_ERROR, "[%s] Failed to extract server Nonce response.", MODULE_NAME);
-    szNonce = malloc(1);
-    memset(szNonce, 0, 1);
+    _psSessionData->nDigestNonceState = DIGEST_NONCE_NEW;
+    FREE(_psSessionData->szDigestNonce);
+    _psSessionData->szDigestNonce = szNonce;
+    _psSessionData->nDigestNonceCount = 0;
+  }
+
+  /* Server indicates our nonce expired, rather than the credentials being wrong */
+  szStale = strcasestr(szAuthenticate, "stale=");
+  if ((szStale) && ((strncasecmp(szStale + 6, "true", 4) == 0) || (strncasecmp(szStale + 6, "\"true\"", 6) == 0)))
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Server flagged previous nonce as stale.", MODULE_NAME);
+    _psSessionData->nDigestNonceState = DIGEST_NONCE_STALE;
   }
 
   /* Extract Digest Quality of Protection (QoP) - If Specified */
-  szTmp = strcasestr(szAuthenticate, "qop=\"");
-  if (szTmp)
+  _psSessionData->szDigestQop = getDigestParam(szAuthenticate, "qop");
+  if (_psSessionData->szDigestQop)
+    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Quality of Protection (QoP) Response: %s", MODULE_NAME, _psSessionData->szDigestQop);
+  else
+    writeError(ERR_DEBUG_MODULE, "[%s] Failed to extract server Quality of Protection (QoP) response.", MODULE_NAME);
+
+  /* Extract Digest Opaque Value - If Specified */
+  _psSessionData->szDigestOpaque = getDigestParam(szAuthenticate, "opaque");
+  if (_psSessionData->szDigestOpaque)
+    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Server Opaque Value: %s", MODULE_NAME, _psSessionData->szDigestOpaque);
+  else
+    writeError(ERR_DEBUG_MODULE, "[%s] Failed to extract server Opaque value.", MODULE_NAME);
+
+  FREE(szAuthenticate);
+  return SUCCESS;
+}
+
+/* Send an unauthenticated request in order to retrieve a fresh digest challenge */
+int getDigestChallenge(int hSocket, _MODULE_DATA* _psSessionData)
+{
+  unsigned char* bufSend = NULL;
+  unsigned char* bufReceive = NULL;
+  int nReceiveBufferSize = 0;
+  int nSendBufferSize = 0;
+  int nRet = SUCCESS;
+
+  /* Send initial request */
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial request for digest authentication.", MODULE_NAME);
+
+  nSendBufferSize = strlen(_psSessionData->szMethod) + 2 + strlen(_psSessionData->szDir) + 17 +
+                    strlen(_psSessionData->szHostHeader) + 14 + strlen(_psSessionData->szUserAgent) + 26 +
+                    strlen(_psSessionData->szCustomHeader) + 2;
+
+
+  bufSend = malloc(nSendBufferSize + 1);
+  memset(bufSend, 0, nSendBufferSize + 1);
+
+  sprintf((char*)bufSend, "%s /%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n%s\r\n",
+          _psSessionData->szMethod, _psSessionData->szDir, _psSessionData->szHostHeader, _psSessionData->szUserAgent,
+          _psSessionData->szCustomHeader);
+
+  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  {
+    writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
+    FREE(bufSend);
+    return FAILURE;
+  }
+
+  FREE(bufSend);
+
+  /* Retrieve digest challenge from server */
+  bufReceive = medusaReceiveLine(hSocket, &nReceiveBufferSize);
+  if (bufReceive == NULL)
   {
-    szTmp += 5;
-    szTmp1 = index(szTmp, '"');
+    writeError(ERR_ERROR, "[%s] No data received", MODULE_NAME);
+    return FAILURE;
+  }
 
-    szQop = malloc (szTmp1 - szTmp + 1);
-    memset(szQop, 0, szTmp1 - szTmp + 1);
-    strncpy(szQop, szTmp, szTmp1 - szTmp);
-    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Quality of Protection (QoP) Response: %s", MODULE_NAME, szQop);
+  if (bufReceive[0] == '\0')
+  {
+    writeError(ERR_ERROR, "[%s] Failed to locate digest challenge.", MODULE_NAME);
+    FREE(bufReceive);
+    return FAILURE;
+  }
+
+  /* A challenge retrieved on this connection is always fresh */
+  FREE(_psSessionData->szDigestNonce);
+  nRet = parseDigestChallenge(_psSessionData, (char*)bufReceive);
+
+  FREE(bufReceive);
+  return nRet;
+}
+
+/*
+  http://www.ietf.org/rfc/rfc2617.txt
+
+  The challenge from the previous attempt is reused with an incrementing
+  nonce-count, so that only the first attempt (or one following a stale
+  nonce) costs an extra unauthenticated request.
+*/
+int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
+{
+  unsigned char* bufSend = NULL;
+  int nSendBufferSize = 0;
+  char *szAuthorization = NULL;
+
+  char *szCNonce = "31337";
+  char  szNonceCount[9];
+  char *szURI = NULL;
+  HASHHEX HA1;
+  HASHHEX HA2 = "";
+  HASHHEX Response;
+
+  /* URI should start with a "/" */
+  if (strncmp(_psSessionData->szDir, "/", 1) == 0) 
+  {
+    szURI = strdup(_psSessionData->szDir);
   }
   else
   {
-    writeError(ERR_DEBUG_MODULE, "[%s] Failed to extract server Quality of Protection (QoP) response.", MODULE_NAME);
-    szQop = NULL;
+    szURI = malloc(1 + strlen(_psSessionData->szDir) + 1);
+    memset(szURI, 0, 1 + strlen(_psSessionData->szDir) + 1);
+    strcpy(szURI, "/");
+    strcat(szURI, _psSessionData->szDir);
   }
 
-  /* Extract Digest Opaque Value - If Specified */
-  szTmp = strcasestr(szAuthenticate, "opaque=\"");
-  if (szTmp)
+  if (_psSessionData->nDigestReuse == FALSE)
+    FREE(_psSessionData->szDigestNonce);
+
+  if (_psSessionData->szDigestNonce == NULL)
   {
-    szTmp += 8;
-    szTmp1 = index(szTmp, '"');
+    if (getDigestChallenge(hSocket, _psSessionData) == FAILURE)
+    {
+      FREE(szURI);
+      return FAILURE;
+    }
 
-    szOpaque = malloc(szTmp1 - szTmp + 1);
-    memset(szOpaque, 0, szTmp1 - szTmp + 1);
-    strncpy(szOpaque, szTmp, szTmp1 - szTmp);
-    writeError(ERR_DEBUG_MODULE, "[%s] Extracted Server Opaque Value: %s", MODULE_NAME, szOpaque);
+    _psSessionData->bDigestNonceReused = FALSE;
   }
   else
   {
-    writeError(ERR_DEBUG_MODULE, "[%s] Failed to extract server Opaque value.", MODULE_NAME);
-    szOpaque = NULL;
+    writeError(ERR_DEBUG_MODULE, "[%s] Reusing server nonce: %s", MODULE_NAME, _psSessionData->szDigestNonce);
+    _psSessionData->bDigestNonceReused = TRUE;
   }
 
-  FREE(szAuthenticate);
+  /* If the server specified a QoP, the client must use a cnonce */
+  if ( (_psSessionData->szDigestQop) && (strcasestr(_psSessionData->szDigestQop, "auth-int")) )
+  {
+    writeError(ERR_ERROR, "[%s] Integrity protection (i.e. qop: auth-int) is currently not supported.", MODULE_NAME);
+    FREE(szURI);
+    return FAILURE;
+  }
+
+  _psSessionData->nDigestNonceCount++;
+  snprintf(szNonceCount, sizeof(szNonceCount), "%08lx", _psSessionData->nDigestNonceCount);
 
   /* Send digest response */
   /* Example: Authorization: Digest username="it5k", realm="Inter-Tel 5000 (00103605AB8A)", nonce="94144a2abae7411d0f6af2b533425497", uri="/", 
                              response="b9c3980ae4e7fb69796772a3bacc5c18"\r\n */
 
-  writeError(ERR_DEBUG_MODULE, "[%s] szAlg: %s", MODULE_NAME, szAlg);
+  writeError(ERR_DEBUG_MODULE, "[%s] szAlg: %s", MODULE_NAME, _psSessionData->szDigestAlg);
   writeError(ERR_DEBUG_MODULE, "[%s] szLogin: %s", MODULE_NAME, szLogin);
-  writeError(ERR_DEBUG_MODULE, "[%s] szRealm: %s", MODULE_NAME, szRealm);
+  writeError(ERR_DEBUG_MODULE, "[%s] szRealm: %s", MODULE_NAME, _psSessionData->szDigestRealm);
   writeError(ERR_DEBUG_MODULE, "[%s] szPassword: %s", MODULE_NAME, szPassword);
-  writeError(ERR_DEBUG_MODULE, "[%s] szNonce: %s", MODULE_NAME, szNonce);
+  writeError(ERR_DEBUG_MODULE, "[%s] szNonce: %s", MODULE_NAME, _psSessionData->szDigestNonce);
   writeError(ERR_DEBUG_MODULE, "[%s] szCNonce: %s", MODULE_NAME, szCNonce);
   writeError(ERR_DEBUG_MODULE, "[%s] szNonceCount: %s", MODULE_NAME, szNonceCount);
-  writeError(ERR_DEBUG_MODULE, "[%s] szQop: %s", MODULE_NAME, szQop);
-  writeError(ERR_DEBUG_MODULE, "[%s] szOpaque: %s", MODULE_NAME, szOpaque);
+  writeError(ERR_DEBUG_MODULE, "[%s] szQop: %s", MODULE_NAME, _psSessionData->szDigestQop);
+  writeError(ERR_DEBUG_MODULE, "[%s] szOpaque: %s", MODULE_NAME, _psSessionData->szDigestOpaque);
   writeError(ERR_DEBUG_MODULE, "[%s] szMethod: %s", MODULE_NAME, _psSessionData->szMethod);
   writeError(ERR_DEBUG_MODULE, "[%s] szURI: %s", MODULE_NAME, szURI);
 
-  DigestCalcHA1(szAlg, szLogin, szRealm, szPassword, szNonce, szCNonce, HA1);
-  DigestCalcResponse(HA1, szNonce, szNonceCount, szCNonce, szQop, _psSessionData->szMethod, szURI, HA2, Response);
+  DigestCalcHA1(_psSessionData->szDigestAlg, szLogin, _psSessionData->szDigestRealm, szPassword, _psSessionData->szDigestNonce, szCNonce, HA1);
+  DigestCalcResponse(HA1, _psSessionData->szDigestNonce, szNonceCount, szCNonce, _psSessionData->szDigestQop ? _psSessionData->szDigestQop : "",
+                     _psSessionData->szMethod, szURI, HA2, Response);
   writeError(ERR_DEBUG_MODULE, "[%s] Calculated Digest Response: %s", MODULE_NAME, Response);
 
   /*
@@ -863,46 +963,35 @@ int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, cha
     OPAQUE: , opaque=\"%s\"
   */
 
-  nSendBufferSize = 17 + strlen(szLogin) + 10 + strlen(szRealm) + 10 + strlen(szNonce) + 8 + strlen(szURI) + 14 + strlen(szAlg) + 13 + strlen((char*)Response);
+  nSendBufferSize = 17 + strlen(szLogin) + 10 + strlen(_psSessionData->szDigestRealm) + 10 + strlen(_psSessionData->szDigestNonce) + 8 + strlen(szURI) +
+                    14 + strlen(_psSessionData->szDigestAlg) + 13 + strlen((char*)Response);
 
-  /* If the server specified a QoP, the client must use a cnonce */
-  if ( strcasestr(szQop, "auth-int") )
-  {
-    writeError(ERR_ERROR, "[%s] Integrity protection (i.e. qop: auth-int) is currently not supported.", MODULE_NAME);
-    return FAILURE;
-  }
-  else if ( strcasestr(szQop, "auth") )
-  {
-    nSendBufferSize += 7 + strlen(szQop) + 5 + strlen(szNonceCount) + 10 + strlen(szCNonce) + 1;
-  }
+  if (_psSessionData->szDigestQop)
+    nSendBufferSize += 7 + strlen(_psSessionData->szDigestQop) + 5 + strlen(szNonceCount) + 10 + strlen(szCNonce) + 1;
 
   /* If the server specified an opaque value, that same value should be included in our response. */
-  if ( szOpaque )
-  {
-    nSendBufferSize += 10 + strlen(szOpaque) + 1; 
-  }
+  if (_psSessionData->szDigestOpaque)
+    nSendBufferSize += 10 + strlen(_psSessionData->szDigestOpaque) + 1; 
 
   szAuthorization = malloc(nSendBufferSize + 1);
   memset(szAuthorization, 0, nSendBufferSize + 1);
 
-  if ( (szQop != NULL) && (szOpaque != NULL) )
-    sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\", qop=%s, nc=00000001, cnonce=\"%s\", opaque=\"%s\"",
-                             szLogin, szRealm, szNonce, szURI, szAlg, Response, szQop, szCNonce, szOpaque);
-  else if (szQop != NULL)
-    sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\", qop=%s, nc=00000001, cnonce=\"%s\"",
-                             szLogin, szRealm, szNonce, szURI, szAlg, Response, szQop, szCNonce);
-  else if (szOpaque != NULL)
+  if ( (_psSessionData->szDigestQop != NULL) && (_psSessionData->szDigestOpaque != NULL) )
+    sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\", qop=%s, nc=%s, cnonce=\"%s\", opaque=\"%s\"",
+                             szLogin, _psSessionData->szDigestRealm, _psSessionData->szDigestNonce, szURI, _psSessionData->szDigestAlg, Response,
+                             _psSessionData->szDigestQop, szNonceCount, szCNonce, _psSessionData->szDigestOpaque);
+  else if (_psSessionData->szDigestQop != NULL)
+    sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\", qop=%s, nc=%s, cnonce=\"%s\"",
+                             szLogin, _psSessionData->szDigestRealm, _psSessionData->szDigestNonce, szURI, _psSessionData->szDigestAlg, Response,
+                             _psSessionData->szDigestQop, szNonceCount, szCNonce);
+  else if (_psSessionData->szDigestOpaque != NULL)
     sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\", opaque=\"%s\"",
-                             szLogin, szRealm, szNonce, szURI, szAlg, Response, szOpaque);
+                             szLogin, _psSessionData->szDigestRealm, _psSessionData->szDigestNonce, szURI, _psSessionData->szDigestAlg, Response,
+                             _psSessionData->szDigestOpaque);
   else
     sprintf(szAuthorization, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", algorithm=%s, response=\"%s\"",
-                             szLogin, szRealm, szNonce, szURI, szAlg, Response);
+                             szLogin, _psSessionData->szDigestRealm, _psSessionData->szDigestNonce, szURI, _psSessionData->szDigestAlg, Response);
 
-  FREE(szAlg);
-  FREE(szRealm);
-  FREE(szNonce);
-  FREE(szQop);
-  FREE(szOpaque);
   FREE(szURI);
 
   nSendBufferSize = strlen(_psSessionData->szMethod) + 2 + strlen(_psSessionData->szDir) + 17 +
@@ -919,6 +1008,8 @@ int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, cha
   if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
+    FREE(szAuthorization);
+    FREE(bufSend);
     return FAILURE;
   }
 
@@ -928,6 +1019,59 @@ int sendAuthDigest(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, cha
   return SUCCESS;
 }
 
+/*
+  Examine the server's reply to a digest attempt. Returns TRUE if the attempt
+  must be repeated because the reused nonce was refused rather than the
+  credentials themselves.
+*/
+int checkDigestResponse(_MODULE_DATA* _psSessionData, char* szResponse, int nStatusCode)
+{
+  char *szTmp = NULL;
+  char *szNextNonce = NULL;
+
+  if (nStatusCode != 401)
+  {
+    /* RFC 2617 3.2.3: server may hand out the nonce to use for the next request */
+    if ( ((szTmp = strcasestr(szResponse, "Authentication-Info:")) != NULL) && ((szNextNonce = getDigestParam(szTmp, "nextnonce")) != NULL) )
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Server supplied next nonce: %s", MODULE_NAME, szNextNonce);
+      FREE(_psSessionData->szDigestNonce);
+      _psSessionData->szDigestNonce = szNextNonce;
+      _psSessionData->nDigestNonceCount = 0;
+    }
+
+    _psSessionData->nDigestRetry = 0;
+    return FALSE;
+  }
+
+  if (parseDigestChallenge(_psSessionData, szResponse) == FAILURE)
+  {
+    FREE(_psSessionData->szDigestNonce);
+    _psSessionData->nDigestRetry = 0;
+    return FALSE;
+  }
+
+  /*
+    A fresh nonce from this connection means the credentials were rejected. A
+    reused nonce answered with a new nonce is ambiguous unless flagged stale:
+    the server may simply not allow nonce reuse.
+  */
+  if ((_psSessionData->bDigestNonceReused == FALSE) || (_psSessionData->nDigestNonceState == DIGEST_NONCE_SAME))
+  {
+    _psSessionData->nDigestRetry = 0;
+    return FALSE;
+  }
+
+  _psSessionData->nDigestRetry++;
+  if ((_psSessionData->nDigestNonceState != DIGEST_NONCE_STALE) || (_psSessionData->nDigestRetry > DIGEST_RETRY_MAX))
+  {
+    writeError(ERR_NOTICE, "[%s] Server %s does not appear to honor nonce reuse. Requesting a new challenge for each attempt.", MODULE_NAME, _psSessionData->szHostHeader);
+    _psSessionData->nDigestReuse = FALSE;
+  }
+
+  return TRUE;
+}
+
 int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* szLogin, char* szPassword)
 {
   unsigned char* pReceiveBuffer = NULL;
@@ -970,12 +1114,29 @@ int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* sz
 
   writeError(ERR_DEBUG_MODULE, "[%s] Retrieving server response.", MODULE_NAME);
   nReceiveBufferSize = 0;
-  if ((medusaReceiveRegex(hSocket, &pReceiveBuffer, &nReceiveBufferSize, "HTTP/1.* [0-9]{3,3} .*\r\n") == FAILURE) || (pReceiveBuffer == NULL))
+  if (_psSessionData->nAuthType == AUTH_DIGEST)
+    pTemp = "HTTP/1.* [0-9]{3,3} .*\r\n\r\n"; /* digest challenge is within the headers */
+  else
+    pTemp = "HTTP/1.* [0-9]{3,3} .*\r\n";
+
+  if ((medusaReceiveRegex(hSocket, &pReceiveBuffer, &nReceiveBufferSize, pTemp) == FAILURE) || (pReceiveBuffer == NULL))
   {
     writeError(ERR_ERROR, "[%s] Failed: Unexpected or no data received: %s", MODULE_NAME, pReceiveBuffer);
     return FAILURE;
   }
 
+  pTemp = strstr((char*)pReceiveBuffer, "HTTP/1.");
+  if ((_psSessionData->nAuthType == AUTH_DIGEST) && (pTemp) && (index(pTemp, ' ')))
+  {
+    if (checkDigestResponse(_psSessionData, (char*)pReceiveBuffer, atoi(index(pTemp, ' ') + 1)) == TRUE)
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Server refused reused nonce. Retrying %s:%s with new challenge.", MODULE_NAME, szLogin, szPassword);
+      FREE(pReceiveBuffer);
+      (*login)->iResult = LOGIN_RESULT_UNKNOWN;
+      return MSTATE_NEW;
+    }
+  }
+
   pTemp = strstr((char*)pReceiveBuffer, "HTTP/1.");
   pTemp = index(pTemp, ' ') + 1;
   memset((char*)index(pTemp, 0x0d), 0, 1);
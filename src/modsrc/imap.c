@@ -62,6 +62,7 @@ typedef struct __MODULE_DATA {
   char *szTag;
   int nAuthType;
   char* szDomain;
+  char bufSASL[SASL_BUFFER_SIZE];
 } _MODULE_DATA;
 
 // Tells us whether we are to continue processing or not
@@ -84,6 +85,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_IMAPS : PORT_IMAP;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -495,56 +502,49 @@ int initConnection(_MODULE_DATA *_psSessionData, int hSocket, sConnectParams *pa
 /* A0001 LOGIN username password */
 int sendAuthLogin(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
   int nSendBufferSize = 0;
   int nRet = SUCCESS;
 
-  nSendBufferSize = strlen(_psSessionData->szTag) + 7 + strlen(szLogin) + 1 + strlen(szPassword) + 4 + 2; 
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-
   if (_psSessionData->szDomain) 
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Sending authenticate login value: %s\\\\%s %s", MODULE_NAME, _psSessionData->szDomain, szLogin, szPassword); 
-    sprintf((char*)bufSend, "%s LOGIN \"%s\\\\%s\" \"%s\"\r\n", _psSessionData->szTag, _psSessionData->szDomain, szLogin, szPassword);
+    nSendBufferSize = snprintf(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "%s LOGIN \"%s\\\\%s\" \"%s\"\r\n", _psSessionData->szTag, _psSessionData->szDomain, szLogin, szPassword);
   }
   else
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Sending authenticate login value: %s %s", MODULE_NAME, szLogin, szPassword); 
-    sprintf((char*)bufSend, "%s LOGIN \"%s\" \"%s\"\r\n", _psSessionData->szTag, szLogin, szPassword);
+    nSendBufferSize = snprintf(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "%s LOGIN \"%s\" \"%s\"\r\n", _psSessionData->szTag, szLogin, szPassword);
   }
 
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (nSendBufferSize >= SASL_BUFFER_SIZE)
+  {
+    writeError(ERR_ERROR, "[%s] Credentials too long for LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
+
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
     nRet = FAILURE;
   }
 
-  FREE(bufSend); 
   return(nRet);
 }
 
 /* A0001 AUTHENTICATE PLAIN credentials(base64) */
 int sendAuthPlain(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
   unsigned char* bufReceive = NULL;
-  char* szTmp = NULL;
-  char* szEncodedAuth = NULL;
   int nSendBufferSize = 0;
   int nReceiveBufferSize = 0;
 
   /* Send initial AUTHENTICATE PLAIN command */
-  nSendBufferSize = strlen(_psSessionData->szTag) + 21;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s AUTHENTICATE PLAIN\r\n", _psSessionData->szTag);
+  nSendBufferSize = snprintf(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "%s AUTHENTICATE PLAIN\r\n", _psSessionData->szTag);
   
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend); 
 
   nReceiveBufferSize = 0;
   if ((medusaReceiveRegex(hSocket, &bufReceive, &nReceiveBufferSize, "\\+.*\r\n") == FAILURE) || (bufReceive == NULL))
@@ -553,37 +553,24 @@ int sendAuthPlain(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char
     writeError(ERR_ERROR, "[%s] IMAP server sent the following response: %s", MODULE_NAME, bufReceive);
     return FAILURE;
   }
+  FREE(bufReceive);
 
-  /* Build a null separated string of szLogin \0 szLogin \0 szPassword */
-  nSendBufferSize = strlen(szLogin) + 1 + strlen(szLogin) + 1 + strlen(szPassword); 
-  
-  szTmp = malloc(nSendBufferSize + 1);
-  memset(szTmp, 0, nSendBufferSize + 1);
-  
   /* username\0username\0password */
-  memcpy(szTmp, szLogin, strlen(szLogin));
-  memcpy(szTmp + strlen(szLogin) + 1, szLogin, strlen(szLogin));
-  memcpy(szTmp + strlen(szLogin) + 1 + strlen(szLogin) + 1, szPassword, strlen(szPassword)); 
-  
-  szEncodedAuth = malloc(2 * nSendBufferSize + 1);
-  memset(szEncodedAuth, 0, 2 * nSendBufferSize + 1);
-  base64_encode(szTmp, nSendBufferSize, szEncodedAuth);
-  FREE(szTmp);
- 
-  writeError(ERR_DEBUG_MODULE, "[%s] Sending authenticate plain value: %s", MODULE_NAME, szEncodedAuth); 
-  nSendBufferSize = strlen(szEncodedAuth) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s\r\n", szEncodedAuth);
-  FREE(szEncodedAuth);
+  nSendBufferSize = sasl_plain_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szLogin, szLogin, szPassword, "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Credentials too long for AUTHENTICATE PLAIN request.", MODULE_NAME);
+    return FAILURE;
+  }
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending authenticate plain value: %s", MODULE_NAME, _psSessionData->bufSASL); 
   
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
 
-  FREE(bufSend); 
   return SUCCESS;
 }
 
@@ -597,7 +584,6 @@ int sendAuthPlain(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char
 */
 int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
   unsigned char* bufReceive = NULL;
   int nSendBufferSize = 0;
   int nReceiveBufferSize = 0;
@@ -605,19 +591,14 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   tSmbNtlmAuthChallenge sTmpChall;
   tSmbNtlmAuthResponse  sTmpResp;
   char* szTmpBuf = NULL;
-  char* szTmpBuf64 = NULL;
 
   /* --- Send initial AUTHENTICATE NTLM command --- */
-  nSendBufferSize = strlen(_psSessionData->szTag) + 21;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s AUTHENTICATE NTLM\r\n", _psSessionData->szTag);
+  nSendBufferSize = snprintf(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "%s AUTHENTICATE NTLM\r\n", _psSessionData->szTag);
   
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend); 
 
   /* Server should respond with an empty challenge, consisting simply of a "+" */
   nReceiveBufferSize = 0;
@@ -632,25 +613,19 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   /* --- Send Base-64 encoded Type-1 message --- */
   buildAuthRequest(&sTmpReq, 0, NULL, NULL);
   
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpReq) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpReq) + 2);
-
-  base64_encode((char *)&sTmpReq, SmbLength(&sTmpReq), szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen(szTmpBuf64) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s\r\n", szTmpBuf64);
-
-  FREE(szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, (char *)&sTmpReq, SmbLength(&sTmpReq), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM request too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL);
 
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
-  FREE(bufSend); 
   
   /* Server should respond with a Base-64 encoded Type-2 challenge message. The challenge response format is 
      specified by RFC 1730 ("+", followed by a space, followed by the challenge message). */
@@ -673,26 +648,20 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
  
   buildAuthResponse(&sTmpChall, &sTmpResp, 0, szLogin, szPassword, _psSessionData->szDomain, NULL); 
 
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpResp) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpResp) + 2);
-
-  base64_encode((char *)&sTmpResp, SmbLength(&sTmpResp), szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen(szTmpBuf64) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s\r\n", szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, (char *)&sTmpResp, SmbLength(&sTmpResp), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM response too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL);
 
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
 
-  FREE(szTmpBuf64);
-  FREE(bufSend);
-
   /* Server should validate the response and indicate the result of authentication.
      e.g.  0001 OK AUTHENTICATE NTLM completed. */
 
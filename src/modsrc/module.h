@@ -48,11 +48,17 @@ void summaryUsage( char **szUsage );	/*	Allocates and populates a string with br
 void showUsage( );	 /*	Displays module usage information	*/
 int go( sLogin* logins, int argc, char *argv[] );	/*	Launches the module with available parameters	*/
 
+/*	Prototypes for optional functions	*/
+int getDefaultPort( int iUseSSL );	/*	TCP port probed by the liveness pre-scan (-S), 0 if none	*/
+int isBlocking( );	/*	TRUE if the module waits outside of medusa-net, so it cannot run as a coroutine (-E)	*/
+
 /*	Typedefs for function pointers	*/
 typedef int (*function_getParamNumber)( );
 typedef void (*function_summaryUsage)( char** );
 typedef void (*function_showUsage)( );
 typedef int (*function_go)( sLogin*, int, char*[] );
+typedef int (*function_getDefaultPort)( int );
+typedef int (*function_isBlocking)( );
 
 #endif	/*	(was this file already included?)	*/
 
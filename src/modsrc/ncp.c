@@ -123,6 +123,12 @@ void showUsage()
   writeVerbose(VB_NONE, "");
 }
 
+// Tell medusa the module waits in libncp, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
+}
+
 // The "main" of the medusa module world - this is what gets called to actually do the work
 int go(sLogin* logins, int argc, char *argv[])
 {
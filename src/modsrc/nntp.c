@@ -71,6 +71,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_NNTPS : PORT_NNTP;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -1085,21 +1085,36 @@ if (p) len = strlen(p); \
 AddBytes(ptr, header, ((unsigned char*)p), len); \
 }
 
+/* Widen straight into the message buffer */
 #define AddUnicodeString(ptr, header, string) \
 { \
 char *p = string; \
-unsigned char *b = NULL; \
 int len = 0; \
-if (p) \
+int i = 0; \
+if (p) len = strlen(p); \
+if (len) \
+  { \
+  SSVAL(&ptr->header.len,0,len*2); \
+  SSVAL(&ptr->header.maxlen,0,len*2); \
+  SIVAL(&ptr->header.offset,0,((ptr->buffer - ((uint8*)ptr)) + ptr->bufIndex)); \
+  for (i = 0; i < len; i++) \
+    { \
+    ptr->buffer[ptr->bufIndex++] = p[i]; \
+    ptr->buffer[ptr->bufIndex++] = 0; \
+    } \
+  } \
+else \
   { \
-  len = strlen(p); \
-  b = strToUnicode(p); \
+  ptr->header.len = \
+  ptr->header.maxlen = 0; \
+  SIVAL(&ptr->header.offset,0,ptr->bufIndex); \
   } \
-AddBytes(ptr, header, b, len*2); \
 }
 
 #define GetUnicodeString(structPtr, header) \
 unicodeToString(((char*)structPtr) + IVAL(&structPtr->header.offset,0) , SVAL(&structPtr->header.len,0)/2)
+#define GetUnicodeStringBuf(structPtr, header, buf, size) \
+unicodeToStringBuf(((char*)structPtr) + IVAL(&structPtr->header.offset,0) , SVAL(&structPtr->header.len,0)/2, buf, size)
 #define GetString(structPtr, header) \
 toString((((char *)structPtr) + IVAL(&structPtr->header.offset,0)), SVAL(&structPtr->header.len,0))
 #define DumpBuffer(fp, structPtr, header) \
@@ -1132,20 +1147,21 @@ static char *unicodeToString(char *p, size_t len)
   return buf;
 }
 
-static unsigned char *strToUnicode(char *p)
+/* Thread-safe variant of unicodeToString() which uses the caller's buffer */
+static char *unicodeToStringBuf(char *p, size_t len, char *buf, size_t size)
 {
-  static unsigned char buf[1024];
-  size_t l = strlen(p);
-  int i = 0;
-  
-  assert(l*2 < sizeof buf);
-  
-  while (l--)
+  size_t i;
+
+  if (len + 1 > size)
+    len = size - 1;
+
+  for (i = 0; i < len; ++i)
   {
-    buf[i++] = *p++;
-    buf[i++] = 0;
+    buf[i] = *p & 0x7f;
+    p += 2;
   }
-  
+
+  buf[i] = '\0';
   return buf;
 }
 
@@ -1163,13 +1179,14 @@ static unsigned char *toString(char *p, size_t len)
 /* Generate a Type-1 NTLM message */
 void buildAuthRequest(tSmbNtlmAuthRequest *request, long flags, char *host, char *domain)
 {
-  char *h = NULL;
+  char h[128];
   char *p = NULL;
 
   if (host == NULL)   host = "";
   if (domain == NULL) domain = "";
 
-  h = strdup(host);
+  assert(strlen(host) < 128);
+  strcpy(h, host);
   p = strchr(h,'@');
   if (p)
   {
@@ -1189,8 +1206,6 @@ void buildAuthRequest(tSmbNtlmAuthRequest *request, long flags, char *host, char
 
   assert(strlen(domain) < 128);
   AddString(request,domain,domain);
-
-  free(h);
 }
 
 /* Process Type-2 message and generate Type-3 NTLM/NTLM2 response*/
@@ -1205,22 +1220,26 @@ void buildAuthResponse(tSmbNtlmAuthChallenge *challenge, tSmbNtlmAuthResponse *r
   uint8 sessionHash[8];
   MD5_CTX Md5Ctx;
 
-  char *u = strdup(user);
-  char *p = strchr(u,'@');
+  char u[2 * 128 + 1];                /* user@domain - each part is checked below */
+  char *p = NULL;
   char *w = NULL;
-  char *d = strdup(GetUnicodeString(challenge,uDomain));
+  char d[128];
   char *domain = d;
 
+  snprintf(u, sizeof(u), "%s", user);
+  p = strchr(u,'@');
+  GetUnicodeStringBuf(challenge, uDomain, d, sizeof(d));
+
   writeError(ERR_INFO, "NTLM Authentication Challenge - Ident: %s", challenge->ident);
   writeError(ERR_INFO, "NTLM Authentication Challenge - mType: %d", IVAL(&challenge->msgType,0));
-  writeError(ERR_INFO, "NTLM Authentication Challenge - Domain: %s", GetUnicodeString(challenge,uDomain));
+  writeError(ERR_INFO, "NTLM Authentication Challenge - Domain: %s", d);
   writeError(ERR_INFO, "NTLM Authentication Challenge - Flags: %08x", IVAL(&challenge->flags,0));
   writeErrorBin(ERR_INFO, "NTLM Authentication Challenge - Challenge:", (unsigned char *)challenge->challengeData, 8);
 
   if (domainname != NULL) domain = domainname;
 
   if (host == NULL) host = "";
-  w = strdup(host);
+  w = host;
 
   if (p)
   {
@@ -1273,9 +1292,6 @@ void buildAuthResponse(tSmbNtlmAuthChallenge *challenge, tSmbNtlmAuthResponse *r
 
   if (flags != 0) challenge->flags = flags; /* Overide flags! */
     response->flags = challenge->flags;
-    
-  if(d) free(d);
-  if(u) free(u);
 }
 
 /* Debugging functions */
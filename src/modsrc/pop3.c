@@ -57,6 +57,7 @@ typedef struct __MODULE_DATA {
   int nMode;
   int nAuthType;
   char* szDomain;
+  char bufSASL[SASL_BUFFER_SIZE];
 } _MODULE_DATA;
   
 // Tells us whether we are to continue processing or not
@@ -79,6 +80,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_POP3S : PORT_POP3;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -522,39 +529,24 @@ int sendAuthUSER(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   Example:
     AUTH PLAIN dGVzdAB0ZXN0AHRlc3Q=
 */
-int sendAuthPLAIN(int hSocket, char* szLogin, char* szPassword)
+int sendAuthPLAIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
-  char* szTmpBuf = NULL;
-  char* szTmpBuf64 = NULL;
   int nSendBufferSize = 0;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating PLAIN Authentication Attempt.", MODULE_NAME);
 
   /* AUTH PLAIN B64(USERNAME\0USERNAME\0PASSWORD) */
-  nSendBufferSize = strlen(szLogin) + 1 + strlen(szLogin) + 1 + strlen(szPassword);
-  szTmpBuf = malloc(nSendBufferSize + 1);
-  memset(szTmpBuf, 0, nSendBufferSize + 1);
-  strcpy(szTmpBuf, szLogin);
-  strcpy(szTmpBuf + strlen(szLogin) + 1, szLogin);
-  strcpy(szTmpBuf + strlen(szLogin) + 1 + strlen(szLogin) + 1, szPassword);
-
-  szTmpBuf64 = malloc((2 * nSendBufferSize + 2) + 1);
-  memset(szTmpBuf64, 0, (2 * nSendBufferSize + 2) + 1);
-  base64_encode(szTmpBuf, nSendBufferSize, szTmpBuf64);
-  FREE(szTmpBuf);
-
-  bufSend = malloc(11 + strlen(szTmpBuf64) + 2 + 1); 
-  memset(bufSend, 0, 11 + strlen(szTmpBuf64) + 2 + 1);
-
-  sprintf((char*)bufSend, "AUTH PLAIN %s\r\n", szTmpBuf64);
-  FREE(szTmpBuf64);
+  nSendBufferSize = sasl_plain_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "AUTH PLAIN ", szLogin, szLogin, szPassword, "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Credentials too long for AUTH PLAIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend);
 
   return SUCCESS;
 }
@@ -568,26 +560,20 @@ int sendAuthPLAIN(int hSocket, char* szLogin, char* szPassword)
       + UGFzc3dvcmQ6      (Password:)
       YmFy                (bar)
 */
-int sendAuthLOGIN(int hSocket, char* szLogin, char* szPassword)
+int sendAuthLOGIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
   unsigned char* bufReceive = NULL;
-  unsigned char* bufSend = NULL;
-  char* szPrompt = NULL;
   char* szTmpBuf = NULL;
   int nReceiveBufferSize = 0;
+  int nSendBufferSize = 0;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating LOGIN Authentication Attempt.", MODULE_NAME);
 
   /* --- Send initial AUTH LOGIN command --- */
-  bufSend = malloc(12 + 1);
-  memset(bufSend, 0, 12 + 1);
-  sprintf((char*)bufSend, "AUTH LOGIN\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)"AUTH LOGIN\r\n", 12, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend);
 
   /* Server should respond with a base64-encoded username prompt */
   nReceiveBufferSize = 0;
@@ -604,24 +590,24 @@ int sendAuthLOGIN(int hSocket, char* szLogin, char* szPassword)
 
   szTmpBuf = index((char*)bufReceive, '\r');
   szTmpBuf[0] = '\0';
-  szPrompt = malloc(strlen((char*)bufReceive + 2) + 1);
-  memset(szPrompt, 0, strlen((char*)bufReceive + 2) + 1);
-  
-  base64_decode((char*)bufReceive + 2, szPrompt);
-  FREE(bufReceive);
 
-  writeError(ERR_DEBUG_MODULE, "[%s] POP3 server sent the following prompt: %s", MODULE_NAME, szPrompt); 
-  FREE(szPrompt);
+  if (strlen((char*)bufReceive + 2) < SASL_BUFFER_SIZE)
+  {
+    memset(_psSessionData->bufSASL, 0, strlen((char*)bufReceive + 2) + 1);
+    base64_decode((char*)bufReceive + 2, _psSessionData->bufSASL);
+    writeError(ERR_DEBUG_MODULE, "[%s] POP3 server sent the following prompt: %s", MODULE_NAME, _psSessionData->bufSASL); 
+  }
+  FREE(bufReceive);
 
   /* --- Send username --- */
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szLogin, strlen(szLogin), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Username too long for AUTH LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  /* Base64 encoded value can be up to 2x+2 original text. Leave additional space for "\r\n" and NULL */
-  bufSend = malloc((2 * strlen(szLogin) + 2) + 2 + 1);
-  memset(bufSend, 0, (2 * strlen(szLogin) + 2) + 2 + 1);
-  base64_encode(szLogin, strlen(szLogin), (char*)bufSend);
-  strcat((char*)bufSend, "\r\n");   
- 
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
@@ -636,24 +622,24 @@ int sendAuthLOGIN(int hSocket, char* szLogin, char* szPassword)
 
   szTmpBuf = index((char*)bufReceive, '\r');
   szTmpBuf[0] = '\0';
-  szPrompt = malloc(strlen((char*)bufReceive + 2) + 1);
-  memset(szPrompt, 0, strlen((char*)bufReceive + 2) + 1);
-  
-  base64_decode((char*)bufReceive + 2, szPrompt);
-  FREE(bufReceive);
 
-  writeError(ERR_DEBUG_MODULE, "[%s] POP3 server sent the following prompt: %s", MODULE_NAME, szPrompt); 
-  FREE(szPrompt);
+  if (strlen((char*)bufReceive + 2) < SASL_BUFFER_SIZE)
+  {
+    memset(_psSessionData->bufSASL, 0, strlen((char*)bufReceive + 2) + 1);
+    base64_decode((char*)bufReceive + 2, _psSessionData->bufSASL);
+    writeError(ERR_DEBUG_MODULE, "[%s] POP3 server sent the following prompt: %s", MODULE_NAME, _psSessionData->bufSASL); 
+  }
+  FREE(bufReceive);
 
   /* --- Send password --- */
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szPassword, strlen(szPassword), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Password too long for AUTH LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  /* Base64 encoded value can be up to 2x+2 original text. Leave additional space for "\r\n" and NULL */
-  bufSend = malloc((2 * strlen(szPassword) + 2) + 2 + 1);
-  memset(bufSend, 0, (2 * strlen(szPassword) + 2) + 2 + 1);
-  base64_encode(szPassword, strlen(szPassword), (char*)bufSend);
-  strcat((char*)bufSend, "\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
@@ -669,7 +655,6 @@ int sendAuthLOGIN(int hSocket, char* szLogin, char* szPassword)
 */
 int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
   unsigned char* bufReceive = NULL;
   int nReceiveBufferSize = 0;
   int nSendBufferSize = 0;
@@ -677,20 +662,14 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   tSmbNtlmAuthChallenge sTmpChall;
   tSmbNtlmAuthResponse  sTmpResp;
   char* szTmpBuf = NULL;
-  char* szTmpBuf64 = NULL;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating NTLM Authentication Attempt.", MODULE_NAME);
 
   /* --- Send initial AUTHENTICATE NTLM command --- */
-  bufSend = malloc(11 + 1);
-  memset(bufSend, 0, 11 + 1);
-  sprintf((char*)bufSend, "AUTH NTLM\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)"AUTH NTLM\r\n", 11, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend);
 
   /* Server should respond with an empty challenge, consisting simply of a "+" */
   nReceiveBufferSize = 0;
@@ -704,25 +683,19 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   /* --- Send Base-64 encoded Type-1 message --- */
   buildAuthRequest(&sTmpReq, 0, NULL, NULL);  
 
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpReq) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpReq) + 2);
-
-  base64_encode((char *)&sTmpReq, SmbLength(&sTmpReq), szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen(szTmpBuf64) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s\r\n", szTmpBuf64);
-
-  FREE(szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, (char *)&sTmpReq, SmbLength(&sTmpReq), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM request too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL);
 
-  if (medusaSend(hSocket, bufSend, strlen((char*)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
-  FREE(bufSend);
 
   /* Server should respond with a Base-64 encoded Type-2 challenge message. The challenge response format is 
      specified by RFC 1730 ("+", followed by a space, followed by the challenge message). */
@@ -744,26 +717,20 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   /* --- Calculate and send Base-64 encoded Type 3 response --- */
   buildAuthResponse(&sTmpChall, &sTmpResp, 0, szLogin, szPassword, _psSessionData->szDomain, NULL);
 
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpResp) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpResp) + 2);
-
-  base64_encode((char *)&sTmpResp, SmbLength(&sTmpResp), szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen(szTmpBuf64) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char*)bufSend, "%s\r\n", szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, (char *)&sTmpResp, SmbLength(&sTmpResp), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM response too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL);
 
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  if (medusaSend(hSocket, (unsigned char*)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
 
-  FREE(szTmpBuf64);
-  FREE(bufSend);
-
   /* Server should validate the response and indicate the result of authentication.
      e.g. +OK User successfully logged on */
 
@@ -784,11 +751,11 @@ int tryLogin(int hSocket, sLogin** psLogin, _MODULE_DATA* _psSessionData, char*
       break;
     case AUTH_PLAIN:
       writeError(ERR_DEBUG_MODULE, "[%s] Sending PLAIN Authentication.", MODULE_NAME);
-      nRet = sendAuthPLAIN(hSocket, szLogin, szPassword);
+      nRet = sendAuthPLAIN(hSocket, _psSessionData, szLogin, szPassword);
       break;
     case AUTH_LOGIN:
       writeError(ERR_DEBUG_MODULE, "[%s] Sending LOGIN Authentication.", MODULE_NAME);
-      nRet = sendAuthLOGIN(hSocket, szLogin, szPassword);
+      nRet = sendAuthLOGIN(hSocket, _psSessionData, szLogin, szPassword);
       break;
     case AUTH_NTLM:
       writeError(ERR_DEBUG_MODULE, "[%s] Sending NTLM Authentication.", MODULE_NAME);
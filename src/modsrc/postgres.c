@@ -70,6 +70,18 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL __attribute__((unused)))
+{
+  return PORT_POSTGRESQL;
+}
+
+// Tell medusa the module waits in libpq, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
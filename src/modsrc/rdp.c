@@ -33,7 +33,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "module.h"
+#include "../uthash.h"
 
 #include <freerdp/freerdp.h>
 #include <freerdp/gdi/gdi.h>
@@ -42,19 +44,46 @@
 #define MODULE_NAME    "rdp.mod"
 #define MODULE_AUTHOR  "JoMo-Kun <jmk@foofus.net>"
 #define MODULE_SUMMARY_USAGE  "Brute force module for RDP (Microsoft Terminal Server) sessions"
-#define MODULE_VERSION    "0.2"
+#define MODULE_VERSION    "0.3"
 #define MODULE_VERSION_SVN "$Id: ssh.c 1403 2010-09-01 21:41:00Z jmk $"
 #define MODULE_SUMMARY_FORMAT  "%s : version %s"
 
 #define PORT_RDP 3389
 #define NTLM_HASH_BLANK "31D6CFE0D16AE931B73C59D7E0C089C0"
 
+/* Security protocols as selected during X.224 negotiation (MS-RDPBCGR 2.2.1.2.1) */
+#define RDP_PROTOCOL_UNKNOWN 0xFFFFFFFF
+#define RDP_PROTOCOL_RDP     0x00000000
+#define RDP_PROTOCOL_TLS     0x00000001
+#define RDP_PROTOCOL_NLA     0x00000002
+
+/*
+  Negotiation result for a host, shared by all login threads. Once known, later
+  connections offer only the selected protocol instead of the full RDP/TLS/NLA set.
+*/
+typedef struct __RDP_HOST {
+  char *szHostIP;                   /* key */
+  UINT32 nProtocol;                 /* RDP_PROTOCOL_* selected by the server */
+  UT_hash_handle hh;
+} _RDP_HOST;
+
 typedef struct __MODULE_DATA {
   char* szDomain;
   int isPassTheHash;
   int isBlankPassword;
+  _RDP_HOST *psHost;
 } _MODULE_DATA;
 
+static _RDP_HOST *psHostTable = NULL;
+static pthread_mutex_t ptmHostTable = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Each login thread keeps its FreeRDP instance between attempts and between
+  hosts. The instance is released when the thread exits.
+*/
+static pthread_key_t pkInstance;
+static pthread_once_t onceInstance = PTHREAD_ONCE_INIT;
+
 // Tells us whether we are to continue processing or not
 enum MODULE_STATE
 {
@@ -67,8 +96,13 @@ enum MODULE_STATE
 // Forward declarations
 int tryLogin(_MODULE_DATA* _psSessionData, sLogin** login, freerdp* instance, char* szLogin, char* szPassword);
 int initModule(sLogin* login, _MODULE_DATA *_psSessionData);
+_RDP_HOST* getHostInfo(char *szHostIP);
+freerdp* getInstance();
+void freeInstance(void *pInstance);
+void prepareInstance(freerdp* instance, sLogin* psLogin, _MODULE_DATA *_psSessionData);
+void resetInstance(freerdp* instance);
 
-void initWLog();
+void initInstanceKey();
 static BOOL tf_context_new(freerdp* instance, rdpContext* context);
 static void tf_context_free(freerdp* instance, rdpContext* context);
 static BOOL tf_begin_paint(rdpContext* context);
@@ -92,6 +126,18 @@ int getParamNumber()
   return 0;
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL __attribute__((unused)))
+{
+  return PORT_RDP;
+}
+
+// Tell medusa the module waits in FreeRDP, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -198,8 +244,7 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
 {
   enum MODULE_STATE nState = MSTATE_NEW;
   sCredentialSet *psCredSet = NULL;
-  freerdp* instance;
-  wLog *root;
+  freerdp* instance = NULL;
 
   /* Retrieve next available credential set to test */
   psCredSet = malloc( sizeof(sCredentialSet) );
@@ -220,42 +265,39 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
     nState = MSTATE_COMPLETE;
   }
 
+  _psSessionData->psHost = getHostInfo(psLogin->psServer->pHostIP);
+
   while (nState != MSTATE_COMPLETE)
   {
     switch (nState)
     {
       case MSTATE_NEW:
-        /* Suppress FreeRDP library FreeRDP output */
-        root = WLog_GetRoot();
-        if ((iVerboseLevel <= 5) && (iErrorLevel <= 5))
-          WLog_SetStringLogLevel(root, "OFF");
-        else
-          WLog_SetStringLogLevel(root, "INFO");
-
-        instance = freerdp_new();
-        instance->PreConnect = (signed int (*)(struct rdp_freerdp *))tf_pre_connect;
-        instance->PostConnect = (signed int (*)(struct rdp_freerdp *))tf_post_connect;
-        instance->ContextSize = sizeof(tfContext);
-        instance->ContextNew = tf_context_new;
-        instance->ContextFree = tf_context_free;
-
-        freerdp_context_new(instance);
+        instance = getInstance();
+        if (instance == NULL)
+        {
+          writeError(ERR_ERROR, "[%s] Failed to initialize FreeRDP instance.", MODULE_NAME);
+          psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+          FREE(psCredSet);
+          return FAILURE;
+        }
 
-        instance->settings->IgnoreCertificate = TRUE;
-        instance->settings->AuthenticationOnly = TRUE;
-        instance->settings->ServerHostname = psLogin->psServer->pHostIP;
+        prepareInstance(instance, psLogin, _psSessionData);
 
-        if (psLogin->psServer->psAudit->iPortOverride > 0)
-          instance->settings->ServerPort = psLogin->psServer->psAudit->iPortOverride;
-        else
-          instance->settings->ServerPort = PORT_RDP;
-
-        writeError(ERR_DEBUG_MODULE, "Id: %d initialized FreeRDP instance.", psLogin->iId);
+        writeError(ERR_DEBUG_MODULE, "Id: %d prepared FreeRDP instance.", psLogin->iId);
         nState = MSTATE_RUNNING;
         break;
       case MSTATE_RUNNING:
         nState = tryLogin(_psSessionData, &psLogin, instance, psCredSet->psUser->pUser, psCredSet->pPass);
 
+        /* FreeRDP session needs to be rebuilt following blank password logon attempt. */
+        if (_psSessionData->isBlankPassword)
+        {
+          _psSessionData->isBlankPassword = FALSE;
+          pthread_setspecific(pkInstance, NULL);
+          freeInstance(instance);
+          instance = NULL;
+        }
+
         if (getNextCredSet(psLogin, psCredSet) == FAILURE)
         {
           writeError(ERR_ERROR, "[%s] Error retrieving next credential set to test.", MODULE_NAME);
@@ -276,23 +318,26 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
           else
             writeError(ERR_DEBUG_MODULE, "[%s] Next credential set - user: %s password: %s", MODULE_NAME, psCredSet->psUser->pUser, psCredSet->pPass);
 
-            /* FreeRDP session needs to be reset following blank password logon attempt. */ 
-            if (_psSessionData->isBlankPassword) {
-              _psSessionData->isBlankPassword = FALSE;
-              nState = MSTATE_NEW;
-            }
+          if ((instance == NULL) && (nState == MSTATE_RUNNING))
+            nState = MSTATE_NEW;
         }
 
         break;
       case MSTATE_EXITING:
-        freerdp_free(instance);
+        /* The instance stays with this thread; drop references to host data that is about to go away */
+        if (instance)
+          instance->settings->ServerHostname = NULL;
+
         nState = MSTATE_COMPLETE;
         break;
       default:
         writeError(ERR_CRITICAL, "Unknown %s module state %d", MODULE_NAME, nState);
 
-        freerdp_free(instance);
+        if (instance)
+          instance->settings->ServerHostname = NULL;
+
         psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+        FREE(psCredSet);
 
         return FAILURE;
     }
@@ -304,6 +349,144 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
 
 /* Module Specific Functions */
 
+/* Look up (or create) the shared negotiation record for a host */
+_RDP_HOST* getHostInfo(char *szHostIP)
+{
+  _RDP_HOST *psHost = NULL;
+
+  pthread_mutex_lock(&ptmHostTable);
+
+  HASH_FIND_STR(psHostTable, szHostIP, psHost);
+  if (psHost == NULL)
+  {
+    psHost = malloc(sizeof(_RDP_HOST));
+    memset(psHost, 0, sizeof(_RDP_HOST));
+    psHost->szHostIP = strdup(szHostIP);
+    psHost->nProtocol = RDP_PROTOCOL_UNKNOWN;
+    HASH_ADD_KEYPTR(hh, psHostTable, psHost->szHostIP, strlen(psHost->szHostIP), psHost);
+  }
+
+  pthread_mutex_unlock(&ptmHostTable);
+
+  return psHost;
+}
+
+void initInstanceKey()
+{
+  wLog *root;
+
+  pthread_key_create(&pkInstance, freeInstance);
+
+  /* Suppress FreeRDP library FreeRDP output */
+  root = WLog_GetRoot();
+  if ((iVerboseLevel <= 5) && (iErrorLevel <= 5))
+    WLog_SetStringLogLevel(root, "OFF");
+  else
+    WLog_SetStringLogLevel(root, "INFO");
+}
+
+/* Return this thread's FreeRDP instance, creating it on first use */
+freerdp* getInstance()
+{
+  freerdp* instance;
+
+  pthread_once(&onceInstance, initInstanceKey);
+
+  instance = pthread_getspecific(pkInstance);
+  if (instance)
+    return instance;
+
+  instance = freerdp_new();
+  if (instance == NULL)
+    return NULL;
+
+  instance->PreConnect = (signed int (*)(struct rdp_freerdp *))tf_pre_connect;
+  instance->PostConnect = (signed int (*)(struct rdp_freerdp *))tf_post_connect;
+  instance->ContextSize = sizeof(tfContext);
+  instance->ContextNew = tf_context_new;
+  instance->ContextFree = tf_context_free;
+
+  if (!freerdp_context_new(instance))
+  {
+    freerdp_free(instance);
+    return NULL;
+  }
+
+  instance->settings->IgnoreCertificate = TRUE;
+  instance->settings->AuthenticationOnly = TRUE;
+
+  pthread_setspecific(pkInstance, instance);
+  writeError(ERR_DEBUG_MODULE, "[%s] Initialized FreeRDP instance for thread.", MODULE_NAME);
+
+  return instance;
+}
+
+void freeInstance(void *pInstance)
+{
+  freerdp* instance = (freerdp*)pInstance;
+
+  if (instance == NULL)
+    return;
+
+  /* Strings below are owned by medusa, not by the FreeRDP settings */
+  resetInstance(instance);
+  instance->settings->ServerHostname = NULL;
+
+  freerdp_context_free(instance);
+  freerdp_free(instance);
+}
+
+/* Point the instance at the current host, offering only the security protocol it is known to select */
+void prepareInstance(freerdp* instance, sLogin* psLogin, _MODULE_DATA *_psSessionData)
+{
+  rdpSettings* settings = instance->settings;
+  UINT32 nProtocol;
+
+  settings->ServerHostname = psLogin->psServer->pHostIP;
+
+  if (psLogin->psServer->psAudit->iPortOverride > 0)
+    settings->ServerPort = psLogin->psServer->psAudit->iPortOverride;
+  else
+    settings->ServerPort = PORT_RDP;
+
+  pthread_mutex_lock(&ptmHostTable);
+  nProtocol = _psSessionData->psHost->nProtocol;
+  pthread_mutex_unlock(&ptmHostTable);
+
+  if (nProtocol == RDP_PROTOCOL_UNKNOWN)
+  {
+    settings->RdpSecurity = TRUE;
+    settings->TlsSecurity = TRUE;
+    settings->NlaSecurity = TRUE;
+  }
+  else
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Using cached security protocol %u for host: %s", MODULE_NAME, nProtocol, psLogin->psServer->pHostIP);
+    settings->RdpSecurity = (nProtocol == RDP_PROTOCOL_RDP);
+    settings->TlsSecurity = (nProtocol == RDP_PROTOCOL_TLS);
+    settings->NlaSecurity = (nProtocol == RDP_PROTOCOL_NLA);
+  }
+  settings->ExtSecurity = FALSE;
+}
+
+/* Return the instance to a clean state between attempts */
+void resetInstance(freerdp* instance)
+{
+  rdpSettings* settings = instance->settings;
+
+  freerdp_disconnect(instance);
+
+  if (instance->context->gdi)
+    gdi_free(instance);
+
+  settings->Username = NULL;
+  settings->Domain = NULL;
+  settings->Password = NULL;
+  settings->PasswordHash = NULL;
+  settings->ConsoleSession = FALSE;
+  settings->RestrictedAdminModeRequired = FALSE;
+}
+
 static BOOL tf_context_new(freerdp* instance, rdpContext* context)
 {
   return TRUE;
@@ -468,9 +651,29 @@ int tryLogin(_MODULE_DATA* _psSessionData, sLogin** psLogin, freerdp* instance,
     _psSessionData->isBlankPassword = TRUE;
   }
 
+  instance->settings->SelectedProtocol = RDP_PROTOCOL_UNKNOWN;
+
   nRet = freerdp_connect(instance);
 
   writeError(ERR_DEBUG_MODULE, "[%s] freerdp_connect exit code: %d", MODULE_NAME, nRet);
+
+  /* Remember the protocol the server selected so later connections skip the fallback rounds */
+  switch (instance->settings->SelectedProtocol)
+  {
+    case RDP_PROTOCOL_RDP:
+    case RDP_PROTOCOL_TLS:
+    case RDP_PROTOCOL_NLA:
+      pthread_mutex_lock(&ptmHostTable);
+      if (_psSessionData->psHost->nProtocol == RDP_PROTOCOL_UNKNOWN)
+      {
+        _psSessionData->psHost->nProtocol = instance->settings->SelectedProtocol;
+        writeError(ERR_DEBUG_MODULE, "[%s] Server selected security protocol: %u", MODULE_NAME, instance->settings->SelectedProtocol);
+      }
+      pthread_mutex_unlock(&ptmHostTable);
+      break;
+    default:
+      break;
+  }
   if (nRet == 1)
   {
     writeError(ERR_DEBUG_MODULE, "[%s] Login attempt successful.", MODULE_NAME);
@@ -529,6 +732,8 @@ int tryLogin(_MODULE_DATA* _psSessionData, sLogin** psLogin, freerdp* instance,
     }
   }
 
+  resetInstance(instance);
+
   setPassResult((*psLogin), szPassword);
   return(nRet);
 }
@@ -61,6 +61,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL __attribute__((unused)))
+{
+  return PORT_REXEC;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -122,6 +122,35 @@
 #define AUTH_NTLM 13
 #define AUTH_LMv2 14
 #define AUTH_NTLMv2 15
+#define SMB_VERSION_AUTO 16
+#define SMB_VERSION_1 17
+#define SMB_VERSION_2 18
+
+#define SMB2_SESSIONS_DEFAULT 8
+#define SMB2_SESSIONS_MAX 64
+
+#define SMB2_HEADER_SIZE 64
+#define SMB2_NEGOTIATE 0x0000
+#define SMB2_SESSION_SETUP 0x0001
+#define SMB2_TREE_CONNECT 0x0003
+#define SMB2_FLAGS_ASYNC_COMMAND 0x00000002
+#define SMB2_NEGOTIATE_SIGNING_REQUIRED 0x0002
+#define SMB2_SESSION_FLAG_IS_GUEST 0x0001
+#define SMB2_SESSION_FLAG_IS_NULL 0x0002
+
+#define STATUS_PENDING 0x00000103
+#define STATUS_MORE_PROCESSING_REQUIRED 0xC0000016
+#define STATUS_UNKNOWN 0xFFFFFFFF
+
+/* NEGOTIATE_UNICODE | REQUEST_TARGET | NEGOTIATE_NTLM | NEGOTIATE_ALWAYS_SIGN */
+#define NTLMSSP_FLAGS 0x00008205
+
+/* Progress of an authentication multiplexed over the SMB2 connection */
+#define SMB2_AUTH_QUEUED 0
+#define SMB2_AUTH_NEGOTIATE 1
+#define SMB2_AUTH_CHALLENGE 2
+#define SMB2_AUTH_AUTHENTICATE 3
+#define SMB2_AUTH_DONE 4
 
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
@@ -144,6 +173,16 @@
 #define TIME_FIXUP_CONSTANT_INT 11644473600LL
 #endif
 
+typedef struct __SMB2_AUTH {
+  sCredentialSet sCredSet;
+  unsigned long long nMessageId;    /* request awaiting a response */
+  unsigned long long nSessionId;    /* assigned by the server in the first SESSION_SETUP response */
+  unsigned char challenge[8];
+  unsigned int nStatus;
+  int nSessionFlags;
+  int nState;
+} _SMB2_AUTH;
+
 typedef struct __SMBNT_DATA {
   unsigned char challenge[8];
   char workgroup[16];
@@ -154,6 +193,15 @@ typedef struct __SMBNT_DATA {
   int hashFlag;
   int accntFlag;
   int protoFlag;
+  int smbVersion;
+  int nSessions;                    /* SMB2 authentications in flight per connection */
+  int nSigningRequired;
+  int nCredits;                     /* SMB2 credits granted by the server and not yet used */
+  unsigned long long nMessageId;
+  unsigned char *bufSMB2;           /* received data not yet consumed as a complete message */
+  int nSMB2Length;
+  _SMB2_AUTH *psAuth;
+  int nAuthQueued;
 } _SMBNT_DATA;
 
 // Tells us whether we are to continue processing or not
@@ -172,6 +220,11 @@ char* parseFullyQualifiedUsername(_SMBNT_DATA *_psSessionData, char* szLogin);
 int NBSSessionRequest(int hSocket, _SMBNT_DATA* _psSessionData);
 int NBSTATQuery(sLogin *_psLogin,_SMBNT_DATA* _psSessionData);
 int SMBNegProt(int hSocket, _SMBNT_DATA* _psSessionData);
+void setWorkgroup(_SMBNT_DATA *_psSessionData);
+int reportResult(sLogin** psLogin, _SMBNT_DATA* _psSessionData, unsigned long SMBSessionRet, char* szPassword);
+int SMB2Negotiate(int hSocket, _SMBNT_DATA* _psSessionData);
+void requeueSMB2(sLogin *psLogin, _SMBNT_DATA *_psSessionData);
+int tryLoginSMB2(int hSocket, sLogin** psLogin, _SMBNT_DATA* _psSessionData, sCredentialSet *psCredSet);
 
 extern void hmac_md5_init_limK_to_64(const unsigned char* key, int key_len, HMACMD5Context *ctx);
 extern void hmac_md5_update(const unsigned char *text, int text_len, HMACMD5Context *ctx);
@@ -183,6 +236,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL __attribute__((unused)))
+{
+  return PORT_SMBNT;    // NetBIOS-only (139/tcp) hosts need -n 139
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -231,6 +290,12 @@ void showUsage()
   writeVerbose(VB_NONE, "    Default mode is to test TCP/445 using Native Win2000. If this fails, module will");
   writeVerbose(VB_NONE, "    fall back to TCP/139 using NetBIOS mode. To test only TCP/139, use the following:");
   writeVerbose(VB_NONE, "    medusa -M smbnt -m NETBIOS -n 139");
+  writeVerbose(VB_NONE, "  PROTO:?  (AUTO*, SMB1, SMB2)");
+  writeVerbose(VB_NONE, "    SMB protocol version. AUTO uses SMB1 and falls back to SMB2/3 if the server refuses");
+  writeVerbose(VB_NONE, "    SMB1 negotiation. SMB2 performs several NTLMSSP authentications in parallel over");
+  writeVerbose(VB_NONE, "    a single connection.");
+  writeVerbose(VB_NONE, "  SESSIONS:? ");
+  writeVerbose(VB_NONE, "    Number of SMB2 authentications in flight per connection. Default: %d, Maximum: %d", SMB2_SESSIONS_DEFAULT, SMB2_SESSIONS_MAX);
   writeVerbose(VB_NONE, "\n(*) Default value");
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "Usage examples:");
@@ -273,7 +338,7 @@ int go(sLogin* logins, int argc, char *argv[])
   psSessionData = malloc(sizeof(_SMBNT_DATA));  
   memset(psSessionData, 0, sizeof(_SMBNT_DATA));
 
-  if ((argc < 0) || (argc > 5))
+  if ((argc < 0) || (argc > 7))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -286,6 +351,8 @@ int go(sLogin* logins, int argc, char *argv[])
     psSessionData->accntFlag = LOCAL;
     psSessionData->hashFlag = PASSWORD;
     psSessionData->protoFlag = WIN2000_NATIVEMODE;
+    psSessionData->smbVersion = SMB_VERSION_AUTO;
+    psSessionData->nSessions = SMB2_SESSIONS_DEFAULT;
 
     for (i=0; i<argc; i++) {
       pOptTmp = strdup(argv[i]);
@@ -362,6 +429,34 @@ int go(sLogin* logins, int argc, char *argv[])
       {
         psSessionData->protoFlag = WIN_NETBIOSMODE;
       }
+      else if (strcmp(pOpt, "PROTO") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if (pOpt == NULL)
+          writeError(ERR_WARNING, "Method PROTO requires value to be set.");
+        else if (strcmp(pOpt, "AUTO") == 0)
+          psSessionData->smbVersion = SMB_VERSION_AUTO;
+        else if (strcmp(pOpt, "SMB1") == 0)
+          psSessionData->smbVersion = SMB_VERSION_1;
+        else if (strcmp(pOpt, "SMB2") == 0)
+          psSessionData->smbVersion = SMB_VERSION_2;
+        else
+          writeError(ERR_WARNING, "Invalid value for method PROTO.");
+      }
+      else if (strcmp(pOpt, "SESSIONS") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if (pOpt == NULL)
+          writeError(ERR_WARNING, "Method SESSIONS requires value to be set.");
+        else if ((atoi(pOpt) < 1) || (atoi(pOpt) > SMB2_SESSIONS_MAX))
+          writeError(ERR_WARNING, "Invalid value for method SESSIONS (1 - %d).", SMB2_SESSIONS_MAX);
+        else
+          psSessionData->nSessions = atoi(pOpt);
+      }
       else 
       {
         writeError(ERR_WARNING, "Invalid method: %s.", pOpt);
@@ -373,6 +468,8 @@ int go(sLogin* logins, int argc, char *argv[])
     initModule(logins, psSessionData);
   }  
 
+  FREE(psSessionData->psAuth);
+  FREE(psSessionData->bufSMB2);
   FREE(psSessionData);
   return SUCCESS;
 }
@@ -413,6 +510,13 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
   
   initConnectionParams(psLogin, &params);
 
+  /* MACHINE mode tests a single value, so there is nothing to multiplex */
+  if (_psSessionData->hashFlag == MACHINE_NAME)
+    _psSessionData->nSessions = 1;
+
+  _psSessionData->psAuth = malloc(_psSessionData->nSessions * sizeof(_SMB2_AUTH));
+  memset(_psSessionData->psAuth, 0, _psSessionData->nSessions * sizeof(_SMB2_AUTH));
+
   while (nState != MSTATE_COMPLETE)
   {  
     switch (nState)
@@ -438,6 +542,7 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
         if (hSocket < 0) 
         {
           writeError(ERR_ERROR, "%s: failed to connect, port %d was not open on %s", MODULE_NAME, params.nPort, psLogin->psServer->pHostIP);
+          requeueSMB2(psLogin, _psSessionData);
           psLogin->iResult = LOGIN_RESULT_UNKNOWN;
           return FAILURE;
         }
@@ -450,15 +555,39 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
         
         if (NBSSessionRequest(hSocket, _psSessionData) < 0) {
           writeError(ERR_ERROR, "Session Setup Failed with host: %s. Is the server service running?", psLogin->psServer->pHostIP);
+          requeueSMB2(psLogin, _psSessionData);
           psLogin->iResult = LOGIN_RESULT_UNKNOWN;
           return FAILURE;
         }
         
-        if (SMBNegProt(hSocket, _psSessionData) < 0)
+        if (_psSessionData->smbVersion == SMB_VERSION_2)
         {
-          writeError(ERR_ERROR, "SMB Protocol Negotiation Failed with host: %s", psLogin->psServer->pHostIP);
-          psLogin->iResult = LOGIN_RESULT_UNKNOWN;
-          return FAILURE;
+          if (SMB2Negotiate(hSocket, _psSessionData) == FAILURE)
+          {
+            writeError(ERR_ERROR, "SMB2 Protocol Negotiation Failed with host: %s", psLogin->psServer->pHostIP);
+            requeueSMB2(psLogin, _psSessionData);
+            psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+            return FAILURE;
+          }
+          else {
+            nState = MSTATE_RUNNING;
+          }
+        }
+        else if (SMBNegProt(hSocket, _psSessionData) < 0)
+        {
+          /* Hosts with SMB1 disabled drop the connection in response to the SMB1 negotiation */
+          if (_psSessionData->smbVersion == SMB_VERSION_AUTO)
+          {
+            writeError(ERR_NOTICE, "%s: SMB1 Protocol Negotiation Failed with host: %s. Attempting SMB2.", MODULE_NAME, psLogin->psServer->pHostIP);
+            _psSessionData->smbVersion = SMB_VERSION_2;
+            nState = MSTATE_NEW;
+          }
+          else
+          {
+            writeError(ERR_ERROR, "SMB Protocol Negotiation Failed with host: %s", psLogin->psServer->pHostIP);
+            psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+            return FAILURE;
+          }
         }
         else {
           nState = MSTATE_RUNNING;
@@ -466,6 +595,13 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
         
         break;
       case MSTATE_RUNNING:
+        /* SMB2 retrieves and reports credential sets itself, as several are tested at once */
+        if (_psSessionData->smbVersion == SMB_VERSION_2)
+        {
+          nState = tryLoginSMB2(hSocket, &psLogin, _psSessionData, psCredSet);
+          break;
+        }
+
         nState = tryLogin(hSocket, &psLogin, _psSessionData, szUser, psCredSet->pPass);
         
         if (psLogin->iResult != LOGIN_RESULT_UNKNOWN)
@@ -495,6 +631,8 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
         }
         break;
       case MSTATE_EXITING:
+        requeueSMB2(psLogin, _psSessionData);
+
         if (hSocket > 0)
           medusaDisconnect(hSocket);
         hSocket = -1;
@@ -502,6 +640,7 @@ int initModule(sLogin* psLogin, _SMBNT_DATA *_psSessionData)
         break;
       default:
         writeError(ERR_CRITICAL, "Unknown %s module (%d) state %d host: %s", MODULE_NAME, psLogin->iId, nState, psLogin->psServer->pHostIP);
+        requeueSMB2(psLogin, _psSessionData);
         if (hSocket > 0)
           medusaDisconnect(hSocket);
         hSocket = -1;
@@ -1409,6 +1548,18 @@ int SMBNegProt(int hSocket, _SMBNT_DATA* _psSessionData)
 }
 
 
+/* Set the workgroup used for authentication based on the GROUP/GROUP_OTHER options */
+void setWorkgroup(_SMBNT_DATA *_psSessionData)
+{
+  if (_psSessionData->accntFlag == LOCAL) {
+    strcpy((char *) _psSessionData->workgroup, "localhost");
+  } else if (_psSessionData->accntFlag == BOTH) {
+    memset(_psSessionData->workgroup, 0, 16);
+  } else if (_psSessionData->accntFlag == OTHER) {
+    strncpy(_psSessionData->workgroup, _psSessionData->workgroup_other, 16);
+  }
+}
+
 /*
   SMBSessionSetup
   Function: Send username + response to the challenge from
@@ -1430,13 +1581,7 @@ unsigned long SMBSessionSetup(int hSocket, sLogin** psLogin, _SMBNT_DATA *_psSes
   unsigned char szPath[256];
   unsigned long SMBSessionRet;
   
-  if (_psSessionData->accntFlag == LOCAL) {
-    strcpy((char *) _psSessionData->workgroup, "localhost");
-  } else if (_psSessionData->accntFlag == BOTH) {
-    memset(_psSessionData->workgroup, 0, 16);
-  } else if (_psSessionData->accntFlag == OTHER) {
-    strncpy(_psSessionData->workgroup, _psSessionData->workgroup_other, 16);
-  }
+  setWorkgroup(_psSessionData);
 
   /* NetBIOS Session Service */
   unsigned char szNBSS[4] = {
@@ -1757,8 +1902,21 @@ unsigned long SMBSessionSetup(int hSocket, sLogin** psLogin, _SMBNT_DATA *_psSes
 
 int tryLogin(int hSocket, sLogin** psLogin, _SMBNT_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  int SMBerr, SMBaction;
   unsigned long SMBSessionRet;
+
+  SMBSessionRet = SMBSessionSetup(hSocket, psLogin, _psSessionData, szLogin, szPassword);
+
+  return reportResult(psLogin, _psSessionData, SMBSessionRet, szPassword);
+}
+
+/*
+  Map the outcome of an authentication attempt to a login result. SMBSessionRet
+  holds the lower 24 bits of the NT status code, and the guest (action) flag 
+  within the upper byte.
+*/
+int reportResult(sLogin** psLogin, _SMBNT_DATA* _psSessionData, unsigned long SMBSessionRet, char* szPassword)
+{
+  int SMBerr, SMBaction;
   char *pErrorMsg = NULL;
   char ErrorCode[10];
   int iRet;
@@ -1822,7 +1980,6 @@ int tryLogin(int hSocket, sLogin** psLogin, _SMBNT_DATA* _psSessionData, char* s
 
   memset(&ErrorCode, 0, 10);
 
-  SMBSessionRet = SMBSessionSetup(hSocket, psLogin, _psSessionData, szLogin, szPassword);
   SMBerr = (unsigned long) SMBSessionRet & 0x00FFFFFF;
   SMBaction = ((unsigned long) SMBSessionRet & 0xFF000000) >> 24;
 
@@ -1933,6 +2090,785 @@ int tryLogin(int hSocket, sLogin** psLogin, _SMBNT_DATA* _psSessionData, char* s
   return(iRet);
 }
 
+
+/*
+  SMB2/3 Support
+
+  SMB2 allows a client to run several SESSION_SETUP exchanges over a single
+  connection at the same time. Each is matched to its response by MessageId,
+  and the server assigns every new authentication its own SessionId. The
+  dialect is negotiated once per connection, after which up to nSessions
+  NTLMSSP authentications are kept in flight, limited by the credits granted
+  by the server. The LM/NTLM/LMv2 response calculations used by the SMB1 code
+  are reused for the NTLMSSP AUTHENTICATE message.
+
+  Security signatures are not supported. If the server requires signing, the
+  ADMIN$ access check is skipped for valid credentials.
+*/
+
+static void smb2Put16(unsigned char *p, unsigned int nValue)
+{
+  p[0] = nValue & 0xFF;
+  p[1] = (nValue >> 8) & 0xFF;
+}
+
+static void smb2Put32(unsigned char *p, unsigned int nValue)
+{
+  smb2Put16(p, nValue & 0xFFFF);
+  smb2Put16(p + 2, (nValue >> 16) & 0xFFFF);
+}
+
+static void smb2Put64(unsigned char *p, unsigned long long nValue)
+{
+  smb2Put32(p, nValue & 0xFFFFFFFF);
+  smb2Put32(p + 4, (nValue >> 32) & 0xFFFFFFFF);
+}
+
+static unsigned int smb2Get16(unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned int smb2Get32(unsigned char *p)
+{
+  return smb2Get16(p) | (smb2Get16(p + 2) << 16);
+}
+
+static unsigned long long smb2Get64(unsigned char *p)
+{
+  return smb2Get32(p) | ((unsigned long long) smb2Get32(p + 4) << 32);
+}
+
+/* Convert an ASCII string to UTF-16LE. Returns the length in bytes. */
+static int smb2Unicode(unsigned char *pDst, char *szSrc, int nMax)
+{
+  int i;
+
+  for (i = 0; (szSrc[i] != '\0') && (i < nMax); i++)
+  {
+    pDst[i * 2] = (unsigned char) szSrc[i];
+    pDst[i * 2 + 1] = 0x00;
+  }
+
+  return i * 2;
+}
+
+/*
+  Fill in the NetBIOS session service header and SMB2 header of a request.
+  Every request consumes one credit and is assigned the next MessageId.
+*/
+unsigned long long SMB2Header(_SMBNT_DATA *_psSessionData, unsigned char *buf, int nCommand, unsigned long long nSessionId)
+{
+  unsigned long long nMessageId = _psSessionData->nMessageId++;
+
+  memset(buf, 0, 4 + SMB2_HEADER_SIZE);
+  memcpy(buf + 4, "\xfeSMB", 4);                        /* ProtocolId */
+  smb2Put16(buf + 8, SMB2_HEADER_SIZE);                 /* StructureSize */
+  smb2Put16(buf + 10, 1);                               /* CreditCharge */
+  smb2Put16(buf + 16, nCommand);                        /* Command */
+  smb2Put16(buf + 18, _psSessionData->nSessions * 2);   /* CreditRequest */
+  smb2Put64(buf + 28, nMessageId);                      /* MessageId */
+  smb2Put32(buf + 36, 0x0000FEFF);                      /* ProcessId */
+  smb2Put64(buf + 44, nSessionId);                      /* SessionId */
+
+  _psSessionData->nCredits--;
+
+  return nMessageId;
+}
+
+/* Set the NetBIOS session service length. Returns the length of the complete message. */
+static int SMB2Frame(unsigned char *buf, int nLength)
+{
+  buf[0] = 0x00;
+  buf[1] = ((nLength - 4) >> 16) & 0xFF;
+  buf[2] = ((nLength - 4) >> 8) & 0xFF;
+  buf[3] = (nLength - 4) & 0xFF;
+
+  return nLength;
+}
+
+/*
+  Retrieve the next complete SMB2 message from the connection. Data following
+  the message is held until the next call. The caller is responsible for 
+  freeing the returned message (less its NetBIOS session service header).
+*/
+int SMB2Receive(int hSocket, _SMBNT_DATA* _psSessionData, unsigned char **bufMessage, int *nMessageSize)
+{
+  unsigned char *bufReceive = NULL;
+  int nReceiveBufferSize = 0;
+  int nLength;
+
+  while (1)
+  {
+    if (_psSessionData->nSMB2Length >= 4)
+    {
+      nLength = (_psSessionData->bufSMB2[1] << 16) | (_psSessionData->bufSMB2[2] << 8) | _psSessionData->bufSMB2[3];
+
+      if (_psSessionData->nSMB2Length >= 4 + nLength)
+      {
+        /* Session keep-alive and other non-message packets are discarded */
+        if ((_psSessionData->bufSMB2[0] == 0x00) && (nLength >= SMB2_HEADER_SIZE) && (memcmp(_psSessionData->bufSMB2 + 4, "\xfeSMB", 4) == 0))
+        {
+          *bufMessage = malloc(nLength);
+          memcpy(*bufMessage, _psSessionData->bufSMB2 + 4, nLength);
+          *nMessageSize = nLength;
+        }
+        else
+        {
+          writeError(ERR_DEBUG_MODULE, "[%s] Discarding non-SMB2 packet (type: 0x%2.2X length: %d).", MODULE_NAME, _psSessionData->bufSMB2[0], nLength);
+          *bufMessage = NULL;
+        }
+
+        _psSessionData->nSMB2Length -= 4 + nLength;
+        memmove(_psSessionData->bufSMB2, _psSessionData->bufSMB2 + 4 + nLength, _psSessionData->nSMB2Length);
+
+        if (*bufMessage)
+          return SUCCESS;
+        continue;
+      }
+    }
+
+    nReceiveBufferSize = 0;
+    bufReceive = medusaReceiveRaw(hSocket, &nReceiveBufferSize);
+    if ((bufReceive == NULL) || (nReceiveBufferSize == 0))
+    {
+      FREE(bufReceive);
+      return FAILURE;
+    }
+
+    _psSessionData->bufSMB2 = realloc(_psSessionData->bufSMB2, _psSessionData->nSMB2Length + nReceiveBufferSize);
+    memcpy(_psSessionData->bufSMB2 + _psSessionData->nSMB2Length, bufReceive, nReceiveBufferSize);
+    _psSessionData->nSMB2Length += nReceiveBufferSize;
+    FREE(bufReceive);
+  }
+}
+
+/*
+  SMB2Negotiate
+  Function: Negotiate a SMB 2.0.2, 2.1, 3.0 or 3.0.2 dialect. SMB 3.1.1 is not
+  offered as it requires pre-authentication integrity over every message.
+*/
+int SMB2Negotiate(int hSocket, _SMBNT_DATA* _psSessionData)
+{
+  unsigned char buf[4 + SMB2_HEADER_SIZE + 36 + 8];
+  unsigned char *bufReceive = NULL;
+  unsigned char *p;
+  int nReceiveBufferSize = 0;
+  unsigned int nDialects[] = { 0x0202, 0x0210, 0x0300, 0x0302 };
+  unsigned int i;
+
+  _psSessionData->nMessageId = 0;
+  _psSessionData->nCredits = 1;
+  _psSessionData->nSMB2Length = 0;
+
+  SMB2Header(_psSessionData, buf, SMB2_NEGOTIATE, 0);
+
+  p = buf + 4 + SMB2_HEADER_SIZE;
+  memset(p, 0, 36 + 8);
+  smb2Put16(p, 36);                                     /* StructureSize */
+  smb2Put16(p + 2, sizeof(nDialects) / sizeof(nDialects[0])); /* DialectCount */
+  smb2Put16(p + 4, 0x0001);                             /* SecurityMode: Signing enabled */
+  memcpy(p + 12, "MEDUSA-SMB2-AUTH", 16);               /* ClientGuid */
+
+  for (i = 0; i < sizeof(nDialects) / sizeof(nDialects[0]); i++)
+    smb2Put16(p + 36 + i * 2, nDialects[i]);
+
+  if (medusaSend(hSocket, buf, SMB2Frame(buf, sizeof(buf)), 0) < 0)
+  {
+    writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
+    return FAILURE;
+  }
+
+  if (SMB2Receive(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize) == FAILURE)
+    return FAILURE;
+
+  if ((nReceiveBufferSize < SMB2_HEADER_SIZE + 64) || (smb2Get16(bufReceive + 12) != SMB2_NEGOTIATE) || (smb2Get32(bufReceive + 8) != 0))
+  {
+    writeError(ERR_ERROR, "%s: Unexpected SMB2 NEGOTIATE response (status: 0x%8.8X).", MODULE_NAME, (nReceiveBufferSize >= SMB2_HEADER_SIZE) ? smb2Get32(bufReceive + 8) : 0);
+    FREE(bufReceive);
+    return FAILURE;
+  }
+
+  _psSessionData->nCredits += smb2Get16(bufReceive + 14);
+
+  p = bufReceive + SMB2_HEADER_SIZE;
+  _psSessionData->nSigningRequired = (smb2Get16(p + 2) & SMB2_NEGOTIATE_SIGNING_REQUIRED) ? TRUE : FALSE;
+
+  writeVerbose(VB_GENERAL, "%s: Negotiated SMB dialect: %d.%d.%d", MODULE_NAME, (smb2Get16(p + 4) >> 8) & 0x0F, (smb2Get16(p + 4) >> 4) & 0x0F, smb2Get16(p + 4) & 0x0F);
+  if (_psSessionData->nSigningRequired)
+    writeVerbose(VB_GENERAL, "%s: Server requires security signatures. ADMIN$ access will not be tested.", MODULE_NAME);
+
+  FREE(bufReceive);
+  return SUCCESS;
+}
+
+/* Length of a DER identifier and length header for a value of nLength bytes */
+static int asn1HeaderLength(int nLength)
+{
+  if (nLength < 0x80)
+    return 2;
+  else if (nLength < 0x100)
+    return 3;
+  else
+    return 4;
+}
+
+static int asn1Header(unsigned char *p, unsigned char nTag, int nLength)
+{
+  p[0] = nTag;
+
+  if (nLength < 0x80)
+  {
+    p[1] = nLength;
+    return 2;
+  }
+  else if (nLength < 0x100)
+  {
+    p[1] = 0x81;
+    p[2] = nLength;
+    return 3;
+  }
+
+  p[1] = 0x82;
+  p[2] = (nLength >> 8) & 0xFF;
+  p[3] = nLength & 0xFF;
+  return 4;
+}
+
+/*
+  Wrap a NTLMSSP token for SESSION_SETUP. The first token is sent within a 
+  GSS-API InitialContextToken/NegTokenInit offering only NTLMSSP, later tokens
+  within a NegTokenResp (RFC 4178).
+*/
+int spnegoWrap(unsigned char *buf, unsigned char *bufToken, int nToken, int isInitial)
+{
+  unsigned char oidSPNEGO[] = { 0x06, 0x06, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02 };
+  unsigned char mechTypes[] = { 0xa0, 0x0e, 0x30, 0x0c, 0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a };
+  int nOctetString, nMechToken, nSequence, nSequenceContent, nChoice;
+  int nOffset = 0;
+
+  nOctetString = asn1HeaderLength(nToken) + nToken;
+  nMechToken = asn1HeaderLength(nOctetString) + nOctetString;
+  nSequenceContent = nMechToken + (isInitial ? sizeof(mechTypes) : 0);
+  nSequence = asn1HeaderLength(nSequenceContent) + nSequenceContent;
+  nChoice = asn1HeaderLength(nSequence) + nSequence;
+
+  if (isInitial)
+  {
+    nOffset += asn1Header(buf + nOffset, 0x60, sizeof(oidSPNEGO) + nChoice);
+    memcpy(buf + nOffset, oidSPNEGO, sizeof(oidSPNEGO));
+    nOffset += sizeof(oidSPNEGO);
+    nOffset += asn1Header(buf + nOffset, 0xa0, nSequence);     /* negTokenInit */
+  }
+  else
+    nOffset += asn1Header(buf + nOffset, 0xa1, nSequence);     /* negTokenResp */
+
+  nOffset += asn1Header(buf + nOffset, 0x30, nSequenceContent);
+
+  if (isInitial)
+  {
+    memcpy(buf + nOffset, mechTypes, sizeof(mechTypes));
+    nOffset += sizeof(mechTypes);
+  }
+
+  nOffset += asn1Header(buf + nOffset, 0xa2, nOctetString);    /* mechToken / responseToken */
+  nOffset += asn1Header(buf + nOffset, 0x04, nToken);
+  memcpy(buf + nOffset, bufToken, nToken);
+
+  return nOffset + nToken;
+}
+
+/* Locate a NTLMSSP message of the given type within a security buffer */
+static unsigned char* ntlmsspFind(unsigned char *buf, int nLength, unsigned int nType, int *nMessageSize)
+{
+  int i;
+
+  for (i = 0; i + 12 <= nLength; i++)
+  {
+    if ((memcmp(buf + i, "NTLMSSP\0", 8) == 0) && (smb2Get32(buf + i + 8) == nType))
+    {
+      *nMessageSize = nLength - i;
+      return buf + i;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+  Retrieve the server challenge from a NTLMSSP CHALLENGE message, along with
+  the server's domain and NetBIOS computer name.
+*/
+int ntlmsspParseChallenge(_SMBNT_DATA *_psSessionData, _SMB2_AUTH *psAuth, unsigned char *buf, int nLength)
+{
+  unsigned char *pChallenge, *pInfo;
+  uint32_t nTarget, nOffset, nInfo, nSize;
+  int nChallenge, nAvId, nAvLength, i;
+
+  pChallenge = ntlmsspFind(buf, nLength, 2, &nChallenge);
+  if ((pChallenge == NULL) || (nChallenge < 48))
+    return FAILURE;
+
+  memcpy(psAuth->challenge, pChallenge + 24, 8);
+  nSize = nChallenge;
+
+  /* TargetName: domain of the server (or server name for stand-alone hosts) - offsets come from the server */
+  nTarget = smb2Get16(pChallenge + 12);
+  nOffset = smb2Get32(pChallenge + 16);
+  if ((nOffset <= nSize) && (nTarget <= nSize - nOffset) && (_psSessionData->accntFlag == NTDOMAIN))
+  {
+    memset(_psSessionData->workgroup, 0, 16);
+    for (i = 0; (i < nTarget / 2) && (i < 15); i++)
+      _psSessionData->workgroup[i] = pChallenge[nOffset + i * 2];
+  }
+
+  /* TargetInfo: MsvAvNbComputerName */
+  nInfo = smb2Get16(pChallenge + 40);
+  nOffset = smb2Get32(pChallenge + 44);
+  if ((_psSessionData->machine_name[0] == 0x00) && (nOffset <= nSize) && (nInfo <= nSize - nOffset))
+  {
+    pInfo = pChallenge + nOffset;
+    while (nInfo >= 4)
+    {
+      nAvId = smb2Get16(pInfo);
+      nAvLength = smb2Get16(pInfo + 2);
+      if ((nAvId == 0x0000) || ((uint32_t)nAvLength + 4 > nInfo))
+        break;
+
+      if (nAvId == 0x0001)
+      {
+        for (i = 0; (i < nAvLength / 2) && (i < 15); i++)
+          _psSessionData->machine_name[i] = pInfo[4 + i * 2];
+        writeVerbose(VB_GENERAL, "%s: Server machine name: %s", MODULE_NAME, _psSessionData->machine_name);
+      }
+
+      pInfo += 4 + nAvLength;
+      nInfo -= 4 + nAvLength;
+    }
+  }
+
+  return SUCCESS;
+}
+
+/* Set a NTLMSSP security buffer field and append its data to the message payload */
+static void ntlmsspField(unsigned char *buf, int nField, unsigned char *bufData, int nLength, int *nOffset)
+{
+  smb2Put16(buf + nField, nLength);
+  smb2Put16(buf + nField + 2, nLength);
+  smb2Put32(buf + nField + 4, *nOffset);
+
+  if (nLength > 0)
+    memcpy(buf + *nOffset, bufData, nLength);
+  *nOffset += nLength;
+}
+
+/*
+  Build a NTLMSSP AUTHENTICATE message for the challenge currently held in 
+  _psSessionData. The LM/NTLM responses are calculated as for SMB1.
+*/
+int ntlmsspAuthenticate(_SMBNT_DATA *_psSessionData, unsigned char *buf, char *szLogin, char *szPassword)
+{
+  unsigned char *LMhash = NULL, *NThash = NULL;
+  unsigned char bufUnicode[256 * 2];
+  int nLM = 0, nNT = 0, nUnicode, nOffset = 64;
+  int ret = SUCCESS;
+
+  switch (_psSessionData->authLevel)
+  {
+    case AUTH_LM:
+      LMhash = malloc(24);
+      memset(LMhash, 0, 24);
+      ret = HashLM(_psSessionData, &LMhash, (unsigned char *) szPassword, _psSessionData->challenge);
+      nLM = 24;
+      break;
+    case AUTH_NTLM:
+      /* The NTLM response is also sent in place of the LM response */
+      NThash = malloc(24);
+      memset(NThash, 0, 24);
+      ret = HashNTLM(_psSessionData, &NThash, (unsigned char *) szPassword, _psSessionData->challenge);
+      LMhash = malloc(24);
+      memcpy(LMhash, NThash, 24);
+      nLM = 24;
+      nNT = 24;
+      break;
+    case AUTH_LMv2:
+      ret = HashLMv2(_psSessionData, &LMhash, (unsigned char *) szLogin, (unsigned char *) szPassword);
+      nLM = 24;
+      break;
+    case AUTH_NTLMv2:
+      ret = HashLMv2(_psSessionData, &LMhash, (unsigned char *) szLogin, (unsigned char *) szPassword);
+      nLM = 24;
+      if (ret == SUCCESS)
+        ret = HashNTLMv2(_psSessionData, &NThash, &nNT, (unsigned char *) szLogin, (unsigned char *) szPassword);
+      break;
+  }
+
+  if (ret == FAILURE)
+  {
+    FREE(LMhash);
+    FREE(NThash);
+    return FAILURE;
+  }
+
+  memset(buf, 0, 64);
+  memcpy(buf, "NTLMSSP\0", 8);
+  smb2Put32(buf + 8, 3);                                    /* MessageType: AUTHENTICATE */
+  ntlmsspField(buf, 12, LMhash, nLM, &nOffset);             /* LmChallengeResponse */
+  ntlmsspField(buf, 20, NThash, nNT, &nOffset);             /* NtChallengeResponse */
+
+  nUnicode = smb2Unicode(bufUnicode, _psSessionData->workgroup, 16);
+  ntlmsspField(buf, 28, bufUnicode, nUnicode, &nOffset);    /* DomainName */
+  nUnicode = smb2Unicode(bufUnicode, szLogin, 256);
+  ntlmsspField(buf, 36, bufUnicode, nUnicode, &nOffset);    /* UserName */
+  nUnicode = smb2Unicode(bufUnicode, "MEDUSA", 16);
+  ntlmsspField(buf, 44, bufUnicode, nUnicode, &nOffset);    /* Workstation */
+  ntlmsspField(buf, 52, NULL, 0, &nOffset);                 /* EncryptedRandomSessionKey */
+  smb2Put32(buf + 60, NTLMSSP_FLAGS);                       /* NegotiateFlags */
+
+  FREE(LMhash);
+  FREE(NThash);
+
+  return nOffset;
+}
+
+/* Build a SESSION_SETUP request carrying the given NTLMSSP token */
+int SMB2SessionSetup(_SMBNT_DATA *_psSessionData, unsigned char *buf, _SMB2_AUTH *psAuth, unsigned char *bufToken, int nToken)
+{
+  unsigned char *p = buf + 4 + SMB2_HEADER_SIZE;
+  int nSecurity;
+
+  psAuth->nMessageId = SMB2Header(_psSessionData, buf, SMB2_SESSION_SETUP, psAuth->nSessionId);
+
+  memset(p, 0, 24);
+  smb2Put16(p, 25);                                         /* StructureSize */
+  p[3] = 0x01;                                              /* SecurityMode: Signing enabled */
+
+  nSecurity = spnegoWrap(p + 24, bufToken, nToken, (psAuth->nSessionId == 0));
+  smb2Put16(p + 12, SMB2_HEADER_SIZE + 24);                 /* SecurityBufferOffset */
+  smb2Put16(p + 14, nSecurity);                             /* SecurityBufferLength */
+
+  return SMB2Frame(buf, 4 + SMB2_HEADER_SIZE + 24 + nSecurity);
+}
+
+/*
+  SMB2TreeConnect
+  Function: Test whether an authenticated session has access to ADMIN$.
+  Returns the NT status of the TREE_CONNECT response.
+*/
+unsigned int SMB2TreeConnect(int hSocket, sLogin *psLogin, _SMBNT_DATA *_psSessionData, unsigned long long nSessionId)
+{
+  unsigned char buf[4 + SMB2_HEADER_SIZE + 8 + 256 * 2];
+  unsigned char *bufReceive = NULL;
+  unsigned char *p = buf + 4 + SMB2_HEADER_SIZE;
+  char szPath[256];
+  int nReceiveBufferSize = 0, nPath;
+  unsigned long long nMessageId;
+  unsigned int nStatus = STATUS_UNKNOWN;
+
+  if (_psSessionData->nCredits < 1)
+    return STATUS_UNKNOWN;
+
+  nMessageId = SMB2Header(_psSessionData, buf, SMB2_TREE_CONNECT, nSessionId);
+
+  snprintf(szPath, sizeof(szPath), "\\\\%s\\ADMIN$", psLogin->psServer->pHostIP);
+  nPath = smb2Unicode(p + 8, szPath, 256);
+
+  memset(p, 0, 8);
+  smb2Put16(p, 9);                                          /* StructureSize */
+  smb2Put16(p + 4, SMB2_HEADER_SIZE + 8);                   /* PathOffset */
+  smb2Put16(p + 6, nPath);                                  /* PathLength */
+
+  if (medusaSend(hSocket, buf, SMB2Frame(buf, 4 + SMB2_HEADER_SIZE + 8 + nPath), 0) < 0)
+  {
+    writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
+    return STATUS_UNKNOWN;
+  }
+
+  while (SMB2Receive(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize) == SUCCESS)
+  {
+    _psSessionData->nCredits += smb2Get16(bufReceive + 14);
+
+    if ((smb2Get64(bufReceive + 24) == nMessageId) && !((smb2Get32(bufReceive + 16) & SMB2_FLAGS_ASYNC_COMMAND) && (smb2Get32(bufReceive + 8) == STATUS_PENDING)))
+    {
+      nStatus = smb2Get32(bufReceive + 8);
+      FREE(bufReceive);
+      break;
+    }
+
+    FREE(bufReceive);
+  }
+
+  return nStatus;
+}
+
+/* Return authentications which were queued or in progress to the host's missed credential list */
+void requeueSMB2(sLogin *psLogin, _SMBNT_DATA *_psSessionData)
+{
+  int i;
+
+  for (i = 0; i < _psSessionData->nAuthQueued; i++)
+  {
+    if (_psSessionData->psAuth[i].nState != SMB2_AUTH_DONE)
+      addMissedCredSet(psLogin, &_psSessionData->psAuth[i].sCredSet);
+  }
+
+  _psSessionData->nAuthQueued = 0;
+}
+
+/*
+  Test a batch of credential sets over the SMB2 connection. Every credential set
+  in the batch sends its NTLMSSP NEGOTIATE before any response is read. The
+  AUTHENTICATE messages are then likewise sent together, each within the session
+  created for it by the server.
+*/
+int tryLoginSMB2(int hSocket, sLogin** psLogin, _SMBNT_DATA* _psSessionData, sCredentialSet *psCredSet)
+{
+  int nRet = MSTATE_RUNNING;
+  int nCredentialsDone = FALSE;
+  int nDone, nOutstanding, nSendBufferSize, nToken, nReceiveBufferSize, i;
+  unsigned char *bufSend = NULL, *bufReceive = NULL, *p;
+  unsigned char bufToken[2048];
+  unsigned long long nMessageId;
+  unsigned long SMBSessionRet;
+  unsigned int nStatus;
+  char *szUser = NULL;
+  sUser *psUserCurrent = NULL;
+  _SMB2_AUTH *psAuth = NULL;
+
+  /* top-up the queue - the credential set held by the caller is used first */
+  while ((_psSessionData->nAuthQueued < _psSessionData->nSessions) && (_psSessionData->nAuthQueued < _psSessionData->nCredits))
+  {
+    if (psCredSet->psUser == NULL)
+    {
+      if ((getNextCredSet(*psLogin, psCredSet) == FAILURE) || (psCredSet->iStatus == CREDENTIAL_DONE) || (psCredSet->psUser == NULL))
+      {
+        nCredentialsDone = TRUE;
+        break;
+      }
+    }
+
+    psAuth = &_psSessionData->psAuth[_psSessionData->nAuthQueued];
+    memset(psAuth, 0, sizeof(_SMB2_AUTH));
+    memcpy(&psAuth->sCredSet, psCredSet, sizeof(sCredentialSet));
+    psAuth->nState = SMB2_AUTH_QUEUED;
+    _psSessionData->nAuthQueued++;
+    psCredSet->psUser = NULL;
+  }
+
+  if (_psSessionData->nAuthQueued == 0)
+  {
+    if (nCredentialsDone)
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] No more available credential sets to test.", MODULE_NAME);
+      return MSTATE_EXITING;
+    }
+
+    writeError(ERR_ERROR, "[%s] Server granted no SMB2 credits. Establishing new connection.", MODULE_NAME);
+    return MSTATE_NEW;
+  }
+
+  bufSend = malloc(_psSessionData->nAuthQueued * (4 + SMB2_HEADER_SIZE + 24 + sizeof(bufToken) + 32));
+
+  do
+  {
+    /* send the next leg of every authentication which is waiting on us */
+    nSendBufferSize = 0;
+    nOutstanding = 0;
+
+    for (i = 0; (i < _psSessionData->nAuthQueued) && (_psSessionData->nCredits > 0); i++)
+    {
+      psAuth = &_psSessionData->psAuth[i];
+
+      if (psAuth->nState == SMB2_AUTH_QUEUED)
+      {
+        /* NTLMSSP NEGOTIATE */
+        memset(bufToken, 0, 32);
+        memcpy(bufToken, "NTLMSSP\0", 8);
+        smb2Put32(bufToken + 8, 1);
+        smb2Put32(bufToken + 12, NTLMSSP_FLAGS);
+
+        nSendBufferSize += SMB2SessionSetup(_psSessionData, bufSend + nSendBufferSize, psAuth, bufToken, 32);
+        psAuth->nState = SMB2_AUTH_NEGOTIATE;
+        nOutstanding++;
+      }
+      else if (psAuth->nState == SMB2_AUTH_CHALLENGE)
+      {
+        /* NTLMSSP AUTHENTICATE */
+        memcpy(_psSessionData->challenge, psAuth->challenge, 8);
+        szUser = parseFullyQualifiedUsername(_psSessionData, psAuth->sCredSet.psUser->pUser);
+        setWorkgroup(_psSessionData);
+
+        nToken = ntlmsspAuthenticate(_psSessionData, bufToken, szUser, psAuth->sCredSet.pPass);
+        FREE(szUser);
+
+        if (nToken == FAILURE)
+        {
+          psAuth->nStatus = STATUS_UNKNOWN;
+          psAuth->nState = SMB2_AUTH_DONE;
+          continue;
+        }
+
+        nSendBufferSize += SMB2SessionSetup(_psSessionData, bufSend + nSendBufferSize, psAuth, bufToken, nToken);
+        psAuth->nState = SMB2_AUTH_AUTHENTICATE;
+        nOutstanding++;
+      }
+    }
+
+    if (nOutstanding > 0)
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Sending %d SMB2 SESSION_SETUP requests.", MODULE_NAME, nOutstanding);
+
+      if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+      {
+        writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
+        nRet = MSTATE_NEW;
+        break;
+      }
+    }
+
+    /* collect the responses, in whatever order the server returns them */
+    while (nOutstanding > 0)
+    {
+      if (SMB2Receive(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize) == FAILURE)
+      {
+        writeError(ERR_ERROR, "[%s] Server failed to respond to %d SMB2 SESSION_SETUP requests.", MODULE_NAME, nOutstanding);
+        nRet = MSTATE_NEW;
+        break;
+      }
+
+      _psSessionData->nCredits += smb2Get16(bufReceive + 14);
+      nStatus = smb2Get32(bufReceive + 8);
+      nMessageId = smb2Get64(bufReceive + 24);
+
+      /* interim response - the final response follows */
+      if ((smb2Get32(bufReceive + 16) & SMB2_FLAGS_ASYNC_COMMAND) && (nStatus == STATUS_PENDING))
+      {
+        FREE(bufReceive);
+        continue;
+      }
+
+      for (i = 0; i < _psSessionData->nAuthQueued; i++)
+      {
+        psAuth = &_psSessionData->psAuth[i];
+        if ((psAuth->nMessageId == nMessageId) && ((psAuth->nState == SMB2_AUTH_NEGOTIATE) || (psAuth->nState == SMB2_AUTH_AUTHENTICATE)))
+          break;
+      }
+
+      if ((i == _psSessionData->nAuthQueued) || (smb2Get16(bufReceive + 12) != SMB2_SESSION_SETUP) || (nReceiveBufferSize < SMB2_HEADER_SIZE + 8))
+      {
+        writeError(ERR_DEBUG_MODULE, "[%s] Ignoring unexpected SMB2 response (MessageId: %llu).", MODULE_NAME, nMessageId);
+        FREE(bufReceive);
+        continue;
+      }
+
+      nOutstanding--;
+      psAuth->nSessionId = smb2Get64(bufReceive + 40);
+      p = bufReceive + SMB2_HEADER_SIZE;
+
+      if ((psAuth->nState == SMB2_AUTH_NEGOTIATE) && (nStatus == STATUS_MORE_PROCESSING_REQUIRED))
+      {
+        if ((smb2Get16(p + 4) + smb2Get16(p + 6) > nReceiveBufferSize) || (ntlmsspParseChallenge(_psSessionData, psAuth, bufReceive + smb2Get16(p + 4), smb2Get16(p + 6)) == FAILURE))
+        {
+          writeError(ERR_ERROR, "[%s] Failed to locate NTLMSSP challenge in SMB2 SESSION_SETUP response.", MODULE_NAME);
+          psAuth->nStatus = STATUS_UNKNOWN;
+          psAuth->nState = SMB2_AUTH_DONE;
+        }
+        else
+          psAuth->nState = SMB2_AUTH_CHALLENGE;
+      }
+      else
+      {
+        psAuth->nStatus = nStatus;
+        psAuth->nSessionFlags = smb2Get16(p + 2);
+        psAuth->nState = SMB2_AUTH_DONE;
+      }
+
+      FREE(bufReceive);
+    }
+
+    if (nRet != MSTATE_RUNNING)
+      break;
+
+    nDone = 0;
+    for (i = 0; i < _psSessionData->nAuthQueued; i++)
+    {
+      if (_psSessionData->psAuth[i].nState == SMB2_AUTH_DONE)
+        nDone++;
+    }
+
+    if ((nDone < _psSessionData->nAuthQueued) && (nOutstanding == 0) && (_psSessionData->nCredits < 1))
+    {
+      writeError(ERR_ERROR, "[%s] Server granted no SMB2 credits. Establishing new connection.", MODULE_NAME);
+      nRet = MSTATE_NEW;
+      break;
+    }
+  } while (nDone < _psSessionData->nAuthQueued);
+
+  FREE(bufSend);
+
+  /* report completed authentications */
+  psUserCurrent = (*psLogin)->psUser;
+
+  for (i = 0; i < _psSessionData->nAuthQueued; i++)
+  {
+    psAuth = &_psSessionData->psAuth[i];
+    if (psAuth->nState != SMB2_AUTH_DONE)
+      continue;
+
+    /* a password for this user was already found within this batch */
+    if (psAuth->sCredSet.psUser->iPassStatus == PASS_AUDIT_COMPLETE)
+      continue;
+
+    (*psLogin)->psUser = psAuth->sCredSet.psUser;
+
+    nStatus = psAuth->nStatus;
+    if ((nStatus == 0) && (psAuth->nSessionFlags & (SMB2_SESSION_FLAG_IS_GUEST | SMB2_SESSION_FLAG_IS_NULL)))
+    {
+      SMBSessionRet = 0x01000000;
+    }
+    else if ((nStatus == 0) && (_psSessionData->nSigningRequired))
+    {
+      /* The Tree Connect request would need to be signed */
+      (*psLogin)->pErrorMsg = malloc( 36 + 1 );
+      memset((*psLogin)->pErrorMsg, 0, 36 + 1 );
+      sprintf((*psLogin)->pErrorMsg, "ADMIN$ - Signing Required (Untested)");
+      (*psLogin)->iResult = LOGIN_RESULT_SUCCESS;
+
+      if (_psSessionData->hashFlag == MACHINE_NAME) { 
+        setPassResult((*psLogin), (char *)_psSessionData->machine_name);
+        nRet = MSTATE_EXITING;
+      }
+      else
+        setPassResult((*psLogin), psAuth->sCredSet.pPass);
+      continue;
+    }
+    else if (nStatus == 0)
+    {
+      /* Match the SMB1 chained Tree Connect AndX request - report ADMIN$ access */
+      SMBSessionRet = SMB2TreeConnect(hSocket, *psLogin, _psSessionData, psAuth->nSessionId) & 0x00FFFFFF;
+    }
+    else
+      SMBSessionRet = nStatus & 0x00FFFFFF;
+
+    if (reportResult(psLogin, _psSessionData, SMBSessionRet, psAuth->sCredSet.pPass) == MSTATE_EXITING)
+    {
+      if (_psSessionData->hashFlag == MACHINE_NAME)
+        nRet = MSTATE_EXITING;
+    }
+  }
+
+  /* restore user pointer used by getNextCredSet() for this login thread */
+  (*psLogin)->psUser = psUserCurrent;
+
+  /* any authentications which did not complete are retried by the remaining threads */
+  requeueSMB2(*psLogin, _psSessionData);
+
+  if ((nRet == MSTATE_RUNNING) && (nCredentialsDone))
+    nRet = MSTATE_EXITING;
+
+  return(nRet);
+}
+
 #else
 
 void summaryUsage(char **ppszSummary)
@@ -57,11 +57,26 @@
 #define VERB_EXPN 2
 #define VERB_RCPT 3
 
+#define PIPELINE_DEFAULT 10
+#define PIPELINE_MAX 100
+
+/* per-reply classification used when attributing pipelined RCPT TO responses */
+#define REPLY_VALID 1
+#define REPLY_INVALID 2
+#define REPLY_ERROR 3
+#define REPLY_DEFER 4
+#define REPLY_CLOSING 5
+
 typedef struct __MODULE_DATA {
   int nHELO;
   char *szHELO;
   char *szMAILFROM;
   int nVerb;
+  int nPipelineSize;              /* maximum RCPT TO commands per write (0 == use default) */
+  int nPipelining;                /* server advertised ESMTP PIPELINING (RFC 2920) */
+  int nResetPending;              /* RSET/MAIL FROM required before the next batch */
+  sCredentialSet *psPipeline;     /* credential sets sent but not yet attributed a reply */
+  int nPipelineQueued;
 } _MODULE_DATA;
 
 
@@ -76,7 +91,10 @@ enum MODULE_STATE
 
 // Forward declarations
 int initConnection(_MODULE_DATA *_psSessionData, int hSocket, sConnectParams *params);
+int sendMailFrom(_MODULE_DATA *_psSessionData, int hSocket);
+void requeuePipeline(sLogin *psLogin, _MODULE_DATA *_psSessionData, sCredentialSet *psCredSet);
 int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword);
+int tryLoginPipelined(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, sCredentialSet *psCredSet);
 int initModule(sLogin* login, _MODULE_DATA *_psSessionData);
 
 // Tell medusa how many parameters this module allows
@@ -85,6 +103,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_SMTPS : PORT_SMTP;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -116,6 +140,9 @@ void showUsage()
   writeVerbose(VB_NONE, " MAILFROM:? [optional] ");
   writeVerbose(VB_NONE, "    Specify the MAIL FROM address. Default: doesnotexist@foofus.net");
   writeVerbose(VB_NONE, " VERB:? (Verb/Command: VRFY/EXPN/RCPT TO. Default: RCPT TO");
+  writeVerbose(VB_NONE, " PIPELINE:? [optional] ");
+  writeVerbose(VB_NONE, "    Number of RCPT TO commands sent per write when the server advertises PIPELINING.");
+  writeVerbose(VB_NONE, "    Set to 1 to disable pipelining. Default: %d, Maximum: %d", PIPELINE_DEFAULT, PIPELINE_MAX);
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "*** NOTE: Target address domain should be specified within password field. ***");
   writeVerbose(VB_NONE, "");
@@ -134,7 +161,7 @@ int go(sLogin* logins, int argc, char *argv[])
   psSessionData = malloc(sizeof(_MODULE_DATA));
   memset(psSessionData, 0, sizeof(_MODULE_DATA));
 
-  if ((argc < 0) || (argc > 4))
+  if ((argc < 0) || (argc > 5))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -193,6 +220,18 @@ int go(sLogin* logins, int argc, char *argv[])
         else
           writeError(ERR_WARNING, "Method MAILFROM requires value to be set.");
       }
+      else if (strcmp(pOpt, "PIPELINE") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if (pOpt == NULL)
+          writeError(ERR_WARNING, "Method PIPELINE requires value to be set.");
+        else if ((atoi(pOpt) < 1) || (atoi(pOpt) > PIPELINE_MAX))
+          writeError(ERR_WARNING, "Invalid value for method PIPELINE (1 - %d).", PIPELINE_MAX);
+        else
+          psSessionData->nPipelineSize = atoi(pOpt);
+      }
       else
          writeError(ERR_WARNING, "Invalid method: %s.", pOpt);
 
@@ -202,6 +241,7 @@ int go(sLogin* logins, int argc, char *argv[])
     initModule(logins, psSessionData);
   }  
 
+  FREE(psSessionData->psPipeline);
   FREE(psSessionData);
   return SUCCESS;
 }
@@ -266,6 +306,16 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
     _psSessionData->nVerb = VERB_RCPT;
   }
 
+  /* RCPT TO commands are batched when the server advertises PIPELINING */
+  if (_psSessionData->nPipelineSize == 0)
+    _psSessionData->nPipelineSize = PIPELINE_DEFAULT;
+
+  if ((_psSessionData->nVerb == VERB_RCPT) && (_psSessionData->nPipelineSize > 1))
+  {
+    _psSessionData->psPipeline = malloc(_psSessionData->nPipelineSize * sizeof(sCredentialSet));
+    memset(_psSessionData->psPipeline, 0, _psSessionData->nPipelineSize * sizeof(sCredentialSet));
+  }
+
   while (nState != MSTATE_COMPLETE)
   {  
     switch(nState)
@@ -282,12 +332,14 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
         if (hSocket < 0) 
         {
           writeError(ERR_NOTICE, "[%s] failed to connect, port %d was not open on %s", MODULE_NAME, params.nPort, psLogin->psServer->pHostIP);
+          requeuePipeline(psLogin, _psSessionData, psCredSet);
           psLogin->iResult = LOGIN_RESULT_UNKNOWN;
           return FAILURE;
         }
 
         if (initConnection(_psSessionData, hSocket, &params) == FAILURE)
         {
+          requeuePipeline(psLogin, _psSessionData, psCredSet);
           psLogin->iResult = LOGIN_RESULT_UNKNOWN;
           return FAILURE;
         }
@@ -297,7 +349,18 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
         nState = MSTATE_RUNNING;
         break;
       case MSTATE_RUNNING:
-        if ( medusaCheckSocket(hSocket, psLogin->psServer->psAudit->iSocketWait) )
+        if ( (_psSessionData->nPipelining) && (_psSessionData->psPipeline) )
+        {
+          /* batches are assembled, sent and attributed within tryLoginPipelined() */
+          if ( medusaCheckSocket(hSocket, psLogin->psServer->psAudit->iSocketWait) )
+            nState = tryLoginPipelined(hSocket, &psLogin, _psSessionData, psCredSet);
+          else
+          {
+            writeError(ERR_NOTICE, "[%s] Socket is no longer valid. Server likely dropped connection. Establishing new session.", MODULE_NAME);
+            nState = MSTATE_NEW;
+          }
+        }
+        else if ( medusaCheckSocket(hSocket, psLogin->psServer->psAudit->iSocketWait) )
         {
           nState = tryLogin(hSocket, &psLogin, _psSessionData, psCredSet->psUser->pUser, psCredSet->pPass);
 
@@ -336,6 +399,8 @@ int initModule(sLogin* psLogin, _MODULE_DATA *_psSessionData)
         }
         break;
       case MSTATE_EXITING:
+        requeuePipeline(psLogin, _psSessionData, psCredSet);
+
         if (hSocket > 0)
           medusaDisconnect(hSocket);
         hSocket = -1;
@@ -436,12 +501,16 @@ int initConnection(_MODULE_DATA *_psSessionData, int hSocket, sConnectParams *pa
         return FAILURE;
       }
   
-      /* Resend HELO greeting as the AUTH types may have changed. */
+      /* Resend HELO greeting as the AUTH types (and extensions) may have changed. */
       writeError(ERR_DEBUG_MODULE, "[%s] Sending SMTP HELO greeting.", MODULE_NAME);  
       nSendBufferSize = 5 + strlen(_psSessionData->szHELO) + 2;
       bufSend = malloc(nSendBufferSize + 1);
       memset(bufSend, 0, nSendBufferSize + 1);
-      sprintf((char *)bufSend, "HELO %s\r\n", _psSessionData->szHELO);
+
+      if (_psSessionData->nHELO == HELO_HELO) 
+        sprintf((char *)bufSend, "HELO %s\r\n", _psSessionData->szHELO);
+      else  
+        sprintf((char *)bufSend, "EHLO %s\r\n", _psSessionData->szHELO);
   
       if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
       {
@@ -466,10 +535,29 @@ int initConnection(_MODULE_DATA *_psSessionData, int hSocket, sConnectParams *pa
     writeError(ERR_DEBUG_MODULE, "Detected verb: VFRY");
   else if (strstr((char *)bufReceive, "RCPT") != NULL)
     writeError(ERR_DEBUG_MODULE, "Detected verb: RCPT");
+
+  /* RFC 2920 - server accepts batches of commands within a single write */
+  _psSessionData->nPipelining = FALSE;
+  _psSessionData->nResetPending = FALSE;
+  if ((_psSessionData->nHELO == HELO_EHLO) && (strstr((char *)bufReceive, "PIPELINING") != NULL))
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Server supports PIPELINING.", MODULE_NAME);
+    _psSessionData->nPipelining = TRUE;
+  }
   
   FREE(bufReceive);
 
-  /* Send MAIL FROM to SMTP server (required for RCPT TO) */
+  return sendMailFrom(_psSessionData, hSocket);
+}
+
+/* Send MAIL FROM to SMTP server (required for RCPT TO) */
+int sendMailFrom(_MODULE_DATA *_psSessionData, int hSocket)
+{
+  unsigned char *bufSend = NULL;
+  unsigned char *bufReceive = NULL;
+  int nReceiveBufferSize = 0;
+  int nSendBufferSize = 0;
+
   writeError(ERR_DEBUG_MODULE, "[%s] Sending SMTP MAIL FROM command.", MODULE_NAME);  
   nSendBufferSize = 12 + strlen(_psSessionData->szMAILFROM) + 3;
   bufSend = malloc(nSendBufferSize + 1);
@@ -609,3 +697,269 @@ int tryLogin(int hSocket, sLogin** psLogin, _MODULE_DATA* _psSessionData, char*
   
   return(nRet);
 }
+
+/*
+  Credential sets which were sent to the server, but for which we never received
+  a reply (connection dropped, thread exiting), are pushed to the host's missed
+  credential queue so that they are tested by the remaining login threads. This
+  includes a credential set held back from the last batch for a user already
+  within it.
+*/
+void requeuePipeline(sLogin *psLogin, _MODULE_DATA *_psSessionData, sCredentialSet *psCredSet)
+{
+  int i;
+
+  for (i = 0; i < _psSessionData->nPipelineQueued; i++)
+    addMissedCredSet(psLogin, &_psSessionData->psPipeline[i]);
+
+  _psSessionData->nPipelineQueued = 0;
+
+  if ((_psSessionData->nPipelining) && (_psSessionData->psPipeline) && (psCredSet->psUser) && (psCredSet->psUser->iPassStatus != PASS_AUDIT_COMPLETE))
+  {
+    addMissedCredSet(psLogin, psCredSet);
+    psCredSet->psUser = NULL;
+  }
+}
+
+/* Map a single final SMTP reply line to the result of its RCPT TO command */
+int classifyReply(char *szLine)
+{
+  if ((strncmp(szLine, "250 ", 4) == 0) || (strncmp(szLine, "252 ", 4) == 0))
+    return REPLY_VALID;
+  else if (strncmp(szLine, "550 Too many invalid recipients", 31) == 0)
+    return REPLY_ERROR;
+  else if ((strncmp(szLine, "550 ", 4) == 0) || (strncmp(szLine, "557 ", 4) == 0))
+    return REPLY_INVALID;
+  else if ((strncmp(szLine, "452 ", 4) == 0) || (strncmp(szLine, "451 ", 4) == 0))
+    return REPLY_DEFER; /* 452 4.5.3 Too many recipients */
+  else if (strncmp(szLine, "421 ", 4) == 0)
+    return REPLY_CLOSING;
+  else
+    return REPLY_ERROR;
+}
+
+/*
+  Return the number of complete final reply lines (e.g. "250 Ok") within the
+  buffer. Continuation lines of multiline replies ("250-...") are not counted.
+*/
+int countReplies(char *szBuf)
+{
+  char *pLine = szBuf, *pEnd = NULL;
+  int nReplies = 0;
+
+  while ((pEnd = strstr(pLine, "\r\n")) != NULL)
+  {
+    if ((pEnd - pLine >= 4) && (pLine[3] == ' '))
+      nReplies++;
+    pLine = pEnd + 2;
+  }
+
+  return nReplies;
+}
+
+/*
+  RFC 2920 (PIPELINING) allows the client to send a group of RCPT TO commands 
+  within a single write. The server processes them in order and returns one 
+  reply per command, in the same order. We queue up to nPipelineSize credential
+  sets, send them together and then attribute each reply to its recipient.
+
+  Servers may cap the number of recipients per transaction (452). Credentials
+  receiving such a reply remain queued, and the transaction is reset prior to
+  them being resent with the next batch.
+*/
+int tryLoginPipelined(int hSocket, sLogin** psLogin, _MODULE_DATA* _psSessionData, sCredentialSet *psCredSet)
+{
+  int nRet = MSTATE_RUNNING;
+  int nCredentialsDone = FALSE;
+  int nSent, nReplies, nReply, nDeferred, i;
+  unsigned char *bufSend = NULL;
+  unsigned char *bufReceive = NULL, *bufReceiveTmp = NULL;
+  int nSendBufferSize = 0, nReceiveBufferSize = 0, nReceiveBufferSizeTmp = 0;
+  char *pLine = NULL, *pEnd = NULL;
+  sUser *psUserCurrent = NULL;
+  sCredentialSet *psEntry = NULL;
+
+  /* reset transaction after server refused additional recipients */
+  if (_psSessionData->nResetPending)
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Resetting SMTP transaction.", MODULE_NAME);
+
+    if (medusaSend(hSocket, (unsigned char *)"RSET\r\n", 6, 0) < 0)
+    {
+      writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
+      return MSTATE_NEW;
+    }
+
+    nReceiveBufferSize = 0;
+    if ((medusaReceiveRegex(hSocket, &bufReceive, &nReceiveBufferSize, "250 .*\r\n") == FAILURE) || (bufReceive == NULL))
+    {
+      writeError(ERR_ERROR, "[%s] failed: Server did not respond to RSET with '250'.", MODULE_NAME);
+      FREE(bufReceive);
+      return MSTATE_NEW;
+    }
+    FREE(bufReceive);
+
+    if (sendMailFrom(_psSessionData, hSocket) == FAILURE)
+      return MSTATE_NEW;
+
+    _psSessionData->nResetPending = FALSE;
+  }
+
+  /* top-up the queue - the credential set held by the caller is used first */
+  while (_psSessionData->nPipelineQueued < _psSessionData->nPipelineSize)
+  {
+    /* a held credential set may belong to a user found valid by the previous batch */
+    if ((psCredSet->psUser) && (psCredSet->psUser->iPassStatus == PASS_AUDIT_COMPLETE))
+      psCredSet->psUser = NULL;
+
+    if (psCredSet->psUser == NULL)
+    {
+      if ((getNextCredSet(*psLogin, psCredSet) == FAILURE) || (psCredSet->iStatus == CREDENTIAL_DONE) || (psCredSet->psUser == NULL))
+      {
+        psCredSet->psUser = NULL;
+        nCredentialsDone = TRUE;
+        break;
+      }
+    }
+
+    /* each user appears once per batch - a second entry is held for the next batch */
+    for (i = 0; i < _psSessionData->nPipelineQueued; i++)
+    {
+      if (_psSessionData->psPipeline[i].psUser == psCredSet->psUser)
+        break;
+    }
+
+    if (i < _psSessionData->nPipelineQueued)
+      break;
+
+    memcpy(&_psSessionData->psPipeline[_psSessionData->nPipelineQueued], psCredSet, sizeof(sCredentialSet));
+    _psSessionData->nPipelineQueued++;
+    psCredSet->psUser = NULL;
+  }
+
+  if (_psSessionData->nPipelineQueued == 0)
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] No more available credential sets to test.", MODULE_NAME);
+    return MSTATE_EXITING;
+  }
+
+  /* build and send the batch */
+  nSent = _psSessionData->nPipelineQueued;
+  bufSend = malloc(nSent * BUF_SIZE + 1);
+  memset(bufSend, 0, nSent * BUF_SIZE + 1);
+
+  for (i = 0; i < nSent; i++)
+  {
+    psEntry = &_psSessionData->psPipeline[i];
+
+    if (strlen(psEntry->pPass) > 0)
+      nSendBufferSize += sprintf((char *)bufSend + nSendBufferSize, "RCPT TO: %.250s@%.250s\r\n", psEntry->psUser->pUser, psEntry->pPass);
+    else
+      nSendBufferSize += sprintf((char *)bufSend + nSendBufferSize, "RCPT TO: %.250s\r\n", psEntry->psUser->pUser);
+  }
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending %d pipelined RCPT TO commands.", MODULE_NAME, nSent);
+
+  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed during sending of pipelined RCPT TO commands.", MODULE_NAME);
+    FREE(bufSend);
+    return MSTATE_NEW;
+  }
+  FREE(bufSend);
+
+  /* collect one reply per command */
+  nReceiveBufferSize = 0;
+  while ((bufReceive == NULL) || (countReplies((char *)bufReceive) < nSent))
+  {
+    bufReceiveTmp = medusaReceiveRaw(hSocket, &nReceiveBufferSizeTmp);
+    if (bufReceiveTmp == NULL)
+    {
+      writeError(ERR_ERROR, "[%s] Server returned %d of %d pipelined replies.", MODULE_NAME, (bufReceive) ? countReplies((char *)bufReceive) : 0, nSent);
+      nRet = MSTATE_NEW;
+      break;
+    }
+
+    bufReceive = realloc(bufReceive, nReceiveBufferSize + nReceiveBufferSizeTmp + 1);
+    memcpy(bufReceive + nReceiveBufferSize, bufReceiveTmp, nReceiveBufferSizeTmp);
+    nReceiveBufferSize += nReceiveBufferSizeTmp;
+    bufReceive[nReceiveBufferSize] = '\0';
+    FREE(bufReceiveTmp);
+  }
+
+  /* attribute replies to their recipients, in order */
+  psUserCurrent = (*psLogin)->psUser;
+  nReplies = 0;
+  nDeferred = 0;
+  pLine = (char *)bufReceive;
+
+  while ((pLine) && (nReplies < nSent) && ((pEnd = strstr(pLine, "\r\n")) != NULL))
+  {
+    if ((pEnd - pLine < 4) || (pLine[3] != ' '))
+    {
+      pLine = pEnd + 2;
+      continue;
+    }
+
+    psEntry = &_psSessionData->psPipeline[nReplies];
+    nReply = classifyReply(pLine);
+    nReplies++;
+
+    switch (nReply)
+    {
+      case REPLY_VALID:
+        writeError(ERR_DEBUG_MODULE, "[%s] Found valid account: %s", MODULE_NAME, psEntry->psUser->pUser);
+        (*psLogin)->iResult = LOGIN_RESULT_SUCCESS;
+        break;
+      case REPLY_INVALID:
+        writeError(ERR_DEBUG_MODULE, "[%s] Non-existant account: %s", MODULE_NAME, psEntry->psUser->pUser);
+        (*psLogin)->iResult = LOGIN_RESULT_FAIL;
+        break;
+      case REPLY_DEFER:
+        writeError(ERR_DEBUG_MODULE, "[%s] Recipient deferred (%.3s): %s", MODULE_NAME, pLine, psEntry->psUser->pUser);
+        memmove(&_psSessionData->psPipeline[nDeferred], psEntry, sizeof(sCredentialSet));
+        nDeferred++;
+        _psSessionData->nResetPending = TRUE;
+        pLine = pEnd + 2;
+        continue;
+      case REPLY_CLOSING:
+        writeError(ERR_DEBUG_MODULE, "[%s] Server closing transmission channel. Restarting connection.", MODULE_NAME);
+        nReplies--;
+        nRet = MSTATE_NEW;
+        break;
+      default:
+        writeError(ERR_ERROR, "[%s] Unknown SMTP server response: %.*s", MODULE_NAME, (int)(pEnd - pLine), pLine);
+        (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+        nRet = MSTATE_EXITING;
+        break;
+    }
+
+    if (nReply == REPLY_CLOSING)
+      break;
+
+    (*psLogin)->psUser = psEntry->psUser;
+    setPassResult((*psLogin), psEntry->pPass);
+    pLine = pEnd + 2;
+  }
+
+  FREE(bufReceive);
+
+  /* restore user pointer used by getNextCredSet() for this login thread */
+  (*psLogin)->psUser = psUserCurrent;
+
+  /* keep deferred and unanswered credential sets queued for the next batch */
+  memmove(&_psSessionData->psPipeline[nDeferred], &_psSessionData->psPipeline[nReplies], (nSent - nReplies) * sizeof(sCredentialSet));
+  _psSessionData->nPipelineQueued = nDeferred + (nSent - nReplies);
+
+  /* a fresh transaction which accepts no recipients at all is not going to improve */
+  if ((nDeferred > 0) && (nDeferred == nSent))
+  {
+    writeError(ERR_ERROR, "[%s] Server deferred every recipient within the batch.", MODULE_NAME);
+    nRet = MSTATE_EXITING;
+  }
+
+  if ((nRet == MSTATE_RUNNING) && (nCredentialsDone) && (_psSessionData->nPipelineQueued == 0))
+    nRet = MSTATE_EXITING;
+
+  return(nRet);
+}
@@ -58,6 +58,7 @@ typedef struct __MODULE_DATA {
   char *szEHLO;
   int nAuthType;
   char* szDomain;
+  char bufSASL[SASL_BUFFER_SIZE];
 } _MODULE_DATA;
 
 
@@ -81,6 +82,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_SMTPS : PORT_SMTP;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -485,27 +492,19 @@ int initConnection(_MODULE_DATA *_psSessionData, int hSocket, sConnectParams *pa
   C: AHdlbGRvbgB3M2xkMG4=
   S: 235 2.0.0 OK Authenticated
 */
-int sendAuthPLAIN(int hSocket, char* szLogin, char* szPassword)
+int sendAuthPLAIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
   unsigned char* bufReceive = NULL;
-  unsigned char* bufSend = NULL;
-  unsigned char* szTmpBuf = NULL;
-  unsigned char* szTmpBuf64 = NULL;
   int nSendBufferSize = 0;
   int nReceiveBufferSize = 0;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating PLAIN Authentication Attempt.", MODULE_NAME);
 
   /* --- Send initial AUTH PLAIN command --- */
-  bufSend = malloc(12 + 1);
-  memset(bufSend, 0, 12 + 1);
-  sprintf((char *)bufSend, "AUTH PLAIN\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)"AUTH PLAIN\r\n", 12, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend);
 
   /* Server should respond with a 334 response code */
   nReceiveBufferSize = 0;
@@ -515,31 +514,45 @@ int sendAuthPLAIN(int hSocket, char* szLogin, char* szPassword)
     FREE(bufReceive);
     return FAILURE;
   }
+  FREE(bufReceive);
 
   /* Send logon credentials: B64(USERNAME\0USERNAME\0PASSWORD) */
-  nSendBufferSize = strlen(szLogin) + 1 + strlen(szLogin) + 1 + strlen(szPassword);
-  szTmpBuf = malloc(nSendBufferSize + 1);
-  memset(szTmpBuf, 0, nSendBufferSize + 1);
-  strcpy((char *)szTmpBuf, szLogin);
-  strcpy((char *)szTmpBuf + strlen(szLogin) + 1, szLogin);
-  strcpy((char *)szTmpBuf + strlen(szLogin) + 1 + strlen(szLogin) + 1, szPassword);
+  nSendBufferSize = sasl_plain_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szLogin, szLogin, szPassword, "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Credentials too long for AUTH PLAIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  szTmpBuf64 = malloc((2 * nSendBufferSize + 2) + 1);
-  memset(szTmpBuf64, 0, (2 * nSendBufferSize + 2) + 1);
-  base64_encode((char *)szTmpBuf, nSendBufferSize, (char *)szTmpBuf64);
-  FREE(szTmpBuf);
+  if (medusaSend(hSocket, (unsigned char *)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
+  }
 
-  bufSend = malloc(strlen((char *)szTmpBuf64) + 2 + 1);
-  memset(bufSend, 0, strlen((char *)szTmpBuf64) + 2 + 1);
+  return SUCCESS;
+}
 
-  sprintf((char *)bufSend, "%s\r\n", szTmpBuf64);
-  FREE(szTmpBuf64);
+/* Decode a "334 <base64>" prompt into the session buffer for logging */
+int getPromptLOGIN(_MODULE_DATA* _psSessionData, unsigned char* bufReceive)
+{
+  unsigned char* szTmpBuf = NULL;
+  unsigned char* szTmpBuf2 = NULL;
 
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (((szTmpBuf = (unsigned char *)strstr((char *)bufReceive, "334")) == NULL) || ((szTmpBuf2 = (unsigned char *)index((char *)szTmpBuf, '\r')) == NULL))
   {
-    writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
+    writeError(ERR_ERROR, "[%s] SMTP server sent unexpected response to AUTH LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
+    
+  szTmpBuf2[0] = '\0';
+  szTmpBuf += 4;
+
+  if (strlen((char *)szTmpBuf) < SASL_BUFFER_SIZE)
+  {
+    memset(_psSessionData->bufSASL, 0, strlen((char *)szTmpBuf) + 1);
+    base64_decode((char *)szTmpBuf, _psSessionData->bufSASL);
+    writeError(ERR_DEBUG_MODULE, "[%s] SMTP server sent the following prompt: %s", MODULE_NAME, _psSessionData->bufSASL);
   }
-  FREE(bufSend);
 
   return SUCCESS;
 }
@@ -557,25 +570,17 @@ int sendAuthPLAIN(int hSocket, char* szLogin, char* szPassword)
 int sendAuthLOGIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
   unsigned char* bufReceive = NULL;
-  unsigned char* bufSend = NULL;
-  unsigned char* szPrompt = NULL;
-  unsigned char* szTmpBuf = NULL;
-  unsigned char* szTmpBuf2 = NULL;
-  unsigned char* szLoginDomain = NULL;
+  char szLoginDomain[512];
   int nReceiveBufferSize = 0;
+  int nSendBufferSize = 0;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating LOGIN Authentication Attempt.", MODULE_NAME);
 
   /* --- Send initial AUTH LOGIN command --- */
-  bufSend = malloc(12 + 1);
-  memset(bufSend, 0, 12 + 1);
-  sprintf((char *)bufSend, "AUTH LOGIN\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)"AUTH LOGIN\r\n", 12, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
-  FREE(bufSend);
 
   /* Server should respond with a base64-encoded username prompt */
   nReceiveBufferSize = 0;
@@ -586,48 +591,36 @@ int sendAuthLOGIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char
     return FAILURE;
   }
 
-  if (((szTmpBuf = (unsigned char *)strstr((char *)bufReceive, "334")) == NULL) || ((szTmpBuf2 = (unsigned char *)index((char *)szTmpBuf, '\r')) == NULL))
+  if (getPromptLOGIN(_psSessionData, bufReceive) == FAILURE)
   {
-    writeError(ERR_ERROR, "[%s] SMTP server sent unexpected response to AUTH LOGIN request.", MODULE_NAME);
+    FREE(bufReceive);
     return FAILURE;
   }
-    
-  szTmpBuf2[0] = '\0';
-
-  szTmpBuf += 4;
-  szPrompt = malloc(strlen((char *)szTmpBuf) + 1);
-  memset(szPrompt, 0, strlen((char *)szTmpBuf) + 1);
-
-  base64_decode((char *)szTmpBuf, (char *)szPrompt);
   FREE(bufReceive);
-
-  writeError(ERR_DEBUG_MODULE, "[%s] SMTP server sent the following prompt: %s", MODULE_NAME, szPrompt);
-  FREE(szPrompt);
   
   /* --- Send username --- */
-
-  /* Base64 encoded value can be up to 2x+2 original text. Leave additional space for "\r\n" and NULL */
   if (_psSessionData->szDomain)
   {
     /* DOMAIN\USERNAME */
-    szLoginDomain = malloc(strlen(_psSessionData->szDomain) + 1 + strlen(szLogin) + 1);
-    memset(szLoginDomain, 0, strlen(_psSessionData->szDomain) + 1 + strlen(szLogin) + 1);
-    sprintf((char *)szLoginDomain, "%s\\%s", _psSessionData->szDomain, szLogin); 
+    if (snprintf(szLoginDomain, sizeof(szLoginDomain), "%s\\%s", _psSessionData->szDomain, szLogin) >= (int)sizeof(szLoginDomain))
+    {
+      writeError(ERR_ERROR, "[%s] Username too long for AUTH LOGIN request.", MODULE_NAME);
+      return FAILURE;
+    }
   }
   else
-    szLoginDomain = (unsigned char *)szLogin;
+    snprintf(szLoginDomain, sizeof(szLoginDomain), "%s", szLogin);
 
   writeError(ERR_DEBUG_MODULE, "[%s] Sending authenticate login value: %s %s", MODULE_NAME, szLoginDomain, szPassword);
   
-  bufSend = malloc((2 * strlen((char *)szLoginDomain) + 2) + 2 + 1);
-  memset(bufSend, 0, (2 * strlen((char *)szLoginDomain) + 2) + 2 + 1);
-  base64_encode((char *)szLoginDomain, strlen((char *)szLoginDomain), (char *)bufSend);
-  strcat((char *)bufSend, "\r\n");
-  
-  if (_psSessionData->szDomain)
-    FREE(szLoginDomain);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szLoginDomain, strlen(szLoginDomain), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Username too long for AUTH LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
@@ -641,33 +634,22 @@ int sendAuthLOGIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char
     return FAILURE;
   }
 
-  if (((szTmpBuf = (unsigned char *)strstr((char *)bufReceive, "334")) == NULL) || ((szTmpBuf2 = (unsigned char *)index((char *)szTmpBuf, '\r')) == NULL))
+  if (getPromptLOGIN(_psSessionData, bufReceive) == FAILURE)
   {
-    writeError(ERR_ERROR, "[%s] SMTP server sent unexpected response to AUTH LOGIN request.", MODULE_NAME);
+    FREE(bufReceive);
     return FAILURE;
   }
-    
-  szTmpBuf2[0] = '\0';
-
-  szTmpBuf += 4;
-  szPrompt = malloc(strlen((char *)szTmpBuf) + 1);
-  memset(szPrompt, 0, strlen((char *)szTmpBuf) + 1);
-
-  base64_decode((char *)szTmpBuf, (char *)szPrompt);
   FREE(bufReceive);
 
-  writeError(ERR_DEBUG_MODULE, "[%s] SMTP server sent the following prompt: %s", MODULE_NAME, szPrompt);
-  FREE(szPrompt);
-
   /* --- Send password --- */
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, szPassword, strlen(szPassword), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Password too long for AUTH LOGIN request.", MODULE_NAME);
+    return FAILURE;
+  }
 
-  /* Base64 encoded value can be up to 2x+2 original text. Leave additional space for "\r\n" and NULL */
-  bufSend = malloc((2 * strlen(szPassword) + 2) + 2 + 1);
-  memset(bufSend, 0, (2 * strlen(szPassword) + 2) + 2 + 1);
-  base64_encode((char *)szPassword, strlen((char *)szPassword), (char *)bufSend);
-  strcat((char *)bufSend, "\r\n");
-
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] Failed: medusaSend was not successful", MODULE_NAME);
   }
@@ -680,7 +662,6 @@ int sendAuthLOGIN(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char
 */
 int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
-  unsigned char* bufSend = NULL;
   unsigned char* bufReceive = NULL;
   int nReceiveBufferSize = 0;
   int nSendBufferSize = 0;
@@ -688,7 +669,6 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   tSmbNtlmAuthChallenge sTmpChall;
   tSmbNtlmAuthResponse  sTmpResp;
   unsigned char* szTmpBuf = NULL;
-  unsigned char* szTmpBuf64 = NULL;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Initiating NTLM Authentication Attempt.", MODULE_NAME);
 
@@ -696,25 +676,19 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
 
   buildAuthRequest(&sTmpReq, 0, NULL, NULL);
 
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpReq) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpReq) + 2);
-
-  base64_encode((char *)&sTmpReq, SmbLength(&sTmpReq), (char *)szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen((char *)szTmpBuf64) + 2;
-  bufSend = malloc(10 + nSendBufferSize + 1);
-  memset(bufSend, 0, 10 + nSendBufferSize + 1);
-  sprintf((char *)bufSend, "AUTH NTLM %s\r\n", szTmpBuf64);
-
-  FREE(szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, "AUTH NTLM ", (char *)&sTmpReq, SmbLength(&sTmpReq), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM request too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending initial challenge (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL + 10);
 
-  if (medusaSend(hSocket, bufSend, strlen((char *)bufSend), 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
-  FREE(bufSend);
 
   /* Server should respond with a Base-64 encoded Type-2 challenge message. The challenge response format is 
      "334", followed by a space, followed by the challenge message. */
@@ -737,26 +711,20 @@ int sendAuthNTLM(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char*
   /* --- Calculate and send Base-64 encoded Type 3 response --- */
   buildAuthResponse(&sTmpChall, &sTmpResp, 0, szLogin, szPassword, _psSessionData->szDomain, NULL);
 
-  szTmpBuf64 = malloc(2 * SmbLength(&sTmpResp) + 2);
-  memset(szTmpBuf64, 0, 2 * SmbLength(&sTmpResp) + 2);
-
-  base64_encode((char *)&sTmpResp, SmbLength(&sTmpResp), (char *)szTmpBuf64);
-  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, szTmpBuf64);
-
-  nSendBufferSize = strlen((char *)szTmpBuf64) + 2;
-  bufSend = malloc(nSendBufferSize + 1);
-  memset(bufSend, 0, nSendBufferSize + 1);
-  sprintf((char *)bufSend, "%s\r\n", szTmpBuf64);
+  nSendBufferSize = base64_build(_psSessionData->bufSASL, SASL_BUFFER_SIZE, NULL, (char *)&sTmpResp, SmbLength(&sTmpResp), "\r\n");
+  if (nSendBufferSize < 0)
+  {
+    writeError(ERR_ERROR, "[%s] NTLM response too long for SASL buffer.", MODULE_NAME);
+    return FAILURE;
+  }
+  writeError(ERR_DEBUG_MODULE, "[%s] NTLM Response (B64 Encoded): %s", MODULE_NAME, _psSessionData->bufSASL);
 
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  if (medusaSend(hSocket, (unsigned char *)_psSessionData->bufSASL, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "[%s] failed: medusaSend was not successful", MODULE_NAME);
     return FAILURE;
   }
 
-  FREE(szTmpBuf64);
-  FREE(bufSend);
-
   return SUCCESS;
 }
 
@@ -770,7 +738,7 @@ int tryLogin(int hSocket, sLogin** psLogin, _MODULE_DATA* _psSessionData, char*
   {
     case AUTH_PLAIN:
       writeError(ERR_DEBUG_MODULE, "[%s] Sending PLAIN Authentication.", MODULE_NAME);
-      nRet = sendAuthPLAIN(hSocket, szLogin, szPassword);
+      nRet = sendAuthPLAIN(hSocket, _psSessionData, szLogin, szPassword);
       break;
     case AUTH_LOGIN:
       writeError(ERR_DEBUG_MODULE, "[%s] Sending LOGIN Authentication.", MODULE_NAME);
@@ -32,6 +32,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+
+/*
+  The request table is keyed by 4 byte request-ids. uthash (included by
+  module.h) hashes them one-at-a-time rather than with its default Jenkins
+  hash, whose switch trips -Wimplicit-fallthrough.
+*/
+#define HASH_FUNCTION HASH_OAT
 #include "module.h"
 
 #define MODULE_NAME    "snmp.mod"
@@ -54,13 +63,84 @@
 #define SEND_DELAY 200 /* Delay between sending SNMP requests (usec) */
 #define RECEIVE_DELAY 5*1000000 /* Response wait time (usec) */
 
+#define SNMP_MODE_HOST 1
+#define SNMP_MODE_SWEEP 2
+
+#define SWEEP_RETRIES 1         /* Retransmissions of unanswered requests */
+#define SWEEP_BATCH 64          /* Datagrams per sendmmsg()/recvmmsg() call */
+#define SWEEP_PACKET_SIZE 1500
+#define SWEEP_MAX_COMMUNITY 92  /* buildRead() uses short form BER lengths: 35 + community < 128 */
+#define SWEEP_IDLE_WAIT 100     /* Maximum engine poll() time (msec) */
+#define SWEEP_RCVBUF 4*1024*1024
+
+#define SWEEP_PENDING 0
+#define SWEEP_VALID 1
+#define SWEEP_TIMEOUT 2
+
 typedef struct __SNMP_DATA {
   int nVersion;
   int nReadWrite;
   int nReadTimeout;
   int nSendDelay;
+  int nMode;
+  int nRate;
+  int nRetries;
 } _SNMP_DATA;
 
+/*
+  SWEEP mode: all login threads share a single non-blocking UDP socket which is 
+  serviced by one engine thread. Each thread registers the community strings for 
+  its host and then waits for the engine to report the outcome. Requests are 
+  matched to their host by request-id and source address.
+*/
+typedef struct __SWEEP_REQUEST {
+  int nRequestId;                         /* key --> SNMP request-id */
+  struct __SWEEP_HOST *psHost;
+  struct __SWEEP_REQUEST *psSentNext;     /* outstanding requests, ordered by send time */
+  struct __SWEEP_REQUEST *psSentPrev;
+  struct __SWEEP_REQUEST *psResendNext;   /* expired requests waiting for retransmission */
+  int nResendQueued;
+  sUser *psUser;
+  char *szCommunity;
+  char *szLocation;
+  int nSent;
+  int64_t nSentTime;
+  int nStatus;
+
+  UT_hash_handle hh;                      /* required for UThash */
+} _SWEEP_REQUEST;
+
+typedef struct __SWEEP_HOST {
+  struct __SWEEP_HOST *psHostNext;
+  struct sockaddr_in sAddr;
+  _SNMP_DATA *psSessionData;
+  _SWEEP_REQUEST *psRequests;
+  int nRequests;
+  int nNextSend;                          /* next request which has not been sent */
+  int nComplete;
+  pthread_cond_t ptcDone;
+} _SWEEP_HOST;
+
+typedef struct __SWEEP_ENGINE {
+  int hSocket;
+  int nStarted;
+  int nRequestId;
+  int nRate;
+  double nTokens;
+  int64_t nTokenTime;
+  _SWEEP_HOST *psHosts;
+  _SWEEP_HOST *psHostCurrent;             /* round-robin position for new requests */
+  _SWEEP_REQUEST *psRequestHash;
+  _SWEEP_REQUEST *psSentHead;
+  _SWEEP_REQUEST *psSentTail;
+  _SWEEP_REQUEST *psResend;
+  pthread_t ptEngine;
+  pthread_mutex_t ptmMutex;
+  pthread_cond_t ptcWork;
+} _SWEEP_ENGINE;
+
+static _SWEEP_ENGINE sSweep = { .hSocket = -1, .ptmMutex = PTHREAD_MUTEX_INITIALIZER, .ptcWork = PTHREAD_COND_INITIALIZER };
+
 // Tells us whether we are to continue processing or not
 enum MODULE_STATE
 {
@@ -76,6 +156,8 @@ int sendRead(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword);
 int sendWrite(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword, char* szLocation);
 int receiveRequest(int hSocket, _SNMP_DATA* _psSessionData, int* nPassCount, char*** arrszPassList, char** szLocation);
 int initModule(sLogin* login, _SNMP_DATA *_psSessionData);
+int initModuleSweep(sLogin* login, _SNMP_DATA *_psSessionData);
+int buildRead(_SNMP_DATA* _psSessionData, char* szPassword, int nRequestId, unsigned char* bufSend);
 
 // Tell medusa how many parameters this module allows
 int getParamNumber()
@@ -115,6 +197,13 @@ void showUsage()
   writeVerbose(VB_NONE, "    Set the SNMP client version.");
   writeVerbose(VB_NONE, "  ACCESS:? (READ*, WRITE)");
   writeVerbose(VB_NONE, "    Set level of access to test for with the community string.");
+  writeVerbose(VB_NONE, "  MODE:? (HOST*, SWEEP)");
+  writeVerbose(VB_NONE, "    HOST opens a UDP socket per login thread. SWEEP shares a single socket between all");
+  writeVerbose(VB_NONE, "    hosts, batching requests and matching responses by request-id and source address.");
+  writeVerbose(VB_NONE, "  RATE:? ");
+  writeVerbose(VB_NONE, "    SWEEP mode: total queries per second sent by the shared socket (default: 1000000/SEND_DELAY).");
+  writeVerbose(VB_NONE, "  RETRIES:? ");
+  writeVerbose(VB_NONE, "    SWEEP mode: number of times an unanswered query is resent after TIMEOUT (default: 1).");
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "(*) Default value");
   writeVerbose(VB_NONE, "");
@@ -135,6 +224,17 @@ void showUsage()
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "  Usage example: \"-M snmp -m TIMEOUT:2 -m ACCESS:WRITE\"");
   writeVerbose(VB_NONE, "");
+  writeVerbose(VB_NONE, "SWEEP mode is intended for auditing large numbers of devices. Each host's login thread");
+  writeVerbose(VB_NONE, "only waits on the shared engine, so a high number of parallel hosts can be used.");
+  writeVerbose(VB_NONE, "");
+  writeVerbose(VB_NONE, "  Usage example: \"-M snmp -H hosts.txt -T 1000 -t 1 -m MODE:SWEEP -m RATE:20000\"");
+  writeVerbose(VB_NONE, "");
+}
+
+// Tell medusa the module waits in its own poll() engine and send delay, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
 }
 
 // The "main" of the medusa module world - this is what gets called to actually do the work
@@ -151,8 +251,10 @@ int go(sLogin* logins, int argc, char *argv[])
   psSessionData->nReadWrite = SNMP_READ;
   psSessionData->nReadTimeout = RECEIVE_DELAY;
   psSessionData->nSendDelay = SEND_DELAY;
+  psSessionData->nMode = SNMP_MODE_HOST;
+  psSessionData->nRetries = SWEEP_RETRIES;
 
-  if ((argc < 0) || (argc > 4))
+  if ((argc < 0) || (argc > 7))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -215,13 +317,53 @@ int go(sLogin* logins, int argc, char *argv[])
         else
           writeError(ERR_WARNING, "Method ACCESS requires value of \"READ\" or \"WRITE\" to be set.");
       }
+      else if (strcmp(pOpt, "MODE") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if (pOpt == NULL)
+          writeError(ERR_WARNING, "Method MODE requires value to be set.");
+        else if ( strcmp(pOpt, "HOST") == 0 )
+          psSessionData->nMode = SNMP_MODE_HOST;
+        else if ( strcmp(pOpt, "SWEEP") == 0 )
+          psSessionData->nMode = SNMP_MODE_SWEEP;
+        else
+          writeError(ERR_WARNING, "Method MODE requires value of \"HOST\" or \"SWEEP\" to be set.");
+      }
+      else if (strcmp(pOpt, "RATE") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if ( pOpt )
+          psSessionData->nRate = atoi(pOpt);
+        else
+          writeError(ERR_WARNING, "Method RATE requires value to be set.");
+      }
+      else if (strcmp(pOpt, "RETRIES") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if ( pOpt )
+          psSessionData->nRetries = atoi(pOpt);
+        else
+          writeError(ERR_WARNING, "Method RETRIES requires value to be set.");
+      }
       else
          writeError(ERR_WARNING, "Invalid method: %s.", pOpt);
 
       free(pOptTmp);
     }
 
-    initModule(logins, psSessionData);
+    if (psSessionData->nRate <= 0)
+      psSessionData->nRate = (psSessionData->nSendDelay > 0) ? 1000000 / psSessionData->nSendDelay : 1000000;
+
+    if (psSessionData->nMode == SNMP_MODE_SWEEP)
+      initModuleSweep(logins, psSessionData);
+    else
+      initModule(logins, psSessionData);
   }  
 
   FREE(psSessionData);
@@ -549,9 +691,9 @@ int processResponse(int nReceiveBufferSize, unsigned char* bufReceive, int *nSNM
   return FAILURE;
 }
 
-int sendRead(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword)
+/* Build GET system.sysLocation request. Returns the number of bytes to be sent. */
+int buildRead(_SNMP_DATA* _psSessionData, char* szPassword, int nRequestId, unsigned char* bufSend)
 {
-  unsigned char* bufSend;
   int nSendBufferSize = 0;
  
   struct _SNMPV1_A {
@@ -580,7 +722,7 @@ int sendRead(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword)
   } snmpv1_r = {
     .type = "\xa0\x1c",                                       /* GET */
     .identid = "\x02\x04",
-    .ident = "\x6f\x67\x4e\xe1",                              /* request id - doesn't matter */
+    .ident = "\x6f\x67\x4e\xe1",                              /* request id */
     .errstat = "\x02\x01\x00",                                /* no error */
     .errind = "\x02\x01\x00",                                 /* error index 0 */
     .objectid = "\x30\x0e",
@@ -591,19 +733,38 @@ int sendRead(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword)
   if (_psSessionData->nVersion == SNMP_VER_V2C)  
     snmpv1_a.ver[2] = '\x01';
 
+  /* request-id is a 4 octet INTEGER -- kept positive so that it is encoded as-is */
+  if (nRequestId > 0)
+  {
+    snmpv1_r.ident[0] = (nRequestId >> 24) & 0x7f;
+    snmpv1_r.ident[1] = (nRequestId >> 16) & 0xff;
+    snmpv1_r.ident[2] = (nRequestId >> 8) & 0xff;
+    snmpv1_r.ident[3] = nRequestId & 0xff;
+  }
+
   /* GET system.sysLocation */
   nSendBufferSize = sizeof(snmpv1_a) + sizeof(snmpv1_r) + strlen(szPassword); 
   snmpv1_a.comlen = (char) strlen(szPassword);
   snmpv1_a.len = nSendBufferSize - 3;
   
-  bufSend = malloc(nSendBufferSize); 
   memset(bufSend, 0, nSendBufferSize);
   memcpy(bufSend, &snmpv1_a, sizeof(snmpv1_a));
   memcpy(bufSend + sizeof(snmpv1_a), szPassword, strlen(szPassword));
   memcpy(bufSend + sizeof(snmpv1_a) + strlen(szPassword), &snmpv1_r, sizeof(snmpv1_r));
 
+  return nSendBufferSize - 1;
+}
+
+int sendRead(int hSocket, _SNMP_DATA* _psSessionData, char* szPassword)
+{
+  unsigned char* bufSend;
+  int nSendBufferSize = 0;
+
+  bufSend = malloc(SWEEP_PACKET_SIZE + strlen(szPassword));
+  nSendBufferSize = buildRead(_psSessionData, szPassword, 0, bufSend);
+
   writeError(ERR_DEBUG_MODULE, "[%s] Sending GET request for system.sysLocation.", MODULE_NAME);
-  if (medusaSend(hSocket, bufSend, nSendBufferSize - 1, 0) < 0)
+  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
     free(bufSend);
@@ -736,3 +897,680 @@ int receiveRequest(int hSocket, _SNMP_DATA* _psSessionData, int* nPassCount, cha
 
   return(nResponse);
 }
+
+/* SWEEP Mode Functions */
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+  typedef struct mmsghdr _SWEEP_MSG;
+#else
+  /* emulate batched calls using a single sendmsg()/recvmsg() per datagram */
+  typedef struct __SWEEP_MSG {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+  } _SWEEP_MSG;
+
+  static int sendmmsg(int hSocket, _SWEEP_MSG *psMsg, unsigned int nMsg, int nFlags)
+  {
+    unsigned int i;
+    ssize_t nRet;
+
+    for (i = 0; i < nMsg; i++)
+    {
+      if ((nRet = sendmsg(hSocket, &psMsg[i].msg_hdr, nFlags)) < 0)
+        return (i > 0) ? (int)i : -1;
+      psMsg[i].msg_len = nRet;
+    }
+
+    return nMsg;
+  }
+
+  static int recvmmsg(int hSocket, _SWEEP_MSG *psMsg, unsigned int nMsg, int nFlags, struct timespec *psTimeout __attribute__((unused)))
+  {
+    unsigned int i;
+    ssize_t nRet;
+
+    for (i = 0; i < nMsg; i++)
+    {
+      if ((nRet = recvmsg(hSocket, &psMsg[i].msg_hdr, nFlags)) < 0)
+        return (i > 0) ? (int)i : -1;
+      psMsg[i].msg_len = nRet;
+    }
+
+    return nMsg;
+  }
+#endif
+
+static int64_t sweepTime()
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Read a BER tag and length. Returns the size of the header or -1 if malformed. */
+static int berHeader(unsigned char *buf, int nLength, unsigned char *nTag, int *nValueLength)
+{
+  int i, nOctets, nHeader = 2;
+
+  if (nLength < 2)
+    return -1;
+
+  *nTag = buf[0];
+  *nValueLength = 0;
+
+  if (buf[1] & 0x80)
+  {
+    nOctets = buf[1] & 0x7f;
+    if ((nOctets < 1) || (nOctets > 3) || (nLength < 2 + nOctets))
+      return -1;
+
+    for (i = 0; i < nOctets; i++)
+      *nValueLength = (*nValueLength << 8) + buf[2 + i];
+
+    nHeader += nOctets;
+  }
+  else
+    *nValueLength = buf[1];
+
+  if (nHeader + *nValueLength > nLength)
+    return -1;
+
+  return nHeader;
+}
+
+/* Read a BER INTEGER value (up to 4 octets) */
+static int berInteger(unsigned char *buf, int nLength, int *nValue)
+{
+  unsigned char nTag;
+  int i, nValueLength, nHeader;
+
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0x02) || (nValueLength < 1) || (nValueLength > 4))
+    return -1;
+
+  *nValue = 0;
+  for (i = 0; i < nValueLength; i++)
+    *nValue = (*nValue << 8) + buf[nHeader + i];
+
+  return nHeader + nValueLength;
+}
+
+/*
+  Walk a GetResponse PDU and extract the request-id, error-status and the value
+  of the first variable binding (sysLocation).
+
+  SEQUENCE { version, community, GetResponse-PDU { request-id, error-status, 
+             error-index, SEQUENCE { SEQUENCE { name, value } } } }
+*/
+static int parseSweepResponse(unsigned char *buf, int nLength, int *nRequestId, int *nErrorStatus, char **szLocation)
+{
+  unsigned char nTag;
+  int nValueLength, nHeader, nValue;
+  int i;
+
+  /* message SEQUENCE */
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0x30))
+    return FAILURE;
+  buf += nHeader; nLength = nValueLength;
+
+  /* version */
+  if ((nHeader = berInteger(buf, nLength, &nValue)) < 0)
+    return FAILURE;
+  buf += nHeader; nLength -= nHeader;
+
+  /* community */
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0x04))
+    return FAILURE;
+  buf += nHeader + nValueLength; nLength -= nHeader + nValueLength;
+
+  /* GetResponse-PDU */
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0xa2))
+    return FAILURE;
+  buf += nHeader; nLength = nValueLength;
+
+  if ((nHeader = berInteger(buf, nLength, nRequestId)) < 0)
+    return FAILURE;
+  buf += nHeader; nLength -= nHeader;
+
+  if ((nHeader = berInteger(buf, nLength, nErrorStatus)) < 0)
+    return FAILURE;
+  buf += nHeader; nLength -= nHeader;
+
+  if ((nHeader = berInteger(buf, nLength, &nValue)) < 0)
+    return FAILURE;
+  buf += nHeader; nLength -= nHeader;
+
+  /* variable-bindings SEQUENCE, first VarBind SEQUENCE and its name */
+  for (i = 0; i < 2; i++)
+  {
+    if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0x30))
+      return SUCCESS;
+    buf += nHeader; nLength = nValueLength;
+  }
+
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) < 0) || (nTag != 0x06))
+    return SUCCESS;
+  buf += nHeader + nValueLength; nLength -= nHeader + nValueLength;
+
+  /* sysLocation value (SNMPv2c may return noSuchObject exceptions instead) */
+  if (((nHeader = berHeader(buf, nLength, &nTag, &nValueLength)) >= 0) && (nTag == 0x04))
+  {
+    *szLocation = malloc(nValueLength + 1);
+    memset(*szLocation, 0, nValueLength + 1);
+    memcpy(*szLocation, buf + nHeader, nValueLength);
+  }
+
+  return SUCCESS;
+}
+
+/* Engine mutex must be held. Marks request as finished and wakes the owning login thread once its host completes. */
+static void sweepComplete(_SWEEP_REQUEST *psRequest, int nStatus)
+{
+  _SWEEP_HOST *psHost = psRequest->psHost;
+  _SWEEP_HOST **ppsHost;
+  _SWEEP_REQUEST **ppsRequest;
+
+  psRequest->nStatus = nStatus;
+  HASH_DEL(sSweep.psRequestHash, psRequest);
+
+  /* a late reply may arrive while the request waits for retransmission */
+  if (psRequest->nResendQueued)
+  {
+    for (ppsRequest = &sSweep.psResend; *ppsRequest; ppsRequest = &(*ppsRequest)->psResendNext)
+    {
+      if (*ppsRequest == psRequest)
+      {
+        *ppsRequest = psRequest->psResendNext;
+        break;
+      }
+    }
+
+    psRequest->psResendNext = NULL;
+    psRequest->nResendQueued = FALSE;
+  }
+
+  /* unlink from the outstanding request list */
+  if (psRequest->psSentPrev)
+    psRequest->psSentPrev->psSentNext = psRequest->psSentNext;
+  else if (sSweep.psSentHead == psRequest)
+    sSweep.psSentHead = psRequest->psSentNext;
+
+  if (psRequest->psSentNext)
+    psRequest->psSentNext->psSentPrev = psRequest->psSentPrev;
+  else if (sSweep.psSentTail == psRequest)
+    sSweep.psSentTail = psRequest->psSentPrev;
+
+  psRequest->psSentNext = NULL;
+  psRequest->psSentPrev = NULL;
+
+  psHost->nComplete++;
+  if (psHost->nComplete == psHost->nRequests)
+  {
+    for (ppsHost = &sSweep.psHosts; *ppsHost; ppsHost = &(*ppsHost)->psHostNext)
+    {
+      if (*ppsHost == psHost)
+      {
+        *ppsHost = psHost->psHostNext;
+        break;
+      }
+    }
+
+    if (sSweep.psHostCurrent == psHost)
+      sSweep.psHostCurrent = psHost->psHostNext;
+
+    pthread_cond_signal(&psHost->ptcDone);
+  }
+}
+
+/* Engine mutex must be held. Append request to the tail of the outstanding list. */
+static void sweepSent(_SWEEP_REQUEST *psRequest, int64_t nNow)
+{
+  psRequest->nSent++;
+  psRequest->nSentTime = nNow;
+  psRequest->psSentNext = NULL;
+  psRequest->psSentPrev = sSweep.psSentTail;
+
+  if (sSweep.psSentTail)
+    sSweep.psSentTail->psSentNext = psRequest;
+  else
+    sSweep.psSentHead = psRequest;
+
+  sSweep.psSentTail = psRequest;
+}
+
+static void sweepReceive(_SWEEP_MSG *psMsg, struct sockaddr_in *psAddr, unsigned char (*bufReceive)[SWEEP_PACKET_SIZE])
+{
+  int i, nReceived, nRequestId, nErrorStatus;
+  char *szLocation;
+  _SWEEP_REQUEST *psRequest;
+
+  while (1)
+  {
+    for (i = 0; i < SWEEP_BATCH; i++)
+      psMsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    nReceived = recvmmsg(sSweep.hSocket, psMsg, SWEEP_BATCH, MSG_DONTWAIT, NULL);
+    if (nReceived <= 0)
+      break;
+
+    pthread_mutex_lock(&sSweep.ptmMutex);
+
+    for (i = 0; i < nReceived; i++)
+    {
+      szLocation = NULL;
+      if (parseSweepResponse(bufReceive[i], psMsg[i].msg_len, &nRequestId, &nErrorStatus, &szLocation) == FAILURE)
+      {
+        writeError(ERR_DEBUG_MODULE, "[%s] Discarding malformed response from %s.", MODULE_NAME, inet_ntoa(psAddr[i].sin_addr));
+        continue;
+      }
+
+      HASH_FIND_INT(sSweep.psRequestHash, &nRequestId, psRequest);
+      if ((psRequest == NULL) || (psRequest->psHost->sAddr.sin_addr.s_addr != psAddr[i].sin_addr.s_addr) || (psRequest->psHost->sAddr.sin_port != psAddr[i].sin_port))
+      {
+        writeError(ERR_DEBUG_MODULE, "[%s] Discarding unexpected response (request-id %d) from %s.", MODULE_NAME, nRequestId, inet_ntoa(psAddr[i].sin_addr));
+        FREE(szLocation);
+        continue;
+      }
+
+      if (nErrorStatus == 0)
+      {
+        writeError(ERR_DEBUG_MODULE, "[%s] Host: %s Located valid community string: %s.", MODULE_NAME, inet_ntoa(psAddr[i].sin_addr), psRequest->szCommunity);
+        psRequest->szLocation = szLocation;
+        sweepComplete(psRequest, SWEEP_VALID);
+      }
+      else
+      {
+        FREE(szLocation);
+        sweepComplete(psRequest, SWEEP_TIMEOUT);
+      }
+    }
+
+    pthread_mutex_unlock(&sSweep.ptmMutex);
+
+    if (nReceived < SWEEP_BATCH)
+      break;
+  }
+}
+
+/*
+  Engine thread. Each pass expires/retransmits outstanding requests, sends a 
+  batch of new requests (round-robin across registered hosts, paced by a token
+  bucket) and then collects any responses.
+*/
+static void *sweepEngine(void *arg __attribute__((unused)))
+{
+  static _SWEEP_MSG sMsgSend[SWEEP_BATCH], sMsgReceive[SWEEP_BATCH];
+  static struct iovec sIovSend[SWEEP_BATCH], sIovReceive[SWEEP_BATCH];
+  static unsigned char bufSend[SWEEP_BATCH][SWEEP_PACKET_SIZE];
+  static unsigned char bufReceive[SWEEP_BATCH][SWEEP_PACKET_SIZE];
+  static struct sockaddr_in sAddrReceive[SWEEP_BATCH];
+  _SWEEP_REQUEST *psRequest, *psResendTail;
+  _SWEEP_HOST *psHost;
+  struct pollfd sPoll;
+  int64_t nNow, nWait;
+  int i, nBatch, nSent, nScanned;
+
+  for (i = 0; i < SWEEP_BATCH; i++)
+  {
+    sIovReceive[i].iov_base = bufReceive[i];
+    sIovReceive[i].iov_len = SWEEP_PACKET_SIZE;
+    memset(&sMsgReceive[i], 0, sizeof(_SWEEP_MSG));
+    sMsgReceive[i].msg_hdr.msg_iov = &sIovReceive[i];
+    sMsgReceive[i].msg_hdr.msg_iovlen = 1;
+    sMsgReceive[i].msg_hdr.msg_name = &sAddrReceive[i];
+  }
+
+  while (1)
+  {
+    pthread_mutex_lock(&sSweep.ptmMutex);
+
+    while (sSweep.psHosts == NULL)
+      pthread_cond_wait(&sSweep.ptcWork, &sSweep.ptmMutex);
+
+    nNow = sweepTime();
+
+    /* expire outstanding requests -- resend or give up */
+    psResendTail = NULL;
+    while ((sSweep.psSentHead) && (nNow - sSweep.psSentHead->nSentTime >= sSweep.psSentHead->psHost->psSessionData->nReadTimeout))
+    {
+      psRequest = sSweep.psSentHead;
+
+      if (psRequest->nSent > psRequest->psHost->psSessionData->nRetries)
+      {
+        sweepComplete(psRequest, SWEEP_TIMEOUT);
+        continue;
+      }
+
+      sSweep.psSentHead = psRequest->psSentNext;
+      if (sSweep.psSentHead)
+        sSweep.psSentHead->psSentPrev = NULL;
+      else
+        sSweep.psSentTail = NULL;
+      psRequest->psSentNext = NULL;
+
+      if (psResendTail)
+        psResendTail->psResendNext = psRequest;
+      else
+      {
+        for (psResendTail = sSweep.psResend; (psResendTail) && (psResendTail->psResendNext); psResendTail = psResendTail->psResendNext);
+        if (psResendTail)
+          psResendTail->psResendNext = psRequest;
+        else
+          sSweep.psResend = psRequest;
+      }
+
+      psRequest->psResendNext = NULL;
+      psRequest->nResendQueued = TRUE;
+      psResendTail = psRequest;
+    }
+
+    /* token bucket output pacing */
+    sSweep.nTokens += (double)(nNow - sSweep.nTokenTime) * sSweep.nRate / 1000000;
+    if (sSweep.nTokens > SWEEP_BATCH)
+      sSweep.nTokens = SWEEP_BATCH;
+    sSweep.nTokenTime = nNow;
+
+    /* retransmissions take priority over new requests */
+    nBatch = 0;
+    while ((sSweep.psResend) && (nBatch < (int)sSweep.nTokens))
+    {
+      psRequest = sSweep.psResend;
+      sSweep.psResend = psRequest->psResendNext;
+      psRequest->psResendNext = NULL;
+      psRequest->nResendQueued = FALSE;
+
+      writeError(ERR_DEBUG_MODULE, "[%s] Host: %s Resending query (%d/%d): %s", MODULE_NAME, inet_ntoa(psRequest->psHost->sAddr.sin_addr), psRequest->nSent, psRequest->psHost->psSessionData->nRetries, psRequest->szCommunity);
+      sIovSend[nBatch].iov_len = buildRead(psRequest->psHost->psSessionData, psRequest->szCommunity, psRequest->nRequestId, bufSend[nBatch]);
+      sMsgSend[nBatch].msg_hdr.msg_name = &psRequest->psHost->sAddr;
+      sweepSent(psRequest, nNow);
+      nBatch++;
+    }
+
+    nScanned = 0;
+    while ((sSweep.psHosts) && (nBatch < (int)sSweep.nTokens) && (nScanned < SWEEP_BATCH))
+    {
+      if (sSweep.psHostCurrent == NULL)
+        sSweep.psHostCurrent = sSweep.psHosts;
+
+      psHost = sSweep.psHostCurrent;
+      sSweep.psHostCurrent = psHost->psHostNext;
+      nScanned++;
+
+      if (psHost->nNextSend >= psHost->nRequests)
+        continue;
+
+      psRequest = &psHost->psRequests[psHost->nNextSend++];
+      psRequest->nRequestId = sSweep.nRequestId++ & 0x7fffffff;
+      if (psRequest->nRequestId == 0)
+        psRequest->nRequestId = sSweep.nRequestId++;
+      HASH_ADD_INT(sSweep.psRequestHash, nRequestId, psRequest);
+
+      sIovSend[nBatch].iov_len = buildRead(psHost->psSessionData, psRequest->szCommunity, psRequest->nRequestId, bufSend[nBatch]);
+      sMsgSend[nBatch].msg_hdr.msg_name = &psHost->sAddr;
+      sweepSent(psRequest, nNow);
+      nBatch++;
+      nScanned = 0;
+    }
+
+    sSweep.nTokens -= nBatch;
+
+    /* next event -- a token becoming available, a request expiring or at most SWEEP_IDLE_WAIT */
+    nWait = SWEEP_IDLE_WAIT * 1000;
+    if (sSweep.psSentHead)
+    {
+      if (sSweep.psSentHead->nSentTime + sSweep.psSentHead->psHost->psSessionData->nReadTimeout - nNow < nWait)
+        nWait = sSweep.psSentHead->nSentTime + sSweep.psSentHead->psHost->psSessionData->nReadTimeout - nNow;
+    }
+    if ((nBatch > 0) || (sSweep.psResend))
+      nWait = 0;
+
+    pthread_mutex_unlock(&sSweep.ptmMutex);
+
+    for (i = 0, nSent = 0; (nBatch > 0) && (nSent < nBatch); )
+    {
+      for (i = 0; i < nBatch; i++)
+      {
+        sIovSend[i].iov_base = bufSend[i];
+        sMsgSend[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        sMsgSend[i].msg_hdr.msg_iov = &sIovSend[i];
+        sMsgSend[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      i = sendmmsg(sSweep.hSocket, sMsgSend + nSent, nBatch - nSent, 0);
+      if (i < 0)
+      {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS))
+        {
+          sPoll.fd = sSweep.hSocket;
+          sPoll.events = POLLOUT;
+          poll(&sPoll, 1, SWEEP_IDLE_WAIT);
+          continue;
+        }
+
+        /* requests remain outstanding and will be resent once they expire */
+        writeError(ERR_ERROR, "[%s] sendmmsg() failed: %s", MODULE_NAME, strerror(errno));
+        break;
+      }
+      nSent += i;
+    }
+
+    sPoll.fd = sSweep.hSocket;
+    sPoll.events = POLLIN;
+    sPoll.revents = 0;
+    if (poll(&sPoll, 1, (int)((nWait + 999) / 1000)) > 0)
+      sweepReceive(sMsgReceive, sAddrReceive, bufReceive);
+  }
+
+  return NULL;
+}
+
+/* Create the shared socket and engine thread on first use */
+static int sweepStart(_SNMP_DATA *_psSessionData)
+{
+  int nRcvBuf = SWEEP_RCVBUF;
+  long flag;
+
+  pthread_mutex_lock(&sSweep.ptmMutex);
+
+  if (sSweep.nStarted)
+  {
+    pthread_mutex_unlock(&sSweep.ptmMutex);
+    return SUCCESS;
+  }
+
+  if ((sSweep.hSocket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed to create SWEEP socket: %s", MODULE_NAME, strerror(errno));
+    pthread_mutex_unlock(&sSweep.ptmMutex);
+    return FAILURE;
+  }
+
+  if (setsockopt(sSweep.hSocket, SOL_SOCKET, SO_RCVBUF, &nRcvBuf, sizeof(nRcvBuf)) < 0)
+    writeError(ERR_DEBUG_MODULE, "[%s] Failed to increase SWEEP socket receive buffer.", MODULE_NAME);
+
+  flag = fcntl(sSweep.hSocket, F_GETFL, NULL);
+  fcntl(sSweep.hSocket, F_SETFL, flag | O_NONBLOCK);
+
+  srandom(time(NULL) ^ getpid());
+  sSweep.nRequestId = (random() & 0x3fffffff) + 1;
+  sSweep.nRate = _psSessionData->nRate;
+  sSweep.nTokenTime = sweepTime();
+
+  if (pthread_create(&sSweep.ptEngine, NULL, sweepEngine, NULL) != 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed to create SWEEP engine thread.", MODULE_NAME);
+    close(sSweep.hSocket);
+    sSweep.hSocket = -1;
+    pthread_mutex_unlock(&sSweep.ptmMutex);
+    return FAILURE;
+  }
+  pthread_detach(sSweep.ptEngine);
+
+  writeError(ERR_DEBUG_MODULE, "[%s] SWEEP engine started (%d queries/sec).", MODULE_NAME, sSweep.nRate);
+  sSweep.nStarted = TRUE;
+
+  pthread_mutex_unlock(&sSweep.ptmMutex);
+  return SUCCESS;
+}
+
+/*
+  SWEEP mode login thread. All of the host's community strings are handed to the
+  shared engine at once. Once every request has been answered or has expired, the
+  results are reported and (optionally) WRITE access is checked for the valid ones.
+*/
+int initModuleSweep(sLogin* psLogin, _SNMP_DATA *_psSessionData)
+{
+  _SWEEP_HOST sHost;
+  _SWEEP_REQUEST *psRequest;
+  sCredentialSet *psCredSet = NULL;
+  sUser *psUserCurrent;
+  sConnectParams params;
+  char **arrszPassListWrite = NULL;
+  char *szLocation = NULL;
+  int hSocket = -1;
+  int i, nAllocated = 0, nPassCountWrite;
+
+  if (sweepStart(_psSessionData) == FAILURE)
+  {
+    psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+    return FAILURE;
+  }
+
+  memset(&params, 0, sizeof(sConnectParams));
+  params.nPort = PORT_SNMP;
+  initConnectionParams(psLogin, &params);
+
+  memset(&sHost, 0, sizeof(_SWEEP_HOST));
+  sHost.sAddr.sin_family = AF_INET;
+  sHost.sAddr.sin_port = htons(params.nPort);
+  sHost.sAddr.sin_addr.s_addr = params.nHost;
+  sHost.psSessionData = _psSessionData;
+  pthread_cond_init(&sHost.ptcDone, NULL);
+
+  /* gather every credential set available to this login thread */
+  psCredSet = malloc( sizeof(sCredentialSet) );
+  memset(psCredSet, 0, sizeof(sCredentialSet));
+
+  while ((getNextCredSet(psLogin, psCredSet) == SUCCESS) && (psCredSet->iStatus != CREDENTIAL_DONE) && (psCredSet->psUser))
+  {
+    /* too long to be sent - reported as not tested */
+    if (strlen(psCredSet->pPass) > SWEEP_MAX_COMMUNITY)
+    {
+      writeError(ERR_ERROR, "[%s] Host: %s - Skipping community string longer than %d bytes.", MODULE_NAME, psLogin->psServer->pHostIP, SWEEP_MAX_COMMUNITY);
+      psUserCurrent = psLogin->psUser;
+      psLogin->psUser = psCredSet->psUser;
+      psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+      setPassResult(psLogin, psCredSet->pPass);
+      psLogin->psUser = psUserCurrent;
+      continue;
+    }
+
+    if (sHost.nRequests == nAllocated)
+    {
+      nAllocated = (nAllocated) ? nAllocated * 2 : 64;
+      sHost.psRequests = realloc(sHost.psRequests, nAllocated * sizeof(_SWEEP_REQUEST));
+    }
+
+    psRequest = &sHost.psRequests[sHost.nRequests++];
+    memset(psRequest, 0, sizeof(_SWEEP_REQUEST));
+    psRequest->psHost = &sHost;
+    psRequest->psUser = psCredSet->psUser;
+    psRequest->szCommunity = psCredSet->pPass;
+  }
+
+  FREE(psCredSet);
+
+  if (sHost.nRequests == 0)
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] module started for host: %s - no more available users to test.", MODULE_NAME, psLogin->psServer->pHostIP);
+    pthread_cond_destroy(&sHost.ptcDone);
+    return SUCCESS;
+  }
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Host: %s - Submitting %d queries to SWEEP engine.", MODULE_NAME, psLogin->psServer->pHostIP, sHost.nRequests);
+
+  /* register host with engine and wait for all requests to complete */
+  pthread_mutex_lock(&sSweep.ptmMutex);
+  sHost.psHostNext = sSweep.psHosts;
+  sSweep.psHosts = &sHost;
+  pthread_cond_signal(&sSweep.ptcWork);
+
+  while (sHost.nComplete < sHost.nRequests)
+    pthread_cond_wait(&sHost.ptcDone, &sSweep.ptmMutex);
+  pthread_mutex_unlock(&sSweep.ptmMutex);
+
+  pthread_cond_destroy(&sHost.ptcDone);
+
+  /* report results */
+  psUserCurrent = psLogin->psUser;
+
+  for (i = 0; i < sHost.nRequests; i++)
+  {
+    psRequest = &sHost.psRequests[i];
+    psLogin->psUser = psRequest->psUser;
+
+    if (psRequest->nStatus != SWEEP_VALID)
+    {
+      psLogin->iResult = LOGIN_RESULT_FAIL;
+      setPassResult(psLogin, psRequest->szCommunity);
+      continue;
+    }
+
+    if (_psSessionData->nReadWrite == SNMP_WRITE)
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Checking if community string has WRITE access.", MODULE_NAME);
+
+      if ((hSocket < 0) && ((hSocket = medusaConnectUDP(&params)) < 0))
+      {
+        writeError(ERR_ERROR, "[%s] Failed to create UDP socket for SET request.", MODULE_NAME);
+        psLogin->iResult = LOGIN_RESULT_ERROR;
+      }
+      else if (sendWrite(hSocket, _psSessionData, psRequest->szCommunity, psRequest->szLocation))
+      {
+        writeError(ERR_ERROR, "[%s] Failed to send SET request.", MODULE_NAME);
+        psLogin->iResult = LOGIN_RESULT_ERROR;
+      }
+      else if (receiveRequest(hSocket, _psSessionData, &nPassCountWrite, &arrszPassListWrite, &szLocation) == SUCCESS)
+      {
+        writeError(ERR_DEBUG_MODULE, "[%s] Located valid WRITE community string: %s.", MODULE_NAME, psRequest->szCommunity);
+        psLogin->iResult = LOGIN_RESULT_SUCCESS;
+      }
+      else
+      {
+        writeError(ERR_ERROR, "[%s] Community string appears to have only READ access.", MODULE_NAME);
+        psLogin->iResult = LOGIN_RESULT_ERROR;
+      }
+
+      if (arrszPassListWrite)
+      {
+        for (nPassCountWrite--; nPassCountWrite >= 0; nPassCountWrite--)
+          FREE(arrszPassListWrite[nPassCountWrite]);
+        FREE(arrszPassListWrite);
+      }
+      FREE(szLocation);
+    }
+    else
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Located valid READ community string: %s.", MODULE_NAME, psRequest->szCommunity);
+      psLogin->iResult = LOGIN_RESULT_SUCCESS;
+    }
+
+    setPassResult(psLogin, psRequest->szCommunity);
+    FREE(psRequest->szLocation);
+  }
+
+  psLogin->psUser = psUserCurrent;
+
+  if (hSocket > 0)
+    medusaDisconnect(hSocket);
+
+  FREE(sHost.psRequests);
+  return SUCCESS;
+}
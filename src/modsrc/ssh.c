@@ -44,6 +44,7 @@
 #ifdef HAVE_LIBSSH2
 
 #include <libssh2.h>
+#include "../uthash.h"
 
 #define PORT_SSH 22
 #define SSH_AUTH_UNDEFINED 1
@@ -52,12 +53,43 @@
 #define SSH_AUTH_ERROR 4
 #define SSH_CONN_UNKNOWN 1
 #define SSH_CONN_ESTABLISHED 2
+#define SSH_USER_CHANGE_UNKNOWN 0
+#define SSH_USER_CHANGE_ALLOWED 1
+#define SSH_USER_CHANGE_DENIED 2
+
+/* Default algorithm preferences -- cheapest first. Methods unknown to the installed libssh2 are ignored. */
+#define SSH_PREF_KEX "curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,diffie-hellman-group14-sha256,diffie-hellman-group14-sha1,diffie-hellman-group-exchange-sha256,diffie-hellman-group-exchange-sha1,diffie-hellman-group1-sha1"
+#define SSH_PREF_HOSTKEY "ssh-ed25519,ecdsa-sha2-nistp256,rsa-sha2-256,rsa-sha2-512,ssh-rsa,ecdsa-sha2-nistp384,ecdsa-sha2-nistp521,ssh-dss"
+#define SSH_PREF_CIPHER "aes128-ctr,aes128-gcm@openssh.com,chacha20-poly1305@openssh.com,aes256-ctr,aes256-gcm@openssh.com,aes192-ctr,aes128-cbc,aes256-cbc,3des-cbc"
+
+/* 
+  What has been learned about a host. Shared by all login threads testing the
+  host, since each thread otherwise has to rediscover it with its own connection.
+*/
+typedef struct __SSH2_HOST {
+  char *szHostIP;                   /* key */
+  int nMaxAuthTries;                /* failed attempts the server accepts per connection (0 = unknown) */
+  int nUserChange;                  /* whether a new username can be used on an existing connection */
+  UT_hash_handle hh;
+} _SSH2_HOST;
 
 typedef struct __SSH2_DATA {
   char *szBannerMsg;
   int iConnectionStatus;
+  char *szPrefKex;
+  char *szPrefHostKey;
+  char *szPrefCipher;
+  char *szPrefMac;
+  int nAuthTries;                   /* user-supplied attempts per connection (0 = learn) */
+  _SSH2_HOST *psHost;
+  int nAttempts;                    /* completed attempts on current connection */
+  char *szAuthUser;                 /* user whose auth methods were retrieved on current connection */
+  int iAuthMode;
 } _SSH2_DATA;
 
+static _SSH2_HOST *psHostTable = NULL;
+static pthread_mutex_t ptmHostTable = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct __ssh2_session_data {
   char *pPass;
   int iAnswerCount;
@@ -75,6 +107,8 @@ enum MODULE_STATE
 // Forward declarations
 int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** login, char* szLogin, char* szPassword);
 int initModule(sLogin* login, _SSH2_DATA *_psSessionData);
+_SSH2_HOST* getHostInfo(char *szHostIP);
+void setMethodPref(LIBSSH2_SESSION *session, int iMethod, char *szName, char *szPrefs);
 
 // Tell medusa how many parameters this module allows
 int getParamNumber()
@@ -82,6 +116,18 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL __attribute__((unused)))
+{
+  return PORT_SSH;
+}
+
+// Tell medusa the module waits in libssh2, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -107,20 +153,31 @@ void showUsage()
   writeVerbose(VB_NONE, "%s (%s) %s :: %s\n", MODULE_NAME, MODULE_VERSION, MODULE_AUTHOR, MODULE_SUMMARY_USAGE);
   writeVerbose(VB_NONE, "Available module options:");
   writeVerbose(VB_NONE, "  BANNER:? (Libssh client banner. Default SSH-2.0-MEDUSA.)");
+  writeVerbose(VB_NONE, "  KEX:? (Comma separated key exchange preference list.)");
+  writeVerbose(VB_NONE, "  HOSTKEY:? (Comma separated host key preference list.)");
+  writeVerbose(VB_NONE, "  CIPHER:? (Comma separated cipher preference list.)");
+  writeVerbose(VB_NONE, "  MAC:? (Comma separated MAC preference list. Default: libssh2 default.)");
+  writeVerbose(VB_NONE, "    The default KEX, HOSTKEY and CIPHER lists favour the least expensive algorithms");
+  writeVerbose(VB_NONE, "    (e.g. curve25519, ed25519, aes128-ctr). Use the value DEFAULT for libssh2's own order.");
+  writeVerbose(VB_NONE, "  AUTHTRIES:? (Authentication attempts per connection. Default: learned from host.)");
+  writeVerbose(VB_NONE, "    The connection is reused across passwords, and across users if the server allows it.");
+  writeVerbose(VB_NONE, "    When the server drops the connection, the number of attempts it allowed is recorded");
+  writeVerbose(VB_NONE, "    and later connections are recycled before reaching that limit.");
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "Usage example: \"-M ssh -m BANNER:SSH-2.0-FOOBAR\"");
+  writeVerbose(VB_NONE, "Usage example: \"-M ssh -m KEX:curve25519-sha256 -m CIPHER:aes128-ctr -m AUTHTRIES:5\"");
 }
 
 // The "main" of the medusa module world - this is what gets called to actually do the work
 int go(sLogin* logins, int argc, char *argv[])
 {
   int i;
-  char *strtok_ptr, *pOpt, *pOptTmp;
+  char *strtok_ptr, *pOpt, *pOptTmp, *pOptName;
   _SSH2_DATA *psSessionData = NULL;
   psSessionData = malloc(sizeof(_SSH2_DATA));
   memset(psSessionData, 0, sizeof(_SSH2_DATA));
 
-  if ((argc < 0) || (argc > 1))
+  if ((argc < 0) || (argc > 7))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -147,6 +204,40 @@ int go(sLogin* logins, int argc, char *argv[])
           writeError(ERR_WARNING, "Method BANNER requires value to be set.");
         }
       }
+      else if ((strcmp(pOpt, "KEX") == 0) || (strcmp(pOpt, "HOSTKEY") == 0) || (strcmp(pOpt, "CIPHER") == 0) || (strcmp(pOpt, "MAC") == 0))
+      {
+        pOptName = pOpt;
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+
+        if ( pOpt )
+        {
+          if (strcmp(pOptName, "KEX") == 0)
+            psSessionData->szPrefKex = strdup(pOpt);
+          else if (strcmp(pOptName, "HOSTKEY") == 0)
+            psSessionData->szPrefHostKey = strdup(pOpt);
+          else if (strcmp(pOptName, "CIPHER") == 0)
+            psSessionData->szPrefCipher = strdup(pOpt);
+          else
+            psSessionData->szPrefMac = strdup(pOpt);
+        }
+        else
+        {
+          writeError(ERR_WARNING, "Method %s requires value to be set.", pOptName);
+        }
+      }
+      else if (strcmp(pOpt, "AUTHTRIES") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+
+        if ( pOpt )
+        {
+          psSessionData->nAuthTries = atoi(pOpt);
+        }
+        else
+        {
+          writeError(ERR_WARNING, "Method AUTHTRIES requires value to be set.");
+        }
+      }
       else 
       {
         writeError(ERR_WARNING, "Invalid method: %s.", pOpt);
@@ -155,9 +246,21 @@ int go(sLogin* logins, int argc, char *argv[])
       free(pOptTmp);
     }
 
+    if (psSessionData->szPrefKex == NULL)
+      psSessionData->szPrefKex = strdup(SSH_PREF_KEX);
+    if (psSessionData->szPrefHostKey == NULL)
+      psSessionData->szPrefHostKey = strdup(SSH_PREF_HOSTKEY);
+    if (psSessionData->szPrefCipher == NULL)
+      psSessionData->szPrefCipher = strdup(SSH_PREF_CIPHER);
+
     initModule(logins, psSessionData);
   }  
 
+  FREE(psSessionData->szPrefKex);
+  FREE(psSessionData->szPrefHostKey);
+  FREE(psSessionData->szPrefCipher);
+  FREE(psSessionData->szPrefMac);
+  FREE(psSessionData->szAuthUser);
   FREE(psSessionData);
   return SUCCESS;
 }
@@ -172,6 +275,7 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
   LIBSSH2_SESSION *session = NULL;
   char *pErrorMsg;
   int iErrorMsg;
+  int nMaxAuthTries, nUserChange, nUserChanged, nReconnects = 0;
 
   _psSessionData->iConnectionStatus = SSH_CONN_UNKNOWN;
   
@@ -220,6 +324,8 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
 
   pthread_mutex_unlock(&psLogin->psServer->psAudit->ptmMutex);
 
+  _psSessionData->psHost = getHostInfo(psLogin->psServer->pHostIP);
+
   while (nState != MSTATE_COMPLETE)
   {  
     switch (nState)
@@ -261,6 +367,18 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
         if ( libssh2_banner_set(session, _psSessionData->szBannerMsg) ) {
            writeError(ERR_DEBUG_MODULE, "Failed to set libssh banner.");
         }
+
+        /* Algorithm preferences -- key exchange is the most expensive part of each connection */
+        setMethodPref(session, LIBSSH2_METHOD_KEX, "KEX", _psSessionData->szPrefKex);
+        setMethodPref(session, LIBSSH2_METHOD_HOSTKEY, "HOSTKEY", _psSessionData->szPrefHostKey);
+        setMethodPref(session, LIBSSH2_METHOD_CRYPT_CS, "CIPHER", _psSessionData->szPrefCipher);
+        setMethodPref(session, LIBSSH2_METHOD_CRYPT_SC, "CIPHER", _psSessionData->szPrefCipher);
+        setMethodPref(session, LIBSSH2_METHOD_MAC_CS, "MAC", _psSessionData->szPrefMac);
+        setMethodPref(session, LIBSSH2_METHOD_MAC_SC, "MAC", _psSessionData->szPrefMac);
+
+        _psSessionData->nAttempts = 0;
+        _psSessionData->iAuthMode = SSH_AUTH_UNDEFINED;
+        FREE(_psSessionData->szAuthUser);
        
         /* Initiate SSH session connection - retry if necessary */ 
         writeError(ERR_DEBUG_MODULE, "Attempting to initiate SSH session.");
@@ -326,10 +444,76 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
         nState = MSTATE_RUNNING;
         break;
       case MSTATE_RUNNING:
+        pthread_mutex_lock(&ptmHostTable);
+        nMaxAuthTries = (_psSessionData->nAuthTries > 0) ? _psSessionData->nAuthTries : _psSessionData->psHost->nMaxAuthTries;
+        nUserChange = _psSessionData->psHost->nUserChange;
+        pthread_mutex_unlock(&ptmHostTable);
+
+        nUserChanged = ((_psSessionData->szAuthUser) && (strcmp(_psSessionData->szAuthUser, psCredSet->psUser->pUser) != 0));
+
+        /* Recycle the connection before the server is expected to drop it */
+        if ((nMaxAuthTries > 0) && (_psSessionData->nAttempts >= nMaxAuthTries))
+        {
+          writeError(ERR_DEBUG_MODULE, "[%s] Reached %d authentication attempts on connection. Reconnecting.", MODULE_NAME, _psSessionData->nAttempts);
+          nState = MSTATE_NEW;
+          break;
+        }
+        else if ((nUserChanged) && (nUserChange == SSH_USER_CHANGE_DENIED))
+        {
+          writeError(ERR_DEBUG_MODULE, "[%s] Server does not allow a change of username. Reconnecting for user: %s", MODULE_NAME, psCredSet->psUser->pUser);
+          nState = MSTATE_NEW;
+          break;
+        }
+
         ssh2_session_data.pPass = psCredSet->pPass;
         ssh2_session_data.iAnswerCount = 0;
         nState = tryLogin(_psSessionData, session, &psLogin, psCredSet->psUser->pUser, psCredSet->pPass);
 
+        /* Connection was lost before the attempt completed -- the credential set is retried on a new connection */
+        if ((psLogin->iResult == LOGIN_RESULT_UNKNOWN) && (nState == MSTATE_NEW))
+        {
+          if ((nUserChanged) && (nUserChange == SSH_USER_CHANGE_UNKNOWN))
+          {
+            writeError(ERR_DEBUG_MODULE, "[%s] Host: %s dropped connection after change of username. Using a new connection for each user.", MODULE_NAME, psLogin->psServer->pHostIP);
+            pthread_mutex_lock(&ptmHostTable);
+            _psSessionData->psHost->nUserChange = SSH_USER_CHANGE_DENIED;
+            pthread_mutex_unlock(&ptmHostTable);
+          }
+          else if ((_psSessionData->nAttempts > 0) && (_psSessionData->nAuthTries == 0))
+          {
+            pthread_mutex_lock(&ptmHostTable);
+            if ((_psSessionData->psHost->nMaxAuthTries == 0) || (_psSessionData->nAttempts < _psSessionData->psHost->nMaxAuthTries))
+            {
+              writeError(ERR_DEBUG_MODULE, "[%s] Host: %s dropped connection after %d authentication attempts.", MODULE_NAME, psLogin->psServer->pHostIP, _psSessionData->nAttempts);
+              _psSessionData->psHost->nMaxAuthTries = _psSessionData->nAttempts;
+            }
+            pthread_mutex_unlock(&ptmHostTable);
+          }
+
+          if (++nReconnects > psLogin->psServer->psHost->iRetries + 1)
+          {
+            if (addMissedCredSet(psLogin, psCredSet) == SUCCESS)
+              writeError(ERR_ERROR, "%s: SSH connection repeatedly dropped. The following credentials have been added to the missed queue for later testing: Host: %s User: %s Pass: %s", MODULE_NAME, psLogin->psServer->pHostIP, psCredSet->psUser->pUser, psCredSet->pPass);
+            else
+              writeError(ERR_ERROR, "%s: SSH connection repeatedly dropped. The following credentials were NOT tested: Host: %s User: %s Pass: %s", MODULE_NAME, psLogin->psServer->pHostIP, psCredSet->psUser->pUser, psCredSet->pPass);
+
+            nState = MSTATE_EXITING;
+          }
+          break;
+        }
+        else if (psLogin->iResult != LOGIN_RESULT_UNKNOWN)
+        {
+          nReconnects = 0;
+          _psSessionData->nAttempts++;
+
+          if ((nUserChanged) && (nUserChange == SSH_USER_CHANGE_UNKNOWN))
+          {
+            pthread_mutex_lock(&ptmHostTable);
+            _psSessionData->psHost->nUserChange = SSH_USER_CHANGE_ALLOWED;
+            pthread_mutex_unlock(&ptmHostTable);
+          }
+        }
+
         if (psLogin->iResult != LOGIN_RESULT_UNKNOWN)
         {
           if (getNextCredSet(psLogin, psCredSet) == FAILURE)
@@ -346,8 +530,10 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
             }
             else if (psCredSet->iStatus == CREDENTIAL_NEW_USER)
             {
+              /* The transport is kept unless the previous attempt ended the session (e.g. successful login) */
               writeError(ERR_DEBUG_MODULE, "[%s] Starting testing for new user: %s.", MODULE_NAME, psCredSet->psUser->pUser);
-              nState = MSTATE_NEW;
+              if (nState != MSTATE_RUNNING)
+                nState = MSTATE_NEW;
             }
             else
               writeError(ERR_DEBUG_MODULE, "[%s] Next credential set - user: %s password: %s", MODULE_NAME, psCredSet->psUser->pUser, psCredSet->pPass);
@@ -395,6 +581,39 @@ int initModule(sLogin* psLogin, _SSH2_DATA *_psSessionData)
   return SUCCESS;
 }
 
+/* Look up (or create) the shared record of what has been learned about a host */
+_SSH2_HOST* getHostInfo(char *szHostIP)
+{
+  _SSH2_HOST *psHost = NULL;
+
+  pthread_mutex_lock(&ptmHostTable);
+
+  HASH_FIND_STR(psHostTable, szHostIP, psHost);
+  if (psHost == NULL)
+  {
+    psHost = malloc(sizeof(_SSH2_HOST));
+    memset(psHost, 0, sizeof(_SSH2_HOST));
+    psHost->szHostIP = strdup(szHostIP);
+    psHost->nUserChange = SSH_USER_CHANGE_UNKNOWN;
+    HASH_ADD_KEYPTR(hh, psHostTable, psHost->szHostIP, strlen(psHost->szHostIP), psHost);
+  }
+
+  pthread_mutex_unlock(&ptmHostTable);
+
+  return psHost;
+}
+
+/* Apply an algorithm preference list. libssh2 drops any methods it does not support. */
+void setMethodPref(LIBSSH2_SESSION *session, int iMethod, char *szName, char *szPrefs)
+{
+  if ((szPrefs == NULL) || (strcmp(szPrefs, "DEFAULT") == 0))
+    return;
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Setting %s preference: %s", MODULE_NAME, szName, szPrefs);
+  if (libssh2_session_method_pref(session, iMethod, szPrefs))
+    writeError(ERR_WARNING, "[%s] None of the requested %s methods are supported by libssh2: %s", MODULE_NAME, szName, szPrefs);
+}
+
 void response_callback(const char* name, int name_len, const char* instruction, int instruction_len, int num_prompts, const LIBSSH2_USERAUTH_KBDINT_PROMPT* prompts, LIBSSH2_USERAUTH_KBDINT_RESPONSE* responses, void **abstract)
 {
   (void) name;
@@ -435,7 +654,7 @@ void response_callback(const char* name, int name_len, const char* instruction,
 int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** psLogin, char* szLogin, char* szPassword)
 {
   char *pErrorMsg = NULL;
-  int iErrorMsg, iAuthMode, iRet;
+  int iErrorMsg, iAuthMode, iRet, iAuthRet;
   void (*pResponseCallback) ();
   char *strtok_ptr = NULL;
   char *pAuth = NULL;
@@ -450,11 +669,17 @@ int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** psLo
 
   /* libssh2 supports: none, password, publickey, hostbased, keyboard-interactive */
   iAuthMode = SSH_AUTH_UNDEFINED;
+
+  /* Supported methods are only requested once per user on each connection */
+  if ((_psSessionData->szAuthUser) && (strcmp(_psSessionData->szAuthUser, szLogin) == 0))
+  {
+    iAuthMode = _psSessionData->iAuthMode;
+    pErrorMsg = NULL;
+  }
   /*  libssh2_userauth_list returns session->userauth_list_data 
       libssh2_session_free() call will handle releasing all session data, 
       including userauth_list_data */
-  pErrorMsg = libssh2_userauth_list(session, szLogin, strlen(szLogin));
-  if (pErrorMsg)
+  else if ((pErrorMsg = libssh2_userauth_list(session, szLogin, strlen(szLogin))))
   {
     writeError(ERR_DEBUG_MODULE, "Supported user-auth modes: %s.", pErrorMsg);
     pAuth = strtok_r(pErrorMsg, ",", &strtok_ptr);
@@ -475,6 +700,10 @@ int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** psLo
 
       pAuth = strtok_r(NULL, ",", &strtok_ptr);
     }
+
+    FREE(_psSessionData->szAuthUser);
+    _psSessionData->szAuthUser = strdup(szLogin);
+    _psSessionData->iAuthMode = iAuthMode;
   }
   else if (_psSessionData->iConnectionStatus == SSH_CONN_ESTABLISHED)
   {
@@ -492,11 +721,19 @@ int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** psLo
   switch (iAuthMode)
   {
     case SSH_AUTH_KBDINT:
-      if (libssh2_userauth_keyboard_interactive(session, szLogin, pResponseCallback) ) 
+      if ((iAuthRet = libssh2_userauth_keyboard_interactive(session, szLogin, pResponseCallback)) == LIBSSH2_ERROR_AUTHENTICATION_FAILED) 
       {
         writeError(ERR_DEBUG_MODULE, "Keyboard-Interactive authentication failed: Host: %s User: %s Pass: %s", (*psLogin)->psServer->pHostIP, szLogin, szPassword);
         (*psLogin)->iResult = LOGIN_RESULT_FAIL;
-        iRet = MSTATE_NEW;
+        iRet = MSTATE_RUNNING;
+      }
+      else if (iAuthRet)
+      {
+        libssh2_session_last_error(session, &pErrorMsg, &iErrorMsg, 1);
+        writeError(ERR_DEBUG_MODULE, "Keyboard-Interactive authentication did not complete (%d): %s: Host: %s User: %s", iAuthRet, pErrorMsg, (*psLogin)->psServer->pHostIP, szLogin);
+        FREE(pErrorMsg);
+        (*psLogin)->iResult = LOGIN_RESULT_UNKNOWN;
+        return MSTATE_NEW;
       }
       else {
         writeError(ERR_DEBUG_MODULE, "Keyboard-Interactive authentication succeeded: Host: %s User: %s Pass: %s", (*psLogin)->psServer->pHostIP, szLogin, szPassword);
@@ -506,13 +743,23 @@ int tryLogin(_SSH2_DATA* _psSessionData, LIBSSH2_SESSION *session, sLogin** psLo
       break;
       
     case SSH_AUTH_PASSWORD:
-      if (libssh2_userauth_password(session, szLogin, szPassword))
+      if ((iAuthRet = libssh2_userauth_password(session, szLogin, szPassword)) == LIBSSH2_ERROR_AUTHENTICATION_FAILED || (iAuthRet == LIBSSH2_ERROR_PASSWORD_EXPIRED))
       {
         libssh2_session_last_error(session, &pErrorMsg, &iErrorMsg, 1);
         writeError(ERR_DEBUG_MODULE, "Password-based authentication failed: %s: Host: %s User: %s Pass: %s", pErrorMsg, (*psLogin)->psServer->pHostIP, szLogin, szPassword);
+        FREE(pErrorMsg);
         (*psLogin)->iResult = LOGIN_RESULT_FAIL;
         iRet = MSTATE_RUNNING;
       }
+      else if (iAuthRet)
+      {
+        /* e.g. server disconnected once its authentication attempt limit was reached */
+        libssh2_session_last_error(session, &pErrorMsg, &iErrorMsg, 1);
+        writeError(ERR_DEBUG_MODULE, "Password-based authentication did not complete (%d): %s: Host: %s User: %s", iAuthRet, pErrorMsg, (*psLogin)->psServer->pHostIP, szLogin);
+        FREE(pErrorMsg);
+        (*psLogin)->iResult = LOGIN_RESULT_UNKNOWN;
+        return MSTATE_NEW;
+      }
       else
       {
         writeError(ERR_DEBUG_MODULE, "Password-based authentication succeeded: Host: %s User: %s Pass: %s", (*psLogin)->psServer->pHostIP, szLogin, szPassword);
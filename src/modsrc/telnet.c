@@ -41,6 +41,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <sys/time.h>
 #include <arpa/telnet.h>
 #include "module.h"
 
@@ -64,19 +66,71 @@
 #define MODE_NORMAL 0
 #define MODE_AS400 1
 
+#define TELNET_BUFFER_SIZE 4096   /* Application data retained from the current exchange */
+#define TELNET_READ_SIZE 1024
+#define TELNET_QUIET_WAIT 100000  /* Confirm shell prompt is not followed by more data (usec) */
+
+/* IAC parser states */
+#define IAC_STATE_DATA 0
+#define IAC_STATE_IAC 1
+#define IAC_STATE_OPTION 2
+#define IAC_STATE_SB 3
+#define IAC_STATE_SB_IAC 4
+
+#define MATCH_CLOSED -1
+#define MATCH_NONE 0
+#define MATCH_LOGIN 1
+#define MATCH_PASSWORD 2
+#define MATCH_SHELL 3
+
+#define MATCHER_MAX_PATTERNS 32
+
 typedef struct __MODULE_DATA {
   int nMode;
 } _MODULE_DATA;
 
+/*
+  Connection state for the streaming IAC parser. Option negotiation is stripped
+  from each read as it arrives and only application data is kept in bufText.
+  The parser state carries across reads, so commands split between two TCP
+  segments are handled correctly.
+*/
+typedef struct __TELNET_STREAM {
+  int hSocket;
+  int nIACState;
+  unsigned char nIACCommand;
+  int nClosed;
+  int nLength;
+  unsigned char bufText[TELNET_BUFFER_SIZE + 1];
+} _TELNET_STREAM;
+
+/* Case-insensitive matcher for a fixed set of patterns, indexed by first character */
+typedef struct __PROMPT_MATCHER {
+  int nPatterns;
+  const char **arrszPatterns;
+  int arrnLength[MATCHER_MAX_PATTERNS];
+  unsigned int arrnFirst[256];   /* bitmap of patterns starting with each (lower-case) character */
+} _PROMPT_MATCHER;
+
 const unsigned int BUFFER_SIZE = 300;
 const char* KNOWN_PROMPTS = ">#$%/?";  // Each character represents a known telnet prompt - feel free to add a new one if desired
 
-const int KNOWN_PWD_SIZE = 4;  // Make sure to keep this in sync with the size of the array below!!
-const char* KNOWN_PWD_PROMPTS[] = { "assword", "asscode", "ennwort", "ASSWORD" };  // Complete/partial lines that indicate a password request
+const int KNOWN_PWD_SIZE = 3;  // Make sure to keep this in sync with the size of the array below!!
+const char* KNOWN_PWD_PROMPTS[] = { "assword", "asscode", "ennwort" };  // Complete/partial lines that indicate a password request
 
 const int KNOWN_LOGIN_SIZE = 3;  // Make sure to keep this in sync with the size of the array below!!
 const char* KNOWN_LOGIN_PROMPTS[] = { "login:", "sername:", "User" }; // Complete/partial lines that request a user name
 
+const int KNOWN_FAILURE_SIZE = 5;  // Make sure to keep this in sync with the size of the array below!!
+const char* KNOWN_FAILURE_MESSAGES[] = { "incorrect", "Authentication failed", "Login invalid", "Invalid login", "Access denied" };
+
+const int KNOWN_AS400_SIZE = 1;
+const char* KNOWN_AS400_PROMPTS[] = { "Sign On" };
+
+/* Matchers are built once and shared (read-only) by all login threads */
+static _PROMPT_MATCHER sMatchLogin, sMatchPassword, sMatchFailure, sMatchAS400;
+static pthread_once_t onceMatchers = PTHREAD_ONCE_INIT;
+
 // Tells us whether we are to continue processing or not
 enum MODULE_STATE
 {
@@ -87,11 +141,16 @@ enum MODULE_STATE
 };
 
 // Forward declarations
-int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword, int nFoundPrompt);
-int tryLoginAS400(int hSocket, sLogin** login, char* szLogin, char* szPassword);
+int tryLogin(_TELNET_STREAM* psStream, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword, int nFoundPrompt);
+int tryLoginAS400(_TELNET_STREAM* psStream, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword);
 int initModule(sLogin* login, _MODULE_DATA* _psSessionData);
 int processIAClogout(int hSocket, _MODULE_DATA* _psSessionData);
-void processIAC(int hSocket, _MODULE_DATA* _psSessionData, unsigned char** buffer, int* nBufferSize);
+int telnetRead(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout);
+int telnetWaitPrompt(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout);
+int telnetWaitText(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, _PROMPT_MATCHER* psMatcher, int nTimeout);
+int telnetReceive(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout1, int nTimeout2);
+void initMatchers(void);
+static int matchPattern(_PROMPT_MATCHER* psMatcher, unsigned char* buf, int nLength, int* nEnd);
 
 // Tell medusa how many parameters this module allows
 int getParamNumber()
@@ -99,6 +158,18 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? PORT_TELNETS : PORT_TELNET;
+}
+
+// Tell medusa the module waits in sleep() while the server cleans up, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -173,6 +244,7 @@ int go(sLogin* logins, int argc, char *argv[])
       free(pOptTmp);
     }
 
+    pthread_once(&onceMatchers, initMatchers);
     initModule(logins, psSessionData);
   }
 
@@ -182,11 +254,9 @@ int go(sLogin* logins, int argc, char *argv[])
 
 int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
 {
-  int hSocket = -1;
+  _TELNET_STREAM *psStream = NULL;
   enum MODULE_STATE nState = MSTATE_NEW;
-  unsigned char* bufReceive;
-  int nReceiveBufferSize = 0, nFoundPrompt = PROMPT_UNKNOWN;
-  int i = 0;
+  int nFoundPrompt = PROMPT_UNKNOWN, nMatch;
   sCredentialSet *psCredSet = NULL;
   sConnectParams params;
 
@@ -217,138 +287,88 @@ int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
     params.nPort = PORT_TELNET;
   initConnectionParams(_psLogin, &params);
 
+  psStream = malloc(sizeof(_TELNET_STREAM));
+  memset(psStream, 0, sizeof(_TELNET_STREAM));
+  psStream->hSocket = -1;
+
   while (nState != MSTATE_COMPLETE)
   {
     switch (nState)
     {
     case MSTATE_NEW:
       // Already have an open socket - close it
-      if (hSocket > 0)
-        medusaDisconnect(hSocket);
+      if (psStream->hSocket > 0)
+        medusaDisconnect(psStream->hSocket);
+
+      memset(psStream, 0, sizeof(_TELNET_STREAM));
 
       if (_psLogin->psServer->psHost->iUseSSL > 0)
-        hSocket = medusaConnectSSL(&params);
+        psStream->hSocket = medusaConnectSSL(&params);
       else 
-        hSocket = medusaConnect(&params);
+        psStream->hSocket = medusaConnect(&params);
       
-      if (hSocket <= 0)
+      if (psStream->hSocket <= 0)
       {
         writeError(ERR_ERROR, "[%s] Failed to connect, port %d was not open on %s", MODULE_NAME, params.nPort, _psLogin->psServer->pHostIP);
         _psLogin->iResult = LOGIN_RESULT_UNKNOWN;
         setPassResult(_psLogin, psCredSet->pPass);
+        FREE(psStream);
+        FREE(psCredSet);
         return FAILURE;
       }
 
       writeError(ERR_DEBUG_MODULE, "Connected");
 
-      // Examine the first line returned
-      nReceiveBufferSize = 0;
-      bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-      if (bufReceive == NULL)
-        return FAILURE;
-
-      bufReceive[nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
+      // Telnet protocol negotiation is handled as data arrives -- wait for a login prompt
+      nFoundPrompt = PROMPT_UNKNOWN;
+      writeError(ERR_DEBUG_MODULE, "Looking for login prompts");
 
-      if (bufReceive == NULL)
+      if (_psSessionData->nMode == MODE_AS400)
       {
-        writeError(ERR_ERROR, "[%s] null response was unexpected from a telnet server (is one running?)", MODULE_NAME);
-        _psLogin->iResult = LOGIN_RESULT_UNKNOWN;
-        setPassResult(_psLogin, psCredSet->pPass);
-        return FAILURE;
-      }
+        if (telnetWaitText(psStream, _psSessionData, &sMatchAS400, RECEIVE_DELAY_1) > 0)
+        {
+          writeError(ERR_INFO, "[%s] Detected AS/400 Sign On Screen.", MODULE_NAME);
+          nFoundPrompt = PROMPT_LOGIN_PASSWORD;
 
-      // Telnet protocol negotiation
-      do
-      {
-        nFoundPrompt = PROMPT_UNKNOWN;
-        processIAC(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize);
+          /* Discard the remainder of the screen */
+          telnetReceive(psStream, _psSessionData, 20000, RECEIVE_DELAY_2);
+        }
 
-        if (bufReceive != NULL && bufReceive[0] != 0 && (unsigned char)bufReceive[0] != IAC)
-          makeToLower((char *)bufReceive);
+        /*
+        Sign On
+        System  . . . . . :   TSTDBS16
+        Subsystem . . . . :   QINTER
+        Display . . . . . :   QPADEV0001
+        */
+      }
+      else
+      {
+        nMatch = telnetWaitPrompt(psStream, _psSessionData, RECEIVE_DELAY_1);
 
-        if (bufReceive != NULL)
+        if (nMatch == MATCH_LOGIN)
+        {
+          writeError(ERR_DEBUG_MODULE, "Found login prompt...");
+          nFoundPrompt = PROMPT_LOGIN_PASSWORD;
+        }
+        else if (nMatch == MATCH_PASSWORD)
         {
-          writeError(ERR_DEBUG_MODULE, "Looking for login prompts");
+          /* Some systems do not provide a login prompt and go right to password */
+          writeError(ERR_DEBUG_MODULE, "Found a password prompt already...");
+          nFoundPrompt = PROMPT_PASSWORD;
 
-          if (_psSessionData->nMode == MODE_AS400)
-          {
-            if (strcasestr((char *)bufReceive, (char *)"Sign On") != NULL)
-            {
-              writeError(ERR_INFO, "[%s] Detected AS/400 Sign On Screen.", MODULE_NAME);
-              nFoundPrompt = PROMPT_LOGIN_PASSWORD;
-              
-              FREE(bufReceive);
-              if (medusaDataReadyTimed(hSocket, 0, 20000) > 0)
-              {
-                // More data waiting
-                bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-                if (bufReceive != NULL)
-                  bufReceive[nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
-              }
- 
-              break;
-            }
-
-            /*
-            Sign On
-            System  . . . . . :   TSTDBS16
-            Subsystem . . . . :   QINTER
-            Display . . . . . :   QPADEV0001
-            */
-          }
-          else
-          {
-            // Look for known login prompts
-            for (i = 0; i < KNOWN_LOGIN_SIZE; i++)
-            {
-              if (strcasestr((char *)bufReceive, KNOWN_LOGIN_PROMPTS[i]) != NULL)
-              {
-                // Do we have a prompt?
-                writeError(ERR_DEBUG_MODULE, "Found login prompt...");
-                nFoundPrompt = PROMPT_LOGIN_PASSWORD;
-                break;
-              }
-            }
-          
-            /* Some systems do not provide a login prompt and go right to password */
-            for (i = 0; i < KNOWN_PWD_SIZE; i++)
-            {
-              if (strcasestr((char *)bufReceive, KNOWN_PWD_PROMPTS[i]) != NULL)
-              {
-                // Do we have a prompt?
-                writeError(ERR_DEBUG_MODULE, "Found a password prompt already...");
-                nFoundPrompt = PROMPT_PASSWORD;
-                
-                if (_psLogin->psServer->iLoginsDone < 1 && _psLogin->iId == 0)
-                  writeVerbose(VB_NONE_FILE, "Password Prompt Only: %s\n", _psLogin->psServer->pHostIP);
-                
-                break;
-              }
-            }
-          
-            if (nFoundPrompt == PROMPT_UNKNOWN)
-            {
-              FREE(bufReceive);
-              if (medusaDataReadyTimed(hSocket, 0, 20000) > 0)
-              {
-                // More data waiting
-                bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-                if (bufReceive != NULL)
-                  bufReceive[nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
-              } 
-            }
-          }
+          if (_psLogin->psServer->iLoginsDone < 1 && _psLogin->iId == 0)
+            writeVerbose(VB_NONE_FILE, "Password Prompt Only: %s\n", _psLogin->psServer->pHostIP);
         }
       }
-      while (bufReceive != NULL && (unsigned char)bufReceive[0] == IAC && nFoundPrompt == PROMPT_UNKNOWN);
-
-      FREE(bufReceive);
 
       if (nFoundPrompt == PROMPT_UNKNOWN)
       {
         writeError(ERR_ERROR, "[%s] Failed to identify logon prompt.", MODULE_NAME); 
         _psLogin->iResult = LOGIN_RESULT_UNKNOWN;
         setPassResult(_psLogin, psCredSet->pPass);
+        medusaDisconnect(psStream->hSocket);
+        FREE(psStream);
+        FREE(psCredSet);
         return FAILURE;
       }
       else
@@ -358,25 +378,29 @@ int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
 
     case MSTATE_RUNNING:
       if (_psSessionData->nMode == MODE_AS400)
-        nState = tryLoginAS400(hSocket, &_psLogin, psCredSet->psUser->pUser, psCredSet->pPass);
+        nState = tryLoginAS400(psStream, &_psLogin, _psSessionData, psCredSet->psUser->pUser, psCredSet->pPass);
       else
-        nState = tryLogin(hSocket, &_psLogin, _psSessionData, psCredSet->psUser->pUser, psCredSet->pPass, nFoundPrompt);
+        nState = tryLogin(psStream, &_psLogin, _psSessionData, psCredSet->psUser->pUser, psCredSet->pPass, nFoundPrompt);
 
       if (_psLogin->iResult != LOGIN_RESULT_UNKNOWN) 
       {
-        if (processIAClogout(hSocket, _psSessionData) == FAILURE)
+        /* MSTATE_RUNNING indicates the server re-prompted and the session can be reused */
+        if (nState != MSTATE_RUNNING)
         {
-          writeError(ERR_ERROR, "[%s] Failed to close existing Telnet session.", MODULE_NAME);
-        }
-        medusaDisconnect(hSocket);
-        hSocket = -1;
+          if ((!psStream->nClosed) && (processIAClogout(psStream->hSocket, _psSessionData) == FAILURE))
+          {
+            writeError(ERR_ERROR, "[%s] Failed to close existing Telnet session.", MODULE_NAME);
+          }
+          medusaDisconnect(psStream->hSocket);
+          psStream->hSocket = -1;
         
-        /*
-          Cisco devices appear to keep sessions open for a brief time after we terminate 
-          the connection. They also seem to ignore "IAC DO LOGOUT" commands. Adding a 
-          sleep() hack here, to give them some time to clean-up. 
-        */
-        sleep(3);
+          /*
+            Cisco devices appear to keep sessions open for a brief time after we terminate 
+            the connection. They also seem to ignore "IAC DO LOGOUT" commands. Adding a 
+            sleep() hack here, to give them some time to clean-up. 
+          */
+          sleep(3);
+        }
 
         if (getNextCredSet(_psLogin, psCredSet) == FAILURE)
         {
@@ -393,7 +417,8 @@ int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
           else if (psCredSet->iStatus == CREDENTIAL_NEW_USER)
           {
             writeError(ERR_DEBUG_MODULE, "[%s] Starting testing for new user: %s.", MODULE_NAME, psCredSet->psUser->pUser);
-            nState = MSTATE_NEW;
+            if (nState != MSTATE_RUNNING)
+              nState = MSTATE_NEW;
           }
           else
             writeError(ERR_DEBUG_MODULE, "[%s] Next credential set - user: %s password: %s", MODULE_NAME, psCredSet->psUser->pUser, psCredSet->pPass);
@@ -401,9 +426,9 @@ int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
       }
       break;
     case MSTATE_EXITING:
-      if (hSocket > 0)
-        medusaDisconnect(hSocket);
-      hSocket = -1;
+      if (psStream->hSocket > 0)
+        medusaDisconnect(psStream->hSocket);
+      psStream->hSocket = -1;
       nState = MSTATE_COMPLETE;
       break;
     default:
@@ -412,20 +437,21 @@ int initModule(sLogin* _psLogin, _MODULE_DATA *_psSessionData)
     }
   }
 
+  FREE(psStream);
   FREE(psCredSet);
   return SUCCESS;
 }
 
-int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword, int nFoundPrompt)
+int tryLogin(_TELNET_STREAM* psStream, sLogin** login, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword, int nFoundPrompt)
 {
-  // This function should return MSTATE_RUNNING to continue or MSTATE_EXITING to terminate the module
+  // This function should return MSTATE_RUNNING to continue within the current session, MSTATE_NEW 
+  // to reconnect or MSTATE_EXITING to terminate the module
   unsigned char bufSend[BUFFER_SIZE];
-  unsigned char* bufReceive;
-  int nSendBufferSize = 0, nReceiveBufferSize = 0;
-  int nContinue = 0, i = 0;
+  int nSendBufferSize = 0;
+  int nMatch;
 
   // Check the socket and such
-  if (hSocket <= 0)
+  if (psStream->hSocket <= 0)
   {
     writeError(ERR_ERROR, "%s failed: socket was invalid", MODULE_NAME);
     (*login)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -437,10 +463,11 @@ int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* sz
   {
     // Set up the send buffer
     memset(bufSend, 0, BUFFER_SIZE);
-    sprintf((char *)bufSend, "%s\r", szLogin);
+    snprintf((char *)bufSend, BUFFER_SIZE - 1, "%s\r", szLogin);
     nSendBufferSize = strlen((char *)bufSend) + 1;  // Count the null terminator
 
-    if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+    psStream->nLength = 0;
+    if (medusaSend(psStream->hSocket, bufSend, nSendBufferSize, 0) < 0)
     {
       writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
       (*login)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -448,60 +475,26 @@ int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* sz
       return MSTATE_EXITING;
     }
 
-    do
+    nMatch = telnetWaitPrompt(psStream, _psSessionData, RECEIVE_DELAY_1);
+    if (nMatch == MATCH_SHELL)
     {
-      // Look for a return
-      bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-      if (bufReceive == NULL)
-      {
-        // Found a prompt - telnet appears to be alive, keep going
-        writeError(ERR_ERROR, "%s: Telnet did not respond to the sending of the user name '%s' in a timely fashion - is it down or refusing connections?", MODULE_NAME, szLogin);
-        (*login)->iResult = LOGIN_RESULT_UNKNOWN;
-        setPassResult(*login, szPassword);
-        return MSTATE_EXITING;
-      }
-
-      bufReceive[nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
-
-      // Do we have a prompt?
-      if (strcspn((char *)bufReceive, KNOWN_PROMPTS) != strlen((char *)bufReceive))
-      {
-        (*login)->iResult = LOGIN_RESULT_SUCCESS;
-        setPassResult(*login, szPassword);
-        free(bufReceive);
-        return MSTATE_EXITING;
-      }
-
-      makeToLower((char *)bufReceive);
-
-      // Are we at a known password prompt?
-      for (i = 0; i < KNOWN_PWD_SIZE; i++)
-      {
-        if (strcasestr((char *)bufReceive, KNOWN_PWD_PROMPTS[i]) != NULL)
-        {
-          nContinue = 1;
-          break;
-        }
-      }
-
-      // Look for known login prompts
-      if (nContinue == 0)
-      {
-        for (i = 0; i < KNOWN_LOGIN_SIZE; i++)
-        {
-          if (strcasestr((char *)bufReceive, KNOWN_LOGIN_PROMPTS[i]) != NULL)
-          {
-            free(bufReceive);
-            (*login)->iResult = LOGIN_RESULT_FAIL;
-            setPassResult(*login, szPassword);
-            return MSTATE_RUNNING;
-          }
-        }
-      }
-
-      free(bufReceive);
+      (*login)->iResult = LOGIN_RESULT_SUCCESS;
+      setPassResult(*login, szPassword);
+      return MSTATE_EXITING;
+    }
+    else if (nMatch == MATCH_LOGIN)
+    {
+      (*login)->iResult = LOGIN_RESULT_FAIL;
+      setPassResult(*login, szPassword);
+      return MSTATE_RUNNING;
+    }
+    else if (nMatch != MATCH_PASSWORD)
+    {
+      writeError(ERR_ERROR, "%s: Telnet did not respond to the sending of the user name '%s' in a timely fashion - is it down or refusing connections?", MODULE_NAME, szLogin);
+      (*login)->iResult = LOGIN_RESULT_UNKNOWN;
+      setPassResult(*login, szPassword);
+      return MSTATE_EXITING;
     }
-    while(nContinue == 0);
   }
   else if (nFoundPrompt == PROMPT_PASSWORD)
   {
@@ -515,10 +508,11 @@ int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* sz
 
   // Send the password
   memset(bufSend, 0, BUFFER_SIZE);
-  sprintf((char *)bufSend, "%s\r", szPassword);
+  snprintf((char *)bufSend, BUFFER_SIZE - 1, "%s\r", szPassword);
   nSendBufferSize = strlen((char *)bufSend) + 1;  // Count the null terminator
 
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  psStream->nLength = 0;
+  if (medusaSend(psStream->hSocket, bufSend, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
     (*login)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -526,9 +520,11 @@ int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* sz
     return MSTATE_EXITING;
   }
 
-  // Look for a return
-  bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-  if (bufReceive == NULL)
+  // It's possible that some telnet servers (like Microsoft's) may send some more IAC commands at this point.
+  // These are consumed by the stream parser while we wait for the next prompt.
+  nMatch = telnetWaitPrompt(psStream, _psSessionData, RECEIVE_DELAY_1);
+
+  if ((nMatch == MATCH_NONE) && (psStream->nLength == 0))
   {
     writeError(ERR_ERROR, "timeout waiting for response from server after sending password");
     (*login)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -536,95 +532,48 @@ int tryLogin(int hSocket, sLogin** login, _MODULE_DATA* _psSessionData, char* sz
     return MSTATE_EXITING;
   }
 
-  bufReceive[nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
-
-  // It's possible that some telnet servers (like Microsoft's) may send some more IAC commands at this point
-  // Take care of zem!
-  processIAC(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize);
-
-  if (bufReceive == NULL)
-    bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-
-  // Do we have a prompt?
-  while (bufReceive != NULL)
+  /* check for known failures */
+  if (matchPattern(&sMatchFailure, psStream->bufText, psStream->nLength, NULL) >= 0)
   {
-    /* check for known failures */
-    if (strstr((char *)bufReceive, "Authentication failed"))
-    {
-      writeError(ERR_DEBUG_MODULE, "Server responded with Cisco \"Authentication failed.\" message.");
-      (*login)->iResult = LOGIN_RESULT_FAIL;
-      setPassResult(*login, szPassword);
-      return MSTATE_NEW;
-    }
-    if (strstr((char *)bufReceive, "Login invalid"))
-    {
-      writeError(ERR_DEBUG_MODULE, "Server responded with Cisco \"Login invalid\" message.");
-      (*login)->iResult = LOGIN_RESULT_FAIL;
-      setPassResult(*login, szPassword);
-      return MSTATE_NEW;
-    }
-    else if (strcspn((char *)bufReceive, KNOWN_PROMPTS) != strlen((char *)bufReceive))
-    {
-      // Found a prompt - telnet appears to be alive
-      free(bufReceive);
-      (*login)->iResult = LOGIN_RESULT_SUCCESS;
-      setPassResult(*login, szPassword);
-      return MSTATE_EXITING;
-    }
-    else
-    {
-      if (nFoundPrompt == PROMPT_LOGIN_PASSWORD) {
-        // If we have a login prompt, we have failed
-        for (i = 0; i < KNOWN_LOGIN_SIZE; i++)
-        {
-          if (strcasestr((char *)bufReceive, KNOWN_LOGIN_PROMPTS[i]) != NULL)
-          {
-            free(bufReceive);
-            writeError(ERR_DEBUG_MODULE, "unsuccessful login - user '%s' with a password of '%s'", szLogin, szPassword);
-            (*login)->iResult = LOGIN_RESULT_FAIL;
-            setPassResult(*login, szPassword);
-            return MSTATE_NEW;
-          }
-        }
-      } 
-      else 
-      {
-        // We are operating on a non-login telnet setup
-        for (i = 0; i < KNOWN_PWD_SIZE; i++)
-        {
-          if (strcasestr((char *)bufReceive, KNOWN_PWD_PROMPTS[i]) != NULL)
-          {
-            free(bufReceive);
-            writeError(ERR_DEBUG_MODULE, "unsuccessful login with a password of '%s'", szPassword);
-            (*login)->iResult = LOGIN_RESULT_FAIL;
-            setPassResult(*login, szPassword);
-            return MSTATE_NEW;
-          }
-        }
-      }
-    }
-
-    free(bufReceive);
-    bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
+    writeError(ERR_DEBUG_MODULE, "Server responded with failure message: %s", psStream->bufText);
+    (*login)->iResult = LOGIN_RESULT_FAIL;
+  }
+  else if (nMatch == MATCH_SHELL)
+  {
+    // Found a prompt - telnet appears to be alive
+    (*login)->iResult = LOGIN_RESULT_SUCCESS;
+    setPassResult(*login, szPassword);
+    return MSTATE_EXITING;
+  }
+  else
+  {
+    writeError(ERR_DEBUG_MODULE, "unsuccessful login - user '%s' with a password of '%s'", szLogin, szPassword);
+    (*login)->iResult = LOGIN_RESULT_FAIL;
   }
 
-  (*login)->iResult = LOGIN_RESULT_FAIL;
   setPassResult(*login, szPassword);
 
+  /* Server re-prompted with the same style of prompt -- retry within this session */
+  if (((nMatch == MATCH_LOGIN) && (nFoundPrompt == PROMPT_LOGIN_PASSWORD)) || ((nMatch == MATCH_PASSWORD) && (nFoundPrompt == PROMPT_PASSWORD)))
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Server re-prompted. Continuing within current session.", MODULE_NAME);
+    return MSTATE_RUNNING;
+  }
+
   return MSTATE_NEW;
 }
 
-int tryLoginAS400(int hSocket, sLogin** psLogin, char* szLogin, char* szPassword)
+int tryLoginAS400(_TELNET_STREAM* psStream, sLogin** psLogin, _MODULE_DATA* _psSessionData, char* szLogin, char* szPassword)
 {
   unsigned char bufSend[BUFFER_SIZE];
   unsigned char* bufReceive;
-  int nSendBufferSize = 0, nReceiveBufferSize = 0;
+  int nSendBufferSize = 0;
   int iRet = FAILURE;
   char szUser[10 + 1];
   char szPass[128 + 1];
   char szErrorMsg[100];
 
-  if (hSocket <= 0)
+  if (psStream->hSocket <= 0)
   {
     writeError(ERR_ERROR, "%s failed: socket was invalid", MODULE_NAME);
     (*psLogin)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -662,7 +611,8 @@ int tryLoginAS400(int hSocket, sLogin** psLogin, char* szLogin, char* szPassword
   sprintf((char *)bufSend, "%s\t%s\r", szUser, szPass);
   nSendBufferSize = strlen((char *)bufSend) + 1;
 
-  if (medusaSend(hSocket, bufSend, nSendBufferSize, 0) < 0)
+  psStream->nLength = 0;
+  if (medusaSend(psStream->hSocket, bufSend, nSendBufferSize, 0) < 0)
   {
     writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
     (*psLogin)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -671,8 +621,7 @@ int tryLoginAS400(int hSocket, sLogin** psLogin, char* szLogin, char* szPassword
   }
 
   /* Process server response */
-  bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-  if (bufReceive == NULL)
+  if (telnetReceive(psStream, _psSessionData, RECEIVE_DELAY_1, RECEIVE_DELAY_2) == 0)
   {
     writeError(ERR_ERROR, "[%s] Timeout waiting for response from server after sending password", MODULE_NAME);
     (*psLogin)->iResult = LOGIN_RESULT_UNKNOWN;
@@ -680,6 +629,8 @@ int tryLoginAS400(int hSocket, sLogin** psLogin, char* szLogin, char* szPassword
     return MSTATE_EXITING;
   }
 
+  bufReceive = psStream->bufText;
+
   if (strstr((char *)bufReceive, "CPF1120") != NULL)
   {
     sprintf(szErrorMsg, "CPF1120 - User %s does not exist.", szUser); 
@@ -780,8 +731,6 @@ int tryLoginAS400(int hSocket, sLogin** psLogin, char* szLogin, char* szPassword
 int processIAClogout(int hSocket, _MODULE_DATA* _psSessionData __attribute__((unused)))
 {
   unsigned char bufSend[] = { 0xFF, 0xFD, 0x12 }; /* IAC DO LOGOUT */
-  //char* bufReceive = NULL;
-  //int nReceiveBufferSize = 0;
 
   writeError(ERR_DEBUG_MODULE, "[%s] Sending IAC DO LOGOUT command.", MODULE_NAME);
   if (medusaSend(hSocket, bufSend, 3, 0) < 0)
@@ -790,74 +739,276 @@ int processIAClogout(int hSocket, _MODULE_DATA* _psSessionData __attribute__((un
     return FAILURE;
   }
 
-  /* Receive any remaining IAC commands */
-  /*
-  bufReceive = medusaReceiveLineDelay(hSocket, &nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-  if (bufReceive == NULL)
-    return FAILURE;
-
-  processIAC(hSocket, _psSessionData, &bufReceive, &nReceiveBufferSize);
-  */
-
   return SUCCESS;
 }
 
-void processIAC(int hSocket, _MODULE_DATA* _psSessionData, unsigned char** buffer, int* nReceiveBufferSize)
+/* Build a matcher from a list of patterns. Patterns are compared case-insensitively. */
+static void compileMatcher(_PROMPT_MATCHER* psMatcher, const char** arrszPatterns, int nPatterns)
 {
-  unsigned char* bufTemp = *buffer;
+  int i;
+
+  memset(psMatcher, 0, sizeof(_PROMPT_MATCHER));
+  psMatcher->arrszPatterns = arrszPatterns;
+  psMatcher->nPatterns = (nPatterns > MATCHER_MAX_PATTERNS) ? MATCHER_MAX_PATTERNS : nPatterns;
 
-  /* We're not that friendly. Refuse to do anything asked of us. */
-  while (*bufTemp == IAC) /* IAC (0xFF) */
+  for (i = 0; i < psMatcher->nPatterns; i++)
   {
-    writeError(ERR_DEBUG_MODULE, "Handling IAC Command...");
+    psMatcher->arrnLength[i] = strlen(arrszPatterns[i]);
+    psMatcher->arrnFirst[tolower((unsigned char)arrszPatterns[i][0])] |= (1U << i);
+    psMatcher->arrnFirst[toupper((unsigned char)arrszPatterns[i][0])] |= (1U << i);
+  }
+}
+
+void initMatchers(void)
+{
+  compileMatcher(&sMatchLogin, KNOWN_LOGIN_PROMPTS, KNOWN_LOGIN_SIZE);
+  compileMatcher(&sMatchPassword, KNOWN_PWD_PROMPTS, KNOWN_PWD_SIZE);
+  compileMatcher(&sMatchFailure, KNOWN_FAILURE_MESSAGES, KNOWN_FAILURE_SIZE);
+  compileMatcher(&sMatchAS400, KNOWN_AS400_PROMPTS, KNOWN_AS400_SIZE);
+}
+
+/* 
+  Single pass search of buf for any of the matcher's patterns. Returns the offset
+  of the first match (-1 if none) and optionally the offset just past its end.
+*/
+static int matchPattern(_PROMPT_MATCHER* psMatcher, unsigned char* buf, int nLength, int* nEnd)
+{
+  unsigned int nCandidates;
+  int i, j;
 
-    if ((bufTemp[1] == 0xfc || bufTemp[1] == 0xfe) && bufTemp[2] == 0x22)
+  for (i = 0; i < nLength; i++)
+  {
+    nCandidates = psMatcher->arrnFirst[buf[i]];
+    for (j = 0; nCandidates; j++, nCandidates >>= 1)
     {
-      writeError(ERR_DEBUG_MODULE, "TELNETD peer does not like linemode");
+      if ((nCandidates & 1) && (i + psMatcher->arrnLength[j] <= nLength) && (strncasecmp((char *)buf + i, psMatcher->arrszPatterns[j], psMatcher->arrnLength[j]) == 0))
+      {
+        if (nEnd)
+          *nEnd = i + psMatcher->arrnLength[j];
+        return i;
+      }
     }
+  }
+
+  return -1;
+}
+
+/*
+  Examine the last line of received data to determine whether the server is 
+  waiting for input. A login/password pattern only counts as a prompt if it is
+  at the end of the line or the line ends in punctuation (e.g. "Username: "), so
+  that banners such as "User Access Verification" are not mistaken for prompts.
+*/
+static int checkPrompt(_TELNET_STREAM* psStream)
+{
+  unsigned char* pLine;
+  int nLine, nEnd, nLast;
+
+  nLine = psStream->nLength;
+  while ((nLine > 0) && (isspace(psStream->bufText[nLine - 1])))
+    nLine--;
+
+  if (nLine == 0)
+    return MATCH_NONE;
+
+  nLast = psStream->bufText[nLine - 1];
+
+  pLine = psStream->bufText + nLine;
+  while ((pLine > psStream->bufText) && (*(pLine - 1) != '\n') && (*(pLine - 1) != '\r'))
+    pLine--;
+  nLine -= (pLine - psStream->bufText);
+
+  if ((matchPattern(&sMatchPassword, pLine, nLine, &nEnd) >= 0) && ((nEnd == nLine) || (!isalnum(nLast))))
+    return MATCH_PASSWORD;
+
+  if ((matchPattern(&sMatchLogin, pLine, nLine, &nEnd) >= 0) && ((nEnd == nLine) || (!isalnum(nLast))))
+    return MATCH_LOGIN;
+
+  if (strchr(KNOWN_PROMPTS, nLast))
+    return MATCH_SHELL;
+
+  return MATCH_NONE;
+}
+
+/*
+  Read whatever data is available (waiting up to nTimeout usec) and run it through
+  the IAC state machine. Option requests are refused, except for ECHO and SGA in 
+  AS/400 mode, and all replies for a read are sent together. Application data is
+  appended to bufText. Returns the number of bytes read, 0 on timeout or -1 if 
+  the connection was closed.
+*/
+int telnetRead(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout)
+{
+  unsigned char bufRaw[TELNET_READ_SIZE + 1];
+  unsigned char bufReply[TELNET_READ_SIZE * 3];
+  unsigned char c;
+  int i, nRead, nReply = 0;
+
+  if (medusaDataReadyTimed(psStream->hSocket, nTimeout / 1000000, nTimeout % 1000000) <= 0)
+    return 0;
+
+  memset(bufRaw, 0, TELNET_READ_SIZE + 1);
+  nRead = medusaReceive(psStream->hSocket, bufRaw, TELNET_READ_SIZE);
+  if (nRead <= 0)
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Connection closed by server.", MODULE_NAME);
+    psStream->nClosed = TRUE;
+    return -1;
+  }
 
-    if (bufTemp[1] == WILL) /* WILL (0xFB), WONT (0xFC) */
+  for (i = 0; i < nRead; i++)
+  {
+    c = bufRaw[i];
+
+    switch (psStream->nIACState)
     {
-      /* AS/400 devices appear to request and require "Echo" and "Suppress Go Ahead" */
-      if (_psSessionData->nMode == MODE_AS400)
-        if ((bufTemp[2] == TELOPT_ECHO) || (bufTemp[2] == TELOPT_SGA))
-          bufTemp[1] = DO;
+      case IAC_STATE_DATA:
+        if (c == IAC)
+          psStream->nIACState = IAC_STATE_IAC;
+        else if (c != 0)
+        {
+          /* retain the most recent data if the server is particularly chatty */
+          if (psStream->nLength == TELNET_BUFFER_SIZE)
+          {
+            memmove(psStream->bufText, psStream->bufText + TELNET_BUFFER_SIZE / 2, TELNET_BUFFER_SIZE / 2);
+            psStream->nLength = TELNET_BUFFER_SIZE / 2;
+          }
+          psStream->bufText[psStream->nLength++] = c;
+        }
+        break;
+      case IAC_STATE_IAC:
+        if ((c == WILL) || (c == WONT) || (c == DO) || (c == DONT))
+        {
+          psStream->nIACCommand = c;
+          psStream->nIACState = IAC_STATE_OPTION;
+        }
+        else if (c == SB)
+          psStream->nIACState = IAC_STATE_SB;
+        else if (c == IAC)
+        {
+          /* escaped 0xFF data byte */
+          if (psStream->nLength < TELNET_BUFFER_SIZE)
+            psStream->bufText[psStream->nLength++] = c;
+          psStream->nIACState = IAC_STATE_DATA;
+        }
         else
-          bufTemp[1] = DONT;
-      else
-        bufTemp[1] = DONT;
+          psStream->nIACState = IAC_STATE_DATA;
+        break;
+      case IAC_STATE_OPTION:
+        writeError(ERR_DEBUG_MODULE, "Handling IAC Command (%d %d)...", psStream->nIACCommand, c);
 
-      medusaSend(hSocket, bufTemp, 3, 0);
+        if ((psStream->nIACCommand == WONT || psStream->nIACCommand == DONT) && c == TELOPT_LINEMODE)
+        {
+          writeError(ERR_DEBUG_MODULE, "TELNETD peer does not like linemode");
+        }
+
+        /* We're not that friendly. Refuse to do anything asked of us. */
+        if (psStream->nIACCommand == WILL)
+        {
+          bufReply[nReply++] = IAC;
+
+          /* AS/400 devices appear to request and require "Echo" and "Suppress Go Ahead" */
+          if ((_psSessionData->nMode == MODE_AS400) && ((c == TELOPT_ECHO) || (c == TELOPT_SGA)))
+            bufReply[nReply++] = DO;
+          else
+            bufReply[nReply++] = DONT;
+
+          bufReply[nReply++] = c;
+        }
+        else if (psStream->nIACCommand == DO)
+        {
+          bufReply[nReply++] = IAC;
+          bufReply[nReply++] = WONT;
+          bufReply[nReply++] = c;
+        }
+
+        psStream->nIACState = IAC_STATE_DATA;
+        break;
+      case IAC_STATE_SB:
+        /* subnegotiation is ignored up to IAC SE */
+        if (c == IAC)
+          psStream->nIACState = IAC_STATE_SB_IAC;
+        break;
+      case IAC_STATE_SB_IAC:
+        psStream->nIACState = (c == SE) ? IAC_STATE_DATA : IAC_STATE_SB;
+        break;
     }
-    else if (bufTemp[1] == DO) /* DO (0xFD), DONT (0xFE) */
+  }
+
+  psStream->bufText[psStream->nLength] = '\0';
+
+  if ((nReply > 0) && (medusaSend(psStream->hSocket, bufReply, nReply, 0) < 0))
+    writeError(ERR_ERROR, "%s failed: medusaSend was not successful", MODULE_NAME);
+
+  return nRead;
+}
+
+/* Wait (up to nTimeout usec in total) until the server is sitting at a login, password or shell prompt */
+int telnetWaitPrompt(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout)
+{
+  struct timeval tvStart, tvNow;
+  int nElapsed = 0, nRet, nMatch;
+
+  gettimeofday(&tvStart, NULL);
+
+  while (nElapsed < nTimeout)
+  {
+    nRet = telnetRead(psStream, _psSessionData, nTimeout - nElapsed);
+    if (nRet < 0)
+      return MATCH_CLOSED;
+    else if (nRet == 0)
+      break;
+
+    nMatch = checkPrompt(psStream);
+
+    /* make sure a shell prompt character is not simply the end of the current segment */
+    if ((nMatch == MATCH_SHELL) && (medusaDataReadyTimed(psStream->hSocket, 0, TELNET_QUIET_WAIT) > 0))
+      nMatch = MATCH_NONE;
+
+    if (nMatch != MATCH_NONE)
     {
-      bufTemp[1] = WONT;
-      medusaSend(hSocket, bufTemp, 3, 0);
+      writeError(ERR_DEBUG_MODULE, "[%s] Found prompt (%d): %s", MODULE_NAME, nMatch, psStream->bufText);
+      return nMatch;
     }
 
-    bufTemp += 3; /* Process three bytes at a time */
+    gettimeofday(&tvNow, NULL);
+    nElapsed = (tvNow.tv_sec - tvStart.tv_sec) * 1000000 + (tvNow.tv_usec - tvStart.tv_usec);
   }
 
-  if (*bufTemp == 0)
+  return MATCH_NONE;
+}
+
+/* Wait (up to nTimeout usec in total) until any of the matcher's patterns has been received */
+int telnetWaitText(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, _PROMPT_MATCHER* psMatcher, int nTimeout)
+{
+  struct timeval tvStart, tvNow;
+  int nElapsed = 0;
+
+  gettimeofday(&tvStart, NULL);
+
+  while (nElapsed < nTimeout)
   {
-    writeError(ERR_DEBUG_MODULE, "Getting more data");
-    free(*buffer);
+    if (telnetRead(psStream, _psSessionData, nTimeout - nElapsed) <= 0)
+      break;
 
-    *nReceiveBufferSize = 0;
-    *buffer = medusaReceiveLineDelay(hSocket, nReceiveBufferSize, RECEIVE_DELAY_1, RECEIVE_DELAY_2);
-    if (*buffer != NULL)
-      (*buffer)[*nReceiveBufferSize] = 0;  // Make certain buffer is null-terminated
-    else
-    {
-      // No data
-      *buffer = NULL;
-      return;
-    }
+    if (matchPattern(psMatcher, psStream->bufText, psStream->nLength, NULL) >= 0)
+      return 1;
 
-    writeError(ERR_DEBUG_MODULE, "Next pass buffer: %s", *buffer);
-    if ((unsigned char)*buffer[0] == IAC)
-    {
-      writeError(ERR_DEBUG_MODULE, "More commands waiting...");
-    }
+    gettimeofday(&tvNow, NULL);
+    nElapsed = (tvNow.tv_sec - tvStart.tv_sec) * 1000000 + (tvNow.tv_usec - tvStart.tv_usec);
   }
+
+  return 0;
+}
+
+/* Wait up to nTimeout1 usec for data and then keep reading until none arrives for nTimeout2 usec */
+int telnetReceive(_TELNET_STREAM* psStream, _MODULE_DATA* _psSessionData, int nTimeout1, int nTimeout2)
+{
+  int nRet;
+
+  nRet = telnetRead(psStream, _psSessionData, nTimeout1);
+  while (nRet > 0)
+    nRet = telnetRead(psStream, _psSessionData, nTimeout2);
+
+  return psStream->nLength;
 }
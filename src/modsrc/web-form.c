@@ -34,7 +34,7 @@
 #define MODULE_NAME    "web-form.mod"
 #define MODULE_AUTHOR  "Luciano Bello <luciano@linux.org.ar>"
 #define MODULE_SUMMARY_USAGE  "Brute force module for web forms"
-#define MODULE_VERSION    "2.1"
+#define MODULE_VERSION    "2.2"
 #define MODULE_VERSION_SVN "$Id: web-form.c 9217 2015-05-07 18:07:03Z jmk $"
 #define MODULE_SUMMARY_FORMAT  "%s : version %s"
 #define MODULE_SUMMARY_FORMAT_WARN  "%s : version %s (%s)"
@@ -49,12 +49,49 @@
 #define FORM_GET 1
 #define FORM_POST 2
 
+/* Response signal types (bitmask) */
+#define SIGNAL_DENY 1
+#define SIGNAL_SUCCESS 2
+
+/* Where a signal is looked for */
+#define SIGNAL_TEXT 0
+#define SIGNAL_CODE 1
+#define SIGNAL_LOCATION 2
+
+#define HEADER_MAX 16384
+
+typedef struct __SIGNAL {
+  int nType;
+  int nTarget;
+  char *szValue;
+  struct __SIGNAL *psNext;
+} _SIGNAL;
+
+/*
+  Aho-Corasick automaton over all text signals. Failure links are folded into
+  the transition table when compiled, so matching is a single table lookup per
+  response byte regardless of the number of signals.
+*/
+typedef struct __AC_NODE {
+  int nNext[256];
+  int nFail;
+  int nOutput;
+} _AC_NODE;
+
+typedef struct __AC_MATCHER {
+  _AC_NODE *psNodes;
+  int nNodes;
+  int nAlloc;
+} _AC_MATCHER;
+
 typedef struct __MODULE_DATA {
   char *szDir;
   char *szHostHeader;
   char *szUserAgent;
   int nFormType;
-  char *szDenySignal;
+  _SIGNAL *psSignals;
+  int nSuccessSignals;
+  _AC_MATCHER *psMatcher;
   char *szFormData;
   char *szFormRest;
   char *szFormUser;
@@ -73,6 +110,9 @@ enum MODULE_STATE
 };
 
 // Forward declarations
+void addSignal(_MODULE_DATA* _psSessionData, int nType, int nTarget, char* szValue);
+void freeSignals(_MODULE_DATA* _psSessionData);
+_AC_MATCHER* buildMatcher(_SIGNAL* psSignals);
 int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* szLogin, char* szPassword);
 int initModule(_MODULE_DATA* _psSessionData, sLogin* login);
 
@@ -82,6 +122,12 @@ int getParamNumber()
   return 0;    // we don't need no stinking parameters
 }
 
+// Tell medusa which TCP port the module connects to by default
+int getDefaultPort(int iUseSSL)
+{
+  return (iUseSSL) ? HTTPS_PORT : HTTP_PORT;
+}
+
 // Displays information about the module and how it must be used
 void summaryUsage(char **ppszSummary)
 {
@@ -111,6 +157,14 @@ void showUsage()
   writeVerbose(VB_NONE, "  FORM:?             Target form to request. Default: \"/\"");
   writeVerbose(VB_NONE, "  DENY-SIGNAL:?      Authentication failure message. Attempt flagged as successful if text is not present in");
   writeVerbose(VB_NONE, "                     server response. Default: \"Login incorrect\"");
+  writeVerbose(VB_NONE, "  SUCCESS-SIGNAL:?   Authentication success message. If set, attempt flagged as failed unless text is present");
+  writeVerbose(VB_NONE, "                     in server response.");
+  writeVerbose(VB_NONE, "  DENY-CODE:?        HTTP status code which indicates an authentication failure (e.g. 401).");
+  writeVerbose(VB_NONE, "  SUCCESS-CODE:?     HTTP status code which indicates an authentication success (e.g. 302).");
+  writeVerbose(VB_NONE, "  DENY-LOCATION:?    Text within the Location header which indicates an authentication failure.");
+  writeVerbose(VB_NONE, "  SUCCESS-LOCATION:? Text within the Location header which indicates an authentication success.");
+  writeVerbose(VB_NONE, "                     Each of the signal options can be defined several times. Signals are matched");
+  writeVerbose(VB_NONE, "                     case-insensitively and the connection is closed as soon as one is seen.");
   writeVerbose(VB_NONE, "  CUSTOM-HEADER:?    Custom HTTP header.");
   writeVerbose(VB_NONE, "                     More headers can be defined by using this option several times.");
   writeVerbose(VB_NONE, "  FORM-DATA:<METHOD>?<FIELDS>");
@@ -121,18 +175,20 @@ void showUsage()
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "Usage example: \"-M web-form -m USER-AGENT:\"g3rg3 gerg\" -m FORM:\"webmail/index.php\" -m DENY-SIGNAL:\"deny!\"");
   writeVerbose(VB_NONE, "                 -m FORM-DATA:\"post?user=&pass=&submit=True\" -m CUSTOM-HEADER:\"Cookie: name=value\"");
+  writeVerbose(VB_NONE, "Usage example: \"-M web-form -m FORM:\"login.php\" -m SUCCESS-CODE:302 -m DENY-LOCATION:\"error=\"");
 }
 
 // The "main" of the medusa module world - this is what gets called to actually do the work
 int go(sLogin* logins, int argc, char *argv[])
 {
   int i;
+  int nSignalType;
   char *strtok_ptr, *pOpt, *pOptTmp;
   _MODULE_DATA *psSessionData;
   psSessionData = malloc(sizeof(_MODULE_DATA));
   memset(psSessionData, 0, sizeof(_MODULE_DATA));
 
-  if ((argc < 0) || (argc > 5))
+  if ((argc < 0) || (argc > 32))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -167,11 +223,49 @@ int go(sLogin* logins, int argc, char *argv[])
 
         if ( pOpt )
         {
-          psSessionData->szDenySignal= strdup(pOpt);
+          addSignal(psSessionData, SIGNAL_DENY, SIGNAL_TEXT, pOpt);
         }
         else
           writeError(ERR_WARNING, "Method DENY-SIGNAL requires value to be set.");
       }
+      else if (strcmp(pOpt, "SUCCESS-SIGNAL") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if ( pOpt )
+        {
+          addSignal(psSessionData, SIGNAL_SUCCESS, SIGNAL_TEXT, pOpt);
+        }
+        else
+          writeError(ERR_WARNING, "Method SUCCESS-SIGNAL requires value to be set.");
+      }
+      else if ((strcmp(pOpt, "DENY-CODE") == 0) || (strcmp(pOpt, "SUCCESS-CODE") == 0))
+      {
+        nSignalType = (strcmp(pOpt, "DENY-CODE") == 0) ? SIGNAL_DENY : SIGNAL_SUCCESS;
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if ( (pOpt) && (atoi(pOpt) >= 100) && (atoi(pOpt) <= 999) )
+        {
+          addSignal(psSessionData, nSignalType, SIGNAL_CODE, pOpt);
+        }
+        else
+          writeError(ERR_WARNING, "Methods DENY-CODE and SUCCESS-CODE require a valid HTTP status code.");
+      }
+      else if ((strcmp(pOpt, "DENY-LOCATION") == 0) || (strcmp(pOpt, "SUCCESS-LOCATION") == 0))
+      {
+        nSignalType = (strcmp(pOpt, "DENY-LOCATION") == 0) ? SIGNAL_DENY : SIGNAL_SUCCESS;
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if ( pOpt )
+        {
+          addSignal(psSessionData, nSignalType, SIGNAL_LOCATION, pOpt);
+        }
+        else
+          writeError(ERR_WARNING, "Methods DENY-LOCATION and SUCCESS-LOCATION require value to be set.");
+      }
       else if (strcmp(pOpt, "FORM-DATA") == 0)
       {
         pOpt = strtok_r(NULL, "\0", &strtok_ptr);
@@ -247,6 +341,7 @@ int initModule(_MODULE_DATA *_psSessionData, sLogin* _psLogin)
   int nBufLength = 0;
   sCredentialSet *psCredSet = NULL;
   sConnectParams params;
+  _SIGNAL *psSignal = NULL;
 
   psCredSet = malloc( sizeof(sCredentialSet) );
   memset(psCredSet, 0, sizeof(sCredentialSet));
@@ -385,10 +480,17 @@ int initModule(_MODULE_DATA *_psSessionData, sLogin* _psLogin)
           sprintf(_psSessionData->szUserAgent, "I'm not Mozilla, I'm Ming Mong");
         }
 
-        if (!_psSessionData->szDenySignal) {
-          _psSessionData->szDenySignal = malloc(19);
-          memset(_psSessionData->szDenySignal, 0, 19);
-          sprintf(_psSessionData->szDenySignal, "Login Incorrect");
+        if (!_psSessionData->psMatcher) {
+          for (psSignal = _psSessionData->psSignals; psSignal; psSignal = psSignal->psNext)
+          {
+            if (psSignal->nTarget == SIGNAL_TEXT)
+              break;
+          }
+
+          if (psSignal == NULL)
+            addSignal(_psSessionData, SIGNAL_DENY, SIGNAL_TEXT, "Login Incorrect");
+
+          _psSessionData->psMatcher = buildMatcher(_psSessionData->psSignals);
         }
 
         if (!_psSessionData->szCustomHeader) {
@@ -442,7 +544,7 @@ int initModule(_MODULE_DATA *_psSessionData, sLogin* _psLogin)
   FREE(_psSessionData->szDir);
   FREE(_psSessionData->szHostHeader);
   FREE(_psSessionData->szUserAgent);
-  FREE(_psSessionData->szDenySignal);
+  freeSignals(_psSessionData);
   FREE(_psSessionData->szFormData);
   FREE(_psSessionData->szFormRest);
   FREE(_psSessionData->szFormUser);
@@ -455,6 +557,186 @@ int initModule(_MODULE_DATA *_psSessionData, sLogin* _psLogin)
 
 /* Module Specific Functions */
 
+void addSignal(_MODULE_DATA* _psSessionData, int nType, int nTarget, char* szValue)
+{
+  _SIGNAL *psSignal = NULL;
+
+  psSignal = malloc(sizeof(_SIGNAL));
+  memset(psSignal, 0, sizeof(_SIGNAL));
+  psSignal->nType = nType;
+  psSignal->nTarget = nTarget;
+  psSignal->szValue = strdup(szValue);
+  psSignal->psNext = _psSessionData->psSignals;
+  _psSessionData->psSignals = psSignal;
+
+  /* any success rule (text, status code or Location) makes a response without a signal a failure */
+  if (nType == SIGNAL_SUCCESS)
+    _psSessionData->nSuccessSignals++;
+}
+
+void freeSignals(_MODULE_DATA* _psSessionData)
+{
+  _SIGNAL *psSignal = NULL;
+
+  while (_psSessionData->psSignals)
+  {
+    psSignal = _psSessionData->psSignals;
+    _psSessionData->psSignals = psSignal->psNext;
+    FREE(psSignal->szValue);
+    FREE(psSignal);
+  }
+
+  if (_psSessionData->psMatcher)
+  {
+    FREE(_psSessionData->psMatcher->psNodes);
+    FREE(_psSessionData->psMatcher);
+  }
+}
+
+int addMatcherNode(_AC_MATCHER* psMatcher)
+{
+  int i;
+
+  if (psMatcher->nNodes == psMatcher->nAlloc)
+  {
+    psMatcher->nAlloc = (psMatcher->nAlloc == 0) ? 64 : psMatcher->nAlloc * 2;
+    psMatcher->psNodes = realloc(psMatcher->psNodes, psMatcher->nAlloc * sizeof(_AC_NODE));
+  }
+
+  for (i = 0; i < 256; i++)
+    psMatcher->psNodes[psMatcher->nNodes].nNext[i] = -1;
+  psMatcher->psNodes[psMatcher->nNodes].nFail = 0;
+  psMatcher->psNodes[psMatcher->nNodes].nOutput = 0;
+
+  return psMatcher->nNodes++;
+}
+
+/* Build a case-insensitive Aho-Corasick automaton from all text signals */
+_AC_MATCHER* buildMatcher(_SIGNAL* psSignals)
+{
+  _AC_MATCHER *psMatcher = NULL;
+  _SIGNAL *psSignal = NULL;
+  _AC_NODE *psNode = NULL;
+  int *pQueue = NULL;
+  int nHead = 0, nTail = 0;
+  int nState, nNext, i;
+  unsigned char *pChar = NULL;
+
+  psMatcher = malloc(sizeof(_AC_MATCHER));
+  memset(psMatcher, 0, sizeof(_AC_MATCHER));
+  addMatcherNode(psMatcher);
+
+  /* trie of lower-cased signals */
+  for (psSignal = psSignals; psSignal; psSignal = psSignal->psNext)
+  {
+    if ((psSignal->nTarget != SIGNAL_TEXT) || (psSignal->szValue[0] == '\0'))
+      continue;
+
+    nState = 0;
+    for (pChar = (unsigned char*)psSignal->szValue; *pChar; pChar++)
+    {
+      if (psMatcher->psNodes[nState].nNext[tolower(*pChar)] == -1)
+      {
+        nNext = addMatcherNode(psMatcher);
+        psMatcher->psNodes[nState].nNext[tolower(*pChar)] = nNext;
+      }
+      nState = psMatcher->psNodes[nState].nNext[tolower(*pChar)];
+    }
+
+    psMatcher->psNodes[nState].nOutput |= psSignal->nType;
+    writeError(ERR_DEBUG_MODULE, "[%s] Added %s signal: %s", MODULE_NAME, (psSignal->nType == SIGNAL_DENY) ? "deny" : "success", psSignal->szValue);
+  }
+
+  /* breadth-first pass: set failure links and fold them into the transition table */
+  pQueue = malloc(psMatcher->nNodes * sizeof(int));
+
+  psNode = &psMatcher->psNodes[0];
+  for (i = 0; i < 256; i++)
+  {
+    if (psNode->nNext[i] == -1)
+      psNode->nNext[i] = 0;
+    else
+    {
+      psMatcher->psNodes[psNode->nNext[i]].nFail = 0;
+      pQueue[nTail++] = psNode->nNext[i];
+    }
+  }
+
+  while (nHead < nTail)
+  {
+    nState = pQueue[nHead++];
+    psNode = &psMatcher->psNodes[nState];
+    psNode->nOutput |= psMatcher->psNodes[psNode->nFail].nOutput;
+
+    for (i = 0; i < 256; i++)
+    {
+      nNext = psNode->nNext[i];
+      if (nNext == -1)
+        psNode->nNext[i] = psMatcher->psNodes[psNode->nFail].nNext[i];
+      else
+      {
+        psMatcher->psNodes[nNext].nFail = psMatcher->psNodes[psNode->nFail].nNext[i];
+        pQueue[nTail++] = nNext;
+      }
+    }
+  }
+
+  FREE(pQueue);
+  return psMatcher;
+}
+
+/*
+  Run a block of response data through the matcher, continuing from the state
+  left by the previous block. Returns the signal type(s) of the first match.
+*/
+int feedMatcher(_AC_MATCHER* psMatcher, int* pnState, unsigned char* pBuf, int nBuf)
+{
+  int i;
+  int nState = *pnState;
+
+  for (i = 0; i < nBuf; i++)
+  {
+    nState = psMatcher->psNodes[nState].nNext[tolower(pBuf[i])];
+    if (psMatcher->psNodes[nState].nOutput)
+    {
+      *pnState = nState;
+      return psMatcher->psNodes[nState].nOutput;
+    }
+  }
+
+  *pnState = nState;
+  return 0;
+}
+
+/* Check status code and Location header signals against the response headers */
+int checkHeaderSignals(_MODULE_DATA* _psSessionData, char* szHeader, int nStatusCode)
+{
+  _SIGNAL *psSignal = NULL;
+  char *szLocation = NULL;
+  char *pTemp = NULL;
+  int nResult = 0;
+
+  szLocation = strcasestr(szHeader, "\nLocation:");
+  if (szLocation)
+  {
+    szLocation = strdup(szLocation + 10);
+    if ((pTemp = index(szLocation, '\r')) != NULL)
+      *pTemp = '\0';
+    writeError(ERR_DEBUG_MODULE, "[%s] Location header: %s", MODULE_NAME, szLocation);
+  }
+
+  for (psSignal = _psSessionData->psSignals; psSignal; psSignal = psSignal->psNext)
+  {
+    if ((psSignal->nTarget == SIGNAL_CODE) && (atoi(psSignal->szValue) == nStatusCode))
+      nResult |= psSignal->nType;
+    else if ((psSignal->nTarget == SIGNAL_LOCATION) && (szLocation) && (strcasestr(szLocation, psSignal->szValue)))
+      nResult |= psSignal->nType;
+  }
+
+  FREE(szLocation);
+  return nResult;
+}
+
 char *urlencodeup(char* szStr){
   unsigned int i=0,j=0;
   size_t iLen=strlen(szStr);
@@ -524,13 +806,48 @@ int sendGet(int hSocket, _MODULE_DATA* _psSessionData, char* szLogin, char* szPa
   return nRet;
 }
 
+/*
+  Evaluate the response headers (and any body data received with them). The
+  status code and Location signals are checked first, followed by the text
+  signals. A non-200 status code without a matching signal is treated as an
+  error, as before.
+*/
+int processHeaders(_MODULE_DATA* _psSessionData, char* szHeader, int nHeader, int* pnState, int* pnSignal, char* szLogin, char* szPassword)
+{
+  char* pTemp = NULL;
+  int nStatusCode = 0;
+
+  pTemp = (char*)index(szHeader, ' ');
+  if (pTemp)
+    nStatusCode = atoi(pTemp + 1);
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Server response status code: %d", MODULE_NAME, nStatusCode);
+
+  *pnSignal = checkHeaderSignals(_psSessionData, szHeader, nStatusCode);
+  if (*pnSignal == 0)
+    *pnSignal = feedMatcher(_psSessionData->psMatcher, pnState, (unsigned char*)szHeader, nHeader);
+
+  if ((*pnSignal == 0) && (nStatusCode != 200))
+  {
+    writeError(ERR_ERROR, "The answer was NOT successfully received, understood, and accepted while trying %s %s: error code %.4s", szLogin, szPassword, pTemp);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
 int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* szLogin, char* szPassword)
 {
   unsigned char* pReceiveBuffer = NULL;
   int nReceiveBufferSize;
   int nRet = FAILURE;
-  char* pTemp = NULL;
   char* szPasswordEncoded = NULL;
+  char* szHeader = NULL;
+  int nHeader = 0;
+  int nTotal = 0;
+  int bHeaders = FALSE;
+  int nState = 0;
+  int nSignal = 0;
   
   szPasswordEncoded = urlencodeup(szPassword);
 
@@ -548,6 +865,8 @@ int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* sz
       break;
   }
 
+  FREE(szPasswordEncoded);
+
   if (nRet == FAILURE)
   {
     writeError(ERR_ERROR, "[%s] Failed during sending of authentication data.", MODULE_NAME);
@@ -557,33 +876,70 @@ int tryLogin(int hSocket, _MODULE_DATA* _psSessionData, sLogin** login, char* sz
   }
 
   writeError(ERR_DEBUG_MODULE, "[%s] Retrieving server response.", MODULE_NAME);
-  pReceiveBuffer = medusaReceiveLine(hSocket, &nReceiveBufferSize);
 
-  if ((pReceiveBuffer == NULL) || (pReceiveBuffer[0] == '\0'))
+  /*
+    The response is scanned as it arrives. Headers are collected first so that
+    status code and Location signals can be checked. The connection is dropped
+    as soon as any signal is seen, rather than downloading the rest of the page.
+  */
+  while ((nSignal == 0) && ((pReceiveBuffer = medusaReceiveLine(hSocket, &nReceiveBufferSize)) != NULL) && (pReceiveBuffer[0] != '\0'))
   {
-    writeError(ERR_ERROR, "[%s] No data received", MODULE_NAME);
-    (*login)->iResult = LOGIN_RESULT_UNKNOWN;
-    setPassResult(*login, szPassword);
-    return MSTATE_EXITING;  
+    nTotal += nReceiveBufferSize;
+
+    if (bHeaders == FALSE)
+    {
+      szHeader = realloc(szHeader, nHeader + nReceiveBufferSize + 1);
+      memcpy(szHeader + nHeader, pReceiveBuffer, nReceiveBufferSize);
+      nHeader += nReceiveBufferSize;
+      szHeader[nHeader] = '\0';
+
+      if ((strstr(szHeader, "\r\n\r\n")) || (nHeader > HEADER_MAX))
+        bHeaders = TRUE;
+    }
+    else
+      nSignal = feedMatcher(_psSessionData->psMatcher, &nState, pReceiveBuffer, nReceiveBufferSize);
+
+    FREE(pReceiveBuffer);
+
+    if ((bHeaders == TRUE) && (szHeader))
+    {
+      nRet = processHeaders(_psSessionData, szHeader, nHeader, &nState, &nSignal, szLogin, szPassword);
+      FREE(szHeader);
+      if (nRet == FAILURE)
+        break;
+    }
   }
+  FREE(pReceiveBuffer);
 
-  pTemp = (char*)index((char *)pReceiveBuffer, ' ');
-  if ( !pTemp || strncmp(pTemp + 1, "200 OK", 6) != 0 )
+  /* connection closed before the end of the headers */
+  if ((nRet != FAILURE) && (szHeader))
   {
-    writeError(ERR_ERROR, "The answer was NOT successfully received, understood, and accepted while trying %s %s: error code %.4s", szLogin, szPassword, pTemp);
+    nRet = processHeaders(_psSessionData, szHeader, nHeader, &nState, &nSignal, szLogin, szPassword);
+    FREE(szHeader);
+  }
+
+  if ((nTotal == 0) || (nRet == FAILURE))
+  {
+    if (nTotal == 0)
+      writeError(ERR_ERROR, "[%s] No data received", MODULE_NAME);
     (*login)->iResult = LOGIN_RESULT_UNKNOWN;
     setPassResult(*login, szPassword);
     return MSTATE_EXITING;
   }
 
-  while (pReceiveBuffer != NULL && (strcasestr((char *)pReceiveBuffer, _psSessionData->szDenySignal) == NULL) && (pReceiveBuffer[0] != '\0'))
+  if (nSignal)
+    writeError(ERR_DEBUG_MODULE, "[%s] Signal located after %d bytes. Closing connection.", MODULE_NAME, nTotal);
+
+  /* deny signals take precedence if both were seen at the same point */
+  if (nSignal & SIGNAL_DENY)
   {
-    free(pReceiveBuffer);
-    pReceiveBuffer = medusaReceiveLine(hSocket, &nReceiveBufferSize);
+    (*login)->iResult = LOGIN_RESULT_FAIL;
+    setPassResult(*login, szPassword);
+    return MSTATE_NEW;
   }
-
-  if(pReceiveBuffer != NULL && strcasestr((char *)pReceiveBuffer, _psSessionData->szDenySignal) != NULL)
+  else if ((nSignal == 0) && (_psSessionData->nSuccessSignals > 0))
   {
+    writeError(ERR_DEBUG_MODULE, "[%s] No success signal located in server response.", MODULE_NAME);
     (*login)->iResult = LOGIN_RESULT_FAIL;
     setPassResult(*login, szPassword);
     return MSTATE_NEW;
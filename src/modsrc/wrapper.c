@@ -29,6 +29,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include "module.h"
 
 #define MODULE_NAME    "wrapper.mod"
@@ -46,6 +49,15 @@
 
 #define TYPE_SINGLE 1
 #define TYPE_STDIN 2
+#define TYPE_COPROC 3
+
+#define FORMAT_LINE 1
+#define FORMAT_LENGTH 2
+
+#define COPROC_BUFFER_SIZE 8192
+#define COPROC_RECORD_MAX 1024*1024
+
+extern char **environ;
 
 typedef struct __MODULE_DATA {
   char *szCmd;
@@ -55,6 +67,10 @@ typedef struct __MODULE_DATA {
   int iReadPipe[2];
   int iWritePipe[2];
   int nType;
+  int nFormat;
+  pid_t pidCoproc;
+  char *bufCoproc;      /* unprocessed data read from the coprocess */
+  int nCoprocLength;
 } _MODULE_DATA;
 
 // Tells us whether we are to continue processing or not
@@ -71,6 +87,10 @@ int tryLogin(_MODULE_DATA* _psSessionData, sLogin** login, char* szPassword);
 int initModule(_MODULE_DATA* _psSessionData, sLogin* login);
 int initProcess(_MODULE_DATA* _psSessionData);
 int closeProcess(_MODULE_DATA* _psSessionData);
+int initModuleCoproc(_MODULE_DATA* _psSessionData, sLogin* login);
+int initCoproc(_MODULE_DATA* _psSessionData, sLogin* login);
+int closeCoproc(_MODULE_DATA* _psSessionData);
+int tryLoginCoproc(_MODULE_DATA* _psSessionData, sLogin** login, char* szLogin, char* szPassword);
 
 // Tell medusa how many parameters this module allows
 int getParamNumber()
@@ -102,13 +122,26 @@ void showUsage()
 {
   writeVerbose(VB_NONE, "%s (%s) %s :: %s\n", MODULE_NAME, MODULE_VERSION, MODULE_AUTHOR, MODULE_SUMMARY_USAGE);
   writeVerbose(VB_NONE, "Available module options:");
-  writeVerbose(VB_NONE, "  TYPE:? (SINGLE, STDIN)");
+  writeVerbose(VB_NONE, "  TYPE:? (SINGLE, STDIN, COPROC)");
   writeVerbose(VB_NONE, "    Option sets type of script being called by module. See included sample scripts");
   writeVerbose(VB_NONE, "    for ideas how to use this module.");
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "    SINGLE: Script expects all user input comes from original command line.");
   writeVerbose(VB_NONE, "    STDIN:  Host and user information passed to script via command line.");
   writeVerbose(VB_NONE, "            Passwords to test are passed via STDIN to script.");
+  writeVerbose(VB_NONE, "    COPROC: Script is started once per login thread (no shell) with host information");
+  writeVerbose(VB_NONE, "            passed via command line. Each username/password pair is sent as a record");
+  writeVerbose(VB_NONE, "            via STDIN and one result record is expected for each via STDOUT.");
+  writeVerbose(VB_NONE, " ");
+  writeVerbose(VB_NONE, "  FORMAT:? (LINE*, LENGTH)");
+  writeVerbose(VB_NONE, "    Record format used by TYPE:COPROC.");
+  writeVerbose(VB_NONE, "");
+  writeVerbose(VB_NONE, "    LINE:   Request \"<user>\\t<password>\\n\". Backslash, tab, CR and newline characters");
+  writeVerbose(VB_NONE, "            within values are escaped as \\\\, \\t, \\r and \\n. Response is a single line.");
+  writeVerbose(VB_NONE, "    LENGTH: Request is two netstrings \"<len>:<user>,<len>:<password>,\". Response is a");
+  writeVerbose(VB_NONE, "            single netstring.");
+  writeVerbose(VB_NONE, "");
+  writeVerbose(VB_NONE, "    Responses: LOGIN_RESULT_SUCCESS, LOGIN_RESULT_FAIL or LOGIN_RESULT_ERROR:<message>");
   writeVerbose(VB_NONE, " ");
   writeVerbose(VB_NONE, "  PROG:? ");
   writeVerbose(VB_NONE, "    Option for setting path to executable file.");
@@ -121,6 +154,13 @@ void showUsage()
   writeVerbose(VB_NONE, "");
   writeVerbose(VB_NONE, "Usage example: \'-M wrapper -m TYPE:SINGLE -m PROG:./foo.pl -m ARGS:\"-h %H -u %U -p %P\"\'");
   writeVerbose(VB_NONE, "Usage example: \'-M wrapper -m TYPE:STDIN  -m PROG:./bar.pl -m ARGS:\"--host %H --user %U\"\'");
+  writeVerbose(VB_NONE, "Usage example: \'-M wrapper -m TYPE:COPROC -m PROG:./baz.pl -m ARGS:\"--host %H\"\'");
+}
+
+// Tell medusa the module waits in the external program, so its logins cannot run as coroutines (-E)
+int isBlocking()
+{
+  return TRUE;
 }
 
 // The "main" of the medusa module world - this is what gets called to actually do the work
@@ -132,7 +172,7 @@ int go(sLogin* logins, int argc, char *argv[])
   psSessionData = malloc(sizeof(_MODULE_DATA));
   memset(psSessionData, 0, sizeof(_MODULE_DATA));
 
-  if ((argc < 0) || (argc > 3))
+  if ((argc < 0) || (argc > 4))
   {
     writeError(ERR_ERROR, "%s: Incorrect number of parameters passed to module (%d). Use \"-q\" option to display module usage.", MODULE_NAME, argc);
     return FAILURE;
@@ -158,9 +198,25 @@ int go(sLogin* logins, int argc, char *argv[])
           psSessionData->nType = TYPE_SINGLE;
         else if (strcmp(pOpt, "STDIN") == 0)
           psSessionData->nType = TYPE_STDIN;
+        else if (strcmp(pOpt, "COPROC") == 0)
+          psSessionData->nType = TYPE_COPROC;
         else
           writeError(ERR_WARNING, "Invalid value for method TYPE.");
       }
+      else if (strcmp(pOpt, "FORMAT") == 0)
+      {
+        pOpt = strtok_r(NULL, "\0", &strtok_ptr);
+        writeError(ERR_DEBUG_MODULE, "Processing option parameter: %s", pOpt);
+
+        if (pOpt == NULL)
+          writeError(ERR_WARNING, "Method FORMAT requires value to be set.");
+        else if (strcmp(pOpt, "LINE") == 0)
+          psSessionData->nFormat = FORMAT_LINE;
+        else if (strcmp(pOpt, "LENGTH") == 0)
+          psSessionData->nFormat = FORMAT_LENGTH;
+        else
+          writeError(ERR_WARNING, "Invalid value for method FORMAT.");
+      }
       else if (strcmp(pOpt, "PROG") == 0)
       {
         pOpt = strtok_r(NULL, "\0", &strtok_ptr);
@@ -193,7 +249,11 @@ int go(sLogin* logins, int argc, char *argv[])
       free(pOptTmp);
     }
  
-    initModule(psSessionData, logins);
+    if (psSessionData->nType == TYPE_COPROC)
+      initModuleCoproc(psSessionData, logins);
+    else
+      initModule(psSessionData, logins);
+
     iRet = SUCCESS;
   }
 
@@ -585,3 +645,447 @@ int tryLogin(_MODULE_DATA* _psSessionData, sLogin** psLogin, char* szPassword)
   setPassResult((*psLogin), szPassword);
   return(iRet);
 }
+
+/* COPROC Functions */
+
+/*
+  Persistent coprocess mode. The helper is started once per login thread and
+  stays running while every credential set for the thread is tested. Records are
+  exchanged over STDIN/STDOUT; the helper's STDERR is left attached to Medusa's.
+*/
+int initModuleCoproc(_MODULE_DATA *_psSessionData, sLogin* psLogin)
+{
+  enum MODULE_STATE nState = MSTATE_NEW;
+  sCredentialSet *psCredSet = NULL;
+  sigset_t sigPipe;
+
+  if (_psSessionData->szCmd == NULL)
+  {
+    writeError(ERR_ERROR, "[%s] Method PROG must be set for TYPE:COPROC.", MODULE_NAME);
+    psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+    return FAILURE;
+  }
+
+  if (_psSessionData->nFormat == 0)
+    _psSessionData->nFormat = FORMAT_LINE;
+
+  /* a helper exiting early should produce EPIPE for this thread, not terminate Medusa */
+  sigemptyset(&sigPipe);
+  sigaddset(&sigPipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigPipe, NULL);
+
+  psCredSet = malloc( sizeof(sCredentialSet) );
+  memset(psCredSet, 0, sizeof(sCredentialSet));
+
+  if (getNextCredSet(psLogin, psCredSet) == FAILURE)
+  {
+    writeError(ERR_ERROR, "[%s] Error retrieving next credential set to test.", MODULE_NAME);
+    nState = MSTATE_COMPLETE;
+  }
+  else if (psCredSet->psUser)
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] module started for host: %s user: %s", MODULE_NAME, psLogin->psServer->pHostIP, psCredSet->psUser->pUser);
+  }
+  else
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] module started for host: %s - no more available users to test.", MODULE_NAME, psLogin->psServer->pHostIP);
+    nState = MSTATE_COMPLETE;
+  }
+
+  while (nState != MSTATE_COMPLETE)
+  {
+    switch (nState)
+    {
+      case MSTATE_NEW:
+        if (initCoproc(_psSessionData, psLogin) == FAILURE)
+        {
+          writeError(ERR_ERROR, "[%s] Failed to initialize coprocess.", MODULE_NAME);
+          psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+          nState = MSTATE_EXITING;
+        }
+        else
+          nState = MSTATE_RUNNING;
+
+        break;
+      case MSTATE_RUNNING:
+        nState = tryLoginCoproc(_psSessionData, &psLogin, psCredSet->psUser->pUser, psCredSet->pPass);
+
+        if (psLogin->iResult != LOGIN_RESULT_UNKNOWN)
+        {
+          if (getNextCredSet(psLogin, psCredSet) == FAILURE)
+          {
+            writeError(ERR_ERROR, "[%s] Error retrieving next credential set to test.", MODULE_NAME);
+            nState = MSTATE_EXITING;
+          }
+          else if (psCredSet->iStatus == CREDENTIAL_DONE)
+          {
+            writeError(ERR_DEBUG_MODULE, "[%s] No more available credential sets to test.", MODULE_NAME);
+            nState = MSTATE_EXITING;
+          }
+          else if (psCredSet->iStatus == CREDENTIAL_NEW_USER)
+            writeError(ERR_DEBUG_MODULE, "[%s] Starting testing for new user: %s.", MODULE_NAME, psCredSet->psUser->pUser);
+          else
+            writeError(ERR_DEBUG_MODULE, "[%s] Next credential set - user: %s password: %s", MODULE_NAME, psCredSet->psUser->pUser, psCredSet->pPass);
+        }
+        break;
+      case MSTATE_EXITING:
+        closeCoproc(_psSessionData);
+        nState = MSTATE_COMPLETE;
+        break;
+      default:
+        writeError(ERR_CRITICAL, "Unknown %s module state %d", MODULE_NAME, nState);
+        closeCoproc(_psSessionData);
+        psLogin->iResult = LOGIN_RESULT_UNKNOWN;
+        FREE(psCredSet);
+        return FAILURE;
+    }
+  }
+
+  /* clean up memory */
+  FREE(_psSessionData->szCmd);
+  FREE(_psSessionData->szCmdParam);
+  FREE(psCredSet);
+
+  return SUCCESS;
+}
+
+/* Replace each occurrence of %H within an argument with the target address */
+static char* expandArgument(char *szArg, char *szHost)
+{
+  char *szExpanded, *szTmp, *pArg = szArg;
+  int nCount = 0;
+
+  for (szTmp = szArg; (szTmp = strstr(szTmp, "%H")); szTmp += 2)
+    nCount++;
+
+  szExpanded = malloc(strlen(szArg) + nCount * strlen(szHost) + 1);
+  memset(szExpanded, 0, strlen(szArg) + nCount * strlen(szHost) + 1);
+
+  while ((szTmp = strstr(pArg, "%H")))
+  {
+    strncat(szExpanded, pArg, szTmp - pArg);
+    strcat(szExpanded, szHost);
+    pArg = szTmp + 2;
+  }
+  strcat(szExpanded, pArg);
+
+  return szExpanded;
+}
+
+int initCoproc(_MODULE_DATA* _psSessionData, sLogin* psLogin)
+{
+  posix_spawn_file_actions_t sActions;
+  posix_spawnattr_t sAttr;
+  sigset_t sigMask;
+  char **argv = NULL;
+  char *szParam = NULL, *szArg, *strtok_ptr;
+  int iReadPipe[2], iWritePipe[2];
+  int i, nArgs = 1, iRet;
+
+  /* build argument vector -- arguments are split on whitespace and not passed through a shell */
+  argv = malloc(2 * sizeof(char*));
+  argv[0] = strdup(_psSessionData->szCmd);
+
+  if (_psSessionData->szCmdParam)
+  {
+    if ((strstr(_psSessionData->szCmdParam, "%U")) || (strstr(_psSessionData->szCmdParam, "%P")))
+      writeError(ERR_WARNING, "[%s] %%U and %%P are not substituted for TYPE:COPROC. Credentials are passed via STDIN.", MODULE_NAME);
+
+    szParam = strdup(_psSessionData->szCmdParam);
+    for (szArg = strtok_r(szParam, " \t", &strtok_ptr); szArg; szArg = strtok_r(NULL, " \t", &strtok_ptr))
+    {
+      argv = realloc(argv, (nArgs + 2) * sizeof(char*));
+      argv[nArgs++] = expandArgument(szArg, psLogin->psServer->pHostIP);
+    }
+    FREE(szParam);
+  }
+  argv[nArgs] = NULL;
+
+  for (i = 0; i < nArgs; i++)
+    writeError(ERR_DEBUG_MODULE, "[%s] Coprocess argv[%d]: %s", MODULE_NAME, i, argv[i]);
+
+  if (pipe(iReadPipe) != 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed to create communication pipes.", MODULE_NAME);
+    iRet = FAILURE;
+  }
+  else if (pipe(iWritePipe) != 0)
+  {
+    writeError(ERR_ERROR, "[%s] Failed to create communication pipes.", MODULE_NAME);
+    close(iReadPipe[0]);
+    close(iReadPipe[1]);
+    iRet = FAILURE;
+  }
+  else
+  {
+    posix_spawn_file_actions_init(&sActions);
+    posix_spawn_file_actions_adddup2(&sActions, iWritePipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&sActions, iReadPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&sActions, iWritePipe[0]);
+    posix_spawn_file_actions_addclose(&sActions, iWritePipe[1]);
+    posix_spawn_file_actions_addclose(&sActions, iReadPipe[0]);
+    posix_spawn_file_actions_addclose(&sActions, iReadPipe[1]);
+
+    /* the login thread blocks SIGPIPE -- the helper should start with a clean signal state */
+    posix_spawnattr_init(&sAttr);
+    sigemptyset(&sigMask);
+    posix_spawnattr_setsigmask(&sAttr, &sigMask);
+    sigaddset(&sigMask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&sAttr, &sigMask);
+    posix_spawnattr_setflags(&sAttr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    iRet = posix_spawnp(&_psSessionData->pidCoproc, _psSessionData->szCmd, &sActions, &sAttr, argv, environ);
+
+    posix_spawnattr_destroy(&sAttr);
+    posix_spawn_file_actions_destroy(&sActions);
+
+    close(iWritePipe[0]);
+    close(iReadPipe[1]);
+
+    if (iRet != 0)
+    {
+      writeError(ERR_ERROR, "[%s] Failed to execute file: %s (%s)", MODULE_NAME, _psSessionData->szCmd, strerror(iRet));
+      close(iWritePipe[1]);
+      close(iReadPipe[0]);
+      _psSessionData->pidCoproc = 0;
+      iRet = FAILURE;
+    }
+    else
+    {
+      writeError(ERR_DEBUG_MODULE, "[%s] Coprocess started (pid %d).", MODULE_NAME, _psSessionData->pidCoproc);
+      _psSessionData->PARENT_WRITE = iWritePipe[1];
+      _psSessionData->PARENT_READ = iReadPipe[0];
+      _psSessionData->bufCoproc = malloc(COPROC_BUFFER_SIZE + 1);
+      _psSessionData->nCoprocLength = 0;
+      iRet = SUCCESS;
+    }
+  }
+
+  for (i = 0; i < nArgs; i++)
+    FREE(argv[i]);
+  FREE(argv);
+
+  return iRet;
+}
+
+int closeCoproc(_MODULE_DATA* _psSessionData)
+{
+  int nStatus;
+
+  if (_psSessionData->pidCoproc == 0)
+    return SUCCESS;
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Closing coprocess (pid %d).", MODULE_NAME, _psSessionData->pidCoproc);
+
+  /* EOF on STDIN signals the helper to exit */
+  close(_psSessionData->PARENT_WRITE);
+  close(_psSessionData->PARENT_READ);
+
+  if (waitpid(_psSessionData->pidCoproc, &nStatus, 0) > 0)
+  {
+    if ((WIFEXITED(nStatus)) && (WEXITSTATUS(nStatus) != 0))
+      writeError(ERR_DEBUG_MODULE, "[%s] Coprocess exited with status %d.", MODULE_NAME, WEXITSTATUS(nStatus));
+  }
+
+  _psSessionData->pidCoproc = 0;
+  FREE(_psSessionData->bufCoproc);
+  _psSessionData->nCoprocLength = 0;
+
+  return SUCCESS;
+}
+
+/* Append value to record, escaping characters which are used for LINE framing */
+static int escapeValue(char *szRecord, char *szValue)
+{
+  int i, nLength = 0;
+
+  for (i = 0; szValue[i]; i++)
+  {
+    switch (szValue[i])
+    {
+      case '\\': szRecord[nLength++] = '\\'; szRecord[nLength++] = '\\'; break;
+      case '\t': szRecord[nLength++] = '\\'; szRecord[nLength++] = 't'; break;
+      case '\r': szRecord[nLength++] = '\\'; szRecord[nLength++] = 'r'; break;
+      case '\n': szRecord[nLength++] = '\\'; szRecord[nLength++] = 'n'; break;
+      default: szRecord[nLength++] = szValue[i]; break;
+    }
+  }
+
+  return nLength;
+}
+
+static int writeCoproc(_MODULE_DATA* _psSessionData, char *szRecord, int nLength)
+{
+  int nSent, nTotal = 0;
+  sigset_t sigPipe;
+  struct timespec tsZero = { 0, 0 };
+
+  while (nTotal < nLength)
+  {
+    nSent = write(_psSessionData->PARENT_WRITE, szRecord + nTotal, nLength - nTotal);
+    if (nSent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      /* discard pending SIGPIPE generated for this thread */
+      if (errno == EPIPE)
+      {
+        sigemptyset(&sigPipe);
+        sigaddset(&sigPipe, SIGPIPE);
+        sigtimedwait(&sigPipe, NULL, &tsZero);
+      }
+
+      return FAILURE;
+    }
+
+    nTotal += nSent;
+  }
+
+  return SUCCESS;
+}
+
+/*
+  Return the next complete response record from the coprocess. The record is 
+  NUL-terminated within bufCoproc and *nConsumed is set to the number of bytes
+  to discard once the caller is finished with it.
+*/
+static char* readCoproc(_MODULE_DATA* _psSessionData, int *nConsumed)
+{
+  char *pEnd, *pColon;
+  int nRead, nRecordLength;
+
+  while (1)
+  {
+    if (_psSessionData->nFormat == FORMAT_LENGTH)
+    {
+      if ((pColon = memchr(_psSessionData->bufCoproc, ':', _psSessionData->nCoprocLength)))
+      {
+        nRecordLength = atoi(_psSessionData->bufCoproc);
+        if ((nRecordLength < 0) || (nRecordLength > COPROC_BUFFER_SIZE - 16))
+        {
+          writeError(ERR_ERROR, "[%s] Invalid record length (%d) received from coprocess.", MODULE_NAME, nRecordLength);
+          return NULL;
+        }
+
+        if ((pColon - _psSessionData->bufCoproc) + 1 + nRecordLength + 1 <= _psSessionData->nCoprocLength)
+        {
+          if (pColon[1 + nRecordLength] != ',')
+          {
+            writeError(ERR_ERROR, "[%s] Malformed netstring received from coprocess.", MODULE_NAME);
+            return NULL;
+          }
+
+          pColon[1 + nRecordLength] = '\0';
+          *nConsumed = (pColon - _psSessionData->bufCoproc) + 1 + nRecordLength + 1;
+          return pColon + 1;
+        }
+      }
+    }
+    else if ((pEnd = memchr(_psSessionData->bufCoproc, '\n', _psSessionData->nCoprocLength)))
+    {
+      *pEnd = '\0';
+      if ((pEnd > _psSessionData->bufCoproc) && (*(pEnd - 1) == '\r'))
+        *(pEnd - 1) = '\0';
+
+      *nConsumed = pEnd - _psSessionData->bufCoproc + 1;
+      return _psSessionData->bufCoproc;
+    }
+
+    if (_psSessionData->nCoprocLength >= COPROC_BUFFER_SIZE)
+    {
+      writeError(ERR_ERROR, "[%s] Response record from coprocess exceeds %d bytes.", MODULE_NAME, COPROC_BUFFER_SIZE);
+      return NULL;
+    }
+
+    nRead = read(_psSessionData->PARENT_READ, _psSessionData->bufCoproc + _psSessionData->nCoprocLength, COPROC_BUFFER_SIZE - _psSessionData->nCoprocLength);
+    if ((nRead < 0) && (errno == EINTR))
+      continue;
+    else if (nRead <= 0)
+      return NULL;
+
+    _psSessionData->nCoprocLength += nRead;
+    _psSessionData->bufCoproc[_psSessionData->nCoprocLength] = '\0';
+  }
+}
+
+int tryLoginCoproc(_MODULE_DATA* _psSessionData, sLogin** psLogin, char* szLogin, char* szPassword)
+{
+  int iRet, nLength, nConsumed = 0;
+  char *szRecord = NULL;
+  char *szResponse = NULL;
+
+  if ((strlen(szLogin) + strlen(szPassword)) > COPROC_RECORD_MAX)
+  {
+    writeError(ERR_ERROR, "[%s] Credential set exceeds maximum record size.", MODULE_NAME);
+    (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+    setPassResult((*psLogin), szPassword);
+    return MSTATE_RUNNING;
+  }
+
+  /* worst case: every character escaped, or two netstring headers */
+  szRecord = malloc(2 * (strlen(szLogin) + strlen(szPassword)) + 32);
+
+  if (_psSessionData->nFormat == FORMAT_LENGTH)
+  {
+    nLength = sprintf(szRecord, "%d:", (int)strlen(szLogin));
+    memcpy(szRecord + nLength, szLogin, strlen(szLogin));
+    nLength += strlen(szLogin);
+    nLength += sprintf(szRecord + nLength, ",%d:", (int)strlen(szPassword));
+    memcpy(szRecord + nLength, szPassword, strlen(szPassword));
+    nLength += strlen(szPassword);
+    szRecord[nLength++] = ',';
+  }
+  else
+  {
+    nLength = escapeValue(szRecord, szLogin);
+    szRecord[nLength++] = '\t';
+    nLength += escapeValue(szRecord + nLength, szPassword);
+    szRecord[nLength++] = '\n';
+  }
+
+  writeError(ERR_DEBUG_MODULE, "[%s] Sending credential record to coprocess (%d bytes).", MODULE_NAME, nLength);
+
+  if (writeCoproc(_psSessionData, szRecord, nLength) == FAILURE)
+  {
+    writeError(ERR_ERROR, "[%s] Error writing to coprocess: %s", MODULE_NAME, strerror(errno));
+    (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+    iRet = MSTATE_EXITING;
+  }
+  else if ((szResponse = readCoproc(_psSessionData, &nConsumed)) == NULL)
+  {
+    writeError(ERR_ERROR, "[%s] Error reading from coprocess. Helper exited or returned an invalid record.", MODULE_NAME);
+    (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+    iRet = MSTATE_EXITING;
+  }
+  else
+  {
+    writeError(ERR_DEBUG_MODULE, "[%s] Coprocess responded with: %s", MODULE_NAME, szResponse);
+
+    if (strncmp(szResponse, "LOGIN_RESULT_SUCCESS", 20) == 0)
+      (*psLogin)->iResult = LOGIN_RESULT_SUCCESS;
+    else if (strncmp(szResponse, "LOGIN_RESULT_FAIL", 17) == 0)
+      (*psLogin)->iResult = LOGIN_RESULT_FAIL;
+    else if (strncmp(szResponse, "LOGIN_RESULT_ERROR", 18) == 0)
+    {
+      /* Allow simple error messages to be passed back to Medusa */
+      writeError(ERR_ERROR, "[%s] Coprocess responded with: LOGIN_RESULT_ERROR (%s).", MODULE_NAME, (szResponse[18] == ':') ? szResponse + 19 : "");
+      (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+    }
+    else
+    {
+      writeError(ERR_ERROR, "[%s] Unknown response from coprocess: %s", MODULE_NAME, szResponse);
+      (*psLogin)->iResult = LOGIN_RESULT_ERROR;
+    }
+
+    iRet = MSTATE_RUNNING;
+
+    /* shift any remaining data (responses are only read after a request, but be tolerant) */
+    _psSessionData->nCoprocLength -= nConsumed;
+    memmove(_psSessionData->bufCoproc, _psSessionData->bufCoproc + nConsumed, _psSessionData->nCoprocLength);
+  }
+
+  FREE(szRecord);
+  setPassResult((*psLogin), szPassword);
+  return(iRet);
+}
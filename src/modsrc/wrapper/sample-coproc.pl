@@ -0,0 +1,35 @@
+#!/usr/bin/perl
+#
+# Sample TYPE:COPROC helper (FORMAT:LINE)
+#
+# medusa -M wrapper -m TYPE:COPROC -m PROG:./sample-coproc.pl -m ARGS:"%H" ...
+#
+# Started once per login thread. Each line on STDIN holds a tab-separated
+# username and password. One result line must be written to STDOUT for each.
+
+$| = 1;
+$host = $ARGV[0];
+
+sub unescape {
+  my $value = shift;
+  $value =~ s/\\(.)/$1 eq 't' ? "\t" : $1 eq 'n' ? "\n" : $1 eq 'r' ? "\r" : $1/ge;
+  return $value;
+}
+
+while (<STDIN>) {
+  chomp;
+  ($user, $pass) = map { unescape($_) } split(/\t/, $_, 2);
+
+  if ($pass eq "CORRECT_PASS")
+  {
+    print "LOGIN_RESULT_SUCCESS\n";
+  }
+  elsif ($pass eq "ERROR_PASS")
+  {
+    print "LOGIN_RESULT_ERROR:sample error for $user\@$host\n";
+  }
+  else
+  {
+    print "LOGIN_RESULT_FAIL\n";
+  }
+}